@@ -18,8 +18,21 @@
 */
 
 #include "connection.hpp"
+#include "contactsearchchannel.hpp"
+#include "e2ee.hpp"
+#include "filetransferchannel.hpp"
+#include "mediacache.hpp"
+#include "memorybudget.hpp"
 #include "messageschannel.hpp"
+#include "outbox.hpp"
+#include "profilecache.hpp"
+#include "reconnectcontroller.hpp"
 #include "requestdetails.hpp"
+#include "requestscheduler.hpp"
+#include "roomlistchannel.hpp"
+#include "sendqueue.hpp"
+#include "userdirectory.hpp"
+#include "watchdog.hpp"
 
 #include <TelepathyQt/Constants>
 #include <TelepathyQt/BaseChannel>
@@ -29,8 +42,12 @@
 #include <QStandardPaths>
 
 #include <QBuffer>
+#include <QChildEvent>
+#include <QDateTime>
 #include <QDir>
 #include <QFile>
+#include <QJsonArray>
+#include <QJsonObject>
 #include <QTimer>
 
 // Quotient
@@ -38,6 +55,9 @@
 #include <room.h>
 #include <settings.h>
 #include <user.h>
+#include <csapi/presence.h>
+#include <jobs/mediathumbnailjob.h>
+#include <jobs/syncjob.h>
 
 #define Q_MATRIX_CLIENT_MAJOR_VERSION 0
 #define Q_MATRIX_CLIENT_MINOR_VERSION 1
@@ -46,9 +66,39 @@
 #define Q_MATRIX_CLIENT_VERSION_CHECK(major, minor, patch) ((major<<16)|(minor<<8)|(patch))
 
 static const QString secretsDirPath = QLatin1String("/secrets/");
+static const QString outboxDirPath = QLatin1String("/outbox/");
+static const QString mediaDirPath = QLatin1String("/media/");
+static const QString pendingDirPath = QLatin1String("/pending/");
+static const QString cryptoDirPath = QLatin1String("/crypto/");
 static const QString c_saslMechanismTelepathyPassword = QLatin1String("X-TELEPATHY-PASSWORD");
 static const int c_sessionDataFormat = 1;
 
+// Sync long-poll timeouts and pauses between the syncs per cadence (in milliseconds)
+static const int c_syncTimeoutActive = 30000;
+static const int c_syncTimeoutAway = 90000;
+static const int c_syncTimeoutIdle = 90000;
+static const int c_syncPauseAway = 30000;
+static const int c_syncPauseIdle = 120000;
+static const int c_deviceIdleTimeout = 10 * 60 * 1000;
+// The contact handles unused for one to two intervals are released
+static const int c_handleCompactionInterval = 15 * 60 * 1000;
+// The PNG data of the avatars kept for the repeated RequestAvatars calls
+static const int c_avatarCacheSize = 4 * 1024 * 1024;
+// The received messages kept in memory until acknowledged, the rest is spilled to disk
+static const int c_channelPendingBudget = 500;
+static const int c_connectionPendingBudget = 5000;
+// The time spent on the room ingestion per event loop turn (in milliseconds)
+static const int c_roomIngestionBudget = 5;
+// Members whose profiles are updated between the checks of the slice budget
+static const int c_profileBatchSize = 64;
+// The text channels left alone by the client are closed and recreated on the next message
+static const int c_idleChannelTimeout = 30 * 60 * 1000;
+static const int c_idleChannelCheckInterval = 5 * 60 * 1000;
+static const int c_memoryBudgetCheckInterval = 5 * 60 * 1000;
+
+// The minimal interval between two self presence updates pushed to the homeserver
+static const int c_selfPresencePushInterval = 10000;
+
 Tp::AvatarSpec MatrixConnection::getAvatarSpec()
 {
     static const auto spec = Tp::AvatarSpec({ QStringLiteral("image/png") },
@@ -81,10 +131,16 @@ Tp::SimpleStatusSpecMap MatrixConnection::getSimpleStatusSpecMap()
         offlineStatus.maySetOnSelf = true;
         offlineStatus.canHaveMessage = false;
 
+        Tp::SimpleStatusSpec unknownStatus;
+        unknownStatus.type = Tp::ConnectionPresenceTypeUnknown;
+        unknownStatus.maySetOnSelf = false;
+        unknownStatus.canHaveMessage = false;
+
         return QMap<QString,Tp::SimpleStatusSpec>({
                                                       { QLatin1String("available"), onlineStatus },
                                                       { QLatin1String("unavailable"), unavailableStatus },
                                                       { QLatin1String("offline"), offlineStatus },
+                                                      { QLatin1String("unknown"), unknownStatus },
                                                   });
     }();
     return map;
@@ -99,10 +155,40 @@ Tp::SimplePresence MatrixConnection::mkSimplePresence(MatrixPresence presence, c
         return { Tp::ConnectionPresenceTypeAway, QLatin1String("unavailable"), statusMessage };
     case MatrixPresence::Offline:
         return { Tp::ConnectionPresenceTypeOffline, QLatin1String("offline"), statusMessage };
+    case MatrixPresence::Unknown:
+        return { Tp::ConnectionPresenceTypeUnknown, QLatin1String("unknown"), statusMessage };
     }
     return { Tp::ConnectionPresenceTypeError, QLatin1String("error"), statusMessage };
 }
 
+MatrixConnection::MatrixPresence MatrixConnection::presenceFromMatrix(const QString &presence)
+{
+    if (presence == QLatin1String("online")) {
+        return MatrixPresence::Online;
+    }
+    if (presence == QLatin1String("unavailable")) {
+        return MatrixPresence::Unavailable;
+    }
+    if (presence == QLatin1String("offline")) {
+        return MatrixPresence::Offline;
+    }
+    return MatrixPresence::Unknown;
+}
+
+QString MatrixConnection::presenceToMatrix(MatrixPresence presence)
+{
+    switch (presence) {
+    case MatrixPresence::Online:
+        return QStringLiteral("online");
+    case MatrixPresence::Unavailable:
+        return QStringLiteral("unavailable");
+    case MatrixPresence::Offline:
+    case MatrixPresence::Unknown:
+        break;
+    }
+    return QStringLiteral("offline");
+}
+
 Tp::RequestableChannelClassSpecList MatrixConnection::getRequestableChannelList()
 {
     Tp::RequestableChannelClassSpecList result;
@@ -120,6 +206,31 @@ Tp::RequestableChannelClassSpecList MatrixConnection::getRequestableChannelList(
     groupChat.allowedProperties.append(TP_QT_IFACE_CHANNEL + QLatin1String(".TargetID"));
     result.append(groupChat);
 
+    Tp::RequestableChannelClass fileTransfer;
+    fileTransfer.fixedProperties[TP_QT_IFACE_CHANNEL + QLatin1String(".ChannelType")] = TP_QT_IFACE_CHANNEL_TYPE_FILE_TRANSFER;
+    fileTransfer.fixedProperties[TP_QT_IFACE_CHANNEL + QLatin1String(".TargetHandleType")]  = Tp::HandleTypeContact;
+    fileTransfer.allowedProperties.append(TP_QT_IFACE_CHANNEL + QLatin1String(".TargetHandle"));
+    fileTransfer.allowedProperties.append(TP_QT_IFACE_CHANNEL + QLatin1String(".TargetID"));
+    fileTransfer.allowedProperties.append(TP_QT_IFACE_CHANNEL_TYPE_FILE_TRANSFER + QLatin1String(".ContentType"));
+    fileTransfer.allowedProperties.append(TP_QT_IFACE_CHANNEL_TYPE_FILE_TRANSFER + QLatin1String(".Filename"));
+    fileTransfer.allowedProperties.append(TP_QT_IFACE_CHANNEL_TYPE_FILE_TRANSFER + QLatin1String(".Size"));
+    fileTransfer.allowedProperties.append(TP_QT_IFACE_CHANNEL_TYPE_FILE_TRANSFER + QLatin1String(".Description"));
+    fileTransfer.allowedProperties.append(TP_QT_IFACE_CHANNEL_TYPE_FILE_TRANSFER + QLatin1String(".Date"));
+    result.append(fileTransfer);
+
+    Tp::RequestableChannelClass roomList;
+    roomList.fixedProperties[TP_QT_IFACE_CHANNEL + QLatin1String(".ChannelType")] = TP_QT_IFACE_CHANNEL_TYPE_ROOM_LIST;
+    roomList.fixedProperties[TP_QT_IFACE_CHANNEL + QLatin1String(".TargetHandleType")]  = Tp::HandleTypeNone;
+    roomList.allowedProperties.append(TP_QT_IFACE_CHANNEL_TYPE_ROOM_LIST + QLatin1String(".Server"));
+    roomList.allowedProperties.append(MatrixRoomListChannel::searchTermProperty());
+    result.append(roomList);
+
+    Tp::RequestableChannelClass contactSearch;
+    contactSearch.fixedProperties[TP_QT_IFACE_CHANNEL + QLatin1String(".ChannelType")] = TP_QT_IFACE_CHANNEL_TYPE_CONTACT_SEARCH;
+    contactSearch.fixedProperties[TP_QT_IFACE_CHANNEL + QLatin1String(".TargetHandleType")]  = Tp::HandleTypeNone;
+    contactSearch.allowedProperties.append(TP_QT_IFACE_CHANNEL_TYPE_CONTACT_SEARCH + QLatin1String(".Limit"));
+    result.append(contactSearch);
+
     return result;
 }
 
@@ -139,6 +250,7 @@ MatrixConnection::MatrixConnection(const QDBusConnection &dbusConnection, const
                                                      TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_LIST,
                                                      TP_QT_IFACE_CONNECTION_INTERFACE_SIMPLE_PRESENCE,
                                                      TP_QT_IFACE_CONNECTION_INTERFACE_AVATARS,
+                                                     TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_INFO,
                                                  });
     plugInterface(Tp::AbstractConnectionInterfacePtr::dynamicCast(contactsIface));
 
@@ -147,6 +259,18 @@ MatrixConnection::MatrixConnection(const QDBusConnection &dbusConnection, const
     m_aliasingIface->setGetAliasesCallback(Tp::memFun(this, &MatrixConnection::getAliases));
     plugInterface(Tp::AbstractConnectionInterfacePtr::dynamicCast(m_aliasingIface));
 
+    /* Connection.Interface.ContactInfo */
+    contactInfoIface = Tp::BaseConnectionContactInfoInterface::create();
+    contactInfoIface->setContactInfoFlags(Tp::ContactInfoFlagPush);
+    contactInfoIface->setSupportedFields({
+                                             Tp::FieldSpec { QStringLiteral("fn"), {}, 0, 1 },
+                                             Tp::FieldSpec { QStringLiteral("nickname"), {}, 0, 1 },
+                                         });
+    contactInfoIface->setGetContactInfoCallback(Tp::memFun(this, &MatrixConnection::getContactInfo));
+    contactInfoIface->setRefreshContactInfoCallback(Tp::memFun(this, &MatrixConnection::refreshContactInfo));
+    contactInfoIface->setRequestContactInfoCallback(Tp::memFun(this, &MatrixConnection::requestContactInfo));
+    plugInterface(Tp::AbstractConnectionInterfacePtr::dynamicCast(contactInfoIface));
+
     /* Connection.Interface.SimplePresence */
     m_simplePresenceIface = Tp::BaseConnectionSimplePresenceInterface::create();
     m_simplePresenceIface->setStatuses(getSimpleStatusSpecMap());
@@ -168,6 +292,11 @@ MatrixConnection::MatrixConnection(const QDBusConnection &dbusConnection, const
     plugInterface(Tp::AbstractConnectionInterfacePtr::dynamicCast(groupsIface));
 #endif
 
+    /* Statistics for the monitoring */
+    m_statisticsIface = MatrixStatisticsInterface::create();
+    m_statisticsIface->setGetStatisticsCallback(Tp::memFun(this, &MatrixConnection::getStatistics));
+    plugInterface(Tp::AbstractConnectionInterfacePtr::dynamicCast(m_statisticsIface));
+
     /* Connection.Interface.Requests */
     m_requestsIface = Tp::BaseConnectionRequestsInterface::create(this);
     m_requestsIface->requestableChannelClasses = getRequestableChannelList().bareClasses();
@@ -191,11 +320,56 @@ MatrixConnection::MatrixConnection(const QDBusConnection &dbusConnection, const
     m_avatarsIface->setRequestAvatarsCallback(Tp::memFun(this, &MatrixConnection::requestAvatars));
     plugInterface(Tp::AbstractConnectionInterfacePtr::dynamicCast(m_avatarsIface));
 
+    m_scheduler = new MatrixRequestScheduler(this);
+    m_avatarCache.setMaxCost(c_avatarCacheSize);
+    m_userDirectory = new MatrixUserDirectory(this);
+    m_profileCache = new MatrixProfileCache(this);
+    connect(m_profileCache, &MatrixProfileCache::profileChanged, this, &MatrixConnection::onProfileChanged);
+
+    m_syncTimer = new QTimer(this);
+    m_syncTimer->setSingleShot(true);
+    connect(m_syncTimer, &QTimer::timeout, this, [this]() { syncNow(); });
+
+    m_deviceIdleTimer = new QTimer(this);
+    m_deviceIdleTimer->setSingleShot(true);
+    m_deviceIdleTimer->setInterval(c_deviceIdleTimeout);
+    connect(m_deviceIdleTimer, &QTimer::timeout, this, [this]() {
+        m_deviceIdle = true;
+        updateSyncCadence();
+    });
+
+    m_handleCompactionTimer = new QTimer(this);
+    m_handleCompactionTimer->setInterval(c_handleCompactionInterval);
+    connect(m_handleCompactionTimer, &QTimer::timeout, this, &MatrixConnection::compactHandles);
+    m_handleCompactionTimer->start();
+
+    m_idleChannelTimer = new QTimer(this);
+    m_idleChannelTimer->setInterval(c_idleChannelCheckInterval);
+    connect(m_idleChannelTimer, &QTimer::timeout, this, &MatrixConnection::closeIdleChannels);
+    m_idleChannelTimer->start();
+
+    m_memoryBudget = new MatrixMemoryBudget();
+    m_memoryBudgetTimer = new QTimer(this);
+    m_memoryBudgetTimer->setInterval(c_memoryBudgetCheckInterval);
+    connect(m_memoryBudgetTimer, &QTimer::timeout, this, &MatrixConnection::trimRooms);
+    m_memoryBudgetTimer->start();
+
+    m_selfPresenceTimer = new QTimer(this);
+    m_selfPresenceTimer->setSingleShot(true);
+    connect(m_selfPresenceTimer, &QTimer::timeout, this, &MatrixConnection::pushSelfPresence);
+
+    // Zero interval: a slice per event loop turn, the D-Bus calls are served in between
+    m_roomIngestionTimer = new QTimer(this);
+    m_roomIngestionTimer->setInterval(0);
+    connect(m_roomIngestionTimer, &QTimer::timeout, this, &MatrixConnection::ingestRooms);
+
     connect(this, &MatrixConnection::disconnected, this, &MatrixConnection::doDisconnect);
 }
 
 MatrixConnection::~MatrixConnection()
 {
+    delete m_outbox;
+    delete m_memoryBudget;
 }
 
 void MatrixConnection::doConnect(Tp::DBusError *error)
@@ -206,18 +380,41 @@ void MatrixConnection::doConnect(Tp::DBusError *error)
     m_connection = new Quotient::Connection(QUrl(m_server));
     connect(m_connection, &Quotient::Connection::connected, this, &MatrixConnection::onConnected);
     connect(m_connection, &Quotient::Connection::syncDone, this, &MatrixConnection::onSyncDone);
-    connect(m_connection, &Quotient::Connection::loginError, [](const QString &error) {
-        qDebug() << "Login error: " << error;
-    });
-//    connect(m_connection, &Quotient::Connection::networkError, [](size_t nextAttempt, int inMilliseconds) {
-//        qDebug() << "networkError: " << nextAttempt << "millis" << inMilliseconds;
-//    });
-    connect(m_connection, &Quotient::Connection::resolveError, [](const QString &error) {
-        qDebug() << "Resolve error: " << error;
-    });
-    connect(m_connection, &Quotient::Connection::newRoom, this, &MatrixConnection::processNewRoom);
+    connect(m_connection, &Quotient::Connection::syncError, this, &MatrixConnection::onSyncError);
+    connect(m_connection, &Quotient::Connection::loginError, this, &MatrixConnection::onLoginError);
+    connect(m_connection, &Quotient::Connection::networkError, this, &MatrixConnection::onNetworkError);
+    connect(m_connection, &Quotient::Connection::resolveError, this, &MatrixConnection::onResolveError);
+    connect(m_connection, &Quotient::Connection::newRoom, this, &MatrixConnection::enqueueRoom);
+    connect(m_connection, &Quotient::Connection::directChatsListChanged, this, &MatrixConnection::onDirectChatsListChanged);
+    // Watch for the sync jobs to pick the data Quotient does not process (e.g. presence)
+    m_connection->installEventFilter(this);
+
+    m_reconnectController = new MatrixReconnectController(this);
+    connect(m_reconnectController, &MatrixReconnectController::reconnectRequested,
+            this, &MatrixConnection::onReconnectRequested);
+    connect(m_reconnectController, &MatrixReconnectController::gaveUp,
+            this, &MatrixConnection::onReconnectGaveUp);
+
+    if (!m_outbox) {
+        m_outbox = new MatrixOutbox(QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + outboxDirPath + m_user);
+        // Load before anything new is appended; the events are resent once the rooms are known
+        m_outboxEntries = m_outbox->load();
+    }
+    if (!m_mediaCache) {
+        m_mediaCache = new MatrixMediaCache(this, QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + mediaDirPath + m_user + QLatin1Char('/'));
+    }
+    if (!m_e2ee) {
+        m_e2ee = new MatrixE2ee(this, QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + cryptoDirPath + m_user);
+        connect(m_e2ee, &MatrixE2ee::eventReady, this, &MatrixConnection::onEventDecrypted);
+    }
+
+    loadSessionData();
+    startSession();
+}
 
-    if (loadSessionData()) {
+void MatrixConnection::startSession()
+{
+    if (!m_accessToken.isEmpty()) {
         qDebug() << Q_FUNC_INFO << "connectWithToken" << m_user << m_accessToken << m_deviceId;
         m_connection->connectWithToken(m_userId, QString::fromLatin1(m_accessToken), m_deviceId);
     } else {
@@ -230,19 +427,95 @@ void MatrixConnection::doDisconnect()
     if (!m_connection) {
         return;
     }
+    m_reconnectController->cancel();
+    m_syncTimer->stop();
+    m_deviceIdleTimer->stop();
+    m_roomIngestionTimer->stop();
+    m_profileQueue.clear();
+    m_queuedProfiles.clear();
+    m_selfPresenceTimer->stop();
+    m_scheduler->clear();
+    m_userDirectory->clear();
+    m_profileCache->clear();
+    if (m_mediaCache) {
+        m_mediaCache->cancelPending();
+    }
+    m_e2ee->stop();
     m_connection->stopSync();
     setStatus(Tp::ConnectionStatusDisconnected, Tp::ConnectionStatusReasonRequested);
 }
 
+void MatrixConnection::onSyncError(const QString &message, const QString &details)
+{
+    qWarning() << Q_FUNC_INFO << message << details;
+    // Quotient stops the sync loop on a failed sync, so it is up to us to resume it
+    m_reconnectController->scheduleReconnect();
+}
+
+void MatrixConnection::onLoginError(const QString &message, const QString &details)
+{
+    qWarning() << Q_FUNC_INFO << message << details;
+    if (m_reconnectController->isReconnecting()) {
+        // The login failed because of the network, not because of the credentials
+        m_reconnectController->scheduleReconnect();
+        return;
+    }
+    if (!m_accessToken.isEmpty()) {
+        // The saved session is not valid anymore (e.g. it was logged out from another client)
+        qDebug() << Q_FUNC_INFO << "Fallback to the password login";
+        m_accessToken.clear();
+        m_connection->connectToServer(m_user, m_password, m_deviceId);
+        return;
+    }
+    m_reconnectController->cancel();
+    setStatus(Tp::ConnectionStatusDisconnected, Tp::ConnectionStatusReasonAuthenticationFailed);
+}
+
+void MatrixConnection::onResolveError(const QString &error)
+{
+    qWarning() << Q_FUNC_INFO << error;
+    m_reconnectController->scheduleReconnect();
+}
+
+void MatrixConnection::onNetworkError(const QString &message, const QString &details,
+                                      int retriesTaken, int nextRetryInMilliseconds)
+{
+    qDebug() << Q_FUNC_INFO << message << details << "retries:" << retriesTaken << "next in" << nextRetryInMilliseconds;
+    // Quotient retries the job on its own; just start measuring the outage
+    m_reconnectController->noteOutage();
+}
+
+void MatrixConnection::onReconnectRequested(int attempt)
+{
+    qDebug() << Q_FUNC_INFO << "attempt" << attempt;
+    if (status() == Tp::ConnectionStatusConnected) {
+        // Fast path: the session (and the access token) is still valid, just resume the sync
+        m_connection->stopSync();
+        syncNow();
+        return;
+    }
+    startSession();
+}
+
+void MatrixConnection::onReconnectGaveUp()
+{
+    // Telepathy has no way back from Connected to Connecting, so let the account manager
+    // recreate the connection (which will take the saved token fast path).
+    m_syncTimer->stop();
+    m_connection->stopSync();
+    setStatus(Tp::ConnectionStatusDisconnected, Tp::ConnectionStatusReasonNetworkError);
+}
+
 QStringList MatrixConnection::inspectHandles(uint handleType, const Tp::UIntList &handles, Tp::DBusError *error)
 {
-    QStringList *knownIds = nullptr;
+    TANK_WATCHDOG_SCOPE();
+    MatrixHandleRegistry *registry = nullptr;
     switch (handleType) {
     case Tp::HandleTypeContact:
-        knownIds = &m_contactIds;
+        registry = &m_contactHandles;
         break;
     case Tp::HandleTypeRoom:
-        knownIds = &m_roomIds;
+        registry = &m_roomHandles;
         break;
     default:
         error->set(TP_QT_ERROR_INVALID_ARGUMENT, QStringLiteral("Unsupported handle type"));
@@ -251,26 +524,29 @@ QStringList MatrixConnection::inspectHandles(uint handleType, const Tp::UIntList
     QStringList result;
     result.reserve(handles.count());
     for (const uint handle : handles) {
-        if ((handle == 0) || (handle > static_cast<uint>(knownIds->count()))) {
+        if (!registry->isValid(handle)) {
             if (error) {
                 error->set(TP_QT_ERROR_INVALID_HANDLE, QStringLiteral("Invalid handle"));
                 return {};
             }
         }
-        result.append(knownIds->at(handle - 1));
+        registry->touch(handle);
+        result.append(registry->identifier(handle));
     }
     return result;
 }
 
 Tp::UIntList MatrixConnection::requestHandles(uint handleType, const QStringList &identifiers, Tp::DBusError *error)
 {
-    QStringList *knownIds = nullptr;
+    TANK_WATCHDOG_SCOPE();
+    noteClientActivity();
+    MatrixHandleRegistry *registry = nullptr;
     switch (handleType) {
     case Tp::HandleTypeContact:
-        knownIds = &m_contactIds;
+        registry = &m_contactHandles;
         break;
     case Tp::HandleTypeRoom:
-        knownIds = &m_roomIds;
+        registry = &m_roomHandles;
         break;
     default:
         error->set(TP_QT_ERROR_INVALID_ARGUMENT, QStringLiteral("Unsupported handle type"));
@@ -279,7 +555,8 @@ Tp::UIntList MatrixConnection::requestHandles(uint handleType, const QStringList
     Tp::UIntList result;
     result.reserve(identifiers.count());
     for (const QString &id : identifiers) {
-        int handle = knownIds->indexOf(id) + 1;
+        const uint handle = registry->handle(id);
+        registry->touch(handle);
         if (handle == 0) {
             if (error) {
                 error->set(TP_QT_ERROR_INVALID_ARGUMENT, QStringLiteral("Unknown identifier"));
@@ -293,13 +570,22 @@ Tp::UIntList MatrixConnection::requestHandles(uint handleType, const QStringList
 
 Tp::BaseChannelPtr MatrixConnection::createChannelCB(const QVariantMap &request, Tp::DBusError *error)
 {
+    TANK_WATCHDOG_SCOPE();
     const RequestDetails details = request;
+    if (details.isRequested()) {
+        // Not the channels created here for the incoming messages and files
+        noteClientActivity();
+    }
 
     if (details.channelType() == TP_QT_IFACE_CHANNEL_TYPE_ROOM_LIST) {
-        return createRoomListChannel();
+        return createRoomListChannel(request);
+    }
+    if (details.channelType() == TP_QT_IFACE_CHANNEL_TYPE_CONTACT_SEARCH) {
+        return createContactSearchChannel(request);
     }
 
-    if (details.channelType() != TP_QT_IFACE_CHANNEL_TYPE_TEXT) {
+    if ((details.channelType() != TP_QT_IFACE_CHANNEL_TYPE_TEXT)
+            && (details.channelType() != TP_QT_IFACE_CHANNEL_TYPE_FILE_TRANSFER)) {
         error->set(TP_QT_ERROR_INVALID_ARGUMENT, QStringLiteral("Unsupported channel type"));
         return Tp::BaseChannelPtr();
     }
@@ -327,6 +613,16 @@ Tp::BaseChannelPtr MatrixConnection::createChannelCB(const QVariantMap &request,
     Quotient::Room *targetRoom = nullptr;
     if (targetHandleType == Tp::HandleTypeContact) {
         DirectContact contact = getDirectContact(targetHandle);
+        Quotient::User *user = contact.isValid() ? nullptr : getUser(targetHandle);
+        if (user) {
+            // The direct chat could still wait for the ingestion
+            for (const QString &roomId : m_connection->directChats().values(user)) {
+                if (Quotient::Room *room = m_connection->room(roomId)) {
+                    ensureRoomIngested(room);
+                }
+            }
+            contact = getDirectContact(targetHandle);
+        }
         if (!contact.isValid()) {
             error->set(TP_QT_ERROR_NOT_IMPLEMENTED, QStringLiteral("Requested single chat does not exist yet "
                                                                    "(and DirectChat creation is not supported yet"));
@@ -340,26 +636,60 @@ Tp::BaseChannelPtr MatrixConnection::createChannelCB(const QVariantMap &request,
     Tp::BaseChannelPtr baseChannel = Tp::BaseChannel::create(this, details.channelType(), targetHandleType, targetHandle);
     baseChannel->setTargetID(targetID);
     baseChannel->setRequested(details.isRequested());
+    if (request.contains(TP_QT_IFACE_CHANNEL + QLatin1String(".InitiatorHandle"))) {
+        baseChannel->setInitiatorHandle(request.value(TP_QT_IFACE_CHANNEL + QLatin1String(".InitiatorHandle")).toUInt());
+    }
 
     if (details.channelType() == TP_QT_IFACE_CHANNEL_TYPE_TEXT) {
         qDebug() << Q_FUNC_INFO << "creating channel for the room:" << targetRoom;
         if (targetRoom) {
             MatrixMessagesChannelPtr messagesChannel = MatrixMessagesChannel::create(this, targetRoom, baseChannel.data());
             baseChannel->plugInterface(Tp::AbstractChannelInterfacePtr::dynamicCast(messagesChannel));
+            m_messagesChannels.insert(targetRoom->id(), messagesChannel.data());
+            m_memoryBudget->touch(targetRoom->id());
+            // A trimmed room gets its members and profiles back
+            prioritizeRoom(targetRoom);
         }
+    } else if (details.channelType() == TP_QT_IFACE_CHANNEL_TYPE_FILE_TRANSFER) {
+        if (!targetRoom) {
+            error->set(TP_QT_ERROR_INVALID_HANDLE, QStringLiteral("No room for the file transfer target"));
+            return Tp::BaseChannelPtr();
+        }
+        if (details.isRequested() && targetRoom->usesEncryption()) {
+            error->set(TP_QT_ERROR_NOT_IMPLEMENTED, QStringLiteral("Sending to the encrypted rooms is not supported"));
+            return Tp::BaseChannelPtr();
+        }
+        MatrixFileTransferChannelPtr fileTransferChannel = MatrixFileTransferChannel::create(this, targetRoom, request);
+        baseChannel->plugInterface(Tp::AbstractChannelInterfacePtr::dynamicCast(fileTransferChannel));
     }
 
     return baseChannel;
 }
 
-Tp::BaseChannelPtr MatrixConnection::createRoomListChannel()
+Tp::BaseChannelPtr MatrixConnection::createRoomListChannel(const QVariantMap &request)
 {
-    return Tp::BaseChannelPtr();
+    Tp::BaseChannelPtr baseChannel = Tp::BaseChannel::create(this, TP_QT_IFACE_CHANNEL_TYPE_ROOM_LIST, Tp::HandleTypeNone, 0);
+    baseChannel->setRequested(RequestDetails(request).isRequested());
+
+    MatrixRoomListChannelPtr roomListChannel = MatrixRoomListChannel::create(this, request);
+    baseChannel->plugInterface(Tp::AbstractChannelInterfacePtr::dynamicCast(roomListChannel));
+    return baseChannel;
+}
+
+Tp::BaseChannelPtr MatrixConnection::createContactSearchChannel(const QVariantMap &request)
+{
+    Tp::BaseChannelPtr baseChannel = Tp::BaseChannel::create(this, TP_QT_IFACE_CHANNEL_TYPE_CONTACT_SEARCH, Tp::HandleTypeNone, 0);
+    baseChannel->setRequested(RequestDetails(request).isRequested());
+
+    MatrixContactSearchChannelPtr contactSearchChannel = MatrixContactSearchChannel::create(this, request);
+    baseChannel->plugInterface(Tp::AbstractChannelInterfacePtr::dynamicCast(contactSearchChannel));
+    return baseChannel;
 }
 
 Tp::ContactAttributesMap MatrixConnection::getContactListAttributes(const QStringList &interfaces,
                                                                     bool hold, Tp::DBusError *error)
 {
+    TANK_WATCHDOG_SCOPE();
     Q_UNUSED(hold)
     return getContactAttributes(m_directContacts.keys(), interfaces, error);
 }
@@ -368,7 +698,9 @@ Tp::ContactAttributesMap MatrixConnection::getContactAttributes(const Tp::UIntLi
                                                                 const QStringList &interfaces,
                                                                 Tp::DBusError *error)
 {
+    TANK_WATCHDOG_SCOPE();
     qDebug() << Q_FUNC_INFO << handles << interfaces;
+    noteClientActivity();
     Tp::ContactAttributesMap contactAttributes;
 
     for (auto handle : handles) {
@@ -377,6 +709,7 @@ Tp::ContactAttributesMap MatrixConnection::getContactAttributes(const Tp::UIntLi
             qWarning() << Q_FUNC_INFO << "No user for handle" << handle;
             continue;
         }
+        m_contactHandles.touch(handle);
         contactAttributes[handle] = {};
         QVariantMap &attributes = contactAttributes[handle];
 
@@ -389,12 +722,16 @@ Tp::ContactAttributesMap MatrixConnection::getContactAttributes(const Tp::UIntLi
         }
         if (interfaces.contains(TP_QT_IFACE_CONNECTION_INTERFACE_SIMPLE_PRESENCE)) {
             attributes[TP_QT_IFACE_CONNECTION_INTERFACE_SIMPLE_PRESENCE + QLatin1String("/presence")]
-                    = QVariant::fromValue(mkSimplePresence(MatrixPresence::Online));
+                    = QVariant::fromValue(getPresence(handle));
         }
         if (interfaces.contains(TP_QT_IFACE_CONNECTION_INTERFACE_ALIASING)) {
             attributes[TP_QT_IFACE_CONNECTION_INTERFACE_ALIASING + QLatin1String("/alias")]
                     = QVariant::fromValue(getContactAlias(handle));
         }
+        if (interfaces.contains(TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_INFO) && m_profileCache->contains(id)) {
+            attributes[TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_INFO + QLatin1String("/info")]
+                    = QVariant::fromValue(getUserInfo(handle));
+        }
         if (handle == selfHandle()) {
             continue;
         }
@@ -416,33 +753,241 @@ void MatrixConnection::requestSubscription(const Tp::UIntList &handles, const QS
 {
 }
 
+Tp::ContactInfoFieldList MatrixConnection::requestContactInfo(uint handle, Tp::DBusError *error)
+{
+    const Quotient::User *user = getUser(handle);
+    if (!user) {
+        error->set(TP_QT_ERROR_INVALID_HANDLE, QStringLiteral("Invalid handle"));
+        return Tp::ContactInfoFieldList();
+    }
+    if (!m_profileCache->contains(user->id())) {
+        // The full info comes with ContactInfoChanged
+        m_profileCache->request({ user->id() });
+    }
+    return getUserInfo(handle);
+}
+
+Tp::ContactInfoFieldList MatrixConnection::getUserInfo(const quint32 userId) const
+{
+    // userId is the contact handle
+    const Quotient::User *user = getUser(userId);
+    if (!user) {
+        return Tp::ContactInfoFieldList();
+    }
+    const MatrixProfileCache::Profile profile = m_profileCache->profile(user->id());
+    const QString name = profile.displayName.isEmpty() ? user->id() : profile.displayName;
+    return Tp::ContactInfoFieldList({
+                                        Tp::ContactInfoField { QStringLiteral("fn"), {}, { name } },
+                                        Tp::ContactInfoField { QStringLiteral("nickname"), {}, { name } },
+                                    });
+}
+
+Tp::ContactInfoMap MatrixConnection::getContactInfo(const Tp::UIntList &contacts, Tp::DBusError *error)
+{
+    TANK_WATCHDOG_SCOPE();
+    Q_UNUSED(error)
+    // Only the cached info is returned; the missing profiles are fetched in the background
+    Tp::ContactInfoMap result;
+    QStringList missingIds;
+    for (uint handle : contacts) {
+        const Quotient::User *user = getUser(handle);
+        if (!user) {
+            continue;
+        }
+        if (m_profileCache->contains(user->id())) {
+            result.insert(handle, getUserInfo(handle));
+        } else {
+            missingIds.append(user->id());
+        }
+    }
+    m_profileCache->request(missingIds);
+    return result;
+}
+
+void MatrixConnection::refreshContactInfo(const Tp::UIntList &contacts, Tp::DBusError *error)
+{
+    Q_UNUSED(error)
+    QStringList userIds;
+    for (uint handle : contacts) {
+        const Quotient::User *user = getUser(handle);
+        if (user) {
+            m_profileCache->invalidate(user->id());
+            userIds.append(user->id());
+        }
+    }
+    m_profileCache->request(userIds);
+}
+
+void MatrixConnection::updateProfile(Quotient::User *user)
+{
+    updateAlias(user);
+    m_profileCache->update(user->id(), { user->displayname(), user->avatarUrl().toString() });
+}
+
+void MatrixConnection::onProfileChanged(const QString &userId)
+{
+    TANK_WATCHDOG_SCOPE();
+    // Do not allocate handles for the users the client does not know about
+    const uint handle = m_contactHandles.handle(userId);
+    if (handle) {
+        contactInfoIface->contactInfoChanged(handle, getUserInfo(handle));
+    }
+}
+
 Tp::AliasMap MatrixConnection::getAliases(const Tp::UIntList &contacts, Tp::DBusError *error)
 {
-    qDebug() << Q_FUNC_INFO << contacts;
+    TANK_WATCHDOG_SCOPE();
+    qDebug() << Q_FUNC_INFO << contacts.count() << "contacts";
+    noteClientActivity();
     Tp::AliasMap aliases;
     for (uint handle : contacts) {
-        aliases[handle] = getContactAlias(handle);
+        aliases.insert(handle, getContactAlias(handle));
     }
     return aliases;
 }
 
 QString MatrixConnection::getContactAlias(uint handle) const
 {
+    const auto it = m_aliases.constFind(handle);
+    if (it != m_aliases.cend()) {
+        return it.value();
+    }
     const Quotient::User *user = getUser(handle);
     if (!user) {
         return QString();
     }
-    return user->displayname();
+    // Kept current by updateAlias()
+    const QString alias = user->displayname();
+    m_aliases.insert(handle, alias);
+    return alias;
+}
+
+void MatrixConnection::updateAlias(Quotient::User *user)
+{
+    const uint handle = getContactHandle(user);
+    auto it = m_aliases.find(handle);
+    if (it == m_aliases.end()) {
+        // The client has not got an alias for the contact yet, nothing to update
+        return;
+    }
+    const QString alias = user->displayname();
+    if (it.value() == alias) {
+        return;
+    }
+    it.value() = alias;
+    m_pendingAliases.insert(handle, alias);
+}
+
+void MatrixConnection::flushAliases()
+{
+    if (m_pendingAliases.isEmpty()) {
+        return;
+    }
+    m_aliasingIface->aliasesChanged(m_pendingAliases);
+    m_pendingAliases.clear();
+}
+
+QVariantMap MatrixConnection::getStatistics(Tp::DBusError *error)
+{
+    Q_UNUSED(error)
+    QVariantMap result = m_statistics.toVariantMap();
+
+    result.insert(QStringLiteral("contact-handles"), m_contactHandles.count());
+    result.insert(QStringLiteral("room-handles"), m_roomHandles.count());
+    result.insert(QStringLiteral("interned-ids"), m_ids.count());
+    result.insert(QStringLiteral("interned-ids-bytes"), m_ids.memoryUsage());
+    // What the same ids would take as separate strings, to compare with the above
+    result.insert(QStringLiteral("interned-ids-plain-bytes"), m_ids.plainStringMemoryUsage());
+    result.insert(QStringLiteral("known-presences"), m_presences.count());
+
+    const QVariantMap requests = m_scheduler->statistics();
+    for (auto it = requests.cbegin(); it != requests.cend(); ++it) {
+        result.insert(QLatin1String("requests-") + it.key(), it.value());
+    }
+
+    QVariantMap pendingMessages;
+    QVariantMap sendQueues;
+    int channels = 0;
+    int spilledMessages = 0;
+    qint64 spilledBytes = 0;
+    for (auto it = m_messagesChannels.cbegin(); it != m_messagesChannels.cend(); ++it) {
+        const MatrixMessagesChannel *channel = it.value().data();
+        if (!channel) {
+            continue;
+        }
+        ++channels;
+        pendingMessages.insert(it.key(), channel->pendingMessageCount() + channel->heldMessageCount());
+        sendQueues.insert(it.key(), channel->sendQueue()->queuedCount() + channel->sendQueue()->inFlightCount());
+        spilledMessages += channel->spilledMessageCount();
+        spilledBytes += channel->spilledMessageBytes();
+    }
+    result.insert(QStringLiteral("text-channels"), channels);
+    result.insert(QStringLiteral("text-channels-closed-idle"), m_idleChannelsClosed);
+    result.insert(QStringLiteral("channel-pending-messages"), pendingMessages);
+    result.insert(QStringLiteral("pending-messages-in-memory"), m_pendingMessageCount);
+    result.insert(QStringLiteral("pending-messages-spilled"), spilledMessages);
+    result.insert(QStringLiteral("pending-log-bytes"), spilledBytes);
+    result.insert(QStringLiteral("channel-send-queues"), sendQueues);
+
+    if (m_mediaCache) {
+        result.insert(QStringLiteral("media-cache-bytes"), m_mediaCache->size());
+        result.insert(QStringLiteral("media-cache-hits"), m_mediaCache->hits());
+        result.insert(QStringLiteral("media-cache-misses"), m_mediaCache->misses());
+    }
+    result.insert(QStringLiteral("avatar-cache-bytes"), m_avatarCache.totalCost());
+    result.insert(QStringLiteral("profile-fetches-pending"), m_profileCache->pendingCount());
+    result.insert(QStringLiteral("rooms-ingested"), m_ingestedRoomIds.count());
+    result.insert(QStringLiteral("rooms-queued"), m_queuedRoomIds.count());
+    result.insert(QStringLiteral("rooms-trimmed"), m_memoryBudget->trimmedCount());
+    result.insert(QStringLiteral("memory-estimate-bytes"), m_memoryBudget->lastEstimate());
+    result.insert(QStringLiteral("memory-budget-bytes"), m_memoryBudget->budget());
+    result.insert(QStringLiteral("memory-over-budget-bytes"), m_memoryBudget->lastExcess());
+
+    const QVariantMap e2eeStatistics = m_e2ee ? m_e2ee->statistics() : QVariantMap();
+    for (auto it = e2eeStatistics.cbegin(); it != e2eeStatistics.cend(); ++it) {
+        result.insert(it.key(), it.value());
+    }
+
+    const QVariantMap latencies = m_tracer.statistics();
+    for (auto it = latencies.cbegin(); it != latencies.cend(); ++it) {
+        result.insert(it.key(), it.value());
+    }
+
+    if (MatrixWatchdog *watchdog = MatrixWatchdog::instance()) {
+        const QVariantMap stalls = watchdog->statistics();
+        for (auto it = stalls.cbegin(); it != stalls.cend(); ++it) {
+            result.insert(it.key(), it.value());
+        }
+    }
+
+    if (m_reconnectController) {
+        // The Telepathy status stays Connected through an outage of a valid session
+        result.insert(QStringLiteral("reconnect-in-progress"), m_reconnectController->isReconnecting());
+        result.insert(QStringLiteral("reconnect-count"), m_reconnectController->reconnectCount());
+        result.insert(QStringLiteral("reconnect-last-ms"), m_reconnectController->lastReconnectTime());
+        result.insert(QStringLiteral("reconnect-max-ms"), m_reconnectController->maxReconnectTime());
+        result.insert(QStringLiteral("reconnect-total-ms"), m_reconnectController->totalReconnectTime());
+    }
+    return result;
 }
 
 Tp::SimplePresence MatrixConnection::getPresence(uint handle)
 {
-    return {};
+    if (handle == selfHandle()) {
+        return mkSimplePresence(m_selfPresence, m_selfStatusMessage);
+    }
+    const Quotient::User *user = getUser(handle);
+    if (!user) {
+        return mkSimplePresence(MatrixPresence::Unknown);
+    }
+    return m_presences.value(user->id(), mkSimplePresence(MatrixPresence::Unknown));
 }
 
 uint MatrixConnection::setPresence(const QString &status, const QString &message, Tp::DBusError *error)
 {
+    TANK_WATCHDOG_SCOPE();
     qDebug() << Q_FUNC_INFO << status << "ret" << selfHandle();
+    noteClientActivity();
     const Tp::SimpleStatusSpec spec = getSimpleStatusSpecMap().value(status);
     if (!spec.maySetOnSelf) {
         error->set(TP_QT_ERROR_INVALID_ARGUMENT, QStringLiteral("The requested presence can not be set on self contact"));
@@ -453,37 +998,230 @@ uint MatrixConnection::setPresence(const QString &status, const QString &message
     presence.status = status;
     presence.statusMessage = message;
     m_simplePresenceIface->setPresences(Tp::SimpleContactPresences({{selfHandle(), presence}}));
+
+    if (status == QLatin1String("unavailable")) {
+        m_selfPresence = MatrixPresence::Unavailable;
+    } else if (status == QLatin1String("offline")) {
+        m_selfPresence = MatrixPresence::Offline;
+    } else {
+        m_selfPresence = MatrixPresence::Online;
+    }
+    m_selfStatusMessage = message;
+    updateSyncCadence();
+
+    if (!m_selfPresenceTimer->isActive()) {
+        // Push right away if the previous push was long enough ago, otherwise the
+        // latest presence is pushed once the rate limit interval is over.
+        const qint64 sinceLastPush = m_selfPresencePushed.isValid() ? m_selfPresencePushed.elapsed() : c_selfPresencePushInterval;
+        m_selfPresenceTimer->start(qMax<qint64>(0, c_selfPresencePushInterval - sinceLastPush));
+    }
+
     return selfHandle();
 }
 
+void MatrixConnection::pushSelfPresence()
+{
+    if (!m_connection || (status() != Tp::ConnectionStatusConnected)) {
+        return;
+    }
+    qDebug() << Q_FUNC_INFO << presenceToMatrix(m_selfPresence);
+    m_selfPresencePushed.start();
+    m_connection->callApi<Quotient::SetPresenceJob>(Quotient::BackgroundRequest,
+                                                    m_userId, presenceToMatrix(m_selfPresence), m_selfStatusMessage);
+}
+
+bool MatrixConnection::eventFilter(QObject *watched, QEvent *event)
+{
+    if ((watched == m_connection) && (event->type() == QEvent::ChildAdded)) {
+        QChildEvent *childEvent = static_cast<QChildEvent *>(event);
+        Quotient::SyncJob *job = dynamic_cast<Quotient::SyncJob *>(childEvent->child());
+        if (job) {
+            const qint64 startTime = m_tracer.now();
+            // BaseJob::result() is emitted before success(), when Quotient takes the data away
+            connect(job, &Quotient::BaseJob::result, this, [this, job, startTime]() {
+                const qint64 receivedTime = m_tracer.now();
+                m_tracer.record(MatrixTracer::Stage::SyncRequest, startTime, receivedTime);
+                if (job->status().good()) {
+                    // Quotient processes the response synchronously, until syncDone()
+                    m_tracer.setSyncReceivedTime(receivedTime);
+                    m_statistics.addSync(job->rawData().size());
+                    processSyncData(job->jsonData());
+                }
+            });
+        }
+    }
+    return Tp::BaseConnection::eventFilter(watched, event);
+}
+
+void MatrixConnection::processSyncData(const QJsonObject &syncData)
+{
+    TANK_WATCHDOG_SCOPE();
+    // The room keys come in the to-device messages, before the room events of the same sync
+    m_e2ee->processSyncData(syncData);
+
+    const QJsonArray presenceEvents = syncData.value(QLatin1String("presence")).toObject()
+            .value(QLatin1String("events")).toArray();
+    for (const QJsonValue &eventValue : presenceEvents) {
+        const QJsonObject event = eventValue.toObject();
+        const QString type = event.value(QLatin1String("type")).toString();
+        m_statistics.addEvent(type);
+        if (type != QLatin1String("m.presence")) {
+            continue;
+        }
+        const QString userId = event.value(QLatin1String("sender")).toString();
+        if (userId.isEmpty() || (userId == m_userId)) {
+            // Self presence is managed by the client
+            continue;
+        }
+        const QJsonObject content = event.value(QLatin1String("content")).toObject();
+        const MatrixPresence presence = presenceFromMatrix(content.value(QLatin1String("presence")).toString());
+        const QString statusMessage = content.value(QLatin1String("status_msg")).toString();
+        const Tp::SimplePresence simplePresence = mkSimplePresence(presence, statusMessage);
+
+        const Tp::SimplePresence previous = m_presences.value(userId, mkSimplePresence(MatrixPresence::Unknown));
+        if ((previous.status == simplePresence.status) && (previous.statusMessage == simplePresence.statusMessage)) {
+            // Skip the last_active_ago-only updates
+            continue;
+        }
+        m_presences.insert(userId, simplePresence);
+
+        // Do not allocate handles for the users the client has never seen
+        const uint handle = m_contactHandles.handle(userId);
+        if (handle) {
+            m_pendingPresences.insert(handle, simplePresence);
+        }
+    }
+}
+
+void MatrixConnection::flushPresences()
+{
+    if (m_pendingPresences.isEmpty()) {
+        return;
+    }
+    qDebug() << Q_FUNC_INFO << m_pendingPresences.count() << "presence updates";
+    m_simplePresenceIface->setPresences(m_pendingPresences);
+    m_pendingPresences.clear();
+}
+
 void MatrixConnection::onAboutToAddNewMessages(Quotient::RoomEventsRange events)
 {
+    TANK_WATCHDOG_SCOPE();
+    const qint64 syncReceivedTime = m_tracer.syncReceivedTime();
+    if (syncReceivedTime >= 0) {
+        m_tracer.record(MatrixTracer::Stage::SyncToEvents, syncReceivedTime);
+    }
+    Quotient::Room *room = qobject_cast<Quotient::Room *>(sender());
+    if (room) {
+        // The messages need only the handle of the room (see getMatrixMessagesChannelPtr());
+        // the members and the profiles are left to the ingestion slices
+        prioritizeRoom(room);
+        m_memoryBudget->touch(room->id());
+    }
+    const qint64 receivedMSecs = QDateTime::currentMSecsSinceEpoch();
     for (auto &event : events) {
+        m_statistics.addEvent(event->matrixType());
+        // Only the live events: the initial sync and the catch-up after an outage bring the history
+        const qint64 eventMSecs = event->timestamp().toMSecsSinceEpoch();
+        if ((syncReceivedTime >= 0) && (m_lastSyncTime >= 0) && (eventMSecs >= m_lastSyncTime)) {
+            const qint64 serverLag = (receivedMSecs - eventMSecs) * 1000;
+            m_tracer.record(MatrixTracer::Stage::ServerToSync, syncReceivedTime - serverLag, syncReceivedTime);
+        }
         Quotient::RoomMessageEvent *message = dynamic_cast<Quotient::RoomMessageEvent *>(event.get());
-        if (message) {
-            Quotient::Room *room = qobject_cast<Quotient::Room *>(sender());
-            if (!room) {
-                continue;
-            }
-            MatrixMessagesChannelPtr textChannel = getMatrixMessagesChannelPtr(room);
-            if (!textChannel) {
-                qDebug() << Q_FUNC_INFO << "Error, channel is not a TextChannel?";
-                continue;
-            }
-            textChannel->processMessageEvent(message);
+        if (!room || (!message && (event->matrixType() != QLatin1String("m.room.encrypted")))) {
+            continue;
         }
+        if (!message || m_e2ee->hasPendingEvents(room->id())) {
+            // Decrypted on the worker threads; the messages after an encrypted one wait for it
+            m_e2ee->addRoomEvent(room->id(), event->originalJsonObject());
+            continue;
+        }
+        processRoomMessage(room, message);
+    }
+}
+
+void MatrixConnection::onEventDecrypted(const QString &roomId, const QJsonObject &event, const QString &error)
+{
+    TANK_WATCHDOG_SCOPE();
+    Quotient::Room *room = m_connection ? m_connection->room(roomId) : nullptr;
+    if (!room) {
+        return;
+    }
+    QJsonObject messageJson = event;
+    if (!error.isEmpty()) {
+        // Keep the encrypted rooms visible: the client gets a notice in place of the message
+        qDebug() << Q_FUNC_INFO << "Unable to decrypt" << event.value(QLatin1String("event_id")).toString() << error;
+        messageJson.insert(QLatin1String("type"), QStringLiteral("m.room.message"));
+        messageJson.insert(QLatin1String("content"), QJsonObject({
+                                                                     { QLatin1String("msgtype"), QStringLiteral("m.notice") },
+                                                                     { QLatin1String("body"), QStringLiteral("Unable to decrypt the message: ") + error },
+                                                                 }));
+    } else if (messageJson.value(QLatin1String("type")).toString() != QLatin1String("m.room.message")) {
+        return;
+    }
+    const Quotient::RoomMessageEvent message(messageJson);
+    processRoomMessage(room, &message);
+}
+
+void MatrixConnection::processRoomMessage(Quotient::Room *room, const Quotient::RoomMessageEvent *message)
+{
+    MatrixMessagesChannelPtr textChannel = getMatrixMessagesChannelPtr(room);
+    if (!textChannel) {
+        qDebug() << Q_FUNC_INFO << "Error, channel is not a TextChannel?";
+        return;
+    }
+    textChannel->processMessageEvent(message);
+    offerIncomingFile(room, message);
+}
+
+void MatrixConnection::offerIncomingFile(Quotient::Room *room, const Quotient::RoomMessageEvent *event)
+{
+    // Files of the group chats are delivered as message parts only
+    if (!room->isDirectChat() || (event->senderId() == m_userId)) {
+        return;
+    }
+    // The history of the initial sync is not offered again on each connect
+    if (!m_initialSyncDone && (event->timestamp() < m_connectedTime)) {
+        return;
+    }
+    const QJsonObject content = event->contentJson();
+    const QString msgType = content.value(QLatin1String("msgtype")).toString();
+    if ((msgType != QLatin1String("m.file")) && (msgType != QLatin1String("m.image"))
+            && (msgType != QLatin1String("m.video")) && (msgType != QLatin1String("m.audio"))) {
+        return;
+    }
+    const uint senderHandle = getDirectContactHandle(room);
+    if (!senderHandle) {
+        return;
+    }
+    const QVariantMap request = MatrixFileTransferChannel::incomingRequest(senderHandle, event->senderId(),
+                                                                           content, event->timestamp());
+    Tp::DBusError error;
+    createChannel(request, /* suppressHandler */ false, &error);
+    if (error.isValid()) {
+        qWarning() << Q_FUNC_INFO << "Unable to offer the file:" << error.name() << error.message();
     }
 }
 
 void MatrixConnection::onConnected()
 {
+    TANK_WATCHDOG_SCOPE();
     m_userId = m_connection->userId();
 
+    if (status() == Tp::ConnectionStatusConnected) {
+        // The session is re-established after an outage
+        qDebug() << Q_FUNC_INFO << "Session resumed";
+        saveSessionData();
+        syncNow();
+        return;
+    }
+
     uint selfId = ensureContactHandle(m_userId);
     if (selfId != 1) {
         qWarning() << "Self ID seems to be set too late";
     }
     setSelfContact(selfId, m_userId);
+    refContactHandle(selfId);
+    m_connectedTime = QDateTime::currentDateTimeUtc();
 
     setStatus(Tp::ConnectionStatusConnected, Tp::ConnectionStatusReasonRequested);
     m_contactListIface->setContactListState(Tp::ContactListStateWaiting);
@@ -491,31 +1229,170 @@ void MatrixConnection::onConnected()
     qDebug() << Q_FUNC_INFO;
     saveSessionData();
 
-    m_connection->syncLoop();
+    m_e2ee->start(m_userId, m_connection->deviceId());
+
+    m_deviceIdleTimer->start();
+    m_selfPresenceTimer->start(0);
+    syncNow();
 }
 
 void MatrixConnection::onSyncDone()
 {
+    TANK_WATCHDOG_SCOPE();
     qDebug() << Q_FUNC_INFO;
+    if (m_reconnectController->isReconnecting()) {
+        m_reconnectController->markRecovered();
+        flushSendQueues();
+    }
+    m_initialSyncDone = true;
     const auto rooms = m_connection->rooms(Quotient::JoinState::Join); // TODO: any state
     for (Quotient::Room *room : rooms) {
-        processNewRoom(room);
+        if (!m_memoryBudget->isTrimmed(room->id())) {
+            enqueueRoom(room);
+        }
+    }
+    if (m_priorityRoomQueue.isEmpty() && m_roomQueue.isEmpty()) {
+        finishRoomIngestion();
+    }
+
+    // All presence and alias updates of the sync go in single PresencesChanged and AliasesChanged signals
+    flushPresences();
+    flushAliases();
+
+    // Emit the delivery reports caused by the remote echoes of this sync in one batch
+    for (MatrixMessagesChannel *channel : messagesChannels()) {
+        channel->flushDeliveryReports();
+    }
+
+    m_tracer.setSyncReceivedTime(-1);
+    m_lastSyncTime = QDateTime::currentMSecsSinceEpoch();
+    scheduleNextSync();
+}
+
+MatrixConnection::SyncCadence MatrixConnection::desiredSyncCadence() const
+{
+    if (m_deviceIdle || (m_selfPresence == MatrixPresence::Offline)) {
+        return SyncCadence::Idle;
+    }
+    if (m_selfPresence == MatrixPresence::Unavailable) {
+        return SyncCadence::Away;
+    }
+    return SyncCadence::Active;
+}
+
+bool MatrixConnection::ephemeralUpdatesEnabled() const
+{
+    return m_syncCadence == SyncCadence::Active;
+}
+
+void MatrixConnection::noteClientActivity()
+{
+    if (status() != Tp::ConnectionStatusConnected) {
+        return;
+    }
+    m_deviceIdleTimer->start();
+    if (m_deviceIdle) {
+        m_deviceIdle = false;
+        updateSyncCadence();
+    }
+}
+
+void MatrixConnection::updateSyncCadence()
+{
+    const SyncCadence cadence = desiredSyncCadence();
+    if (cadence == m_syncCadence) {
+        return;
+    }
+    qDebug() << Q_FUNC_INFO << "Sync cadence changed from" << static_cast<int>(m_syncCadence)
+             << "to" << static_cast<int>(cadence);
+    m_syncCadence = cadence;
+
+    if (status() != Tp::ConnectionStatusConnected) {
+        return;
+    }
+    if (cadence == SyncCadence::Active) {
+        // Catch up immediately instead of waiting for the pending long-poll or pause to finish
+        m_connection->stopSync();
+        syncNow(/* timeout */ 0);
+    }
+    // A slower cadence takes effect from the next sync
+}
+
+void MatrixConnection::syncNow(int timeout)
+{
+    m_syncTimer->stop();
+    if (timeout < 0) {
+        switch (m_syncCadence) {
+        case SyncCadence::Active:
+            timeout = c_syncTimeoutActive;
+            break;
+        case SyncCadence::Away:
+            timeout = c_syncTimeoutAway;
+            break;
+        case SyncCadence::Idle:
+            timeout = c_syncTimeoutIdle;
+            break;
+        }
+    }
+    m_connection->sync(timeout);
+}
+
+void MatrixConnection::scheduleNextSync()
+{
+    if (status() != Tp::ConnectionStatusConnected) {
+        return;
+    }
+    switch (m_syncCadence) {
+    case SyncCadence::Active:
+        m_syncTimer->start(0);
+        break;
+    case SyncCadence::Away:
+        m_syncTimer->start(c_syncPauseAway);
+        break;
+    case SyncCadence::Idle:
+        m_syncTimer->start(c_syncPauseIdle);
+        break;
     }
-    m_contactListIface->setContactListState(Tp::ContactListStateSuccess);
 }
 
 void MatrixConnection::onUserAvatarChanged(Quotient::User *user)
 {
-    QByteArray outData;
-    QBuffer output(&outData);
-    const QImage ava = user->avatar(64, 64);
-    qDebug() << Q_FUNC_INFO << ava.isNull();
-    if (ava.isNull()) {
+    TANK_WATCHDOG_SCOPE();
+    updateProfile(user);
+    fetchAvatar(user);
+}
+
+void MatrixConnection::fetchAvatar(Quotient::User *user)
+{
+    const QUrl avatarUrl = user->avatarUrl();
+    if (!avatarUrl.isValid()) {
+        return;
+    }
+    const QString userId = user->id();
+    const QByteArray *cachedData = m_avatarCache.object(avatarUrl.toString());
+    m_statistics.addAvatarLookup(cachedData != nullptr);
+    if (cachedData) {
+        m_avatarsIface->avatarRetrieved(ensureContactHandle(userId), avatarUrl.toString(), *cachedData, QStringLiteral("image/png"));
         return;
     }
-    ava.save(&output, "png");
-    m_avatarsIface->avatarRetrieved(ensureHandle(user), user->avatarUrl().toString(), outData, QStringLiteral("image/png"));
-    qDebug() << Q_FUNC_INFO << "retrieved";
+    // Avatars have the lowest priority; a newer request for the same user replaces the queued one
+    m_scheduler->schedule(MatrixRequestScheduler::Priority::Media, [this, userId, avatarUrl]() -> Quotient::BaseJob * {
+        Quotient::MediaThumbnailJob *job = m_connection->getThumbnail(avatarUrl, 64, 64);
+        connect(job, &Quotient::BaseJob::success, this, [this, job, userId, avatarUrl]() {
+            QByteArray outData;
+            QBuffer output(&outData);
+            const QImage ava = job->thumbnail();
+            qDebug() << Q_FUNC_INFO << ava.isNull();
+            if (ava.isNull()) {
+                return;
+            }
+            ava.save(&output, "png");
+            m_avatarCache.insert(avatarUrl.toString(), new QByteArray(outData), outData.size());
+            m_avatarsIface->avatarRetrieved(ensureContactHandle(userId), avatarUrl.toString(), outData, QStringLiteral("image/png"));
+            qDebug() << Q_FUNC_INFO << "retrieved";
+        });
+        return job;
+    }, QLatin1String("avatar:") + userId);
 }
 
 bool MatrixConnection::loadSessionData()
@@ -577,11 +1454,140 @@ bool MatrixConnection::saveSessionData() const
     return secretFile.write(data) == data.size();
 }
 
+void MatrixConnection::enqueueRoom(Quotient::Room *room)
+{
+    if (m_ingestedRoomIds.contains(room->id()) || m_queuedRoomIds.contains(room->id())) {
+        return;
+    }
+    // Cheap, and the events of the rooms waiting in the queue must not be missed
+    connectRoom(room);
+    m_queuedRoomIds.insert(room->id());
+
+    // The rooms the user is looking at (or about to) go first
+    const bool priority = m_messagesChannels.value(room->id()) || room->hasUnreadMessages();
+    if (priority) {
+        m_priorityRoomQueue.append(room);
+        m_priorityRoomIds.insert(room->id());
+    } else {
+        m_roomQueue.append(room);
+    }
+    if (!m_roomIngestionTimer->isActive()) {
+        m_roomIngestionTimer->start();
+    }
+}
+
+void MatrixConnection::ensureRoomIngested(Quotient::Room *room)
+{
+    if (!m_ingestedRoomIds.contains(room->id())) {
+        processNewRoom(room);
+    }
+}
+
+void MatrixConnection::prioritizeRoom(Quotient::Room *room)
+{
+    if (m_ingestedRoomIds.contains(room->id())) {
+        return;
+    }
+    enqueueRoom(room);
+    if (m_priorityRoomIds.contains(room->id())) {
+        return;
+    }
+    // The copy left in the other queue is skipped once the room is ingested
+    m_priorityRoomQueue.append(room);
+    m_priorityRoomIds.insert(room->id());
+}
+
+void MatrixConnection::ingestRooms()
+{
+    TANK_WATCHDOG_SCOPE();
+    QElapsedTimer budget;
+    budget.start();
+    const bool roomsQueued = !m_priorityRoomQueue.isEmpty() || !m_roomQueue.isEmpty();
+    // A room (or a batch of member profiles) is the unit of work, so a slice takes at least one
+    do {
+        QList<QPointer<Quotient::Room>> &queue = m_priorityRoomQueue.isEmpty() ? m_roomQueue : m_priorityRoomQueue;
+        if (queue.isEmpty()) {
+            // The handles of all rooms first, then the profiles of their members
+            if (!ingestProfiles(c_profileBatchSize)) {
+                break;
+            }
+            continue;
+        }
+        const QPointer<Quotient::Room> room = queue.takeFirst();
+        if (room && (&queue == &m_priorityRoomQueue)) {
+            m_priorityRoomIds.remove(room->id());
+        }
+        if (room) {
+            // Could be ingested out of order, on a message or a channel request
+            ensureRoomIngested(room);
+        }
+    } while (budget.elapsed() < c_roomIngestionBudget);
+
+    flushAliases();
+    if (!m_priorityRoomQueue.isEmpty() || !m_roomQueue.isEmpty()) {
+        return;
+    }
+    if (roomsQueued) {
+        // Drop the ids of the rooms deleted while in the queue
+        m_queuedRoomIds.clear();
+        m_priorityRoomIds.clear();
+        qDebug() << Q_FUNC_INFO << "Ingested" << m_ingestedRoomIds.count() << "rooms";
+        if (m_initialSyncDone) {
+            finishRoomIngestion();
+        }
+    }
+    if (m_profileQueue.isEmpty()) {
+        m_roomIngestionTimer->stop();
+    }
+}
+
+bool MatrixConnection::ingestProfiles(int count)
+{
+    if (m_profileQueue.isEmpty()) {
+        return false;
+    }
+    for (int i = 0; (i < count) && !m_profileQueue.isEmpty(); ++i) {
+        const QPointer<Quotient::User> user = m_profileQueue.takeFirst();
+        if (user) {
+            m_queuedProfiles.remove(user.data());
+            updateProfile(user);
+        }
+    }
+    if (m_profileQueue.isEmpty()) {
+        // Drop the users deleted while in the queue
+        m_queuedProfiles.clear();
+    }
+    return true;
+}
+
+void MatrixConnection::finishRoomIngestion()
+{
+    if (m_contactListIface->contactListState() != Tp::ContactListStateSuccess) {
+        m_contactListIface->setContactListState(Tp::ContactListStateSuccess);
+    }
+    if (!m_outboxRestored) {
+        // The rooms are known after the first sync
+        m_outboxRestored = true;
+        restoreOutbox();
+    }
+}
+
+void MatrixConnection::connectRoom(Quotient::Room *room)
+{
+    connect(room, &Quotient::Room::aboutToAddNewMessages,
+            this, &MatrixConnection::onAboutToAddNewMessages,
+            Qt::UniqueConnection);
+    connect(room, &Quotient::Room::userAdded, this, &MatrixConnection::updateProfile, Qt::UniqueConnection);
+    connect(room, &Quotient::Room::memberRenamed, this, &MatrixConnection::updateProfile, Qt::UniqueConnection);
+}
+
 void MatrixConnection::processNewRoom(Quotient::Room *room)
 {
-    qDebug() << Q_FUNC_INFO << room;
-    qDebug() << room->displayName() << room->topic();
-    qDebug() << room->memberNames();
+    TANK_WATCHDOG_SCOPE();
+    qDebug() << Q_FUNC_INFO << room->id();
+    m_ingestedRoomIds.insert(room->id());
+    m_queuedRoomIds.remove(room->id());
+    connectRoom(room);
     if (room->isDirectChat()) {
         // Single user room
         for (Quotient::User *user : room->users()) {
@@ -593,16 +1599,95 @@ void MatrixConnection::processNewRoom(Quotient::Room *room)
     } else {
         ensureHandle(room);
     }
-    connect(room, &Quotient::Room::aboutToAddNewMessages,
-            this, &MatrixConnection::onAboutToAddNewMessages,
-            Qt::UniqueConnection);
+
+    // The member events carry the profiles, so the members never need a profile request;
+    // taken over from them in the ingestion slices
+    for (Quotient::User *user : room->users()) {
+        if (!m_queuedProfiles.contains(user)) {
+            m_queuedProfiles.insert(user);
+            m_profileQueue.append(user);
+        }
+    }
+    if (!m_profileQueue.isEmpty() && !m_roomIngestionTimer->isActive()) {
+        m_roomIngestionTimer->start();
+    }
+}
+
+uint MatrixConnection::ensureRoomHandle(Quotient::Room *room)
+{
+    if (!room->isDirectChat()) {
+        return ensureHandle(room);
+    }
+    uint handle = getDirectContactHandle(room);
+    if (handle) {
+        return handle;
+    }
+    for (Quotient::User *user : room->users()) {
+        if (user != room->localUser()) {
+            handle = ensureDirectContact(user, room);
+        }
+    }
+    return handle;
+}
+
+void MatrixConnection::onDirectChatsListChanged(const QMultiHash<const Quotient::User *, QString> &additions,
+                                                const QMultiHash<const Quotient::User *, QString> &removals)
+{
+    TANK_WATCHDOG_SCOPE();
+    // m.direct comes after the rooms in a sync, so the rooms of the first sync are seen as group chats at first
+    Tp::ContactSubscriptionMap changes;
+    Tp::HandleIdentifierMap identifiers;
+    Tp::HandleIdentifierMap removed;
+    for (auto it = removals.cbegin(); it != removals.cend(); ++it) {
+        const uint handle = m_contactHandles.handle(it.key()->id());
+        if (!handle || !m_directContacts.contains(handle)) {
+            continue;
+        }
+        const Quotient::Room *room = m_directContacts.value(handle).room;
+        if (room && (room->id() != it.value())) {
+            continue;
+        }
+        m_directContacts.remove(handle);
+        if (m_directContactHandles.value(room) == handle) {
+            m_directContactHandles.remove(room);
+        }
+        removed.insert(handle, it.key()->id());
+        unrefContactHandle(handle);
+    }
+    for (auto it = additions.cbegin(); it != additions.cend(); ++it) {
+        Quotient::Room *room = m_connection->room(it.value(), Quotient::JoinState::Join);
+        Quotient::User *user = getUser(it.key()->id());
+        if (!room || !user || !m_ingestedRoomIds.contains(room->id())) {
+            // A queued room gets its direct contact once ingested
+            continue;
+        }
+        const bool known = m_directContacts.contains(getContactHandle(user));
+        const uint handle = ensureDirectContact(user, room);
+        if (!known) {
+            changes.insert(handle, { Tp::SubscriptionStateYes, Tp::SubscriptionStateYes, QString() });
+            identifiers.insert(handle, user->id());
+            removed.remove(handle);
+        }
+    }
+    if ((!changes.isEmpty() || !removed.isEmpty())
+            && (m_contactListIface->contactListState() == Tp::ContactListStateSuccess)) {
+        m_contactListIface->contactsChangedWithId(changes, identifiers, removed);
+    }
 }
 
 uint MatrixConnection::ensureDirectContact(Quotient::User *user, Quotient::Room *room)
 {
     qDebug() << Q_FUNC_INFO << user->id() << user->displayname();
     const uint handle = ensureHandle(user);
+    const auto existing = m_directContacts.constFind(handle);
+    if (existing == m_directContacts.cend()) {
+        // The roster holds its contacts
+        refContactHandle(handle);
+    } else if (m_directContactHandles.value(existing->room) == handle) {
+        m_directContactHandles.remove(existing->room);
+    }
     m_directContacts.insert(handle, DirectContact(user, room));
+    m_directContactHandles.insert(room, handle);
     return handle;
 }
 
@@ -611,7 +1696,7 @@ MatrixMessagesChannelPtr MatrixConnection::getMatrixMessagesChannelPtr(Quotient:
 {
     MatrixMessagesChannelPtr textChannel;
     uint handleType = room->isDirectChat() ? Tp::HandleTypeContact : Tp::HandleTypeRoom;
-    uint handle = room->isDirectChat() ? getDirectContactHandle(room) : getRoomHandle(room);
+    uint handle = ensureRoomHandle(room);
 
     if (!handle) {
         qWarning() << Q_FUNC_INFO << "Unknown room" << room->id();
@@ -637,6 +1722,69 @@ MatrixMessagesChannelPtr MatrixConnection::getMatrixMessagesChannelPtr(Quotient:
     return textChannel;
 }
 
+QList<MatrixMessagesChannel *> MatrixConnection::messagesChannels() const
+{
+    QList<MatrixMessagesChannel *> result;
+    result.reserve(m_messagesChannels.count());
+    for (const QPointer<MatrixMessagesChannel> &channel : m_messagesChannels) {
+        if (channel) {
+            result.append(channel.data());
+        }
+    }
+    return result;
+}
+
+bool MatrixConnection::isPendingBudgetAvailable(int channelPendingCount) const
+{
+    return (channelPendingCount < c_channelPendingBudget) && (m_pendingMessageCount < c_connectionPendingBudget);
+}
+
+void MatrixConnection::changePendingMessageCount(int delta)
+{
+    m_pendingMessageCount += delta;
+    if ((delta >= 0) || m_pageInScheduled) {
+        return;
+    }
+    // Any channel could wait for the connection budget; not from within the acknowledgement
+    // handling of TelepathyQt, which is iterating its pending list
+    m_pageInScheduled = true;
+    QTimer::singleShot(0, this, [this]() {
+        m_pageInScheduled = false;
+        for (MatrixMessagesChannel *channel : messagesChannels()) {
+            channel->pageIn();
+        }
+    });
+}
+
+QString MatrixConnection::pendingLogFileName(const QString &roomId) const
+{
+    return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + pendingDirPath + m_user
+            + QLatin1Char('/') + QString::fromLatin1(QUrl::toPercentEncoding(roomId));
+}
+
+void MatrixConnection::flushSendQueues()
+{
+    for (MatrixMessagesChannel *channel : messagesChannels()) {
+        channel->sendQueue()->flush();
+    }
+}
+
+void MatrixConnection::restoreOutbox()
+{
+    const QList<MatrixOutbox::Entry> entries = m_outboxEntries;
+    m_outboxEntries.clear();
+    for (const MatrixOutbox::Entry &entry : entries) {
+        Quotient::Room *room = m_connection->room(entry.roomId);
+        MatrixMessagesChannelPtr textChannel = room ? getMatrixMessagesChannelPtr(room) : MatrixMessagesChannelPtr();
+        if (!textChannel) {
+            qWarning() << Q_FUNC_INFO << "Drop the event" << entry.txnId << "for unknown room" << entry.roomId;
+            m_outbox->markDone(entry.txnId);
+            continue;
+        }
+        textChannel->sendQueue()->restore(entry);
+    }
+}
+
 void MatrixConnection::prefetchHistory(Quotient::Room *room)
 {
     if (room->messageEvents().begin() == room->messageEvents().end()) {
@@ -654,14 +1802,14 @@ void MatrixConnection::prefetchHistory(Quotient::Room *room)
 
 Quotient::User *MatrixConnection::getUser(uint handle) const
 {
-    if (handle == 0 || handle > static_cast<uint>(m_contactIds.count())) {
+    const QString id = m_contactHandles.identifier(handle);
+    if (id.isEmpty()) {
         qWarning() << Q_FUNC_INFO << "Invalid handle";
         return nullptr;
     }
     if (handle == selfHandle()) {
         return m_connection->user();
     }
-    const QString id = m_contactIds.at(handle - 1);
     return m_connection->user(id);
 }
 
@@ -680,62 +1828,141 @@ DirectContact MatrixConnection::getDirectContact(uint contactHandle) const
 
 Quotient::Room *MatrixConnection::getRoom(uint handle) const
 {
-    if (handle == 0 || handle > static_cast<uint>(m_roomIds.count())) {
+    const QString id = m_roomHandles.identifier(handle);
+    if (id.isEmpty()) {
         qWarning() << Q_FUNC_INFO << "Invalid handle";
         return nullptr;
     }
-    const QString id = m_roomIds.at(handle - 1);
     return m_connection->room(id);
 }
 
 uint MatrixConnection::getContactHandle(Quotient::User *user)
 {
-    return m_contactIds.indexOf(user->id()) + 1;
+    return m_contactHandles.handle(user->id());
 }
 
 uint MatrixConnection::getDirectContactHandle(Quotient::Room *room)
 {
-    for (uint handle : m_directContacts.keys()) {
-        if (m_directContacts.value(handle).room == room) {
-            return handle;
-        }
-    }
-    return 0;
+    return m_directContactHandles.value(room);
 }
 
 uint MatrixConnection::getRoomHandle(Quotient::Room *room)
 {
-    return m_roomIds.indexOf(room->id()) + 1;
+    return m_roomHandles.handle(room->id());
 }
 
 uint MatrixConnection::ensureHandle(Quotient::User *user)
 {
-    uint index = getContactHandle(user);
-    if (index != 0) {
-        return index;
-    }
-    m_contactIds.append(user->id());
-    return m_contactIds.count();
+    return m_contactHandles.ensureHandle(user->id());
 }
 
 uint MatrixConnection::ensureHandle(Quotient::Room *room)
 {
-    uint index = getRoomHandle(room);
-    if (index != 0) {
-        return index;
-    }
-    m_roomIds.append(room->id());
-    return m_roomIds.count();
+    return m_roomHandles.ensureHandle(room->id());
 }
 
 uint MatrixConnection::ensureContactHandle(const QString &identifier)
 {
-    int index = m_contactIds.indexOf(identifier);
-    if (index < 0) {
-        m_contactIds.append(identifier);
-        return m_contactIds.count();
+    return m_contactHandles.ensureHandle(identifier);
+}
+
+void MatrixConnection::refContactHandle(uint handle)
+{
+    m_contactHandles.ref(handle);
+}
+
+void MatrixConnection::unrefContactHandle(uint handle)
+{
+    m_contactHandles.unref(handle);
+}
+
+void MatrixConnection::compactHandles()
+{
+    TANK_WATCHDOG_SCOPE();
+    const QList<uint> released = m_contactHandles.compact();
+    for (uint handle : released) {
+        m_aliases.remove(handle);
+        m_pendingAliases.remove(handle);
+        m_pendingPresences.remove(handle);
+    }
+    qDebug() << Q_FUNC_INFO << "Released" << released.count() << "contact handles," << m_contactHandles.count() << "left";
+    qDebug() << Q_FUNC_INFO << m_ids.count() << "ids on" << m_ids.serverCount() << "servers take" << m_ids.memoryUsage()
+             << "bytes instead of" << m_ids.plainStringMemoryUsage();
+}
+
+void MatrixConnection::closeIdleChannels()
+{
+    TANK_WATCHDOG_SCOPE();
+    QList<MatrixMessagesChannel *> idleChannels;
+    for (auto it = m_messagesChannels.begin(); it != m_messagesChannels.end(); ) {
+        MatrixMessagesChannel *channel = it.value().data();
+        if (!channel) {
+            it = m_messagesChannels.erase(it);
+            continue;
+        }
+        if (channel->isIdle(c_idleChannelTimeout)) {
+            idleChannels.append(channel);
+            it = m_messagesChannels.erase(it);
+            continue;
+        }
+        ++it;
+    }
+
+    // Closing releases the channel (and its handles) right away, so it is done out of the iteration
+    for (MatrixMessagesChannel *channel : idleChannels) {
+        channel->close();
+    }
+    m_idleChannelsClosed += idleChannels.count();
+    if (!idleChannels.isEmpty()) {
+        qDebug() << Q_FUNC_INFO << "Closed" << idleChannels.count() << "idle text channels," << m_messagesChannels.count() << "left";
+    }
+}
+
+void MatrixConnection::trimRooms()
+{
+    TANK_WATCHDOG_SCOPE();
+    if (!m_connection) {
+        return;
+    }
+    QList<MatrixMemoryBudget::RoomUsage> usage;
+    QHash<QString, Quotient::Room *> rooms;
+    for (Quotient::Room *room : m_connection->allRooms()) {
+        MatrixMemoryBudget::RoomUsage roomUsage;
+        roomUsage.roomId = room->id();
+        roomUsage.size = MatrixMemoryBudget::estimate(room);
+        // The pending messages live in the channels; a room not ingested yet has nothing to trim
+        roomUsage.pinned = m_messagesChannels.value(room->id()) || !m_ingestedRoomIds.contains(room->id());
+        if (!roomUsage.pinned) {
+            int profiles = 0;
+            for (const Quotient::User *user : room->users()) {
+                if (!m_contactHandles.handle(user->id())) {
+                    ++profiles;
+                }
+            }
+            roomUsage.releasable = MatrixMemoryBudget::releasableEstimate(profiles);
+        }
+        usage.append(roomUsage);
+        rooms.insert(room->id(), room);
+    }
+
+    for (const QString &roomId : m_memoryBudget->select(usage)) {
+        trimRoom(rooms.value(roomId));
+    }
+}
+
+void MatrixConnection::trimRoom(Quotient::Room *room)
+{
+    // Quotient (0.6) can not unload the timeline of a room, so only the state kept here goes.
+    // The room is ingested again on its next message or channel request, not on the next sync.
+    m_ingestedRoomIds.remove(room->id());
+    disconnect(room, &Quotient::Room::userAdded, this, &MatrixConnection::updateProfile);
+    disconnect(room, &Quotient::Room::memberRenamed, this, &MatrixConnection::updateProfile);
+    for (Quotient::User *user : room->users()) {
+        // The client knows only the users with handles, the rest is refilled from the member events
+        if (!m_contactHandles.handle(user->id())) {
+            m_profileCache->invalidate(user->id());
+        }
     }
-    return index + 1;
 }
 
 void MatrixConnection::requestAvatars(const Tp::UIntList &handles, Tp::DBusError *error)
@@ -761,13 +1988,14 @@ Tp::AvatarTokenMap MatrixConnection::getKnownAvatarTokens(const Tp::UIntList &ha
 
 void MatrixConnection::requestAvatarsImpl(const Tp::UIntList &handles)
 {
+    TANK_WATCHDOG_SCOPE();
     qDebug() << Q_FUNC_INFO << handles;
     for (auto handle : handles) {
         Quotient::User *user = getUser(handle);
         if (!user) {
             continue;
         }
-        connect(user, &Quotient::User::avatarChanged, this, &MatrixConnection::onUserAvatarChanged);
-        onUserAvatarChanged(user);
+        connect(user, &Quotient::User::avatarChanged, this, &MatrixConnection::onUserAvatarChanged, Qt::UniqueConnection);
+        fetchAvatar(user);
     }
 }
@@ -24,9 +24,19 @@
 #include <TelepathyQt/RequestableChannelClassSpec>
 #include <TelepathyQt/RequestableChannelClassSpecList>
 
+#include <QCache>
+#include <QDateTime>
+#include <QElapsedTimer>
 #include <QHash>
+#include <QPointer>
+#include <QSet>
 
 #include "messageschannel.hpp" // MatrixMessagesChannelPtr typedef
+#include "handleregistry.hpp"
+#include "outbox.hpp"
+#include "statistics.hpp"
+#include "statisticsinterface.hpp"
+#include "tracer.hpp"
 
 namespace Quotient
 {
@@ -51,6 +61,17 @@ class Connection;
 
 } // Quotient
 
+class MatrixE2ee;
+class MatrixMediaCache;
+class MatrixMemoryBudget;
+class MatrixProfileCache;
+class MatrixReconnectController;
+class MatrixRequestScheduler;
+class MatrixUserDirectory;
+
+class QJsonObject;
+class QTimer;
+
 struct DirectContact {
     DirectContact() = default;
     DirectContact(const DirectContact &contact) = default;
@@ -72,11 +93,18 @@ public:
         Online,
         Offline,
         Unavailable,
+        Unknown,
     };
 //    online : The default state when the user is connected to an event stream.
 //    unavailable : The user is not reachable at this time e.g. they are idle.
 //    offline : The user is not connected to an event stream or is explicitly suppressing their profile information from being sent.
 
+    enum class SyncCadence {
+        Active, // Regular long-poll, typing and receipts are processed
+        Away, // Longer long-poll with pauses, no typing and receipts
+        Idle, // The longest pauses between the syncs
+    };
+
     MatrixConnection(const QDBusConnection &dbusConnection,
             const QString &cmName, const QString &protocolName,
             const QVariantMap &parameters);
@@ -85,10 +113,20 @@ public:
     static Tp::AvatarSpec getAvatarSpec();
     static Tp::SimpleStatusSpecMap getSimpleStatusSpecMap();
     static Tp::SimplePresence mkSimplePresence(MatrixPresence presence, const QString &statusMessage = QString());
+    static MatrixPresence presenceFromMatrix(const QString &presence);
+    static QString presenceToMatrix(MatrixPresence presence);
     static Tp::RequestableChannelClassSpecList getRequestableChannelList();
 
     void doConnect(Tp::DBusError *error);
     void doDisconnect();
+    void startSession();
+    void updateSyncCadence();
+    void syncNow(int timeout = -1);
+    void scheduleNextSync();
+
+    void processSyncData(const QJsonObject &syncData);
+    void flushPresences();
+    void pushSelfPresence();
 
     QStringList inspectHandles(uint handleType, const Tp::UIntList &handles, Tp::DBusError *error);
     Tp::UIntList requestHandles(uint handleType, const QStringList &identifiers, Tp::DBusError *error);
@@ -103,14 +141,40 @@ public:
     Tp::ContactInfoFieldList requestContactInfo(uint handle, Tp::DBusError *error);
     Tp::ContactInfoFieldList getUserInfo(const quint32 userId) const;
     Tp::ContactInfoMap getContactInfo(const Tp::UIntList &contacts, Tp::DBusError *error);
+    void refreshContactInfo(const Tp::UIntList &contacts, Tp::DBusError *error);
+    void updateProfile(Quotient::User *user);
+    void updateAlias(Quotient::User *user);
+    void flushAliases();
+    void onProfileChanged(const QString &userId);
 
     Tp::AliasMap getAliases(const Tp::UIntList &handles, Tp::DBusError *error = nullptr);
     QString getContactAlias(uint handle) const;
 
+    QVariantMap getStatistics(Tp::DBusError *error);
+
     Tp::SimplePresence getPresence(uint handle);
     uint setPresence(const QString &status, const QString &message, Tp::DBusError *error);
 
     Quotient::Connection *matrix() const { return m_connection; }
+    MatrixRequestScheduler *scheduler() const { return m_scheduler; }
+    MatrixOutbox *outbox() const { return m_outbox; }
+    MatrixMediaCache *mediaCache() const { return m_mediaCache; }
+    MatrixUserDirectory *userDirectory() const { return m_userDirectory; }
+    const MatrixIdTable *ids() const { return &m_ids; }
+    MatrixTracer *tracer() { return &m_tracer; }
+
+    // The budget of the received messages given to the clients and not acknowledged yet
+    bool isPendingBudgetAvailable(int channelPendingCount) const;
+    void changePendingMessageCount(int delta);
+    QString pendingLogFileName(const QString &roomId) const;
+
+    bool eventFilter(QObject *watched, QEvent *event) override;
+
+    SyncCadence syncCadence() const { return m_syncCadence; }
+    SyncCadence desiredSyncCadence() const;
+    bool ephemeralUpdatesEnabled() const;
+    // Called on the client D-Bus calls (sending, reading, handle and contact queries, channel requests)
+    void noteClientActivity();
 
 public slots:
     void onAboutToAddNewMessages(Quotient::RoomEventsRange events);
@@ -120,17 +184,36 @@ signals:
     void chatDetailsChanged(quint32 chatId, const Tp::UIntList &handles);
 
 protected:
-    Tp::BaseChannelPtr createRoomListChannel();
+    Tp::BaseChannelPtr createRoomListChannel(const QVariantMap &request);
+    Tp::BaseChannelPtr createContactSearchChannel(const QVariantMap &request);
 
 protected slots:
     void onConnected();
     void onSyncDone();
+    void onSyncError(const QString &message, const QString &details);
+    void onLoginError(const QString &message, const QString &details);
+    void onResolveError(const QString &error);
+    void onNetworkError(const QString &message, const QString &details, int retriesTaken, int nextRetryInMilliseconds);
+    void onReconnectRequested(int attempt);
+    void onReconnectGaveUp();
     void onUserAvatarChanged(Quotient::User *user);
+    void onEventDecrypted(const QString &roomId, const QJsonObject &event, const QString &error);
+    // Quotient::DirectChatsMap
+    void onDirectChatsListChanged(const QMultiHash<const Quotient::User *, QString> &additions,
+                                  const QMultiHash<const Quotient::User *, QString> &removals);
 
 public:
     bool loadSessionData();
     bool saveSessionData() const;
 
+    void enqueueRoom(Quotient::Room *room);
+    void ensureRoomIngested(Quotient::Room *room);
+    void prioritizeRoom(Quotient::Room *room);
+    uint ensureRoomHandle(Quotient::Room *room);
+    void ingestRooms();
+    bool ingestProfiles(int count);
+    void finishRoomIngestion();
+    void connectRoom(Quotient::Room *room);
     void processNewRoom(Quotient::Room *room);
     uint ensureDirectContact(Quotient::User *user, Quotient::Room *room);
 
@@ -145,8 +228,19 @@ public:
     uint ensureHandle(Quotient::User *user);
     uint ensureHandle(Quotient::Room *room);
     uint ensureContactHandle(const QString &identifier);
+    void refContactHandle(uint handle);
+    void unrefContactHandle(uint handle);
+    void compactHandles();
+    void closeIdleChannels();
+    void trimRooms();
+    void trimRoom(Quotient::Room *room);
 
     MatrixMessagesChannelPtr getMatrixMessagesChannelPtr(Quotient::Room *room);
+    void processRoomMessage(Quotient::Room *room, const Quotient::RoomMessageEvent *message);
+    void offerIncomingFile(Quotient::Room *room, const Quotient::RoomMessageEvent *event);
+    QList<MatrixMessagesChannel *> messagesChannels() const;
+    void flushSendQueues();
+    void restoreOutbox();
     void prefetchHistory(Quotient::Room *room);
 
     void startMechanismWithData_authCode(const QString &mechanism, const QByteArray &data, Tp::DBusError *error);
@@ -156,6 +250,7 @@ public:
     Tp::AvatarTokenMap getKnownAvatarTokens(const Tp::UIntList &handles, Tp::DBusError *error);
 
     void requestAvatarsImpl(const Tp::UIntList &handles);
+    void fetchAvatar(Quotient::User *user);
 
     Tp::BaseConnectionContactsInterfacePtr contactsIface;
     Tp::BaseConnectionSimplePresenceInterfacePtr m_simplePresenceIface;
@@ -163,14 +258,63 @@ public:
     Tp::BaseConnectionContactInfoInterfacePtr contactInfoIface;
     Tp::BaseConnectionAvatarsInterfacePtr m_avatarsIface;
     Tp::BaseConnectionAliasingInterfacePtr m_aliasingIface;
+    MatrixStatisticsInterfacePtr m_statisticsIface;
     Tp::BaseConnectionAddressingInterfacePtr addressingIface;
     Tp::BaseConnectionRequestsInterfacePtr m_requestsIface;
     Tp::BaseChannelSASLAuthenticationInterfacePtr saslIface_password;
 
     Quotient::Connection *m_connection = nullptr;
+    MatrixReconnectController *m_reconnectController = nullptr;
+    MatrixRequestScheduler *m_scheduler = nullptr;
+    MatrixOutbox *m_outbox = nullptr;
+    MatrixMediaCache *m_mediaCache = nullptr;
+    MatrixE2ee *m_e2ee = nullptr;
+    MatrixUserDirectory *m_userDirectory = nullptr;
+    MatrixProfileCache *m_profileCache = nullptr;
+    QList<MatrixOutbox::Entry> m_outboxEntries; // Not sent in the previous session
+    bool m_outboxRestored = false;
+    QTimer *m_syncTimer = nullptr;
+    QTimer *m_deviceIdleTimer = nullptr;
+    SyncCadence m_syncCadence = SyncCadence::Active;
+    MatrixPresence m_selfPresence = MatrixPresence::Online;
+    bool m_deviceIdle = false;
+
+    QHash<QString, Tp::SimplePresence> m_presences; // User id to the last known presence
+    mutable QHash<uint, QString> m_aliases; // The aliases given to the client
+    Tp::AliasMap m_pendingAliases; // Changes to be signalled after the sync
+    Tp::SimpleContactPresences m_pendingPresences; // Changes to be signalled after the sync
+    QTimer *m_selfPresenceTimer = nullptr;
+    QElapsedTimer m_selfPresencePushed;
+    QString m_selfStatusMessage;
     QHash<uint, DirectContact> m_directContacts; // Handle to contact, also known as contactlist or roster in other IM
-    QStringList m_contactIds;
-    QStringList m_roomIds;
+    QHash<const Quotient::Room *, uint> m_directContactHandles; // Room to the handle in m_directContacts
+    QHash<QString, QPointer<MatrixMessagesChannel>> m_messagesChannels; // Room id to the open text channel
+    int m_pendingMessageCount = 0; // In the memory of all the channels
+    bool m_pageInScheduled = false;
+    MatrixStatistics m_statistics;
+    MatrixTracer m_tracer;
+    QCache<QString, QByteArray> m_avatarCache; // Avatar URL to the PNG data given to the client
+    MatrixIdTable m_ids;
+    MatrixHandleRegistry m_contactHandles { &m_ids };
+    MatrixHandleRegistry m_roomHandles { &m_ids };
+    QTimer *m_handleCompactionTimer = nullptr;
+    QTimer *m_idleChannelTimer = nullptr;
+    int m_idleChannelsClosed = 0;
+    MatrixMemoryBudget *m_memoryBudget = nullptr;
+    QTimer *m_memoryBudgetTimer = nullptr;
+
+    // The rooms are ingested (handles, contacts, profiles) in time slices, see ingestRooms()
+    QTimer *m_roomIngestionTimer = nullptr;
+    QList<QPointer<Quotient::Room>> m_priorityRoomQueue; // Rooms with open channels or unread messages
+    QList<QPointer<Quotient::Room>> m_roomQueue;
+    QSet<QString> m_queuedRoomIds;
+    QSet<QString> m_priorityRoomIds; // Rooms in m_priorityRoomQueue
+    QList<QPointer<Quotient::User>> m_profileQueue; // Members of the ingested rooms, after the rooms
+    QSet<const Quotient::User *> m_queuedProfiles;
+    QSet<QString> m_ingestedRoomIds;
+    bool m_initialSyncDone = false;
+    qint64 m_lastSyncTime = -1; // Msecs since epoch of the last completed sync
+    QDateTime m_connectedTime; // Files of the older events are not offered as transfers
 
     QString m_user; // User id as given by user during the account setup
     QString m_password;
@@ -0,0 +1,227 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "contactsearchchannel.hpp"
+#include "connection.hpp"
+
+#include <TelepathyQt/Constants>
+#include <TelepathyQt/DBusObject>
+
+#include <QDBusMessage>
+#include <QDebug>
+#include <QTimer>
+
+// The number of contacts to look up if the client did not set the limit
+static const int c_searchPageSize = 50;
+// Contacts per SearchResultReceived signal
+static const int c_resultBatchSize = 20;
+
+MatrixContactSearchChannel::MatrixContactSearchChannel(MatrixConnection *connection, const QVariantMap &request)
+    : Tp::AbstractChannelInterface(TP_QT_IFACE_CHANNEL_TYPE_CONTACT_SEARCH),
+      m_connection(connection),
+      m_limit(request.value(TP_QT_IFACE_CHANNEL_TYPE_CONTACT_SEARCH + QLatin1String(".Limit")).toUInt())
+{
+}
+
+MatrixContactSearchChannelPtr MatrixContactSearchChannel::create(MatrixConnection *connection, const QVariantMap &request)
+{
+    return MatrixContactSearchChannelPtr(new MatrixContactSearchChannel(connection, request));
+}
+
+MatrixContactSearchChannel::~MatrixContactSearchChannel()
+{
+    if (m_connection->userDirectory()) {
+        m_connection->userDirectory()->cancel(this);
+    }
+}
+
+QVariantMap MatrixContactSearchChannel::immutableProperties() const
+{
+    QVariantMap map;
+    map.insert(TP_QT_IFACE_CHANNEL_TYPE_CONTACT_SEARCH + QLatin1String(".Limit"), QVariant::fromValue(limit()));
+    map.insert(TP_QT_IFACE_CHANNEL_TYPE_CONTACT_SEARCH + QLatin1String(".AvailableSearchKeys"), QVariant::fromValue(availableSearchKeys()));
+    map.insert(TP_QT_IFACE_CHANNEL_TYPE_CONTACT_SEARCH + QLatin1String(".Server"), QVariant::fromValue(server()));
+    return map;
+}
+
+QStringList MatrixContactSearchChannel::availableSearchKeys()
+{
+    // The user directory matches the user id and the display name with a single search string
+    return { QString() };
+}
+
+void MatrixContactSearchChannel::search(const Tp::ContactSearchMap &terms, Tp::DBusError *error)
+{
+    if (m_searchState != Tp::ChannelContactSearchStateNotStarted) {
+        error->set(TP_QT_ERROR_NOT_AVAILABLE, QStringLiteral("The search has been already started"));
+        return;
+    }
+    for (auto it = terms.cbegin(); it != terms.cend(); ++it) {
+        if (!it.key().isEmpty()) {
+            error->set(TP_QT_ERROR_INVALID_ARGUMENT, QStringLiteral("Unsupported search key: ") + it.key());
+            return;
+        }
+    }
+    m_term = terms.value(QString()).trimmed();
+    if (m_term.isEmpty()) {
+        error->set(TP_QT_ERROR_INVALID_ARGUMENT, QStringLiteral("Empty search term"));
+        return;
+    }
+
+    m_requestedCount = m_limit ? m_limit : c_searchPageSize;
+    setSearchState(Tp::ChannelContactSearchStateInProgress);
+    requestResults();
+}
+
+void MatrixContactSearchChannel::more(Tp::DBusError *error)
+{
+    if (m_searchState != Tp::ChannelContactSearchStateMoreAvailable) {
+        error->set(TP_QT_ERROR_NOT_AVAILABLE, QStringLiteral("No more results available"));
+        return;
+    }
+    // The directory API has no paging; ask for a bigger result and report only the new contacts
+    m_requestedCount += m_limit ? m_limit : c_searchPageSize;
+    setSearchState(Tp::ChannelContactSearchStateInProgress);
+    requestResults();
+}
+
+void MatrixContactSearchChannel::stop(Tp::DBusError *error)
+{
+    switch (m_searchState) {
+    case Tp::ChannelContactSearchStateNotStarted:
+        error->set(TP_QT_ERROR_NOT_AVAILABLE, QStringLiteral("The search is not started"));
+        return;
+    case Tp::ChannelContactSearchStateInProgress:
+    case Tp::ChannelContactSearchStateMoreAvailable:
+        m_connection->userDirectory()->cancel(this);
+        setSearchState(Tp::ChannelContactSearchStateCompleted);
+        return;
+    default:
+        return;
+    }
+}
+
+void MatrixContactSearchChannel::createAdaptor()
+{
+    (void) new MatrixContactSearchAdaptor(dbusObject()->dbusConnection(), this, dbusObject());
+}
+
+void MatrixContactSearchChannel::requestResults()
+{
+    // Start on the next event loop iteration, so the results (maybe cached) follow the method reply
+    QTimer::singleShot(0, this, [this]() {
+        if (m_searchState != Tp::ChannelContactSearchStateInProgress) {
+            return;
+        }
+        m_connection->userDirectory()->search(m_term, m_requestedCount, this, [this](const MatrixUserDirectory::Reply &reply) {
+            onReply(reply);
+        });
+    });
+}
+
+void MatrixContactSearchChannel::onReply(const MatrixUserDirectory::Reply &reply)
+{
+    if (m_searchState != Tp::ChannelContactSearchStateInProgress) {
+        return;
+    }
+    if (reply.cancelled) {
+        setSearchState(Tp::ChannelContactSearchStateFailed, TP_QT_ERROR_CANCELLED, QStringLiteral("Superseded by a newer search"));
+        return;
+    }
+    if (!reply.error.isEmpty()) {
+        setSearchState(Tp::ChannelContactSearchStateFailed, TP_QT_ERROR_NETWORK_ERROR, reply.error);
+        return;
+    }
+
+    Tp::ContactSearchResultMap batch;
+    for (const MatrixUserDirectory::User &user : reply.users) {
+        if (m_reportedIds.contains(user.userId)) {
+            continue;
+        }
+        m_reportedIds.insert(user.userId);
+
+        Tp::ContactInfoFieldList fields;
+        if (!user.displayName.isEmpty()) {
+            fields.append(Tp::ContactInfoField { QStringLiteral("fn"), {}, { user.displayName } });
+            fields.append(Tp::ContactInfoField { QStringLiteral("nickname"), {}, { user.displayName } });
+        }
+        batch.insert(user.userId, fields);
+        if (batch.count() == c_resultBatchSize) {
+            emit searchResultReceived(batch);
+            batch.clear();
+        }
+    }
+    if (!batch.isEmpty()) {
+        emit searchResultReceived(batch);
+    }
+
+    // A client limit caps the whole search
+    const bool canHaveMore = reply.limited && (!m_limit || (static_cast<uint>(m_reportedIds.count()) < m_limit));
+    setSearchState(canHaveMore ? Tp::ChannelContactSearchStateMoreAvailable : Tp::ChannelContactSearchStateCompleted);
+}
+
+void MatrixContactSearchChannel::setSearchState(uint state, const QString &error, const QString &debugMessage)
+{
+    m_searchState = state;
+    QVariantMap details;
+    if (!debugMessage.isEmpty()) {
+        details.insert(QStringLiteral("debug-message"), debugMessage);
+    }
+    emit searchStateChanged(state, error, details);
+}
+
+MatrixContactSearchAdaptor::MatrixContactSearchAdaptor(const QDBusConnection &dbusConnection, MatrixContactSearchChannel *channel, QObject *parent)
+    : QDBusAbstractAdaptor(parent),
+      m_dbusConnection(dbusConnection),
+      m_channel(channel)
+{
+    connect(channel, &MatrixContactSearchChannel::searchStateChanged, this, &MatrixContactSearchAdaptor::SearchStateChanged);
+    connect(channel, &MatrixContactSearchChannel::searchResultReceived, this, &MatrixContactSearchAdaptor::SearchResultReceived);
+}
+
+void MatrixContactSearchAdaptor::Search(const Tp::ContactSearchMap &terms, const QDBusMessage &message)
+{
+    Tp::DBusError error;
+    m_channel->search(terms, &error);
+    reply(message, error);
+}
+
+void MatrixContactSearchAdaptor::More(const QDBusMessage &message)
+{
+    Tp::DBusError error;
+    m_channel->more(&error);
+    reply(message, error);
+}
+
+void MatrixContactSearchAdaptor::Stop(const QDBusMessage &message)
+{
+    Tp::DBusError error;
+    m_channel->stop(&error);
+    reply(message, error);
+}
+
+void MatrixContactSearchAdaptor::reply(const QDBusMessage &message, const Tp::DBusError &error)
+{
+    message.setDelayedReply(true);
+    if (error.isValid()) {
+        m_dbusConnection.send(message.createErrorReply(error.name(), error.message()));
+    } else {
+        m_dbusConnection.send(message.createReply());
+    }
+}
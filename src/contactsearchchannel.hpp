@@ -0,0 +1,108 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_CONTACT_SEARCH_CHANNEL_HPP
+#define TANK_CONTACT_SEARCH_CHANNEL_HPP
+
+#include <QDBusAbstractAdaptor>
+#include <QSet>
+
+#include <TelepathyQt/BaseChannel>
+
+#include "userdirectory.hpp"
+
+class QDBusMessage;
+
+class MatrixConnection;
+class MatrixContactSearchChannel;
+
+typedef Tp::SharedPtr<MatrixContactSearchChannel> MatrixContactSearchChannelPtr;
+
+// TelepathyQt has no service side ContactSearch channel type, so this one comes with its own adaptor
+class MatrixContactSearchChannel : public Tp::AbstractChannelInterface
+{
+    Q_OBJECT
+public:
+    static MatrixContactSearchChannelPtr create(MatrixConnection *connection, const QVariantMap &request);
+    ~MatrixContactSearchChannel() override;
+
+    QVariantMap immutableProperties() const override;
+
+    uint searchState() const { return m_searchState; }
+    uint limit() const { return m_limit; }
+    static QStringList availableSearchKeys();
+    QString server() const { return QString(); }
+
+    void search(const Tp::ContactSearchMap &terms, Tp::DBusError *error);
+    void more(Tp::DBusError *error);
+    void stop(Tp::DBusError *error);
+
+signals:
+    void searchStateChanged(uint state, const QString &error, const QVariantMap &details);
+    void searchResultReceived(const Tp::ContactSearchResultMap &result);
+
+private:
+    MatrixContactSearchChannel(MatrixConnection *connection, const QVariantMap &request);
+
+    void createAdaptor() override;
+    void requestResults();
+    void onReply(const MatrixUserDirectory::Reply &reply);
+    void setSearchState(uint state, const QString &error = QString(), const QString &debugMessage = QString());
+
+    MatrixConnection *m_connection = nullptr;
+    uint m_searchState = Tp::ChannelContactSearchStateNotStarted;
+    uint m_limit = 0;
+    QString m_term;
+    int m_requestedCount = 0;
+    QSet<QString> m_reportedIds;
+};
+
+class MatrixContactSearchAdaptor : public QDBusAbstractAdaptor
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "org.freedesktop.Telepathy.Channel.Type.ContactSearch")
+    Q_PROPERTY(uint SearchState READ searchState)
+    Q_PROPERTY(uint Limit READ limit)
+    Q_PROPERTY(QStringList AvailableSearchKeys READ availableSearchKeys)
+    Q_PROPERTY(QString Server READ server)
+public:
+    MatrixContactSearchAdaptor(const QDBusConnection &dbusConnection, MatrixContactSearchChannel *channel, QObject *parent);
+
+    uint searchState() const { return m_channel->searchState(); }
+    uint limit() const { return m_channel->limit(); }
+    QStringList availableSearchKeys() const { return m_channel->availableSearchKeys(); }
+    QString server() const { return m_channel->server(); }
+
+public slots:
+    void Search(const Tp::ContactSearchMap &terms, const QDBusMessage &message);
+    void More(const QDBusMessage &message);
+    void Stop(const QDBusMessage &message);
+
+signals:
+    void SearchStateChanged(uint state, const QString &error, const QVariantMap &details);
+    void SearchResultReceived(const Tp::ContactSearchResultMap &result);
+
+private:
+    void reply(const QDBusMessage &message, const Tp::DBusError &error);
+
+    QDBusConnection m_dbusConnection;
+    MatrixContactSearchChannel *m_channel = nullptr;
+};
+
+#endif // TANK_CONTACT_SEARCH_CHANNEL_HPP
@@ -0,0 +1,187 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "cryptostore.hpp"
+
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+
+#include "olm.hpp"
+
+static const int c_cryptoStoreFormat = 1;
+static const int c_pickleKeySize = 32;
+// The older sessions with a device are dropped; the other side starts a new one if needed
+static const int c_maxOlmSessionsPerDevice = 8;
+
+MatrixCryptoStore::MatrixCryptoStore(const QString &fileName)
+    : m_fileName(fileName)
+{
+}
+
+bool MatrixCryptoStore::load(const QString &userId, const QString &deviceId)
+{
+    QFile file(m_fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    const QJsonObject root = QJsonDocument::fromJson(file.readAll()).object();
+    if (root.value(QLatin1String("format")).toInt() > c_cryptoStoreFormat) {
+        qWarning() << Q_FUNC_INFO << "Unsupported file format" << root.value(QLatin1String("format")).toInt();
+        return false;
+    }
+    // The keys belong to a device, a new login is a new device
+    if ((root.value(QLatin1String("userId")).toString() != userId)
+            || (root.value(QLatin1String("deviceId")).toString() != deviceId)) {
+        return false;
+    }
+
+    m_userId = userId;
+    m_deviceId = deviceId;
+    m_pickleKey = QByteArray::fromBase64(root.value(QLatin1String("pickleKey")).toString().toLatin1());
+    m_account = root.value(QLatin1String("account")).toString().toLatin1();
+    m_olmSessions.clear();
+    m_groupSessions.clear();
+
+    const QJsonObject olmSessions = root.value(QLatin1String("olmSessions")).toObject();
+    for (auto it = olmSessions.constBegin(); it != olmSessions.constEnd(); ++it) {
+        QList<QByteArray> sessions;
+        for (const QJsonValue &session : it.value().toArray()) {
+            sessions.append(session.toString().toLatin1());
+        }
+        m_olmSessions.insert(it.key(), sessions);
+    }
+
+    const QJsonArray groupSessions = root.value(QLatin1String("groupSessions")).toArray();
+    for (const QJsonValue &value : groupSessions) {
+        const QJsonObject object = value.toObject();
+        GroupSession session;
+        session.roomId = object.value(QLatin1String("room")).toString();
+        session.sessionId = object.value(QLatin1String("session")).toString();
+        session.pickle = object.value(QLatin1String("pickle")).toString().toLatin1();
+        session.senderKey = object.value(QLatin1String("senderKey")).toString();
+        session.signingKey = object.value(QLatin1String("signingKey")).toString();
+        m_groupSessions.insert(groupSessionKey(session.roomId, session.senderKey, session.sessionId), session);
+    }
+    m_modified = false;
+
+    qDebug() << Q_FUNC_INFO << m_olmSessions.count() << "devices," << m_groupSessions.count() << "room keys";
+    return (m_pickleKey.size() == c_pickleKeySize) && !m_account.isEmpty();
+}
+
+void MatrixCryptoStore::reset(const QString &userId, const QString &deviceId)
+{
+    m_userId = userId;
+    m_deviceId = deviceId;
+    m_pickleKey = MatrixOlm::randomBytes(c_pickleKeySize);
+    m_account.clear();
+    m_olmSessions.clear();
+    m_groupSessions.clear();
+    m_modified = true;
+}
+
+bool MatrixCryptoStore::save()
+{
+    QJsonObject olmSessions;
+    for (auto it = m_olmSessions.cbegin(); it != m_olmSessions.cend(); ++it) {
+        QJsonArray sessions;
+        for (const QByteArray &session : it.value()) {
+            sessions.append(QString::fromLatin1(session));
+        }
+        olmSessions.insert(it.key(), sessions);
+    }
+    QJsonArray groupSessions;
+    for (const GroupSession &session : m_groupSessions) {
+        groupSessions.append(QJsonObject({
+                                             { QLatin1String("room"), session.roomId },
+                                             { QLatin1String("session"), session.sessionId },
+                                             { QLatin1String("pickle"), QString::fromLatin1(session.pickle) },
+                                             { QLatin1String("senderKey"), session.senderKey },
+                                             { QLatin1String("signingKey"), session.signingKey },
+                                         }));
+    }
+
+    QJsonObject root;
+    root.insert(QLatin1String("format"), c_cryptoStoreFormat);
+    root.insert(QLatin1String("userId"), m_userId);
+    root.insert(QLatin1String("deviceId"), m_deviceId);
+    root.insert(QLatin1String("pickleKey"), QString::fromLatin1(m_pickleKey.toBase64()));
+    root.insert(QLatin1String("account"), QString::fromLatin1(m_account));
+    root.insert(QLatin1String("olmSessions"), olmSessions);
+    root.insert(QLatin1String("groupSessions"), groupSessions);
+
+    // Replace the file atomically, a torn write would lose the keys of the device
+    QDir().mkpath(QFileInfo(m_fileName).absolutePath());
+    QSaveFile saveFile(m_fileName);
+    if (!saveFile.open(QIODevice::WriteOnly)) {
+        qWarning() << Q_FUNC_INFO << "Unable to save the keys to" << m_fileName;
+        return false;
+    }
+    saveFile.setPermissions(QFileDevice::ReadOwner | QFileDevice::WriteOwner);
+    saveFile.write(QJsonDocument(root).toJson(QJsonDocument::Compact));
+    if (!saveFile.commit()) {
+        qWarning() << Q_FUNC_INFO << "Unable to save the keys to" << m_fileName;
+        return false;
+    }
+    m_modified = false;
+    return true;
+}
+
+void MatrixCryptoStore::setAccount(const QByteArray &account)
+{
+    m_account = account;
+    m_modified = true;
+}
+
+void MatrixCryptoStore::setOlmSessions(const QString &senderKey, const QList<QByteArray> &sessions)
+{
+    QList<QByteArray> &stored = m_olmSessions[senderKey];
+    stored = sessions;
+    while (stored.count() > c_maxOlmSessionsPerDevice) {
+        stored.removeFirst();
+    }
+    m_modified = true;
+}
+
+bool MatrixCryptoStore::hasGroupSession(const QString &roomId, const QString &senderKey, const QString &sessionId) const
+{
+    return m_groupSessions.contains(groupSessionKey(roomId, senderKey, sessionId));
+}
+
+MatrixCryptoStore::GroupSession MatrixCryptoStore::groupSession(const QString &roomId, const QString &senderKey,
+                                                                const QString &sessionId) const
+{
+    return m_groupSessions.value(groupSessionKey(roomId, senderKey, sessionId));
+}
+
+void MatrixCryptoStore::addGroupSession(const GroupSession &session)
+{
+    m_groupSessions.insert(groupSessionKey(session.roomId, session.senderKey, session.sessionId), session);
+    m_modified = true;
+}
+
+QString MatrixCryptoStore::groupSessionKey(const QString &roomId, const QString &senderKey, const QString &sessionId)
+{
+    return roomId + QLatin1Char('|') + senderKey + QLatin1Char('|') + sessionId;
+}
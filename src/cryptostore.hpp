@@ -0,0 +1,77 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_CRYPTO_STORE_HPP
+#define TANK_CRYPTO_STORE_HPP
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QString>
+
+// The end-to-end encryption state of the device: the Olm account, the Olm sessions with the other devices
+// and the Megolm sessions of the rooms. The Olm objects are kept pickled with a random pickle key stored
+// in the same (owner-only) file, so the file is as secret as the access token next to it.
+class MatrixCryptoStore
+{
+public:
+    struct GroupSession {
+        QString roomId;
+        QString sessionId;
+        QByteArray pickle;
+        QString senderKey; // Curve25519 key of the device which shared the session
+        QString signingKey; // Ed25519 key claimed by that device
+    };
+
+    explicit MatrixCryptoStore(const QString &fileName);
+
+    // Returns false if there is no state of this device (the first start or a new login)
+    bool load(const QString &userId, const QString &deviceId);
+    // Starts over with a new pickle key and no account
+    void reset(const QString &userId, const QString &deviceId);
+    bool save();
+    bool isModified() const { return m_modified; }
+
+    QByteArray pickleKey() const { return m_pickleKey; }
+    QByteArray account() const { return m_account; }
+    void setAccount(const QByteArray &account);
+
+    // The Olm sessions with a device (by its Curve25519 key), the newest last
+    QList<QByteArray> olmSessions(const QString &senderKey) const { return m_olmSessions.value(senderKey); }
+    void setOlmSessions(const QString &senderKey, const QList<QByteArray> &sessions);
+
+    bool hasGroupSession(const QString &roomId, const QString &senderKey, const QString &sessionId) const;
+    GroupSession groupSession(const QString &roomId, const QString &senderKey, const QString &sessionId) const;
+    void addGroupSession(const GroupSession &session);
+    int groupSessionCount() const { return m_groupSessions.count(); }
+
+protected:
+    static QString groupSessionKey(const QString &roomId, const QString &senderKey, const QString &sessionId);
+
+    QString m_fileName;
+    QString m_userId;
+    QString m_deviceId;
+    QByteArray m_pickleKey;
+    QByteArray m_account;
+    QHash<QString, QList<QByteArray>> m_olmSessions;
+    QHash<QString, GroupSession> m_groupSessions; // See groupSessionKey()
+    bool m_modified = false;
+};
+
+#endif // TANK_CRYPTO_STORE_HPP
@@ -0,0 +1,225 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "decryptor.hpp"
+
+#include <QDebug>
+#include <QJsonDocument>
+#include <QRunnable>
+#include <QThread>
+
+#include "olm.hpp"
+
+#include <functional>
+
+// The latest message indexes kept per session for the replay check
+static const int c_maxMessageIndexesPerSession = 256;
+
+namespace
+{
+
+class DecryptJob : public QRunnable
+{
+public:
+    DecryptJob(MatrixDecryptor *decryptor, const std::function<void(const QJsonObject &, const QString &, const QString &, quint32)> &done,
+               const QString &roomId, const QJsonObject &event, const QByteArray &pickleKey, const QByteArray &session)
+        : m_decryptor(decryptor),
+          m_done(done),
+          m_roomId(roomId),
+          m_event(event),
+          m_pickleKey(pickleKey),
+          m_session(session)
+    {
+    }
+
+    void run() override
+    {
+        QJsonObject event = m_event;
+        QString error;
+        QString session;
+        const QJsonObject content = m_event.value(QLatin1String("content")).toObject();
+        quint32 messageIndex = 0;
+        const QByteArray plaintext = MatrixOlm::groupDecrypt(m_pickleKey, m_session,
+                                                             content.value(QLatin1String("ciphertext")).toString().toLatin1(),
+                                                             &messageIndex, &error);
+        if (!plaintext.isNull()) {
+            const QJsonObject payload = QJsonDocument::fromJson(plaintext).object();
+            // The room is in the encrypted payload, so an event can not be replayed in another room
+            if (payload.value(QLatin1String("room_id")).toString() != m_roomId) {
+                error = QStringLiteral("The event was encrypted for another room");
+            } else {
+                event.insert(QLatin1String("type"), payload.value(QLatin1String("type")));
+                event.insert(QLatin1String("content"), payload.value(QLatin1String("content")));
+                session = content.value(QLatin1String("sender_key")).toString() + QLatin1Char('|')
+                        + content.value(QLatin1String("session_id")).toString();
+            }
+        }
+        if (!error.isEmpty()) {
+            event = m_event;
+        }
+
+        // Back to the thread of the decryptor; the decryptor waits for the jobs on destruction
+        const auto done = m_done;
+        QMetaObject::invokeMethod(m_decryptor, [done, event, error, session, messageIndex]() {
+            done(event, error, session, messageIndex);
+        }, Qt::QueuedConnection);
+    }
+
+private:
+    MatrixDecryptor *m_decryptor;
+    std::function<void(const QJsonObject &, const QString &, const QString &, quint32)> m_done;
+    QString m_roomId;
+    QJsonObject m_event;
+    QByteArray m_pickleKey;
+    QByteArray m_session;
+};
+
+} // namespace
+
+MatrixDecryptor::MatrixDecryptor(QObject *parent)
+    : QObject(parent)
+{
+    m_pool.setMaxThreadCount(QThread::idealThreadCount());
+}
+
+MatrixDecryptor::~MatrixDecryptor()
+{
+    m_pool.clear();
+    m_pool.waitForDone();
+}
+
+void MatrixDecryptor::enqueue(const QString &roomId, const QJsonObject &event, const QByteArray &pickleKey, const QByteArray &session)
+{
+    const quint64 serial = append(roomId, Item());
+    const quint64 generation = m_generation;
+    auto done = [this, generation, roomId, serial, event](const QJsonObject &result, const QString &error,
+                                                         const QString &replaySession, quint32 messageIndex) {
+        onDecrypted(generation, roomId, serial, event, result, error, replaySession, messageIndex);
+    };
+    m_pool.start(new DecryptJob(this, done, roomId, event, pickleKey, session));
+}
+
+void MatrixDecryptor::enqueueFailed(const QString &roomId, const QJsonObject &event, const QString &error)
+{
+    Item item;
+    item.event = event;
+    item.error = error;
+    item.done = true;
+    ++m_failedCount;
+    append(roomId, item);
+    release(roomId);
+}
+
+void MatrixDecryptor::enqueuePlain(const QString &roomId, const QJsonObject &event)
+{
+    Item item;
+    item.event = event;
+    item.done = true;
+    append(roomId, item);
+    release(roomId);
+}
+
+int MatrixDecryptor::pendingCount() const
+{
+    int result = 0;
+    for (const RoomQueue &queue : m_rooms) {
+        result += queue.items.count();
+    }
+    return result;
+}
+
+void MatrixDecryptor::clear()
+{
+    ++m_generation;
+    m_pool.clear();
+    m_rooms.clear();
+}
+
+quint64 MatrixDecryptor::append(const QString &roomId, const Item &item)
+{
+    RoomQueue &queue = m_rooms[roomId];
+    queue.items.append(item);
+    return queue.firstSerial + quint64(queue.items.count()) - 1;
+}
+
+void MatrixDecryptor::onDecrypted(quint64 generation, const QString &roomId, quint64 serial, const QJsonObject &encryptedEvent,
+                                  const QJsonObject &event, const QString &error, const QString &session, quint32 messageIndex)
+{
+    if ((generation != m_generation) || !m_rooms.contains(roomId)) {
+        return;
+    }
+    Item item;
+    item.event = event;
+    item.error = error;
+    item.done = true;
+    if (!session.isEmpty() && isReplay(session, messageIndex, event.value(QLatin1String("event_id")).toString())) {
+        qWarning() << Q_FUNC_INFO << "Message index replayed by" << event.value(QLatin1String("event_id")).toString() << "in" << roomId;
+        item.event = encryptedEvent;
+        item.error = QStringLiteral("The message index was already used by another event");
+    }
+    if (item.error.isEmpty()) {
+        ++m_decryptedCount;
+    } else {
+        ++m_failedCount;
+    }
+
+    RoomQueue &queue = m_rooms[roomId];
+    queue.items[int(serial - queue.firstSerial)] = item;
+    release(roomId);
+}
+
+bool MatrixDecryptor::isReplay(const QString &session, quint32 messageIndex, const QString &eventId)
+{
+    // A message index of a session is used once; the same event can come again (e.g. after a gap)
+    QMap<quint32, QString> &indexes = m_messageIndexes[session];
+    const auto it = indexes.constFind(messageIndex);
+    if (it != indexes.cend()) {
+        return it.value() != eventId;
+    }
+    if ((indexes.count() >= c_maxMessageIndexesPerSession) && (messageIndex < indexes.firstKey())) {
+        // Older than the indexes kept (e.g. a back-paginated message), can not be checked
+        return false;
+    }
+    indexes.insert(messageIndex, eventId);
+    if (indexes.count() > c_maxMessageIndexesPerSession) {
+        indexes.erase(indexes.begin());
+    }
+    return false;
+}
+
+void MatrixDecryptor::release(const QString &roomId)
+{
+    auto it = m_rooms.find(roomId);
+    if (it == m_rooms.end()) {
+        return;
+    }
+    QList<Item> ready;
+    RoomQueue &queue = it.value();
+    while (!queue.items.isEmpty() && queue.items.first().done) {
+        ready.append(queue.items.takeFirst());
+        ++queue.firstSerial;
+    }
+    if (queue.items.isEmpty()) {
+        m_rooms.erase(it);
+    }
+    // Emitted after the queue is consistent, the receivers may queue more events
+    for (const Item &item : ready) {
+        emit eventReady(roomId, item.event, item.error);
+    }
+}
@@ -0,0 +1,85 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_DECRYPTOR_HPP
+#define TANK_DECRYPTOR_HPP
+
+#include <QHash>
+#include <QJsonObject>
+#include <QList>
+#include <QMap>
+#include <QObject>
+#include <QThreadPool>
+
+// Decrypts the Megolm room events on a thread pool (a thread per core). The events of a room come out
+// in the order they were queued: a decrypted event waits for the ones before it, and the plain events
+// queued behind an encrypted one wait for its decryption.
+class MatrixDecryptor : public QObject
+{
+    Q_OBJECT
+public:
+    explicit MatrixDecryptor(QObject *parent = nullptr);
+    ~MatrixDecryptor() override;
+
+    // The pickle key and the session pickle are copied to the job, it does not touch the store
+    void enqueue(const QString &roomId, const QJsonObject &event, const QByteArray &pickleKey, const QByteArray &session);
+    // Keeps the place of an event which can not be decrypted (e.g. the room key was not shared)
+    void enqueueFailed(const QString &roomId, const QJsonObject &event, const QString &error);
+    void enqueuePlain(const QString &roomId, const QJsonObject &event);
+
+    bool hasPending(const QString &roomId) const { return m_rooms.contains(roomId); }
+    int pendingCount() const;
+    // Drops the queued events, the jobs in flight are finished and ignored
+    void clear();
+
+    quint64 decryptedCount() const { return m_decryptedCount; }
+    quint64 failedCount() const { return m_failedCount; }
+
+signals:
+    // The error is set if the event could not be decrypted, the event is the encrypted one then
+    void eventReady(const QString &roomId, const QJsonObject &event, const QString &error);
+
+protected:
+    struct Item {
+        QJsonObject event;
+        QString error;
+        bool done = false;
+    };
+    struct RoomQueue {
+        quint64 firstSerial = 0;
+        QList<Item> items;
+    };
+
+    quint64 append(const QString &roomId, const Item &item);
+    void onDecrypted(quint64 generation, const QString &roomId, quint64 serial, const QJsonObject &encryptedEvent,
+                     const QJsonObject &event, const QString &error, const QString &session, quint32 messageIndex);
+    bool isReplay(const QString &session, quint32 messageIndex, const QString &eventId);
+    void release(const QString &roomId);
+
+    QThreadPool m_pool;
+    QHash<QString, RoomQueue> m_rooms; // Only the rooms with queued events
+    // Sender key and session id to the message indexes and their event ids, to reject the replays;
+    // the latest indexes of a session only, see isReplay()
+    QHash<QString, QMap<quint32, QString>> m_messageIndexes;
+    quint64 m_generation = 0; // The results of the jobs started before clear() are dropped
+    quint64 m_decryptedCount = 0;
+    quint64 m_failedCount = 0;
+};
+
+#endif // TANK_DECRYPTOR_HPP
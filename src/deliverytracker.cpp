@@ -0,0 +1,151 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "deliverytracker.hpp"
+
+// The number of messages to remember for the read receipts and late remote echoes
+static const int c_maxTrackedMessages = 512;
+
+void MatrixDeliveryTracker::addOutgoing(const QString &txnId)
+{
+    if (m_entries.contains(txnId)) {
+        return;
+    }
+    m_entries.insert(txnId, Entry());
+    m_order.append(txnId);
+    if (m_order.count() > c_maxTrackedMessages) {
+        forgetOldest();
+    }
+}
+
+bool MatrixDeliveryTracker::setState(const QString &txnId, State state)
+{
+    auto it = m_entries.find(txnId);
+    if (it == m_entries.end()) {
+        return false;
+    }
+    if (!isTransitionAllowed(it->state, state)) {
+        return false;
+    }
+    it->state = state;
+
+    if (isReportable(state)) {
+        if (!m_reports.contains(txnId)) {
+            m_reportOrder.append(txnId);
+        }
+        m_reports.insert(txnId, state);
+    }
+    return true;
+}
+
+void MatrixDeliveryTracker::setEventId(const QString &txnId, const QString &eventId)
+{
+    auto it = m_entries.find(txnId);
+    if ((it == m_entries.end()) || eventId.isEmpty()) {
+        return;
+    }
+    it->eventId = eventId;
+    m_eventToTxn.insert(eventId, txnId);
+}
+
+void MatrixDeliveryTracker::addUntrackedReport(const QString &token, State state)
+{
+    if (m_entries.contains(token) || !isReportable(state)) {
+        return;
+    }
+    if (m_reports.value(token, State::Queued) == state) {
+        return;
+    }
+    if (!m_reports.contains(token)) {
+        m_reportOrder.append(token);
+    }
+    m_reports.insert(token, state);
+}
+
+QList<MatrixDeliveryTracker::Report> MatrixDeliveryTracker::takeReports()
+{
+    QList<Report> reports;
+    reports.reserve(m_reportOrder.count());
+    for (const QString &txnId : m_reportOrder) {
+        reports.append(Report(txnId, toDeliveryStatus(m_reports.value(txnId))));
+    }
+    m_reports.clear();
+    m_reportOrder.clear();
+    return reports;
+}
+
+bool MatrixDeliveryTracker::isReportable(State state)
+{
+    return (state != State::Queued) && (state != State::Sending);
+}
+
+Tp::DeliveryStatus MatrixDeliveryTracker::toDeliveryStatus(State state)
+{
+    switch (state) {
+    case State::Accepted:
+        return Tp::DeliveryStatusAccepted;
+    case State::Delivered:
+        return Tp::DeliveryStatusDelivered;
+    case State::Read:
+        return Tp::DeliveryStatusRead;
+    case State::TemporarilyFailed:
+        return Tp::DeliveryStatusTemporarilyFailed;
+    case State::PermanentlyFailed:
+        return Tp::DeliveryStatusPermanentlyFailed;
+    case State::Queued:
+    case State::Sending:
+        break;
+    }
+    return Tp::DeliveryStatusUnknown;
+}
+
+bool MatrixDeliveryTracker::isTransitionAllowed(State from, State to)
+{
+    if (from == to) {
+        return false;
+    }
+    switch (from) {
+    case State::PermanentlyFailed:
+        return false;
+    case State::TemporarilyFailed:
+        // The message can be resent
+        return to != State::Queued;
+    case State::Queued:
+    case State::Sending:
+    case State::Accepted:
+    case State::Delivered:
+    case State::Read:
+        break;
+    }
+    const bool failure = (to == State::TemporarilyFailed) || (to == State::PermanentlyFailed);
+    if (failure) {
+        // A message that has reached the server can not fail anymore
+        return (from == State::Queued) || (from == State::Sending);
+    }
+    return static_cast<int>(to) > static_cast<int>(from);
+}
+
+void MatrixDeliveryTracker::forgetOldest()
+{
+    const QString txnId = m_order.takeFirst();
+    const Entry entry = m_entries.take(txnId);
+    if (!entry.eventId.isEmpty()) {
+        m_eventToTxn.remove(entry.eventId);
+    }
+}
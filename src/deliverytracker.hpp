@@ -0,0 +1,82 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_DELIVERY_TRACKER_HPP
+#define TANK_DELIVERY_TRACKER_HPP
+
+#include <QHash>
+#include <QList>
+#include <QPair>
+#include <QString>
+
+#include <TelepathyQt/Constants>
+
+// Tracks the outgoing messages (by the transaction id, which is the Telepathy message token)
+// and collects a delivery report for each real state transition.
+class MatrixDeliveryTracker
+{
+public:
+    enum class State {
+        Queued,
+        Sending,
+        Accepted, // The homeserver returned the event id
+        Delivered, // The remote echo came with the sync
+        Read, // Someone else has read the message
+        TemporarilyFailed,
+        PermanentlyFailed,
+    };
+
+    using Report = QPair<QString, Tp::DeliveryStatus>;
+
+    void addOutgoing(const QString &txnId);
+    bool isTracked(const QString &txnId) const { return m_entries.contains(txnId); }
+
+    // Returns false if the transition is not a real one (e.g. a late Accepted after the remote echo)
+    bool setState(const QString &txnId, State state);
+    void setEventId(const QString &txnId, const QString &eventId);
+    QString txnIdForEvent(const QString &eventId) const { return m_eventToTxn.value(eventId); }
+
+    // Report for a message that is not tracked (e.g. one sent in a previous session)
+    void addUntrackedReport(const QString &token, State state);
+
+    bool hasReports() const { return !m_reportOrder.isEmpty(); }
+    // The pending reports in order of the first transition, with the latest status per message
+    QList<Report> takeReports();
+
+    static bool isReportable(State state);
+    static Tp::DeliveryStatus toDeliveryStatus(State state);
+
+protected:
+    struct Entry {
+        State state = State::Queued;
+        QString eventId;
+    };
+
+    static bool isTransitionAllowed(State from, State to);
+    void forgetOldest();
+
+    QHash<QString, Entry> m_entries; // Transaction id to the entry
+    QList<QString> m_order; // Transaction ids in order of sending
+    QHash<QString, QString> m_eventToTxn;
+
+    QHash<QString, State> m_reports;
+    QList<QString> m_reportOrder;
+};
+
+#endif // TANK_DELIVERY_TRACKER_HPP
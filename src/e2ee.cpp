@@ -0,0 +1,338 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "e2ee.hpp"
+#include "connection.hpp"
+#include "decryptor.hpp"
+#include "olm.hpp"
+
+#include <QDebug>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QStringList>
+
+// Quotient
+#include <connection.h>
+#include <csapi/keys.h>
+
+static const QString c_olmAlgorithm = QStringLiteral("m.olm.v1.curve25519-aes-sha2");
+static const QString c_megolmAlgorithm = QStringLiteral("m.megolm.v1.aes-sha2");
+static const QString c_signedCurve25519 = QStringLiteral("signed_curve25519");
+// The room keys often come after the first messages of a session; the events are decrypted again then
+static const int c_maxEventsWaitingForKeys = 1000;
+
+MatrixE2ee::MatrixE2ee(MatrixConnection *connection, const QString &storeFileName)
+    : QObject(connection),
+      m_connection(connection),
+      m_store(storeFileName),
+      m_decryptor(new MatrixDecryptor(this))
+{
+    connect(m_decryptor, &MatrixDecryptor::eventReady, this, &MatrixE2ee::eventReady);
+}
+
+MatrixE2ee::~MatrixE2ee()
+{
+    if (m_store.isModified()) {
+        m_store.save();
+    }
+}
+
+bool MatrixE2ee::isEncrypted(const QJsonObject &event)
+{
+    return event.value(QLatin1String("type")).toString() == QLatin1String("m.room.encrypted");
+}
+
+void MatrixE2ee::start(const QString &userId, const QString &deviceId)
+{
+    m_userId = userId;
+    m_deviceId = deviceId;
+    if (!MatrixOlm::isAvailable()) {
+        qDebug() << Q_FUNC_INFO << "The encrypted events will not be decrypted: built without libolm";
+        return;
+    }
+
+    QString error;
+    if (!m_store.load(userId, deviceId)) {
+        qDebug() << Q_FUNC_INFO << "New keys for the device" << deviceId;
+        m_store.reset(userId, deviceId);
+        m_store.setAccount(MatrixOlm::createAccount(m_store.pickleKey(), &error));
+        if (m_store.account().isEmpty()) {
+            qWarning() << Q_FUNC_INFO << "Unable to create the Olm account:" << error;
+            return;
+        }
+        m_store.save();
+    }
+    const QJsonObject identityKeys = MatrixOlm::identityKeys(m_store.pickleKey(), m_store.account(), &error);
+    m_curve25519Key = identityKeys.value(QLatin1String("curve25519")).toString();
+    m_ed25519Key = identityKeys.value(QLatin1String("ed25519")).toString();
+    if (m_ed25519Key.isEmpty()) {
+        qWarning() << Q_FUNC_INFO << "Unable to read the identity keys:" << error;
+        return;
+    }
+    // The server takes the same device keys again; the one-time keys are topped up after the first sync
+    uploadKeys(0);
+}
+
+void MatrixE2ee::stop()
+{
+    m_decryptor->clear();
+    m_waitingForKeys.clear();
+    m_waitingForKeysCount = 0;
+    m_serverOneTimeKeys = -1;
+    if (m_store.isModified()) {
+        m_store.save();
+    }
+}
+
+void MatrixE2ee::processSyncData(const QJsonObject &syncData)
+{
+    if (!isStarted()) {
+        return;
+    }
+    const QJsonArray toDeviceEvents = syncData.value(QLatin1String("to_device")).toObject()
+            .value(QLatin1String("events")).toArray();
+    for (const QJsonValue &event : toDeviceEvents) {
+        processToDeviceEvent(event.toObject());
+    }
+    // Written once per sync, the keys come in bursts
+    if (m_store.isModified()) {
+        m_store.save();
+    }
+
+    const QJsonValue counts = syncData.value(QLatin1String("device_one_time_keys_count"));
+    if (counts.isObject()) {
+        m_serverOneTimeKeys = counts.toObject().value(c_signedCurve25519).toInt();
+    }
+    // Keep the server half full, the other devices take a key for every new Olm session
+    const int target = MatrixOlm::maxOneTimeKeys(m_store.pickleKey(), m_store.account()) / 2;
+    if ((m_serverOneTimeKeys >= 0) && (m_serverOneTimeKeys < target) && !m_uploadInFlight) {
+        uploadKeys(target - m_serverOneTimeKeys);
+    }
+}
+
+void MatrixE2ee::addRoomEvent(const QString &roomId, const QJsonObject &event)
+{
+    if (!isEncrypted(event)) {
+        m_decryptor->enqueuePlain(roomId, event);
+        return;
+    }
+    const QJsonObject content = event.value(QLatin1String("content")).toObject();
+    if (content.isEmpty()) {
+        // Redacted
+        m_decryptor->enqueueFailed(roomId, event, QStringLiteral("The message was deleted"));
+        return;
+    }
+    if (!MatrixOlm::isAvailable()) {
+        m_decryptor->enqueueFailed(roomId, event, QStringLiteral("End-to-end encryption is not supported"));
+        return;
+    }
+    if (content.value(QLatin1String("algorithm")).toString() != c_megolmAlgorithm) {
+        m_decryptor->enqueueFailed(roomId, event, QStringLiteral("Unsupported encryption algorithm"));
+        return;
+    }
+    const QString senderKey = content.value(QLatin1String("sender_key")).toString();
+    const QString sessionId = content.value(QLatin1String("session_id")).toString();
+    const MatrixCryptoStore::GroupSession session = m_store.groupSession(roomId, senderKey, sessionId);
+    if (session.pickle.isEmpty()) {
+        // The notice keeps the place of the event; the message follows if the key arrives
+        if (m_waitingForKeysCount < c_maxEventsWaitingForKeys) {
+            m_waitingForKeys[sessionKey(roomId, senderKey, sessionId)].append(qMakePair(roomId, event));
+            ++m_waitingForKeysCount;
+        }
+        m_decryptor->enqueueFailed(roomId, event, QStringLiteral("The room key was not shared with this device"));
+        return;
+    }
+    m_decryptor->enqueue(roomId, event, m_store.pickleKey(), session.pickle);
+}
+
+bool MatrixE2ee::hasPendingEvents(const QString &roomId) const
+{
+    return m_decryptor->hasPending(roomId);
+}
+
+QVariantMap MatrixE2ee::statistics() const
+{
+    QVariantMap result;
+    result.insert(QStringLiteral("e2ee-room-keys"), m_store.groupSessionCount());
+    result.insert(QStringLiteral("e2ee-room-keys-received"), m_roomKeysReceived);
+    result.insert(QStringLiteral("e2ee-to-device-failures"), m_toDeviceFailures);
+    result.insert(QStringLiteral("e2ee-events-decrypted"), m_decryptor->decryptedCount());
+    result.insert(QStringLiteral("e2ee-events-failed"), m_decryptor->failedCount());
+    result.insert(QStringLiteral("e2ee-events-pending"), m_decryptor->pendingCount());
+    result.insert(QStringLiteral("e2ee-events-waiting-for-keys"), m_waitingForKeysCount);
+    return result;
+}
+
+void MatrixE2ee::processToDeviceEvent(const QJsonObject &event)
+{
+    if (!isEncrypted(event)) {
+        return;
+    }
+    const QJsonObject content = event.value(QLatin1String("content")).toObject();
+    if (content.value(QLatin1String("algorithm")).toString() != c_olmAlgorithm) {
+        qDebug() << Q_FUNC_INFO << "Unsupported algorithm" << content.value(QLatin1String("algorithm")).toString();
+        return;
+    }
+    const QJsonObject message = content.value(QLatin1String("ciphertext")).toObject().value(m_curve25519Key).toObject();
+    if (message.isEmpty()) {
+        // Encrypted for the other devices only
+        return;
+    }
+
+    const QString senderKey = content.value(QLatin1String("sender_key")).toString();
+    QByteArray account = m_store.account();
+    QList<QByteArray> sessions = m_store.olmSessions(senderKey);
+    QString error;
+    const QByteArray plaintext = MatrixOlm::decrypt(m_store.pickleKey(), &account, &sessions, senderKey,
+                                                    message.value(QLatin1String("type")).toInt(),
+                                                    message.value(QLatin1String("body")).toString().toLatin1(), &error);
+    if (plaintext.isNull()) {
+        qWarning() << Q_FUNC_INFO << "Unable to decrypt a message of" << event.value(QLatin1String("sender")).toString() << error;
+        ++m_toDeviceFailures;
+        return;
+    }
+    if (account != m_store.account()) {
+        m_store.setAccount(account);
+    }
+    m_store.setOlmSessions(senderKey, sessions);
+
+    // The payload names both ends, so a message can not be passed on as if it was sent by another user or to another device
+    const QJsonObject payload = QJsonDocument::fromJson(plaintext).object();
+    if ((payload.value(QLatin1String("sender")).toString() != event.value(QLatin1String("sender")).toString())
+            || (payload.value(QLatin1String("recipient")).toString() != m_userId)
+            || (payload.value(QLatin1String("recipient_keys")).toObject().value(QLatin1String("ed25519")).toString() != m_ed25519Key)) {
+        qWarning() << Q_FUNC_INFO << "Ignored a message with a wrong sender or recipient";
+        ++m_toDeviceFailures;
+        return;
+    }
+    if (payload.value(QLatin1String("type")).toString() == QLatin1String("m.room_key")) {
+        addRoomKey(senderKey, payload);
+    }
+}
+
+void MatrixE2ee::addRoomKey(const QString &senderKey, const QJsonObject &payload)
+{
+    const QJsonObject content = payload.value(QLatin1String("content")).toObject();
+    if (content.value(QLatin1String("algorithm")).toString() != c_megolmAlgorithm) {
+        return;
+    }
+    MatrixCryptoStore::GroupSession session;
+    session.roomId = content.value(QLatin1String("room_id")).toString();
+    session.sessionId = content.value(QLatin1String("session_id")).toString();
+    session.senderKey = senderKey;
+    session.signingKey = payload.value(QLatin1String("keys")).toObject().value(QLatin1String("ed25519")).toString();
+    // The first copy of a session can decrypt from an earlier message index than a later one
+    if (m_store.hasGroupSession(session.roomId, senderKey, session.sessionId)) {
+        return;
+    }
+    QString error;
+    session.pickle = MatrixOlm::createGroupSession(m_store.pickleKey(),
+                                                   content.value(QLatin1String("session_key")).toString().toLatin1(), &error);
+    if (session.pickle.isEmpty()) {
+        qWarning() << Q_FUNC_INFO << "Unable to import the room key" << session.sessionId << "of" << session.roomId << error;
+        return;
+    }
+    qDebug() << Q_FUNC_INFO << "Room key" << session.sessionId << "of" << session.roomId;
+    m_store.addGroupSession(session);
+    ++m_roomKeysReceived;
+
+    const QList<QPair<QString, QJsonObject>> events = m_waitingForKeys.take(sessionKey(session.roomId, senderKey, session.sessionId));
+    m_waitingForKeysCount -= events.count();
+    for (const QPair<QString, QJsonObject> &event : events) {
+        addRoomEvent(event.first, event.second);
+    }
+}
+
+void MatrixE2ee::uploadKeys(int oneTimeKeyCount)
+{
+    const QString keySuffix = QLatin1Char(':') + m_deviceId;
+    const QStringList algorithms = { c_olmAlgorithm, c_megolmAlgorithm };
+
+    Quotient::DeviceKeys deviceKeys;
+    deviceKeys.userId = m_userId;
+    deviceKeys.deviceId = m_deviceId;
+    deviceKeys.algorithms = algorithms;
+    deviceKeys.keys = {
+        { QLatin1String("curve25519") + keySuffix, m_curve25519Key },
+        { QLatin1String("ed25519") + keySuffix, m_ed25519Key },
+    };
+    const QJsonObject signedDeviceKeys = {
+        { QLatin1String("algorithms"), QJsonArray::fromStringList(algorithms) },
+        { QLatin1String("device_id"), m_deviceId },
+        { QLatin1String("keys"), QJsonObject({
+              { QLatin1String("curve25519") + keySuffix, m_curve25519Key },
+              { QLatin1String("ed25519") + keySuffix, m_ed25519Key },
+          }) },
+        { QLatin1String("user_id"), m_userId },
+    };
+    deviceKeys.signatures = { { m_userId, { { QLatin1String("ed25519") + keySuffix, sign(signedDeviceKeys) } } } };
+
+    QHash<QString, QVariant> oneTimeKeys;
+    if (oneTimeKeyCount > 0) {
+        QByteArray account = m_store.account();
+        QString error;
+        const QJsonObject generated = MatrixOlm::generateOneTimeKeys(m_store.pickleKey(), &account, oneTimeKeyCount, &error);
+        if (generated.isEmpty()) {
+            qWarning() << Q_FUNC_INFO << "Unable to generate the one-time keys:" << error;
+        } else {
+            m_store.setAccount(account);
+            m_store.save();
+        }
+        const QJsonObject curveKeys = generated.value(QLatin1String("curve25519")).toObject();
+        for (auto it = curveKeys.constBegin(); it != curveKeys.constEnd(); ++it) {
+            const QJsonObject key = { { QLatin1String("key"), it.value() } };
+            const QVariantMap signatures = {
+                { m_userId, QVariantMap({ { QLatin1String("ed25519") + keySuffix, sign(key) } }) },
+            };
+            oneTimeKeys.insert(c_signedCurve25519 + QLatin1Char(':') + it.key(), QVariantMap({
+                                                                                                  { QLatin1String("key"), it.value().toString() },
+                                                                                                  { QLatin1String("signatures"), signatures },
+                                                                                              }));
+        }
+    }
+
+    m_uploadInFlight = true;
+    Quotient::UploadKeysJob *job = m_connection->matrix()->callApi<Quotient::UploadKeysJob>(deviceKeys, oneTimeKeys);
+    connect(job, &Quotient::BaseJob::result, this, [this, job]() {
+        m_uploadInFlight = false;
+        if (!job->status().good()) {
+            qWarning() << Q_FUNC_INFO << "Unable to upload the keys:" << job->errorString();
+            return;
+        }
+        m_serverOneTimeKeys = job->oneTimeKeyCounts().value(c_signedCurve25519);
+        qDebug() << Q_FUNC_INFO << m_serverOneTimeKeys << "one-time keys on the server";
+    });
+}
+
+QString MatrixE2ee::sessionKey(const QString &roomId, const QString &senderKey, const QString &sessionId)
+{
+    return roomId + QLatin1Char('|') + senderKey + QLatin1Char('|') + sessionId;
+}
+
+QString MatrixE2ee::sign(const QJsonObject &object) const
+{
+    // Canonical JSON: QJsonObject keeps the keys sorted and the compact form has no whitespace
+    QString error;
+    const QString signature = MatrixOlm::sign(m_store.pickleKey(), m_store.account(),
+                                              QJsonDocument(object).toJson(QJsonDocument::Compact), &error);
+    if (signature.isEmpty()) {
+        qWarning() << Q_FUNC_INFO << "Unable to sign:" << error;
+    }
+    return signature;
+}
@@ -0,0 +1,87 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_E2EE_HPP
+#define TANK_E2EE_HPP
+
+#include <QHash>
+#include <QJsonObject>
+#include <QList>
+#include <QObject>
+#include <QPair>
+#include <QVariantMap>
+
+#include "cryptostore.hpp"
+
+class MatrixConnection;
+class MatrixDecryptor;
+
+// Receiving side of the end-to-end encryption: publishes the keys of the device, takes the Megolm room keys
+// from the Olm encrypted to-device messages and decrypts the room events with MatrixDecryptor.
+class MatrixE2ee : public QObject
+{
+    Q_OBJECT
+public:
+    MatrixE2ee(MatrixConnection *connection, const QString &storeFileName);
+    ~MatrixE2ee() override;
+
+    static bool isEncrypted(const QJsonObject &event);
+
+    // Loads (or creates) the keys of the device and publishes them
+    void start(const QString &userId, const QString &deviceId);
+    void stop();
+    bool isStarted() const { return !m_ed25519Key.isEmpty(); }
+
+    // The to-device messages and the one-time key counts of a sync response
+    void processSyncData(const QJsonObject &syncData);
+
+    // Encrypted events are decrypted, the other ones keep their place behind them
+    void addRoomEvent(const QString &roomId, const QJsonObject &event);
+    bool hasPendingEvents(const QString &roomId) const;
+
+    QVariantMap statistics() const;
+
+signals:
+    // In the order of addRoomEvent() per room; the error is set if the event could not be decrypted
+    void eventReady(const QString &roomId, const QJsonObject &event, const QString &error);
+
+protected:
+    void processToDeviceEvent(const QJsonObject &event);
+    void addRoomKey(const QString &senderKey, const QJsonObject &payload);
+    void uploadKeys(int oneTimeKeyCount);
+    QString sign(const QJsonObject &object) const;
+    static QString sessionKey(const QString &roomId, const QString &senderKey, const QString &sessionId);
+
+    MatrixConnection *m_connection = nullptr;
+    MatrixCryptoStore m_store;
+    MatrixDecryptor *m_decryptor = nullptr;
+    QString m_userId;
+    QString m_deviceId;
+    QString m_curve25519Key;
+    QString m_ed25519Key;
+    int m_serverOneTimeKeys = -1; // Unknown until the first sync or upload
+    bool m_uploadInFlight = false;
+    quint64 m_roomKeysReceived = 0;
+    quint64 m_toDeviceFailures = 0;
+    // Room, sender key and session id to the events (with their room ids) waiting for the room key
+    QHash<QString, QList<QPair<QString, QJsonObject>>> m_waitingForKeys;
+    int m_waitingForKeysCount = 0;
+};
+
+#endif // TANK_E2EE_HPP
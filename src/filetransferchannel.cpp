@@ -0,0 +1,366 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "filetransferchannel.hpp"
+#include "connection.hpp"
+#include "requestscheduler.hpp"
+#include "sendqueue.hpp"
+
+#include <TelepathyQt/Constants>
+
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonObject>
+#include <QStandardPaths>
+
+#include <functional>
+#include <limits>
+
+// Quotient
+#include <connection.h>
+#include <room.h>
+#include <csapi/content-repo.h>
+#include <jobs/downloadfilejob.h>
+
+static const QString filesDirPath = QLatin1String("/files/");
+
+// Writes the data received from the client socket into the spool file and tells when all bytes are there.
+// The final chunk is not reported as written: the transfer is complete only once the file is sent to the room.
+// If the client did not announce the size, the spool is complete when the client closes the socket.
+class MatrixSpoolDevice : public QIODevice
+{
+public:
+    static const qint64 UnknownSize = -1;
+
+    MatrixSpoolDevice(const QString &fileName, qint64 expectedSize, std::function<void()> completeCallback, QObject *parent)
+        : QIODevice(parent),
+          m_file(fileName),
+          m_expectedSize(expectedSize),
+          m_completeCallback(completeCallback)
+    {
+    }
+
+    bool open(OpenMode mode) override
+    {
+        if (!m_file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            return false;
+        }
+        return QIODevice::open(mode);
+    }
+
+    void close() override
+    {
+        if (m_expectedSize == UnknownSize) {
+            finish();
+        }
+        m_file.close();
+        QIODevice::close();
+    }
+
+    bool isSequential() const override { return true; }
+    bool isFinished() const { return m_finished; }
+
+    void finish()
+    {
+        if (m_finished || !m_file.isOpen()) {
+            return;
+        }
+        m_finished = true;
+        m_file.close();
+        m_completeCallback();
+    }
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override
+    {
+        Q_UNUSED(data)
+        Q_UNUSED(maxSize)
+        return -1;
+    }
+
+    qint64 writeData(const char *data, qint64 size) override
+    {
+        if (m_finished) {
+            return -1;
+        }
+        const qint64 written = m_file.write(data, size);
+        if (written <= 0) {
+            return written;
+        }
+        m_written += written;
+        if ((m_expectedSize == UnknownSize) || (m_written < m_expectedSize)) {
+            emit bytesWritten(written);
+            return written;
+        }
+        finish();
+        return written;
+    }
+
+    QFile m_file;
+    qint64 m_expectedSize = 0;
+    qint64 m_written = 0;
+    bool m_finished = false;
+    std::function<void()> m_completeCallback;
+};
+
+MatrixFileTransferChannel::MatrixFileTransferChannel(MatrixConnection *connection, Quotient::Room *room, const QVariantMap &request)
+    : Tp::BaseChannelFileTransferType(request),
+      m_connection(connection),
+      m_room(room),
+      m_contentUri(request.value(contentUriProperty()).toUrl())
+{
+    connect(this, &Tp::BaseChannelFileTransferType::stateChanged, this, &MatrixFileTransferChannel::onStateChanged);
+}
+
+MatrixFileTransferChannelPtr MatrixFileTransferChannel::create(MatrixConnection *connection, Quotient::Room *room, const QVariantMap &request)
+{
+    return MatrixFileTransferChannelPtr(new MatrixFileTransferChannel(connection, room, request));
+}
+
+QString MatrixFileTransferChannel::contentUriProperty()
+{
+    // Not a D-Bus property; used to pass the mxc URI from the incoming event to the channel
+    return QStringLiteral("im.telepathy.tank.FileTransfer.ContentUri");
+}
+
+QVariantMap MatrixFileTransferChannel::incomingRequest(uint senderHandle, const QString &senderId, const QJsonObject &content,
+                                                       const QDateTime &timestamp)
+{
+    const QJsonObject info = content.value(QLatin1String("info")).toObject();
+    QString contentType = info.value(QLatin1String("mimetype")).toString();
+    if (contentType.isEmpty()) {
+        contentType = QStringLiteral("application/octet-stream");
+    }
+
+    QVariantMap request;
+    request.insert(TP_QT_IFACE_CHANNEL + QLatin1String(".ChannelType"), TP_QT_IFACE_CHANNEL_TYPE_FILE_TRANSFER);
+    request.insert(TP_QT_IFACE_CHANNEL + QLatin1String(".TargetHandleType"), Tp::HandleTypeContact);
+    request.insert(TP_QT_IFACE_CHANNEL + QLatin1String(".TargetHandle"), senderHandle);
+    request.insert(TP_QT_IFACE_CHANNEL + QLatin1String(".TargetID"), senderId);
+    request.insert(TP_QT_IFACE_CHANNEL + QLatin1String(".InitiatorHandle"), senderHandle);
+    request.insert(TP_QT_IFACE_CHANNEL + QLatin1String(".Requested"), false);
+    request.insert(TP_QT_IFACE_CHANNEL_TYPE_FILE_TRANSFER + QLatin1String(".ContentType"), contentType);
+    request.insert(TP_QT_IFACE_CHANNEL_TYPE_FILE_TRANSFER + QLatin1String(".Filename"), content.value(QLatin1String("body")).toString());
+    request.insert(TP_QT_IFACE_CHANNEL_TYPE_FILE_TRANSFER + QLatin1String(".Size"),
+                   static_cast<qulonglong>(info.value(QLatin1String("size")).toDouble()));
+    request.insert(TP_QT_IFACE_CHANNEL_TYPE_FILE_TRANSFER + QLatin1String(".Date"),
+                   static_cast<qulonglong>(timestamp.toMSecsSinceEpoch() / 1000));
+    request.insert(contentUriProperty(), QUrl(content.value(QLatin1String("url")).toString()));
+    return request;
+}
+
+void MatrixFileTransferChannel::onStateChanged(uint state, uint reason)
+{
+    qDebug() << Q_FUNC_INFO << state << reason;
+    switch (state) {
+    case Tp::FileTransferStatePending:
+        if (direction() == Outgoing) {
+            // The client provided the file; Matrix has no remote side to accept it, so do it right away.
+            // The media upload can not be resumed, so the whole file is always requested (the offset is 0).
+            const qint64 expectedSize = (size() == std::numeric_limits<qulonglong>::max())
+                    ? MatrixSpoolDevice::UnknownSize : static_cast<qint64>(size());
+            m_spool = new MatrixSpoolDevice(cacheFilePath(), expectedSize, [this]() { onFileSpooled(); }, this);
+            if (!m_spool->open(QIODevice::WriteOnly)) {
+                fail(Tp::FileTransferStateChangeReasonLocalError, QStringLiteral("Unable to create the spool file"));
+                return;
+            }
+            remoteAcceptFile(m_spool, 0);
+            if (expectedSize == 0) {
+                // No bytes will ever come from the client
+                m_spool->finish();
+            }
+        }
+        break;
+    case Tp::FileTransferStateAccepted:
+        if (direction() == Incoming) {
+            startDownload();
+        }
+        break;
+    case Tp::FileTransferStateCancelled:
+    case Tp::FileTransferStateCompleted:
+        if ((state == Tp::FileTransferStateCompleted) && m_spool && !m_spool->isFinished()) {
+            // The transfer of a file of unknown size is over; send what was spooled
+            m_spool->finish();
+            break;
+        }
+        if (m_job) {
+            m_job->abandon();
+        }
+        if (m_file) {
+            m_file->close();
+        }
+        if ((direction() == Outgoing) && (state == Tp::FileTransferStateCancelled)) {
+            // After a completed upload the spool is removed by the upload result handler
+            QFile::remove(cacheFilePath());
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void MatrixFileTransferChannel::onFileSpooled()
+{
+    if (m_room->usesEncryption()) {
+        // The upload would put the plain file on the media repository
+        fail(Tp::FileTransferStateChangeReasonLocalError, QStringLiteral("Sending to the encrypted rooms is not supported"));
+        return;
+    }
+    // The upload job streams the file from the disk; nothing is loaded into the memory
+    const QString fileName = cacheFilePath();
+    const QString contentType = this->contentType();
+    const QString originalName = filename();
+    const qulonglong fileSize = static_cast<qulonglong>(QFileInfo(fileName).size());
+    const QPointer<MatrixFileTransferChannel> channel = this;
+    Quotient::Connection *matrix = m_connection->matrix();
+    m_connection->scheduler()->schedule(MatrixRequestScheduler::Priority::Media, [channel, matrix, fileName, contentType, originalName, fileSize]() -> Quotient::BaseJob * {
+        if (!channel) {
+            return nullptr;
+        }
+        Quotient::UploadContentJob *job = matrix->uploadFile(fileName, contentType);
+        channel->m_job = job;
+        connect(job, &Quotient::BaseJob::result, channel.data(), [channel, job, contentType, originalName, fileSize]() {
+            QFile::remove(channel->cacheFilePath());
+            if (!job->status().good()) {
+                channel->fail(Tp::FileTransferStateChangeReasonRemoteError, job->errorString());
+                return;
+            }
+
+            QString msgType = QStringLiteral("m.file");
+            if (contentType.startsWith(QLatin1String("image/"))) {
+                msgType = QStringLiteral("m.image");
+            } else if (contentType.startsWith(QLatin1String("video/"))) {
+                msgType = QStringLiteral("m.video");
+            } else if (contentType.startsWith(QLatin1String("audio/"))) {
+                msgType = QStringLiteral("m.audio");
+            }
+            QJsonObject info;
+            info.insert(QStringLiteral("size"), static_cast<double>(fileSize));
+            info.insert(QStringLiteral("mimetype"), contentType);
+            QJsonObject content;
+            content.insert(QStringLiteral("msgtype"), msgType);
+            content.insert(QStringLiteral("body"), originalName);
+            content.insert(QStringLiteral("url"), QUrl(job->contentUri()).toString());
+            content.insert(QStringLiteral("info"), info);
+
+            MatrixMessagesChannelPtr textChannel = channel->m_connection->getMatrixMessagesChannelPtr(channel->m_room);
+            if (!textChannel) {
+                channel->fail(Tp::FileTransferStateChangeReasonLocalError, QStringLiteral("No text channel for the room"));
+                return;
+            }
+            MatrixSendQueue *sendQueue = textChannel->sendQueue();
+            const QString txnId = sendQueue->enqueue(content);
+            if (txnId.isEmpty()) {
+                channel->fail(Tp::FileTransferStateChangeReasonLocalError, QStringLiteral("Unable to store the message for sending"));
+                return;
+            }
+            // Keep the transfer open until the event is in the room
+            connect(sendQueue, &MatrixSendQueue::messageAccepted, channel.data(), [channel, txnId, fileSize](const QString &acceptedTxnId) {
+                if ((acceptedTxnId == txnId) && channel->isActive()) {
+                    channel->setTransferredBytes(fileSize);
+                    channel->setState(Tp::FileTransferStateCompleted, Tp::FileTransferStateChangeReasonNone);
+                }
+            });
+            connect(sendQueue, &MatrixSendQueue::messageFailed, channel.data(), [channel, txnId](const QString &failedTxnId, bool permanently, const QString &reason) {
+                Q_UNUSED(permanently)
+                if ((failedTxnId == txnId) && channel->isActive()) {
+                    channel->fail(Tp::FileTransferStateChangeReasonRemoteError, reason);
+                }
+            });
+        });
+        return job;
+    });
+}
+
+void MatrixFileTransferChannel::startDownload()
+{
+    if (!m_contentUri.isValid()) {
+        fail(Tp::FileTransferStateChangeReasonRemoteError, QStringLiteral("The event has no content URI"));
+        return;
+    }
+    const QString fileName = cacheFilePath();
+    const QFileInfo cachedFile(fileName);
+    if (cachedFile.exists() && (static_cast<qulonglong>(cachedFile.size()) == size())) {
+        // Downloaded already (e.g. the previous transfer was interrupted on the client side)
+        provideFile(fileName);
+        return;
+    }
+
+    const QPointer<MatrixFileTransferChannel> channel = this;
+    Quotient::Connection *matrix = m_connection->matrix();
+    const QUrl contentUri = m_contentUri;
+    m_connection->scheduler()->schedule(MatrixRequestScheduler::Priority::Media, [channel, matrix, contentUri, fileName]() -> Quotient::BaseJob * {
+        if (!channel) {
+            return nullptr;
+        }
+        // DownloadFileJob writes the reply to the file chunk by chunk as it arrives
+        Quotient::DownloadFileJob *job = matrix->downloadFile(contentUri, fileName);
+        channel->m_job = job;
+        connect(job, &Quotient::BaseJob::result, channel.data(), [channel, job, fileName]() {
+            if (!job->status().good()) {
+                channel->fail(Tp::FileTransferStateChangeReasonRemoteError, job->errorString());
+                return;
+            }
+            channel->provideFile(fileName);
+        });
+        return job;
+    });
+}
+
+void MatrixFileTransferChannel::provideFile(const QString &fileName)
+{
+    m_file = new QFile(fileName, this);
+    if (!m_file->open(QIODevice::ReadOnly)) {
+        fail(Tp::FileTransferStateChangeReasonLocalError, QStringLiteral("Unable to open the downloaded file"));
+        return;
+    }
+    // Resume from the offset the client asked for in AcceptFile()
+    const qulonglong offset = initialOffset();
+    if (offset && !m_file->seek(static_cast<qint64>(offset))) {
+        fail(Tp::FileTransferStateChangeReasonLocalError, QStringLiteral("Unable to seek to the requested offset"));
+        return;
+    }
+    remoteProvideFile(m_file, offset);
+}
+
+void MatrixFileTransferChannel::fail(uint reason, const QString &message)
+{
+    qWarning() << Q_FUNC_INFO << message;
+    setState(Tp::FileTransferStateCancelled, reason);
+}
+
+bool MatrixFileTransferChannel::isActive() const
+{
+    return (state() != Tp::FileTransferStateCompleted) && (state() != Tp::FileTransferStateCancelled);
+}
+
+QString MatrixFileTransferChannel::cacheFilePath() const
+{
+    const QString dirPath = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + filesDirPath;
+    QDir().mkpath(dirPath);
+    if (direction() == Incoming) {
+        // Named by the content, so an interrupted transfer of the same file reuses the download
+        const QByteArray hash = QCryptographicHash::hash(m_contentUri.toString().toUtf8(), QCryptographicHash::Sha1);
+        return dirPath + QString::fromLatin1(hash.toHex());
+    }
+    return dirPath + QStringLiteral("upload-%1").arg(reinterpret_cast<quintptr>(this), 0, 16);
+}
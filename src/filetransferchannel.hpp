@@ -0,0 +1,75 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_FILE_TRANSFER_CHANNEL_HPP
+#define TANK_FILE_TRANSFER_CHANNEL_HPP
+
+#include <QPointer>
+#include <QUrl>
+
+#include <TelepathyQt/BaseChannel>
+
+class QFile;
+class QJsonObject;
+
+class MatrixConnection;
+class MatrixFileTransferChannel;
+class MatrixSpoolDevice;
+
+namespace Quotient
+{
+
+class BaseJob;
+class Room;
+
+} // Quotient
+
+typedef Tp::SharedPtr<MatrixFileTransferChannel> MatrixFileTransferChannelPtr;
+
+class MatrixFileTransferChannel : public Tp::BaseChannelFileTransferType
+{
+    Q_OBJECT
+public:
+    static MatrixFileTransferChannelPtr create(MatrixConnection *connection, Quotient::Room *room, const QVariantMap &request);
+
+    // Request details to announce an incoming file of the given m.room.message content
+    static QVariantMap incomingRequest(uint senderHandle, const QString &senderId, const QJsonObject &content,
+                                       const QDateTime &timestamp);
+    static QString contentUriProperty();
+
+private:
+    MatrixFileTransferChannel(MatrixConnection *connection, Quotient::Room *room, const QVariantMap &request);
+
+    void onStateChanged(uint state, uint reason);
+    void onFileSpooled();
+    void startDownload();
+    void provideFile(const QString &fileName);
+    void fail(uint reason, const QString &message);
+    bool isActive() const;
+    QString cacheFilePath() const;
+
+    MatrixConnection *m_connection = nullptr;
+    Quotient::Room *m_room = nullptr;
+    QUrl m_contentUri;
+    QFile *m_file = nullptr;
+    MatrixSpoolDevice *m_spool = nullptr;
+    QPointer<Quotient::BaseJob> m_job;
+};
+
+#endif // TANK_FILE_TRANSFER_CHANNEL_HPP
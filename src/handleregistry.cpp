@@ -0,0 +1,126 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "handleregistry.hpp"
+
+#include <QDebug>
+
+MatrixHandleRegistry::MatrixHandleRegistry(MatrixIdTable *ids)
+    : m_ids(ids)
+{
+}
+
+MatrixHandleRegistry::~MatrixHandleRegistry()
+{
+    for (const Entry &entry : m_entries) {
+        m_ids->release(entry.id);
+    }
+}
+
+uint MatrixHandleRegistry::ensureHandle(const QString &identifier)
+{
+    const uint existing = handle(identifier);
+    if (existing) {
+        m_entries[existing].touched = true;
+        return existing;
+    }
+    Entry entry;
+    entry.id = m_ids->intern(identifier);
+    if (!entry.id.isValid()) {
+        return 0;
+    }
+    const uint newHandle = ++m_lastHandle;
+    m_entries.insert(newHandle, entry);
+    m_handles.insert(entry.id, newHandle);
+    return newHandle;
+}
+
+uint MatrixHandleRegistry::handle(const QString &identifier) const
+{
+    const MatrixIdTable::Id id = m_ids->find(identifier);
+    if (!id.isValid()) {
+        return 0;
+    }
+    return m_handles.value(id);
+}
+
+QString MatrixHandleRegistry::identifier(uint handle) const
+{
+    const auto it = m_entries.constFind(handle);
+    if (it == m_entries.cend()) {
+        return QString();
+    }
+    return m_ids->toString(it->id);
+}
+
+void MatrixHandleRegistry::ref(uint handle)
+{
+    auto it = m_entries.find(handle);
+    if (it == m_entries.end()) {
+        qWarning() << Q_FUNC_INFO << "Invalid handle" << handle;
+        return;
+    }
+    ++it->refCount;
+}
+
+void MatrixHandleRegistry::unref(uint handle)
+{
+    auto it = m_entries.find(handle);
+    if ((it == m_entries.end()) || (it->refCount == 0)) {
+        qWarning() << Q_FUNC_INFO << "Unbalanced unref of handle" << handle;
+        return;
+    }
+    --it->refCount;
+    // Keep it for one more compaction period in case the client still uses it
+    it->touched = true;
+}
+
+int MatrixHandleRegistry::refCount(uint handle) const
+{
+    return m_entries.value(handle).refCount;
+}
+
+void MatrixHandleRegistry::touch(uint handle)
+{
+    auto it = m_entries.find(handle);
+    if (it != m_entries.end()) {
+        it->touched = true;
+    }
+}
+
+QList<uint> MatrixHandleRegistry::compact()
+{
+    QList<uint> released;
+    for (auto it = m_entries.begin(); it != m_entries.end();) {
+        if (it->refCount || it->touched) {
+            it->touched = false;
+            ++it;
+            continue;
+        }
+        released.append(it.key());
+        m_handles.remove(it->id);
+        m_ids->release(it->id);
+        it = m_entries.erase(it);
+    }
+    if (!released.isEmpty()) {
+        m_entries.squeeze();
+        m_handles.squeeze();
+    }
+    return released;
+}
@@ -0,0 +1,73 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_HANDLE_REGISTRY_HPP
+#define TANK_HANDLE_REGISTRY_HPP
+
+#include <QHash>
+#include <QList>
+#include <QString>
+
+#include "idtable.hpp"
+
+// Maps the identifiers to the Telepathy handles. The handles held by the channels, the roster and
+// the pending messages are reference counted; the rest is released by compact() once unused.
+// A released handle number is never given out again during the connection lifetime.
+class MatrixHandleRegistry
+{
+public:
+    // The identifiers are interned in the given table, which can be shared by several registries
+    explicit MatrixHandleRegistry(MatrixIdTable *ids);
+    ~MatrixHandleRegistry();
+    Q_DISABLE_COPY(MatrixHandleRegistry)
+
+    uint ensureHandle(const QString &identifier);
+    // Returns 0 for an unknown identifier
+    uint handle(const QString &identifier) const;
+    // Returns an empty string for an invalid or released handle
+    QString identifier(uint handle) const;
+    MatrixIdTable::Id id(uint handle) const { return m_entries.value(handle).id; }
+    bool isValid(uint handle) const { return m_entries.contains(handle); }
+
+    void ref(uint handle);
+    void unref(uint handle);
+    int refCount(uint handle) const;
+    // Marks the handle as recently used by the client, so it survives the next compaction
+    void touch(uint handle);
+
+    // Releases the handles without references which were not used since the previous compaction
+    QList<uint> compact();
+
+    int count() const { return m_entries.count(); }
+    uint lastHandle() const { return m_lastHandle; }
+
+protected:
+    struct Entry {
+        MatrixIdTable::Id id;
+        int refCount = 0;
+        bool touched = true;
+    };
+
+    MatrixIdTable *m_ids = nullptr;
+    QHash<MatrixIdTable::Id, uint> m_handles;
+    QHash<uint, Entry> m_entries;
+    uint m_lastHandle = 0;
+};
+
+#endif // TANK_HANDLE_REGISTRY_HPP
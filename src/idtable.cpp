@@ -0,0 +1,199 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "idtable.hpp"
+
+#include <QDebug>
+
+static const QString c_sigils = QStringLiteral("@!#$+");
+
+MatrixIdTable::MatrixIdTable()
+{
+    m_entries.append(Entry());
+    m_servers.append(QString());
+}
+
+MatrixIdTable::Id MatrixIdTable::intern(const QString &identifier)
+{
+    Id id = find(identifier);
+    if (id.isValid()) {
+        ++m_entries[id.index].refCount;
+        return id;
+    }
+
+    const bool hasSigil = !identifier.isEmpty() && c_sigils.contains(identifier.at(0));
+    const int localpartStart = hasSigil ? 1 : 0;
+    const int separator = identifier.indexOf(QLatin1Char(':'), localpartStart);
+    const int localpartEnd = separator < 0 ? identifier.size() : separator;
+    const QByteArray localpart = identifier.midRef(localpartStart, localpartEnd - localpartStart).toUtf8();
+    if (localpart.size() > 0xffff) {
+        qWarning() << Q_FUNC_INFO << "The identifier is too long";
+        return Id();
+    }
+
+    Entry entry;
+    entry.sigil = hasSigil ? identifier.at(0).toLatin1() : 0;
+    entry.server = separator < 0 ? 0 : internServer(identifier.midRef(separator + 1));
+    entry.offset = static_cast<quint32>(m_localparts.size());
+    entry.length = static_cast<quint16>(localpart.size());
+    entry.refCount = 1;
+    m_localparts.append(localpart);
+
+    if (m_freeEntries.isEmpty()) {
+        id.index = static_cast<quint32>(m_entries.count());
+        m_entries.append(entry);
+    } else {
+        id.index = m_freeEntries.takeLast();
+        m_entries[id.index] = entry;
+    }
+    m_lookup.insert(::qHash(identifier), id.index);
+    ++m_count;
+    m_plainBytes += plainStringSize(identifier);
+    return id;
+}
+
+void MatrixIdTable::release(Id id)
+{
+    if (!id.isValid() || (id.index >= static_cast<quint32>(m_entries.count())) || !m_entries.at(id.index).refCount) {
+        qWarning() << Q_FUNC_INFO << "Invalid id" << id.index;
+        return;
+    }
+    Entry &entry = m_entries[id.index];
+    if (--entry.refCount) {
+        return;
+    }
+    const QString identifier = toString(id);
+    m_lookup.remove(::qHash(identifier), id.index);
+    m_wastedBytes += entry.length;
+    m_plainBytes -= plainStringSize(identifier);
+    entry = Entry();
+    m_freeEntries.append(id.index);
+    --m_count;
+
+    if ((m_wastedBytes > 4096) && (m_wastedBytes > m_localparts.size() / 2)) {
+        compactBuffer();
+    }
+}
+
+MatrixIdTable::Id MatrixIdTable::find(const QString &identifier) const
+{
+    const uint hash = ::qHash(identifier);
+    for (auto it = m_lookup.constFind(hash); (it != m_lookup.cend()) && (it.key() == hash); ++it) {
+        if (matches(m_entries.at(it.value()), identifier)) {
+            Id id;
+            id.index = it.value();
+            return id;
+        }
+    }
+    return Id();
+}
+
+QString MatrixIdTable::toString(Id id) const
+{
+    if (!id.isValid() || (id.index >= static_cast<quint32>(m_entries.count()))) {
+        return QString();
+    }
+    const Entry &entry = m_entries.at(id.index);
+    const QString &server = m_servers.at(entry.server);
+    QString result;
+    result.reserve(1 + entry.length + 1 + server.size());
+    if (entry.sigil) {
+        result.append(QLatin1Char(entry.sigil));
+    }
+    result.append(QString::fromUtf8(m_localparts.constData() + entry.offset, entry.length));
+    if (entry.server) {
+        result.append(QLatin1Char(':'));
+        result.append(server);
+    }
+    return result;
+}
+
+qint64 MatrixIdTable::memoryUsage() const
+{
+    // The container node sizes are approximate
+    qint64 usage = m_localparts.capacity();
+    usage += m_entries.capacity() * static_cast<qint64>(sizeof(Entry));
+    usage += m_freeEntries.capacity() * static_cast<qint64>(sizeof(quint32));
+    usage += m_lookup.size() * static_cast<qint64>(3 * sizeof(void *));
+    for (const QString &server : m_servers) {
+        usage += plainStringSize(server) + static_cast<qint64>(3 * sizeof(void *));
+    }
+    return usage;
+}
+
+bool MatrixIdTable::matches(const Entry &entry, const QString &identifier) const
+{
+    if (!entry.refCount) {
+        return false;
+    }
+    int position = 0;
+    if (entry.sigil) {
+        if (identifier.isEmpty() || (identifier.at(0) != QLatin1Char(entry.sigil))) {
+            return false;
+        }
+        position = 1;
+    }
+    const QString &server = m_servers.at(entry.server);
+    const int localpartSize = identifier.size() - position - (entry.server ? server.size() + 1 : 0);
+    if (localpartSize < 0) {
+        return false;
+    }
+    if (entry.server) {
+        if ((identifier.at(position + localpartSize) != QLatin1Char(':'))
+                || (identifier.midRef(position + localpartSize + 1) != server)) {
+            return false;
+        }
+    }
+    return identifier.midRef(position, localpartSize) == QString::fromUtf8(m_localparts.constData() + entry.offset, entry.length);
+}
+
+quint32 MatrixIdTable::internServer(const QStringRef &server)
+{
+    const QString serverName = server.toString();
+    const quint32 existing = m_serverIndex.value(serverName);
+    if (existing) {
+        return existing;
+    }
+    const quint32 index = static_cast<quint32>(m_servers.count());
+    m_servers.append(serverName);
+    m_serverIndex.insert(serverName, index);
+    return index;
+}
+
+void MatrixIdTable::compactBuffer()
+{
+    QByteArray localparts;
+    localparts.reserve(m_localparts.size() - m_wastedBytes);
+    for (Entry &entry : m_entries) {
+        if (!entry.refCount) {
+            continue;
+        }
+        const quint32 offset = static_cast<quint32>(localparts.size());
+        localparts.append(m_localparts.constData() + entry.offset, entry.length);
+        entry.offset = offset;
+    }
+    m_localparts = localparts;
+    m_wastedBytes = 0;
+}
+
+qint64 MatrixIdTable::plainStringSize(const QString &identifier)
+{
+    // QArrayData header plus the UTF-16 data with the terminating null
+    return static_cast<qint64>(sizeof(QArrayData)) + (identifier.size() + 1) * 2;
+}
@@ -0,0 +1,87 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_ID_TABLE_HPP
+#define TANK_ID_TABLE_HPP
+
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+#include <QVector>
+
+// Interned Matrix identifiers (@user:server, !room:server, #alias:server). The localparts are kept
+// as UTF-8 in a single buffer and the server names are shared, so a known id costs a few bytes
+// instead of a QString of its own. The ids are reference counted by the owners (the handle registries).
+class MatrixIdTable
+{
+public:
+    struct Id {
+        quint32 index = 0;
+        bool isValid() const { return index != 0; }
+        bool operator==(const Id &other) const { return index == other.index; }
+        bool operator!=(const Id &other) const { return index != other.index; }
+    };
+
+    MatrixIdTable();
+    Q_DISABLE_COPY(MatrixIdTable)
+
+    // Adds a reference to the id (the id is added if it is not known yet)
+    Id intern(const QString &identifier);
+    void release(Id id);
+    // Returns an invalid Id for an unknown identifier
+    Id find(const QString &identifier) const;
+    QString toString(Id id) const;
+
+    int count() const { return m_count; }
+    int serverCount() const { return m_servers.count() - 1; }
+    // The approximate memory used by the table and what the same ids would take as separate QStrings
+    qint64 memoryUsage() const;
+    qint64 plainStringMemoryUsage() const { return m_plainBytes; }
+
+protected:
+    struct Entry {
+        quint32 offset = 0;
+        quint32 server = 0; // 0 is for the ids without a server part
+        quint32 refCount = 0;
+        quint16 length = 0;
+        char sigil = 0;
+    };
+
+    bool matches(const Entry &entry, const QString &identifier) const;
+    quint32 internServer(const QStringRef &server);
+    void compactBuffer();
+    static qint64 plainStringSize(const QString &identifier);
+
+    QByteArray m_localparts;
+    QVector<Entry> m_entries; // Index 0 is reserved for the invalid Id
+    QVector<quint32> m_freeEntries;
+    QMultiHash<uint, quint32> m_lookup; // Hash of the full identifier to the entry index
+    QVector<QString> m_servers;
+    QHash<QString, quint32> m_serverIndex;
+    int m_count = 0;
+    int m_wastedBytes = 0; // Localparts of the released ids in m_localparts
+    qint64 m_plainBytes = 0;
+};
+
+inline uint qHash(MatrixIdTable::Id id, uint seed = 0)
+{
+    return ::qHash(id.index, seed);
+}
+
+#endif // TANK_ID_TABLE_HPP
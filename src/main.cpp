@@ -24,6 +24,7 @@
 #include <TelepathyQt/Debug>
 
 #include "protocol.hpp"
+#include "watchdog.hpp"
 
 int main(int argc, char *argv[])
 {
@@ -35,6 +36,9 @@ int main(int argc, char *argv[])
     Tp::enableDebug(true);
     Tp::enableWarnings(true);
 
+    // Optional, see TANK_WATCHDOG_MS
+    MatrixWatchdog::startFromEnvironment();
+
     Tp::BaseProtocolPtr protocol = Tp::BaseProtocol::create<MatrixProtocol>(QLatin1String("matrix"));
     Tp::BaseConnectionManagerPtr cm = Tp::BaseConnectionManager::create(QLatin1String("tank"));
 
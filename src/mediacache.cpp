@@ -0,0 +1,179 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "mediacache.hpp"
+#include "connection.hpp"
+#include "requestscheduler.hpp"
+
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QImage>
+
+#include <algorithm>
+
+// Quotient
+#include <connection.h>
+#include <jobs/mediathumbnailjob.h>
+
+MatrixMediaCache::MatrixMediaCache(MatrixConnection *connection, const QString &dirPath)
+    : QObject(connection),
+      m_connection(connection),
+      m_dirPath(dirPath)
+{
+    QDir().mkpath(m_dirPath);
+    loadIndex();
+}
+
+void MatrixMediaCache::setMaxSize(qint64 bytes)
+{
+    m_maxSize = bytes;
+    evict();
+}
+
+QString MatrixMediaCache::cachedThumbnail(const QUrl &contentUri, const QSize &size)
+{
+    const QString key = keyFor(contentUri, size);
+    auto it = m_entries.find(key);
+    if (it == m_entries.end()) {
+        ++m_misses;
+        return QString();
+    }
+    ++m_hits;
+    it->lastUsed = ++m_useCounter;
+    return filePath(key);
+}
+
+void MatrixMediaCache::fetchThumbnail(const QUrl &contentUri, const QSize &size, QObject *context, const ThumbnailCallback &callback)
+{
+    const QString cached = cachedThumbnail(contentUri, size);
+    if (!cached.isEmpty()) {
+        callback(cached);
+        return;
+    }
+
+    const QString key = keyFor(contentUri, size);
+    const bool inProgress = m_waiters.contains(key);
+    m_waiters[key].append({ context, callback });
+    if (inProgress) {
+        return;
+    }
+
+    const QPointer<MatrixMediaCache> cache = this;
+    Quotient::Connection *matrix = m_connection->matrix();
+    m_connection->scheduler()->schedule(MatrixRequestScheduler::Priority::Media, [cache, matrix, contentUri, size, key]() -> Quotient::BaseJob * {
+        if (!cache) {
+            return nullptr;
+        }
+        Quotient::MediaThumbnailJob *job = matrix->getThumbnail(contentUri, size.width(), size.height());
+        connect(job, &Quotient::BaseJob::result, cache.data(), [cache, job, size, key]() {
+            if (!job->status().good()) {
+                cache->finishFetch(key, QString());
+                return;
+            }
+            // The server may return a bigger image than requested; never keep more than the bounds
+            QImage image = job->thumbnail();
+            if ((image.width() > size.width()) || (image.height() > size.height())) {
+                image = image.scaled(size, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+            }
+            const QString path = cache->filePath(key);
+            if (image.isNull() || !image.save(path, image.hasAlphaChannel() ? "PNG" : "JPG")) {
+                cache->finishFetch(key, QString());
+                return;
+            }
+            cache->insert(key, QFileInfo(path).size());
+            cache->finishFetch(key, path);
+        });
+        return job;
+    });
+}
+
+void MatrixMediaCache::cancelPending()
+{
+    const QStringList keys = m_waiters.keys();
+    for (const QString &key : keys) {
+        finishFetch(key, QString());
+    }
+}
+
+QString MatrixMediaCache::keyFor(const QUrl &contentUri, const QSize &size) const
+{
+    const QByteArray source = contentUri.toString().toUtf8() + '@' + QByteArray::number(size.width())
+            + 'x' + QByteArray::number(size.height());
+    return QString::fromLatin1(QCryptographicHash::hash(source, QCryptographicHash::Sha1).toHex());
+}
+
+QString MatrixMediaCache::filePath(const QString &key) const
+{
+    return m_dirPath + key;
+}
+
+void MatrixMediaCache::loadIndex()
+{
+    // Oldest first, so the previous usage order is approximately kept
+    const QFileInfoList files = QDir(m_dirPath).entryInfoList(QDir::Files, QDir::Time | QDir::Reversed);
+    for (const QFileInfo &file : files) {
+        insert(file.fileName(), file.size());
+    }
+}
+
+void MatrixMediaCache::insert(const QString &key, qint64 size)
+{
+    Entry &entry = m_entries[key];
+    m_size += size - entry.size;
+    entry.size = size;
+    entry.lastUsed = ++m_useCounter;
+    evict();
+}
+
+void MatrixMediaCache::evict()
+{
+    if (m_size <= m_maxSize) {
+        return;
+    }
+    QList<QPair<quint64, QString>> byAge;
+    byAge.reserve(m_entries.count());
+    for (auto it = m_entries.cbegin(); it != m_entries.cend(); ++it) {
+        byAge.append(qMakePair(it->lastUsed, it.key()));
+    }
+    std::sort(byAge.begin(), byAge.end());
+
+    // Evict down to 90% of the budget to not run the eviction on every insert
+    const qint64 target = m_maxSize - m_maxSize / 10;
+    for (const auto &item : byAge) {
+        if (m_size <= target) {
+            break;
+        }
+        m_size -= m_entries.take(item.second).size;
+        QFile::remove(filePath(item.second));
+    }
+    qDebug() << Q_FUNC_INFO << "Media cache size" << m_size << "of" << m_maxSize;
+}
+
+void MatrixMediaCache::finishFetch(const QString &key, const QString &filePath)
+{
+    const QList<Waiter> waiters = m_waiters.take(key);
+    for (const Waiter &waiter : waiters) {
+        if (!waiter.context) {
+            continue;
+        }
+        waiter.callback(filePath);
+    }
+}
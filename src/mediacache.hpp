@@ -0,0 +1,86 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_MEDIA_CACHE_HPP
+#define TANK_MEDIA_CACHE_HPP
+
+#include <QHash>
+#include <QObject>
+#include <QPointer>
+#include <QSize>
+#include <QUrl>
+
+#include <functional>
+
+class MatrixConnection;
+
+// Bounded on-disk cache of the media thumbnails. The clients get file URIs of the cached
+// files, so the image data never goes through D-Bus nor stays in the memory.
+class MatrixMediaCache : public QObject
+{
+    Q_OBJECT
+public:
+    using ThumbnailCallback = std::function<void(const QString &filePath)>;
+
+    explicit MatrixMediaCache(MatrixConnection *connection, const QString &dirPath);
+
+    void setMaxSize(qint64 bytes);
+    qint64 maxSize() const { return m_maxSize; }
+    qint64 size() const { return m_size; }
+
+    // Returns the path of the cached thumbnail or an empty string
+    QString cachedThumbnail(const QUrl &contentUri, const QSize &size);
+    // Calls back with the path of the thumbnail (or an empty path on failure); concurrent requests are merged
+    void fetchThumbnail(const QUrl &contentUri, const QSize &size, QObject *context, const ThumbnailCallback &callback);
+    // Fails the fetches in progress (e.g. when the scheduler queue is dropped on disconnect)
+    void cancelPending();
+
+    quint64 hits() const { return m_hits; }
+    quint64 misses() const { return m_misses; }
+
+protected:
+    struct Entry {
+        qint64 size = 0;
+        quint64 lastUsed = 0;
+    };
+
+    struct Waiter {
+        QPointer<QObject> context;
+        ThumbnailCallback callback;
+    };
+
+    QString keyFor(const QUrl &contentUri, const QSize &size) const;
+    QString filePath(const QString &key) const;
+    void loadIndex();
+    void insert(const QString &key, qint64 size);
+    void evict();
+    void finishFetch(const QString &key, const QString &filePath);
+
+    MatrixConnection *m_connection = nullptr;
+    QString m_dirPath;
+    QHash<QString, Entry> m_entries;
+    QHash<QString, QList<Waiter>> m_waiters; // Fetches in progress
+    qint64 m_maxSize = 64 * 1024 * 1024;
+    qint64 m_size = 0;
+    quint64 m_useCounter = 0;
+    quint64 m_hits = 0;
+    quint64 m_misses = 0;
+};
+
+#endif // TANK_MEDIA_CACHE_HPP
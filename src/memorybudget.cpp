@@ -0,0 +1,115 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "memorybudget.hpp"
+
+#include <QDebug>
+
+#include <algorithm>
+
+#include <room.h>
+
+static const int c_defaultBudgetMegabytes = 256;
+// Per item guesses: a RoomEvent keeps its original JSON, a User keeps the names and the avatars per room
+static const qint64 c_eventCost = 2 * 1024;
+static const qint64 c_memberCost = 1024;
+static const qint64 c_roomCost = 16 * 1024;
+// A cached profile: the display name, the avatar URL and the contact info fields
+static const qint64 c_profileCost = 512;
+
+MatrixMemoryBudget::MatrixMemoryBudget()
+{
+    int megabytes = qEnvironmentVariableIntValue("TANK_MEMORY_BUDGET_MB");
+    if (megabytes <= 0) {
+        megabytes = c_defaultBudgetMegabytes;
+    }
+    m_budget = qint64(megabytes) * 1024 * 1024;
+    m_clock.start();
+}
+
+qint64 MatrixMemoryBudget::estimate(const Quotient::Room *room)
+{
+    return c_roomCost + room->timelineSize() * c_eventCost + room->users().count() * c_memberCost;
+}
+
+qint64 MatrixMemoryBudget::releasableEstimate(int profileCount)
+{
+    return profileCount * c_profileCost;
+}
+
+void MatrixMemoryBudget::touch(const QString &roomId)
+{
+    m_lastActive.insert(roomId, m_clock.elapsed());
+    m_trimmed.remove(roomId);
+}
+
+QStringList MatrixMemoryBudget::select(const QList<RoomUsage> &rooms)
+{
+    m_lastEstimate = 0;
+    QList<const RoomUsage *> candidates;
+    QSet<QString> roomIds;
+    for (const RoomUsage &room : rooms) {
+        m_lastEstimate += room.size;
+        roomIds.insert(room.roomId);
+        if (!room.pinned && !m_trimmed.contains(room.roomId)) {
+            candidates.append(&room);
+        }
+    }
+
+    // Forget the rooms left or deleted since the previous call
+    for (auto it = m_lastActive.begin(); it != m_lastActive.end(); ) {
+        it = roomIds.contains(it.key()) ? std::next(it) : m_lastActive.erase(it);
+    }
+    for (auto it = m_trimmed.begin(); it != m_trimmed.end(); ) {
+        it = roomIds.contains(*it) ? std::next(it) : m_trimmed.erase(it);
+    }
+
+    qint64 excess = m_lastEstimate - m_budget;
+    m_lastExcess = std::max<qint64>(excess, 0);
+    if (excess <= 0) {
+        return {};
+    }
+
+    // The rooms never active in this session go first (-1), then the biggest ones among the equals
+    std::sort(candidates.begin(), candidates.end(), [this](const RoomUsage *left, const RoomUsage *right) {
+        const qint64 leftActive = m_lastActive.value(left->roomId, -1);
+        const qint64 rightActive = m_lastActive.value(right->roomId, -1);
+        if (leftActive != rightActive) {
+            return leftActive < rightActive;
+        }
+        return left->size > right->size;
+    });
+
+    QStringList result;
+    for (const RoomUsage *room : candidates) {
+        if (excess <= 0) {
+            break;
+        }
+        result.append(room->roomId);
+        m_trimmed.insert(room->roomId);
+        excess -= room->releasable;
+    }
+    m_lastExcess = std::max<qint64>(excess, 0);
+    qDebug() << Q_FUNC_INFO << "Estimated" << m_lastEstimate << "bytes over the budget of" << m_budget
+             << "bytes, trimming" << result.count() << "rooms";
+    if (m_lastExcess) {
+        qDebug() << Q_FUNC_INFO << m_lastExcess << "bytes over the budget can not be released (timelines)";
+    }
+    return result;
+}
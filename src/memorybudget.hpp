@@ -0,0 +1,77 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_MEMORY_BUDGET_HPP
+#define TANK_MEMORY_BUDGET_HPP
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QSet>
+#include <QStringList>
+
+namespace Quotient
+{
+class Room;
+} // Quotient
+
+// Estimates the memory taken by the rooms and picks the least recently active ones to be trimmed once
+// the estimate goes over the budget. A trimmed room is not picked again until it becomes active.
+// Only the state kept here (the member profiles) can be released; the timelines held by Quotient
+// count towards the estimate but not towards what trimming frees.
+class MatrixMemoryBudget
+{
+public:
+    struct RoomUsage {
+        QString roomId;
+        qint64 size = 0;
+        qint64 releasable = 0; // What trimming the room frees, see releasableEstimate()
+        bool pinned = false; // Never trimmed (an open channel or pending messages)
+    };
+
+    // The budget is TANK_MEMORY_BUDGET_MB megabytes, 256 if not set
+    MatrixMemoryBudget();
+
+    // A rough estimate: the timeline events, the members and the room state
+    static qint64 estimate(const Quotient::Room *room);
+    // The profiles of the members without handles
+    static qint64 releasableEstimate(int profileCount);
+
+    qint64 budget() const { return m_budget; }
+    void touch(const QString &roomId);
+    bool isTrimmed(const QString &roomId) const { return m_trimmed.contains(roomId); }
+
+    // Returns the ids of the rooms to trim, the least recently active first, and marks them as trimmed
+    QStringList select(const QList<RoomUsage> &rooms);
+
+    qint64 lastEstimate() const { return m_lastEstimate; }
+    // The estimate which could not be released by trimming at the last check
+    qint64 lastExcess() const { return m_lastExcess; }
+    int trimmedCount() const { return m_trimmed.count(); }
+
+protected:
+    qint64 m_budget = 0;
+    QElapsedTimer m_clock;
+    QHash<QString, qint64> m_lastActive; // Room id to the m_clock time
+    QSet<QString> m_trimmed;
+    qint64 m_lastEstimate = 0;
+    qint64 m_lastExcess = 0;
+};
+
+#endif // TANK_MEMORY_BUDGET_HPP
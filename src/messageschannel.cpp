@@ -19,23 +19,37 @@
 
 #include "messageschannel.hpp"
 #include "connection.hpp"
+#include "mediacache.hpp"
+#include "pendinglog.hpp"
+#include "requestscheduler.hpp"
+#include "sendqueue.hpp"
+#include "watchdog.hpp"
 
 #include <TelepathyQt/Constants>
 #include <TelepathyQt/RequestableChannelClassSpec>
 #include <TelepathyQt/RequestableChannelClassSpecList>
 #include <TelepathyQt/Types>
+#include <QFileInfo>
+#include <QJsonArray>
 #include <QJsonDocument>
+#include <QJsonObject>
+#include <QMimeDatabase>
+#include <QSize>
+#include <QUrl>
 
 // Quotient
 #include <connection.h>
 #include <room.h>
 #include <user.h>
+#include <csapi/read_markers.h>
 #include <csapi/typing.h>
 #include <events/typingevent.h>
+#include <jobs/syncjob.h>
 
 MatrixMessagesChannel::MatrixMessagesChannel(MatrixConnection *connection, Quotient::Room *room, Tp::BaseChannel *baseChannel)
     : Tp::BaseChannelTextType(baseChannel),
       m_connection(connection),
+      m_baseChannel(baseChannel),
       m_room(room),
       m_targetHandle(baseChannel->targetHandle()),
       m_targetHandleType(baseChannel->targetHandleType()),
@@ -52,7 +66,8 @@ MatrixMessagesChannel::MatrixMessagesChannel(MatrixConnection *connection, Quoti
             | Tp::DeliveryReportingSupportFlagReceiveSuccesses
             | Tp::DeliveryReportingSupportFlagReceiveRead;
 
-    // setMessageAcknowledgedCallback(Tp::memFun(this, &MatrixMessagesChannel::messageAcknowledged));
+    m_lastClientActivity.start();
+    setMessageAcknowledgedCallback(Tp::memFun(this, &MatrixMessagesChannel::messageAcknowledged));
 
     m_messagesIface = Tp::BaseChannelMessagesInterface::create(this,
                                                                supportedContentTypes,
@@ -81,6 +96,7 @@ MatrixMessagesChannel::MatrixMessagesChannel(MatrixConnection *connection, Quoti
             members.append(m_connection->ensureHandle(member));
         }
         m_groupIface->setMembers(members, {});
+        m_heldHandles = members;
 
 
         m_roomIface = Tp::BaseChannelRoomInterface::create(m_room->displayName(),
@@ -96,13 +112,110 @@ MatrixMessagesChannel::MatrixMessagesChannel(MatrixConnection *connection, Quoti
         m_roomConfigIface->setDescription(room->topic());
     }
 
-    connect(m_room, &Quotient::Room::pendingEventChanged, this, &MatrixMessagesChannel::onPendingEventChanged);
+    if (m_targetHandleType == Tp::HandleTypeContact) {
+        m_heldHandles.append(m_targetHandle);
+    }
+    for (uint handle : m_heldHandles) {
+        m_connection->refContactHandle(handle);
+    }
+
+    m_sendQueue = new MatrixSendQueue(m_connection, m_room, this);
+    connect(m_sendQueue, &MatrixSendQueue::messageQueued, this, [this](const QString &txnId) {
+        m_deliveryTracker.addOutgoing(txnId);
+    });
+    connect(m_sendQueue, &MatrixSendQueue::messageSending, this, [this](const QString &txnId) {
+        setDeliveryState(txnId, MatrixDeliveryTracker::State::Sending);
+    });
+    connect(m_sendQueue, &MatrixSendQueue::messageAccepted, this, &MatrixMessagesChannel::onMessageAccepted);
+    connect(m_sendQueue, &MatrixSendQueue::messageFailed, this, &MatrixMessagesChannel::onMessageFailed);
+
     connect(m_room, &Quotient::Room::typingChanged, this, &MatrixMessagesChannel::onTypingChanged);
     connect(m_room, &Quotient::Room::readMarkerForUserMoved, this, &MatrixMessagesChannel::onReadMarkerForUserMoved);
     connect(m_room, &Quotient::Room::displaynameChanged, this, &MatrixMessagesChannel::onDisplayNameChanged);
     connect(m_room, &Quotient::Room::topicChanged, this, &MatrixMessagesChannel::onTopicChanged);
 }
 
+MatrixMessagesChannel::~MatrixMessagesChannel()
+{
+    for (uint handle : m_heldHandles) {
+        m_connection->unrefContactHandle(handle);
+    }
+    for (uint handle : m_pendingSenders) {
+        m_connection->unrefContactHandle(handle);
+    }
+    m_connection->changePendingMessageCount(-m_memoryPendingCount);
+    delete m_pendingLog;
+}
+
+void MatrixMessagesChannel::messageAcknowledged(const QString &messageId)
+{
+    // Reading is activity too, the user keeps getting the messages on time
+    noteClientActivity();
+    const uint senderHandle = m_pendingSenders.take(messageId);
+    if (senderHandle) {
+        m_connection->unrefContactHandle(senderHandle);
+    }
+    if (senderHandle || m_pendingReports.remove(messageId)) {
+        // Frees the budget; the spilled messages are paged in on the next event loop turn
+        --m_memoryPendingCount;
+        m_connection->changePendingMessageCount(-1);
+    }
+}
+
+void MatrixMessagesChannel::noteClientActivity()
+{
+    m_lastClientActivity.restart();
+    m_connection->noteClientActivity();
+}
+
+bool MatrixMessagesChannel::isIdle(qint64 timeout) const
+{
+    if (!m_pendingSenders.isEmpty() || !m_heldMessages.isEmpty() || spilledMessageCount()) {
+        return false;
+    }
+    // Closing would drop the delivery and read reports the client has not seen
+    if (!m_pendingReports.isEmpty()) {
+        return false;
+    }
+    if (m_sendQueue->queuedCount() || m_sendQueue->inFlightCount() || m_deliveryTracker.hasReports()) {
+        return false;
+    }
+    if (m_localTypingTimer && m_localTypingTimer->isActive()) {
+        return false;
+    }
+    return m_lastClientActivity.hasExpired(timeout);
+}
+
+void MatrixMessagesChannel::close()
+{
+    // The connection drops the closed channel, this interface goes away with it
+    m_baseChannel->close();
+}
+
+int MatrixMessagesChannel::spilledMessageCount() const
+{
+    return m_pendingLog ? m_pendingLog->count() : 0;
+}
+
+qint64 MatrixMessagesChannel::spilledMessageBytes() const
+{
+    return m_pendingLog ? m_pendingLog->size() : 0;
+}
+
+void MatrixMessagesChannel::pageIn()
+{
+    while (m_pendingLog && !m_pendingLog->isEmpty()
+           && m_connection->isPendingBudgetAvailable(m_memoryPendingCount)) {
+        const Tp::MessagePartList parts = m_pendingLog->takeFirst();
+        if (parts.isEmpty()) {
+            continue;
+        }
+        addReceivedMessage(parts);
+        ++m_memoryPendingCount;
+        m_connection->changePendingMessageCount(1);
+    }
+}
+
 void MatrixMessagesChannel::sendDeliveryReport(Tp::DeliveryStatus tpDeliveryStatus, const QString &deliveryToken)
 {
     Tp::MessagePartList partList;
@@ -113,45 +226,101 @@ void MatrixMessagesChannel::sendDeliveryReport(Tp::DeliveryStatus tpDeliveryStat
     header[QStringLiteral("message-type")]      = QDBusVariant(Tp::ChannelTextMessageTypeDeliveryReport);
     header[QStringLiteral("delivery-status")]   = QDBusVariant(tpDeliveryStatus);
     header[QStringLiteral("delivery-token")]    = QDBusVariant(deliveryToken);
+    // A token of its own, so the report counts against the pending budget until acknowledged
+    const QString token = QStringLiteral("delivery-report-%1").arg(++m_reportSerial);
+    header[QStringLiteral("message-token")]     = QDBusVariant(token);
     partList << header;
 
-    addReceivedMessage(partList);
+    m_pendingReports.insert(token);
+    deliverMessage(partList);
+}
+
+void MatrixMessagesChannel::setDeliveryState(const QString &txnId, MatrixDeliveryTracker::State state)
+{
+    if (m_deliveryTracker.setState(txnId, state) && MatrixDeliveryTracker::isReportable(state)) {
+        scheduleDeliveryReports();
+    }
+}
+
+void MatrixMessagesChannel::scheduleDeliveryReports()
+{
+    if (m_deliveryReportsScheduled) {
+        return;
+    }
+    m_deliveryReportsScheduled = true;
+    // Collect all transitions caused by the same sync (or job results) into one batch
+    QTimer::singleShot(0, this, &MatrixMessagesChannel::flushDeliveryReports);
+}
+
+void MatrixMessagesChannel::flushDeliveryReports()
+{
+    m_deliveryReportsScheduled = false;
+    if (!m_deliveryTracker.hasReports()) {
+        return;
+    }
+    for (const MatrixDeliveryTracker::Report &report : m_deliveryTracker.takeReports()) {
+        sendDeliveryReport(report.second, report.first);
+    }
 }
 
-void MatrixMessagesChannel::onPendingEventChanged(int pendingEventIndex)
+void MatrixMessagesChannel::onMessageAccepted(const QString &txnId, const QString &eventId)
 {
     // Delivery Report message
     // https://telepathy.freedesktop.org/spec/Channel_Interface_Messages.html#Enum:Delivery_Status
     // https://matrix.org/docs/spec/client_server/r0.4.0.html#put-matrix-client-r0-rooms-roomid-send-eventtype-txnid
-
-    const Quotient::PendingEventItem &pendingEvent = m_room->pendingEvents().at(pendingEventIndex);
-    Tp::DeliveryStatus tpDeliveryStatus;
-    switch (pendingEvent.deliveryStatus()) {
-    case Quotient::EventStatus::ReachedServer:
-        tpDeliveryStatus = Tp::DeliveryStatusAccepted;
-        break;
-    case Quotient::EventStatus::SendingFailed:
-        tpDeliveryStatus = Tp::DeliveryStatusTemporarilyFailed;
-        break;
-    default:
-        tpDeliveryStatus = Tp::DeliveryStatusUnknown;
-        break;
+    if (m_sendStartTimes.contains(txnId)) {
+        m_connection->tracer()->record(MatrixTracer::Stage::SendToAccepted, m_sendStartTimes.value(txnId));
     }
+    m_deliveryTracker.setEventId(txnId, eventId);
+    setDeliveryState(txnId, MatrixDeliveryTracker::State::Accepted);
+}
 
-    sendDeliveryReport(tpDeliveryStatus, pendingEvent.event()->id());
+void MatrixMessagesChannel::onMessageFailed(const QString &txnId, bool permanently, const QString &reason)
+{
+    qDebug() << Q_FUNC_INFO << txnId << reason;
+    if (permanently) {
+        m_sendStartTimes.remove(txnId);
+    }
+    setDeliveryState(txnId, permanently ? MatrixDeliveryTracker::State::PermanentlyFailed
+                                        : MatrixDeliveryTracker::State::TemporarilyFailed);
 }
 
 void MatrixMessagesChannel::onReadMarkerForUserMoved(Quotient::User *user, const QString &fromEventId, const QString &toEventId)
 {
-    Q_UNUSED(user);
+    if (!m_connection->ephemeralUpdatesEnabled()) {
+        return;
+    }
+    // Walk from the new read marker back in history until the previous one
+    static const int c_maxReadMarkerEvents = 100;
+    const bool selfMarker = (user == m_connection->matrix()->user());
+    const auto fromIt = m_room->findInTimeline(fromEventId);
     QStringList tokens;
-    for (auto eventIt = m_room->findInTimeline(fromEventId); eventIt < m_room->findInTimeline(toEventId); ++eventIt) {
-        sendDeliveryReport(Tp::DeliveryStatusRead, eventIt->event()->id());
-        tokens.append(eventIt->event()->id());
+    int count = 0;
+    for (auto eventIt = m_room->findInTimeline(toEventId);
+         (eventIt != m_room->historyEdge()) && (eventIt != fromIt) && (count < c_maxReadMarkerEvents);
+         ++eventIt, ++count) {
+        const Quotient::RoomEvent *event = eventIt->event();
+        if (selfMarker) {
+            // Read on another device of ours
+            tokens.append(event->id());
+            continue;
+        }
+        if (event->senderId() != m_connection->matrix()->user()->id()) {
+            continue;
+        }
+        const QString txnId = m_deliveryTracker.txnIdForEvent(event->id());
+        if (txnId.isEmpty()) {
+            m_deliveryTracker.addUntrackedReport(event->id(), MatrixDeliveryTracker::State::Read);
+            scheduleDeliveryReports();
+        } else {
+            setDeliveryState(txnId, MatrixDeliveryTracker::State::Read);
+        }
     }
 #if TP_QT_VERSION >= TP_QT_VERSION_CHECK(0, 9, 8)
-    Tp::DBusError error;
-    acknowledgePendingMessages(tokens, &error);
+    if (!tokens.isEmpty()) {
+        Tp::DBusError error;
+        acknowledgePendingMessages(tokens, &error);
+    }
 #endif // TP_QT_VERSION >= TP_QT_VERSION_CHECK(0, 9, 8)
 }
 
@@ -167,10 +336,53 @@ void MatrixMessagesChannel::onTopicChanged()
 
 void MatrixMessagesChannel::sendChatStateNotification(uint state)
 {
-    m_room->connection()->
-            callApi<Quotient::SetTypingJob>
-            (Quotient::BackgroundRequest,
-             m_connection->matrix()->user()->id(), m_room->id(), (state == Tp::ChannelChatStateComposing));
+    if (!m_connection->ephemeralUpdatesEnabled()) {
+        return;
+    }
+    Quotient::Connection *matrix = m_connection->matrix();
+    const QString roomId = m_room->id();
+    const bool typing = (state == Tp::ChannelChatStateComposing);
+    // Only the latest typing state matters, so a queued notification is replaced by the new one
+    m_connection->scheduler()->schedule(MatrixRequestScheduler::Priority::Typing, [matrix, roomId, typing]() {
+        return matrix->callApi<Quotient::SetTypingJob>(Quotient::BackgroundRequest,
+                                                       matrix->user()->id(), roomId, typing);
+    }, QLatin1String("typing:") + roomId);
+}
+
+void MatrixMessagesChannel::markAllMessagesAsRead()
+{
+    if (m_room->messageEvents().begin() == m_room->messageEvents().end()) {
+        return;
+    }
+    const QString eventId = m_room->messageEvents().back()->id();
+    if (eventId.isEmpty() || (eventId == m_lastReadEventId)) {
+        return;
+    }
+    m_lastReadEventId = eventId;
+
+    // Both the read marker (m.fully_read, for the other clients) and the public receipt (m.read)
+    const QPointer<Quotient::Room> room = m_room;
+    Quotient::Connection *matrix = m_connection->matrix();
+    m_connection->scheduler()->schedule(MatrixRequestScheduler::Priority::Receipt, [matrix, room, eventId]() -> Quotient::BaseJob * {
+        if (!room) {
+            return nullptr;
+        }
+        Quotient::SetReadMarkerJob *job = matrix->callApi<Quotient::SetReadMarkerJob>(room->id(), eventId, eventId);
+        connect(job, &Quotient::BaseJob::success, room.data(), [room, eventId]() {
+            // Move the local read marker and the unread count the way the echo in the next sync would:
+            // given as the account data, Quotient takes it as the marker the server already has
+            const QJsonObject roomData = {
+                { QLatin1String("account_data"), QJsonObject({
+                      { QLatin1String("events"), QJsonArray({ QJsonObject({
+                            { QLatin1String("type"), QStringLiteral("m.fully_read") },
+                            { QLatin1String("content"), QJsonObject({ { QLatin1String("event_id"), eventId } }) },
+                        }) }) },
+                  }) },
+            };
+            room->updateData(Quotient::SyncRoomData(room->id(), Quotient::JoinState::Join, roomData));
+        });
+        return job;
+    }, QLatin1String("receipt:") + m_room->id());
 }
 
 MatrixMessagesChannelPtr MatrixMessagesChannel::create(MatrixConnection *connection, Quotient::Room *room, Tp::BaseChannel *baseChannel)
@@ -180,6 +392,15 @@ MatrixMessagesChannelPtr MatrixMessagesChannel::create(MatrixConnection *connect
 
 QString MatrixMessagesChannel::sendMessage(const Tp::MessagePartList &messageParts, uint flags, Tp::DBusError *error)
 {
+    TANK_WATCHDOG_SCOPE();
+    noteClientActivity();
+
+    if (m_room->usesEncryption()) {
+        // Only the receiving side of the end-to-end encryption is there, do not leak the plain text
+        error->set(TP_QT_ERROR_NOT_IMPLEMENTED, QStringLiteral("Sending to the encrypted rooms is not supported"));
+        return QString();
+    }
+
     QString content;
     for (const Tp::MessagePart &part : messageParts) {
         if (part.contains(QStringLiteral("content-type"))
@@ -190,12 +411,37 @@ QString MatrixMessagesChannel::sendMessage(const Tp::MessagePartList &messagePar
         }
     }
 
-    QString txnId = m_room->postPlainText(content);
+    QJsonObject eventContent;
+    eventContent.insert(QStringLiteral("msgtype"), QStringLiteral("m.text"));
+    eventContent.insert(QStringLiteral("body"), content);
+
+    const QString txnId = m_sendQueue->enqueue(eventContent);
+    if (txnId.isEmpty()) {
+        error->set(TP_QT_ERROR_NOT_AVAILABLE, QStringLiteral("Unable to store the message for sending"));
+        return QString();
+    }
+    m_sendStartTimes.insert(txnId, m_connection->tracer()->now());
     return txnId;
 }
 
 void MatrixMessagesChannel::processMessageEvent(const Quotient::RoomMessageEvent *event)
 {
+    TANK_WATCHDOG_SCOPE();
+    MatrixTracer *tracer = m_connection->tracer();
+    const qint64 startTime = tracer->now();
+    if (event->senderId() == m_connection->matrix()->user()->id()) {
+        const QString txnId = event->transactionId();
+        if (m_sendStartTimes.contains(txnId)) {
+            tracer->record(MatrixTracer::Stage::SendToEcho, m_sendStartTimes.take(txnId), startTime);
+        }
+        if (!txnId.isEmpty() && m_deliveryTracker.isTracked(txnId)) {
+            // The remote echo of a message sent via this channel; the client already has the message
+            m_deliveryTracker.setEventId(txnId, event->id());
+            setDeliveryState(txnId, MatrixDeliveryTracker::State::Delivered);
+            return;
+        }
+    }
+
     QJsonDocument doc(event->originalJsonObject());
     qDebug().noquote() << Q_FUNC_INFO << "Process message" << doc.toJson(QJsonDocument::Indented);
     bool silent = true;
@@ -204,15 +450,23 @@ void MatrixMessagesChannel::processMessageEvent(const Quotient::RoomMessageEvent
     header[QStringLiteral("message-sent")] = QDBusVariant(event->timestamp().toMSecsSinceEpoch() / 1000);
     header[QStringLiteral("message-received")] = QDBusVariant(event->timestamp().toMSecsSinceEpoch() / 1000);
     header[QStringLiteral("message-type")] = QDBusVariant(Tp::ChannelTextMessageTypeNormal);
+    uint senderHandle = 0;
     if (event->senderId() == m_connection->matrix()->user()->id()) {
-        header[QStringLiteral("message-sender")] = QDBusVariant(m_connection->selfHandle());
+        senderHandle = m_connection->selfHandle();
+        header[QStringLiteral("message-sender")] = QDBusVariant(senderHandle);
         header[QStringLiteral("message-sender-id")] = QDBusVariant(m_connection->selfID());
     } else {
-        header[QStringLiteral("message-sender")] = QDBusVariant(m_connection->ensureContactHandle(event->senderId()));
+        senderHandle = m_connection->ensureContactHandle(event->senderId());
+        header[QStringLiteral("message-sender")] = QDBusVariant(senderHandle);
         header[QStringLiteral("message-sender-id")] = QDBusVariant(event->senderId());
         if (m_targetHandleType == Tp::HandleTypeContact)
             silent = false;
     }
+    // The sender handle has to stay valid while the message is pending
+    if (!m_pendingSenders.contains(event->id())) {
+        m_connection->refContactHandle(senderHandle);
+        m_pendingSenders.insert(event->id(), senderHandle);
+    }
 
     /* Redacted deleted message */
     // https://matrix.org/docs/spec/client_server/r0.4.0.html#id259
@@ -239,9 +493,163 @@ void MatrixMessagesChannel::processMessageEvent(const Quotient::RoomMessageEvent
     text[QStringLiteral("content")] = QDBusVariant(event->isRedacted() ? event->redactionReason() : event->plainBody());
     body << text;
 
+    QUrl thumbnailSource;
+    if (!event->isRedacted() && event->hasFileContent()) {
+        appendMediaParts(event, &body, &thumbnailSource);
+    }
+
     Tp::MessagePartList partList;
     partList << header << body;
-    addReceivedMessage(partList);
+    addMessageInOrder(partList, thumbnailSource);
+    tracer->record(MatrixTracer::Stage::EventProcessing, startTime);
+}
+
+// The maximal size of the thumbnails referenced by the messages
+static const QSize c_thumbnailSize = QSize(320, 240);
+// How long a received message can wait for its thumbnail
+static const int c_thumbnailTimeout = 5000;
+
+void MatrixMessagesChannel::appendMediaParts(const Quotient::RoomMessageEvent *event, Tp::MessagePartList *parts, QUrl *thumbnailSource)
+{
+    // The media is passed by reference: the clients download it (or get it via a file transfer
+    // channel), the connection manager never puts the file content on the bus. The part is not
+    // marked needs-retrieval as there is no GetPendingMessageContent() to retrieve it with.
+    const QJsonObject content = event->contentJson();
+    const QUrl contentUri = QUrl(content.value(QLatin1String("url")).toString());
+    if (!contentUri.isValid() || (contentUri.scheme() != QLatin1String("mxc"))) {
+        return;
+    }
+    const QJsonObject info = content.value(QLatin1String("info")).toObject();
+    const QString mimeType = info.value(QLatin1String("mimetype")).toString(QStringLiteral("application/octet-stream"));
+
+    QUrl downloadUri = m_connection->matrix()->homeserver();
+    downloadUri.setPath(QStringLiteral("/_matrix/media/r0/download/") + contentUri.authority() + contentUri.path());
+
+    Tp::MessagePart media;
+    media[QStringLiteral("identifier")] = QDBusVariant(QStringLiteral("media"));
+    media[QStringLiteral("alternative")] = QDBusVariant(QStringLiteral("main"));
+    media[QStringLiteral("content-type")] = QDBusVariant(mimeType);
+    media[QStringLiteral("x-matrix-uri")] = QDBusVariant(contentUri.toString());
+    media[QStringLiteral("x-download-uri")] = QDBusVariant(downloadUri.toString());
+    if (info.contains(QLatin1String("size"))) {
+        media[QStringLiteral("size")] = QDBusVariant(static_cast<qulonglong>(info.value(QLatin1String("size")).toDouble()));
+    }
+
+    // The media part is preferred over the text body
+    Tp::MessagePart &text = (*parts)[0];
+    text[QStringLiteral("alternative")] = QDBusVariant(QStringLiteral("main"));
+    parts->prepend(media);
+
+    const QString msgType = content.value(QLatin1String("msgtype")).toString();
+    if (msgType == QLatin1String("m.image")) {
+        *thumbnailSource = contentUri;
+    } else if (msgType == QLatin1String("m.video")) {
+        // The server can not thumbnail a video; use the preview image of the sender, if any
+        const QUrl thumbnailUri = QUrl(info.value(QLatin1String("thumbnail_url")).toString());
+        if (thumbnailUri.isValid() && (thumbnailUri.scheme() == QLatin1String("mxc"))) {
+            *thumbnailSource = thumbnailUri;
+        }
+    }
+}
+
+void MatrixMessagesChannel::addMessageInOrder(const Tp::MessagePartList &parts, const QUrl &thumbnailSource)
+{
+    ReceivedMessage message;
+    message.parts = parts;
+    message.syncReceivedTime = m_connection->tracer()->syncReceivedTime();
+    if (thumbnailSource.isEmpty() && m_heldMessages.isEmpty()) {
+        emitReceivedMessage(message);
+        return;
+    }
+
+    message.serial = ++m_heldMessageSerial;
+    message.ready = thumbnailSource.isEmpty();
+    m_heldMessages.append(message);
+    if (message.ready) {
+        return;
+    }
+
+    const quint64 serial = message.serial;
+    QTimer::singleShot(c_thumbnailTimeout, this, [this, serial]() {
+        completeMessage(serial, QString());
+    });
+    // Calls back immediately if the thumbnail is already cached
+    m_connection->mediaCache()->fetchThumbnail(thumbnailSource, c_thumbnailSize, this, [this, serial](const QString &filePath) {
+        completeMessage(serial, filePath);
+    });
+}
+
+void MatrixMessagesChannel::completeMessage(quint64 serial, const QString &thumbnailPath)
+{
+    for (ReceivedMessage &message : m_heldMessages) {
+        if (message.serial != serial) {
+            continue;
+        }
+        if (message.ready) {
+            return;
+        }
+        message.ready = true;
+        if (!thumbnailPath.isEmpty()) {
+            Tp::MessagePart thumbnail;
+            thumbnail[QStringLiteral("identifier")] = QDBusVariant(QStringLiteral("thumbnail"));
+            thumbnail[QStringLiteral("thumbnail")] = QDBusVariant(true);
+            thumbnail[QStringLiteral("content-type")] = QDBusVariant(QMimeDatabase().mimeTypeForFile(thumbnailPath).name());
+            thumbnail[QStringLiteral("size")] = QDBusVariant(static_cast<qulonglong>(QFileInfo(thumbnailPath).size()));
+            thumbnail[QStringLiteral("x-file-uri")] = QDBusVariant(QUrl::fromLocalFile(thumbnailPath).toString());
+            message.parts.append(thumbnail);
+        }
+        break;
+    }
+    releaseReadyMessages();
+}
+
+void MatrixMessagesChannel::releaseReadyMessages()
+{
+    while (!m_heldMessages.isEmpty() && m_heldMessages.first().ready) {
+        emitReceivedMessage(m_heldMessages.takeFirst());
+    }
+}
+
+void MatrixMessagesChannel::emitReceivedMessage(const ReceivedMessage &message)
+{
+    deliverMessage(message.parts);
+    if (message.syncReceivedTime >= 0) {
+        m_connection->tracer()->record(MatrixTracer::Stage::SyncToDBus, message.syncReceivedTime);
+    }
+}
+
+void MatrixMessagesChannel::deliverMessage(const Tp::MessagePartList &parts)
+{
+    // Only the messages and the delivery reports with a token are acknowledged through messageAcknowledged()
+    const QString token = parts.first().value(QStringLiteral("message-token")).variant().toString();
+    if (!m_pendingSenders.contains(token) && !m_pendingReports.contains(token)) {
+        addReceivedMessage(parts);
+        return;
+    }
+    // Once anything is spilled, the following messages go after it to keep the order
+    const bool spilled = m_pendingLog && !m_pendingLog->isEmpty();
+    if (m_room->usesEncryption()) {
+        // The decrypted messages never go to the disk in plain text; they stay in the memory over the budget
+        while (spilled && !m_pendingLog->isEmpty()) {
+            const Tp::MessagePartList earlier = m_pendingLog->takeFirst();
+            if (!earlier.isEmpty()) {
+                addReceivedMessage(earlier);
+                ++m_memoryPendingCount;
+                m_connection->changePendingMessageCount(1);
+            }
+        }
+    } else if (spilled || !m_connection->isPendingBudgetAvailable(m_memoryPendingCount)) {
+        if (!m_pendingLog) {
+            m_pendingLog = new MatrixPendingLog(m_connection->pendingLogFileName(m_room->id()));
+        }
+        if (m_pendingLog->append(parts)) {
+            return;
+        }
+        // Better over the budget than lost
+    }
+    addReceivedMessage(parts);
+    ++m_memoryPendingCount;
+    m_connection->changePendingMessageCount(1);
 }
 
 void MatrixMessagesChannel::fetchHistory()
@@ -256,6 +664,9 @@ void MatrixMessagesChannel::fetchHistory()
 
 void MatrixMessagesChannel::onTypingChanged()
 {
+    if (!m_connection->ephemeralUpdatesEnabled()) {
+        return;
+    }
     if (m_room->usersTyping().isEmpty()) {
         for (auto user: m_room->users()) {
             const uint handle = m_connection->ensureContactHandle(user->id());
@@ -278,6 +689,8 @@ void MatrixMessagesChannel::setChatState(uint state, Tp::DBusError *error)
 {
     Q_UNUSED(error);
 
+    noteClientActivity();
+
     if (!m_localTypingTimer) {
         m_localTypingTimer = new QTimer(this);
         constexpr int c_chatStateResendInterval = 5000;
@@ -291,7 +704,9 @@ void MatrixMessagesChannel::setChatState(uint state, Tp::DBusError *error)
         m_localTypingTimer->stop();
     }
     
-    m_room->markAllMessagesAsRead();
-    
+    if (m_connection->ephemeralUpdatesEnabled()) {
+        markAllMessagesAsRead();
+    }
+
     sendChatStateNotification(state);
 }
@@ -20,15 +20,23 @@
 #ifndef TANK_MESSAGES_CHANNEL_HPP
 #define TANK_MESSAGES_CHANNEL_HPP
 
+#include <QElapsedTimer>
+#include <QHash>
 #include <QPointer>
+#include <QSet>
 
 #include <TelepathyQt/BaseChannel>
 #include <events/roommessageevent.h>
 
+#include "deliverytracker.hpp"
+
 class QTimer;
+class QUrl;
 
 class MatrixMessagesChannel;
 class MatrixConnection;
+class MatrixPendingLog;
+class MatrixSendQueue;
 
 namespace Quotient
 {
@@ -61,33 +69,75 @@ class MatrixMessagesChannel : public Tp::BaseChannelTextType
     Q_OBJECT
 public:
     static MatrixMessagesChannelPtr create(MatrixConnection *connection, Quotient::Room *room, Tp::BaseChannel *baseChannel);
+    ~MatrixMessagesChannel() override;
 
     QString sendMessage(const Tp::MessagePartList &messageParts, uint flags, Tp::DBusError *error);
-    // void messageAcknowledged(const QString &messageId);
+    void messageAcknowledged(const QString &messageId);
     void setChatState(uint state, Tp::DBusError *error);
 
     void fetchHistory();
     void processMessageEvent(const Quotient::RoomMessageEvent *event);
 
+    MatrixSendQueue *sendQueue() const { return m_sendQueue; }
+    // The received messages not acknowledged by the client, and the ones waiting for a thumbnail
+    int pendingMessageCount() const { return m_pendingSenders.count(); }
+    int heldMessageCount() const { return m_heldMessages.count(); }
+    // The received messages over the pending budget, kept on disk until the client acknowledges enough
+    int spilledMessageCount() const;
+    qint64 spilledMessageBytes() const;
+    // Moves the spilled messages to the client as far as the budget allows
+    void pageIn();
+
+    // Emits the collected delivery reports (called once per sync and on the next event loop turn)
+    void flushDeliveryReports();
+
+    // True if nothing is left for the client or the homeserver and the client did not touch the channel for a while
+    bool isIdle(qint64 timeout) const;
+    void close();
+
 private:
     MatrixMessagesChannel(MatrixConnection *connection, Quotient::Room *room, Tp::BaseChannel *baseChannel);
 
+    struct ReceivedMessage {
+        quint64 serial = 0;
+        Tp::MessagePartList parts;
+        bool ready = false;
+        qint64 syncReceivedTime = -1; // For the latency tracing
+    };
+
+    void appendMediaParts(const Quotient::RoomMessageEvent *event, Tp::MessagePartList *parts, QUrl *thumbnailSource);
+    void addMessageInOrder(const Tp::MessagePartList &parts, const QUrl &thumbnailSource);
+    void emitReceivedMessage(const ReceivedMessage &message);
+    void deliverMessage(const Tp::MessagePartList &parts);
+    void completeMessage(quint64 serial, const QString &thumbnailPath);
+    void releaseReadyMessages();
+
     void sendDeliveryReport(Tp::DeliveryStatus tpDeliveryStatus, const QString &deliveryToken);
-    void onPendingEventChanged(int pendingEventIndex);
+    void setDeliveryState(const QString &txnId, MatrixDeliveryTracker::State state);
+    void scheduleDeliveryReports();
+    void onMessageAccepted(const QString &txnId, const QString &eventId);
+    void onMessageFailed(const QString &txnId, bool permanently, const QString &reason);
     void onReadMarkerForUserMoved(Quotient::User* user, const QString &fromEventId, const QString &toEventId);
     void onDisplayNameChanged(Quotient::Room *room, const QString &oldName);
     void onTopicChanged();
     void onTypingChanged();
     void reactivateLocalTyping();
     void sendChatStateNotification(uint state);
+    void markAllMessagesAsRead();
+    void noteClientActivity();
 
     MatrixConnection *m_connection = nullptr;
+    Tp::BaseChannel *m_baseChannel = nullptr; // Owns this interface
     Quotient::Room *m_room = nullptr;
 
     uint m_targetHandle;
     uint m_targetHandleType;
     uint m_selfHandle;
     QString m_targetId;
+    Tp::UIntList m_heldHandles; // The target contact or the room members
+    QHash<QString, uint> m_pendingSenders; // Message token to the sender handle held until the message is acknowledged
+    QSet<QString> m_pendingReports; // Tokens of the delivery reports not acknowledged by the client
+    quint64 m_reportSerial = 0;
 
     Tp::BaseChannelTextTypePtr m_channelTextType;
     Tp::BaseChannelMessagesInterfacePtr m_messagesIface;
@@ -97,6 +147,17 @@ private:
     Tp::BaseChannelRoomConfigInterfacePtr m_roomConfigIface;
 
     QTimer *m_localTypingTimer = nullptr;
+    QString m_lastReadEventId;
+    MatrixSendQueue *m_sendQueue = nullptr;
+    MatrixDeliveryTracker m_deliveryTracker;
+    bool m_deliveryReportsScheduled = false;
+    QHash<QString, qint64> m_sendStartTimes; // Transaction id to the sendMessage() time, for the latency tracing
+    // The received messages held back (in order) until the thumbnail of a media message is ready
+    QList<ReceivedMessage> m_heldMessages;
+    quint64 m_heldMessageSerial = 0;
+    int m_memoryPendingCount = 0; // Given to the client and not acknowledged yet
+    MatrixPendingLog *m_pendingLog = nullptr;
+    QElapsedTimer m_lastClientActivity; // Sending, chat state and acknowledgements
 };
 
 #endif // TANK_MESSAGES_CHANNEL_HPP
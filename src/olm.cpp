@@ -0,0 +1,381 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "olm.hpp"
+
+#include <QJsonDocument>
+#include <QRandomGenerator>
+
+#ifdef TANK_E2EE
+
+#include <olm/olm.h>
+
+#include <cstdint>
+#include <memory>
+
+namespace
+{
+
+// Owns the memory of an Olm object and wipes it on destruction
+template <typename T, size_t (*Size)(), T *(*Init)(void *), size_t (*Clear)(T *)>
+class OlmObject
+{
+public:
+    OlmObject()
+        : m_memory(new std::uint8_t[Size()]),
+          m_object(Init(m_memory.get()))
+    {
+    }
+    ~OlmObject()
+    {
+        Clear(m_object);
+    }
+    OlmObject(const OlmObject &) = delete;
+    OlmObject &operator=(const OlmObject &) = delete;
+
+    T *get() const { return m_object; }
+
+private:
+    std::unique_ptr<std::uint8_t[]> m_memory;
+    T *m_object;
+};
+
+using Account = OlmObject<OlmAccount, olm_account_size, olm_account, olm_clear_account>;
+using Session = OlmObject<OlmSession, olm_session_size, olm_session, olm_clear_session>;
+using GroupSession = OlmObject<OlmInboundGroupSession, olm_inbound_group_session_size,
+                               olm_inbound_group_session, olm_clear_inbound_group_session>;
+
+bool setError(QString *error, const char *message)
+{
+    if (error) {
+        *error = QString::fromLatin1(message);
+    }
+    return false;
+}
+
+bool unpickle(const Account &account, const QByteArray &key, QByteArray pickle, QString *error)
+{
+    // The pickle buffer is overwritten, so it is a detached copy
+    if (olm_unpickle_account(account.get(), key.constData(), size_t(key.size()), pickle.data(), size_t(pickle.size())) == olm_error()) {
+        return setError(error, olm_account_last_error(account.get()));
+    }
+    return true;
+}
+
+bool unpickle(const Session &session, const QByteArray &key, QByteArray pickle, QString *error)
+{
+    if (olm_unpickle_session(session.get(), key.constData(), size_t(key.size()), pickle.data(), size_t(pickle.size())) == olm_error()) {
+        return setError(error, olm_session_last_error(session.get()));
+    }
+    return true;
+}
+
+bool unpickle(const GroupSession &session, const QByteArray &key, QByteArray pickle, QString *error)
+{
+    if (olm_unpickle_inbound_group_session(session.get(), key.constData(), size_t(key.size()), pickle.data(), size_t(pickle.size())) == olm_error()) {
+        return setError(error, olm_inbound_group_session_last_error(session.get()));
+    }
+    return true;
+}
+
+QByteArray pickle(const Account &account, const QByteArray &key)
+{
+    QByteArray result(int(olm_pickle_account_length(account.get())), Qt::Uninitialized);
+    if (olm_pickle_account(account.get(), key.constData(), size_t(key.size()), result.data(), size_t(result.size())) == olm_error()) {
+        return QByteArray();
+    }
+    return result;
+}
+
+QByteArray pickle(const Session &session, const QByteArray &key)
+{
+    QByteArray result(int(olm_pickle_session_length(session.get())), Qt::Uninitialized);
+    if (olm_pickle_session(session.get(), key.constData(), size_t(key.size()), result.data(), size_t(result.size())) == olm_error()) {
+        return QByteArray();
+    }
+    return result;
+}
+
+QByteArray pickle(const GroupSession &session, const QByteArray &key)
+{
+    QByteArray result(int(olm_pickle_inbound_group_session_length(session.get())), Qt::Uninitialized);
+    if (olm_pickle_inbound_group_session(session.get(), key.constData(), size_t(key.size()), result.data(), size_t(result.size())) == olm_error()) {
+        return QByteArray();
+    }
+    return result;
+}
+
+QByteArray decryptWith(const Session &session, int type, const QByteArray &body, QString *error)
+{
+    // Both calls destroy the message buffer
+    QByteArray message = body;
+    const size_t maxLength = olm_decrypt_max_plaintext_length(session.get(), size_t(type), message.data(), size_t(message.size()));
+    if (maxLength == olm_error()) {
+        setError(error, olm_session_last_error(session.get()));
+        return QByteArray();
+    }
+    message = body;
+    QByteArray plaintext(int(maxLength), Qt::Uninitialized);
+    const size_t length = olm_decrypt(session.get(), size_t(type), message.data(), size_t(message.size()),
+                                      plaintext.data(), size_t(plaintext.size()));
+    if (length == olm_error()) {
+        setError(error, olm_session_last_error(session.get()));
+        return QByteArray();
+    }
+    plaintext.resize(int(length));
+    return plaintext;
+}
+
+} // namespace
+
+bool MatrixOlm::isAvailable()
+{
+    return true;
+}
+
+QByteArray MatrixOlm::createAccount(const QByteArray &pickleKey, QString *error)
+{
+    Account account;
+    QByteArray random = randomBytes(int(olm_create_account_random_length(account.get())));
+    if (olm_create_account(account.get(), random.data(), size_t(random.size())) == olm_error()) {
+        setError(error, olm_account_last_error(account.get()));
+        return QByteArray();
+    }
+    return pickle(account, pickleKey);
+}
+
+QJsonObject MatrixOlm::identityKeys(const QByteArray &pickleKey, const QByteArray &accountPickle, QString *error)
+{
+    Account account;
+    if (!unpickle(account, pickleKey, accountPickle, error)) {
+        return QJsonObject();
+    }
+    QByteArray keys(int(olm_account_identity_keys_length(account.get())), Qt::Uninitialized);
+    if (olm_account_identity_keys(account.get(), keys.data(), size_t(keys.size())) == olm_error()) {
+        setError(error, olm_account_last_error(account.get()));
+        return QJsonObject();
+    }
+    return QJsonDocument::fromJson(keys).object();
+}
+
+QString MatrixOlm::sign(const QByteArray &pickleKey, const QByteArray &accountPickle, const QByteArray &message, QString *error)
+{
+    Account account;
+    if (!unpickle(account, pickleKey, accountPickle, error)) {
+        return QString();
+    }
+    QByteArray signature(int(olm_account_signature_length(account.get())), Qt::Uninitialized);
+    if (olm_account_sign(account.get(), message.constData(), size_t(message.size()),
+                         signature.data(), size_t(signature.size())) == olm_error()) {
+        setError(error, olm_account_last_error(account.get()));
+        return QString();
+    }
+    return QString::fromLatin1(signature);
+}
+
+int MatrixOlm::maxOneTimeKeys(const QByteArray &pickleKey, const QByteArray &accountPickle)
+{
+    Account account;
+    if (!unpickle(account, pickleKey, accountPickle, nullptr)) {
+        return 0;
+    }
+    return int(olm_account_max_number_of_one_time_keys(account.get()));
+}
+
+QJsonObject MatrixOlm::generateOneTimeKeys(const QByteArray &pickleKey, QByteArray *accountPickle, int count, QString *error)
+{
+    Account account;
+    if (!unpickle(account, pickleKey, *accountPickle, error)) {
+        return QJsonObject();
+    }
+    QByteArray random = randomBytes(int(olm_account_generate_one_time_keys_random_length(account.get(), size_t(count))));
+    if (olm_account_generate_one_time_keys(account.get(), size_t(count), random.data(), size_t(random.size())) == olm_error()) {
+        setError(error, olm_account_last_error(account.get()));
+        return QJsonObject();
+    }
+    QByteArray keys(int(olm_account_one_time_keys_length(account.get())), Qt::Uninitialized);
+    if (olm_account_one_time_keys(account.get(), keys.data(), size_t(keys.size())) == olm_error()) {
+        setError(error, olm_account_last_error(account.get()));
+        return QJsonObject();
+    }
+    olm_account_mark_keys_as_published(account.get());
+    *accountPickle = pickle(account, pickleKey);
+    return QJsonDocument::fromJson(keys).object();
+}
+
+QByteArray MatrixOlm::decrypt(const QByteArray &pickleKey, QByteArray *accountPickle, QList<QByteArray> *sessions,
+                              const QString &senderKey, int type, const QByteArray &body, QString *error)
+{
+    const QByteArray theirKey = senderKey.toLatin1();
+    // The messages of the established sessions are type 1; a pre-key message (type 0) matches the session it started
+    for (int i = sessions->count() - 1; i >= 0; --i) {
+        Session session;
+        if (!unpickle(session, pickleKey, sessions->at(i), nullptr)) {
+            continue;
+        }
+        if (type == 0) {
+            QByteArray message = body;
+            if (olm_matches_inbound_session_from(session.get(), theirKey.constData(), size_t(theirKey.size()),
+                                                 message.data(), size_t(message.size())) != 1) {
+                continue;
+            }
+        }
+        const QByteArray plaintext = decryptWith(session, type, body, error);
+        if (!plaintext.isNull()) {
+            (*sessions)[i] = pickle(session, pickleKey);
+            return plaintext;
+        }
+        if (type == 0) {
+            return QByteArray();
+        }
+    }
+    if (type != 0) {
+        setError(error, "No Olm session for the message");
+        return QByteArray();
+    }
+
+    Account account;
+    if (!unpickle(account, pickleKey, *accountPickle, error)) {
+        return QByteArray();
+    }
+    Session session;
+    QByteArray message = body;
+    if (olm_create_inbound_session_from(session.get(), account.get(), theirKey.constData(), size_t(theirKey.size()),
+                                        message.data(), size_t(message.size())) == olm_error()) {
+        setError(error, olm_session_last_error(session.get()));
+        return QByteArray();
+    }
+    const QByteArray plaintext = decryptWith(session, type, body, error);
+    if (plaintext.isNull()) {
+        return QByteArray();
+    }
+    // A one-time key is good for a single session
+    olm_remove_one_time_keys(account.get(), session.get());
+    *accountPickle = pickle(account, pickleKey);
+    sessions->append(pickle(session, pickleKey));
+    return plaintext;
+}
+
+QByteArray MatrixOlm::createGroupSession(const QByteArray &pickleKey, const QByteArray &sessionKey, QString *error)
+{
+    GroupSession session;
+    if (olm_init_inbound_group_session(session.get(), reinterpret_cast<const std::uint8_t *>(sessionKey.constData()),
+                                       size_t(sessionKey.size())) == olm_error()) {
+        setError(error, olm_inbound_group_session_last_error(session.get()));
+        return QByteArray();
+    }
+    return pickle(session, pickleKey);
+}
+
+QByteArray MatrixOlm::groupDecrypt(const QByteArray &pickleKey, const QByteArray &sessionPickle, const QByteArray &ciphertext,
+                                   quint32 *messageIndex, QString *error)
+{
+    GroupSession session;
+    if (!unpickle(session, pickleKey, sessionPickle, error)) {
+        return QByteArray();
+    }
+    // Both calls destroy the message buffer
+    QByteArray message = ciphertext;
+    const size_t maxLength = olm_group_decrypt_max_plaintext_length(session.get(), reinterpret_cast<std::uint8_t *>(message.data()),
+                                                                    size_t(message.size()));
+    if (maxLength == olm_error()) {
+        setError(error, olm_inbound_group_session_last_error(session.get()));
+        return QByteArray();
+    }
+    message = ciphertext;
+    QByteArray plaintext(int(maxLength), Qt::Uninitialized);
+    std::uint32_t index = 0;
+    const size_t length = olm_group_decrypt(session.get(), reinterpret_cast<std::uint8_t *>(message.data()), size_t(message.size()),
+                                            reinterpret_cast<std::uint8_t *>(plaintext.data()), size_t(plaintext.size()), &index);
+    if (length == olm_error()) {
+        setError(error, olm_inbound_group_session_last_error(session.get()));
+        return QByteArray();
+    }
+    plaintext.resize(int(length));
+    *messageIndex = index;
+    return plaintext;
+}
+
+#else // TANK_E2EE
+
+static const QString c_unavailable = QStringLiteral("Built without the end-to-end encryption support (libolm)");
+
+bool MatrixOlm::isAvailable()
+{
+    return false;
+}
+
+QByteArray MatrixOlm::createAccount(const QByteArray &, QString *error)
+{
+    *error = c_unavailable;
+    return QByteArray();
+}
+
+QJsonObject MatrixOlm::identityKeys(const QByteArray &, const QByteArray &, QString *error)
+{
+    *error = c_unavailable;
+    return QJsonObject();
+}
+
+QString MatrixOlm::sign(const QByteArray &, const QByteArray &, const QByteArray &, QString *error)
+{
+    *error = c_unavailable;
+    return QString();
+}
+
+int MatrixOlm::maxOneTimeKeys(const QByteArray &, const QByteArray &)
+{
+    return 0;
+}
+
+QJsonObject MatrixOlm::generateOneTimeKeys(const QByteArray &, QByteArray *, int, QString *error)
+{
+    *error = c_unavailable;
+    return QJsonObject();
+}
+
+QByteArray MatrixOlm::decrypt(const QByteArray &, QByteArray *, QList<QByteArray> *, const QString &, int, const QByteArray &, QString *error)
+{
+    *error = c_unavailable;
+    return QByteArray();
+}
+
+QByteArray MatrixOlm::createGroupSession(const QByteArray &, const QByteArray &, QString *error)
+{
+    *error = c_unavailable;
+    return QByteArray();
+}
+
+QByteArray MatrixOlm::groupDecrypt(const QByteArray &, const QByteArray &, const QByteArray &, quint32 *, QString *error)
+{
+    *error = c_unavailable;
+    return QByteArray();
+}
+
+#endif // TANK_E2EE
+
+QByteArray MatrixOlm::randomBytes(int count)
+{
+    QByteArray result(count, Qt::Uninitialized);
+    QRandomGenerator *generator = QRandomGenerator::system();
+    for (int i = 0; i < count; ++i) {
+        result[i] = char(generator->bounded(256));
+    }
+    return result;
+}
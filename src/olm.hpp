@@ -0,0 +1,59 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_OLM_HPP
+#define TANK_OLM_HPP
+
+#include <QByteArray>
+#include <QJsonObject>
+#include <QList>
+#include <QString>
+
+// Stateless helpers over libolm. The Olm objects are passed around pickled (encrypted with the pickle key),
+// so the helpers keep nothing between the calls and the group decryption can run on any thread.
+// Without TANK_E2EE (libolm) every call fails.
+class MatrixOlm
+{
+public:
+    static bool isAvailable();
+    static QByteArray randomBytes(int count);
+
+    // Returns the pickle of a new account or an empty array
+    static QByteArray createAccount(const QByteArray &pickleKey, QString *error);
+    // The Curve25519 and Ed25519 keys of the device: { "curve25519": ..., "ed25519": ... }
+    static QJsonObject identityKeys(const QByteArray &pickleKey, const QByteArray &account, QString *error);
+    // Returns the Ed25519 signature of the message
+    static QString sign(const QByteArray &pickleKey, const QByteArray &account, const QByteArray &message, QString *error);
+    static int maxOneTimeKeys(const QByteArray &pickleKey, const QByteArray &account);
+    // Generates the keys and marks them as published: { "curve25519": { <key id>: <key> } }
+    static QJsonObject generateOneTimeKeys(const QByteArray &pickleKey, QByteArray *account, int count, QString *error);
+
+    // Decrypts an m.olm.v1.curve25519-aes-sha2 message of the given sender with one of the sessions, or with
+    // a new inbound session (appended to the list) for a pre-key message. Returns a null array on failure.
+    static QByteArray decrypt(const QByteArray &pickleKey, QByteArray *account, QList<QByteArray> *sessions,
+                              const QString &senderKey, int type, const QByteArray &body, QString *error);
+
+    // Returns the pickle of the m.megolm.v1.aes-sha2 inbound session made of an m.room_key session key
+    static QByteArray createGroupSession(const QByteArray &pickleKey, const QByteArray &sessionKey, QString *error);
+    // Thread-safe; returns a null array on failure
+    static QByteArray groupDecrypt(const QByteArray &pickleKey, const QByteArray &session, const QByteArray &ciphertext,
+                                   quint32 *messageIndex, QString *error);
+};
+
+#endif // TANK_OLM_HPP
@@ -0,0 +1,182 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "outbox.hpp"
+
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QHash>
+#include <QJsonDocument>
+#include <QSaveFile>
+
+#include <unistd.h>
+
+static const int c_outboxFormat = 1;
+// Rewrite the journal when there is nothing pending and this many events are done
+static const int c_compactThreshold = 256;
+
+MatrixOutbox::MatrixOutbox(const QString &fileName)
+    : m_file(fileName)
+{
+}
+
+MatrixOutbox::~MatrixOutbox()
+{
+    m_file.close();
+}
+
+QList<MatrixOutbox::Entry> MatrixOutbox::load()
+{
+    QList<Entry> entries;
+    QHash<QString, int> indexes;
+
+    m_file.close();
+    if (m_file.open(QIODevice::ReadOnly)) {
+        while (!m_file.atEnd()) {
+            const QByteArray line = m_file.readLine().trimmed();
+            if (line.isEmpty()) {
+                continue;
+            }
+            // A truncated last line (e.g. after a crash during the write) is not valid JSON and is skipped
+            const QJsonObject record = QJsonDocument::fromJson(line).object();
+            if (record.value(QLatin1String("format")).toInt(c_outboxFormat) > c_outboxFormat) {
+                qWarning() << Q_FUNC_INFO << "Unsupported record format";
+                continue;
+            }
+            const QString txnId = record.value(QLatin1String("txn")).toString();
+            const QString op = record.value(QLatin1String("op")).toString();
+            if (txnId.isEmpty()) {
+                continue;
+            }
+            if (op == QLatin1String("queued")) {
+                Entry entry;
+                entry.roomId = record.value(QLatin1String("room")).toString();
+                entry.txnId = txnId;
+                entry.eventType = record.value(QLatin1String("type")).toString();
+                entry.content = record.value(QLatin1String("content")).toObject();
+                indexes.insert(txnId, entries.count());
+                entries.append(entry);
+            } else if (op == QLatin1String("done")) {
+                if (indexes.contains(txnId)) {
+                    entries[indexes.value(txnId)].txnId.clear();
+                }
+            }
+        }
+        m_file.close();
+    }
+
+    QList<Entry> pending;
+    for (const Entry &entry : entries) {
+        if (!entry.txnId.isEmpty()) {
+            pending.append(entry);
+        }
+    }
+    compact(pending);
+    qDebug() << Q_FUNC_INFO << m_file.fileName() << pending.count() << "pending events";
+    return pending;
+}
+
+static QJsonObject queuedRecord(const MatrixOutbox::Entry &entry)
+{
+    QJsonObject record;
+    record.insert(QLatin1String("op"), QLatin1String("queued"));
+    record.insert(QLatin1String("room"), entry.roomId);
+    record.insert(QLatin1String("txn"), entry.txnId);
+    record.insert(QLatin1String("type"), entry.eventType);
+    record.insert(QLatin1String("content"), entry.content);
+    return record;
+}
+
+bool MatrixOutbox::append(const Entry &entry)
+{
+    if (!writeRecord(queuedRecord(entry), /* sync */ true)) {
+        return false;
+    }
+    m_pending.insert(entry.txnId);
+    return true;
+}
+
+void MatrixOutbox::markDone(const QString &txnId)
+{
+    if (!m_pending.remove(txnId)) {
+        return;
+    }
+    QJsonObject record;
+    record.insert(QLatin1String("op"), QLatin1String("done"));
+    record.insert(QLatin1String("txn"), txnId);
+    writeRecord(record, /* sync */ false);
+    ++m_doneRecords;
+
+    if (m_pending.isEmpty() && (m_doneRecords >= c_compactThreshold)) {
+        compact({});
+    }
+}
+
+bool MatrixOutbox::writeRecord(const QJsonObject &record, bool sync)
+{
+    if (!m_file.isOpen()) {
+        QDir().mkpath(QFileInfo(m_file).absolutePath());
+        if (!m_file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+            qWarning() << Q_FUNC_INFO << "Unable to open the outbox" << m_file.fileName();
+            return false;
+        }
+    }
+    QByteArray line = QJsonDocument(record).toJson(QJsonDocument::Compact);
+    line.append('\n');
+    if (m_file.write(line) != line.size()) {
+        qWarning() << Q_FUNC_INFO << "Unable to write the outbox" << m_file.fileName();
+        return false;
+    }
+    // Hand the record to the OS before the message is acknowledged
+    if (!m_file.flush()) {
+        return false;
+    }
+    // A queued event has to survive a power loss; a lost done record only makes the event
+    // be sent again with the same transaction id, which the homeserver drops
+    if (sync && (::fsync(m_file.handle()) != 0)) {
+        qWarning() << Q_FUNC_INFO << "Unable to sync the outbox" << m_file.fileName();
+        return false;
+    }
+    return true;
+}
+
+void MatrixOutbox::compact(const QList<Entry> &entries)
+{
+    m_file.close();
+    m_pending.clear();
+    m_doneRecords = 0;
+
+    // Replace the journal atomically to not lose the pending events on a crash
+    QDir().mkpath(QFileInfo(m_file).absolutePath());
+    QSaveFile saveFile(m_file.fileName());
+    if (!saveFile.open(QIODevice::WriteOnly)) {
+        qWarning() << Q_FUNC_INFO << "Unable to compact the outbox" << m_file.fileName();
+        return;
+    }
+    for (const Entry &entry : entries) {
+        QByteArray line = QJsonDocument(queuedRecord(entry)).toJson(QJsonDocument::Compact);
+        line.append('\n');
+        saveFile.write(line);
+        m_pending.insert(entry.txnId);
+    }
+    if (!saveFile.commit()) {
+        qWarning() << Q_FUNC_INFO << "Unable to compact the outbox" << m_file.fileName();
+    }
+}
@@ -0,0 +1,60 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_OUTBOX_HPP
+#define TANK_OUTBOX_HPP
+
+#include <QFile>
+#include <QJsonObject>
+#include <QList>
+#include <QSet>
+#include <QString>
+
+// Append-only journal of the outgoing events. An event is written before sendMessage()
+// returns and marked as done once the homeserver accepted (or finally rejected) it.
+class MatrixOutbox
+{
+public:
+    struct Entry {
+        QString roomId;
+        QString txnId;
+        QString eventType;
+        QJsonObject content;
+    };
+
+    explicit MatrixOutbox(const QString &fileName);
+    ~MatrixOutbox();
+
+    // Reads the journal and returns the events that are not done yet (in order of sending)
+    QList<Entry> load();
+
+    bool append(const Entry &entry);
+    void markDone(const QString &txnId);
+    int pendingCount() const { return m_pending.count(); }
+
+protected:
+    bool writeRecord(const QJsonObject &record, bool sync);
+    void compact(const QList<Entry> &entries);
+
+    QFile m_file;
+    QSet<QString> m_pending;
+    int m_doneRecords = 0;
+};
+
+#endif // TANK_OUTBOX_HPP
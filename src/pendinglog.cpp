@@ -0,0 +1,172 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "pendinglog.hpp"
+
+#include <QDataStream>
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QVariantMap>
+
+// The space of the records taken which makes the log rewrite its unread tail
+static const qint64 c_compactionThreshold = 1024 * 1024;
+
+MatrixPendingLog::MatrixPendingLog(const QString &fileName)
+    : m_file(fileName)
+{
+}
+
+MatrixPendingLog::~MatrixPendingLog()
+{
+    // The messages are not persisted across the sessions (the in-memory ones are not either)
+    if (m_file.isOpen()) {
+        m_file.close();
+        m_file.remove();
+    }
+}
+
+bool MatrixPendingLog::open()
+{
+    if (m_file.isOpen()) {
+        return true;
+    }
+    QDir().mkpath(QFileInfo(m_file).absolutePath());
+    // Truncate: a file left by a crashed session has nothing to deliver anymore
+    if (!m_file.open(QIODevice::ReadWrite | QIODevice::Truncate)) {
+        qWarning() << Q_FUNC_INFO << "Unable to open" << m_file.fileName() << m_file.errorString();
+        return false;
+    }
+    return true;
+}
+
+bool MatrixPendingLog::append(const Tp::MessagePartList &message)
+{
+    if (!open()) {
+        return false;
+    }
+    QList<QVariantMap> parts;
+    parts.reserve(message.count());
+    for (const Tp::MessagePart &part : message) {
+        QVariantMap map;
+        for (auto it = part.cbegin(); it != part.cend(); ++it) {
+            map.insert(it.key(), it.value().variant());
+        }
+        parts.append(map);
+    }
+
+    QByteArray record;
+    QDataStream stream(&record, QIODevice::WriteOnly);
+    stream << parts;
+
+    QByteArray size;
+    QDataStream(&size, QIODevice::WriteOnly) << quint32(record.size());
+    m_file.seek(m_file.size());
+    if ((m_file.write(size) != size.size()) || (m_file.write(record) != record.size())) {
+        qWarning() << Q_FUNC_INFO << "Unable to write" << m_file.fileName() << m_file.errorString();
+        return false;
+    }
+    ++m_count;
+    return true;
+}
+
+Tp::MessagePartList MatrixPendingLog::takeFirst()
+{
+    while (!isEmpty()) {
+        m_file.seek(m_readOffset);
+        const QByteArray size = m_file.read(sizeof(quint32));
+        quint32 recordSize = 0;
+        QDataStream sizeStream(size);
+        sizeStream >> recordSize;
+        const QByteArray record = m_file.read(recordSize);
+        if ((size.size() != sizeof(quint32)) || (record.size() != int(recordSize))) {
+            // The rest of the file can not be framed anymore
+            qWarning() << Q_FUNC_INFO << "Truncated" << m_file.fileName() << "lost" << m_count << "messages";
+            clear();
+            return {};
+        }
+        m_readOffset += sizeof(recordSize) + recordSize;
+        --m_count;
+        if (m_count == 0) {
+            m_file.resize(0);
+            m_readOffset = 0;
+        } else if ((m_readOffset > c_compactionThreshold) && (m_readOffset > m_file.size() / 2)) {
+            compact();
+        }
+
+        QList<QVariantMap> parts;
+        QDataStream stream(record);
+        stream >> parts;
+        if ((stream.status() != QDataStream::Ok) || parts.isEmpty()) {
+            qWarning() << Q_FUNC_INFO << "Skipped a damaged record in" << m_file.fileName();
+            continue;
+        }
+
+        Tp::MessagePartList message;
+        message.reserve(parts.count());
+        for (const QVariantMap &map : parts) {
+            Tp::MessagePart part;
+            for (auto it = map.cbegin(); it != map.cend(); ++it) {
+                part.insert(it.key(), QDBusVariant(it.value()));
+            }
+            message.append(part);
+        }
+        return message;
+    }
+    return {};
+}
+
+void MatrixPendingLog::compact()
+{
+    // Moves the unread tail to the start of the file in chunks, the client may never catch up fully
+    static const qint64 c_chunkSize = 64 * 1024;
+    qint64 readPosition = m_readOffset;
+    qint64 writePosition = 0;
+    const qint64 fileSize = m_file.size();
+    while (readPosition < fileSize) {
+        m_file.seek(readPosition);
+        const QByteArray chunk = m_file.read(qMin(c_chunkSize, fileSize - readPosition));
+        if (chunk.isEmpty()) {
+            break;
+        }
+        m_file.seek(writePosition);
+        if (m_file.write(chunk) != chunk.size()) {
+            qWarning() << Q_FUNC_INFO << "Unable to compact" << m_file.fileName() << m_file.errorString();
+            return;
+        }
+        readPosition += chunk.size();
+        writePosition += chunk.size();
+    }
+    if (readPosition != fileSize) {
+        // A short read; the records before the read offset are still intact
+        qWarning() << Q_FUNC_INFO << "Unable to compact" << m_file.fileName() << m_file.errorString();
+        return;
+    }
+    m_file.resize(writePosition);
+    m_readOffset = 0;
+}
+
+void MatrixPendingLog::clear()
+{
+    if (m_file.isOpen()) {
+        m_file.resize(0);
+    }
+    m_readOffset = 0;
+    m_count = 0;
+}
@@ -0,0 +1,56 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_PENDINGLOG_HPP
+#define TANK_PENDINGLOG_HPP
+
+#include <QFile>
+#include <QString>
+
+#include <TelepathyQt/Types>
+
+// On-disk FIFO of the received messages over the pending budget. The records are length-prefixed
+// QDataStream blobs; the file lives for the session only. It is truncated whenever it drains and
+// compacted once the records already taken make up the most of it.
+class MatrixPendingLog
+{
+public:
+    explicit MatrixPendingLog(const QString &fileName);
+    ~MatrixPendingLog();
+    Q_DISABLE_COPY(MatrixPendingLog)
+
+    bool append(const Tp::MessagePartList &message);
+    // Returns an empty list if the log is empty; the damaged records are skipped
+    Tp::MessagePartList takeFirst();
+    void clear();
+
+    int count() const { return m_count; }
+    bool isEmpty() const { return m_count == 0; }
+    qint64 size() const { return m_file.isOpen() ? m_file.size() - m_readOffset : 0; }
+
+protected:
+    bool open();
+    void compact();
+
+    QFile m_file;
+    qint64 m_readOffset = 0;
+    int m_count = 0;
+};
+
+#endif // TANK_PENDINGLOG_HPP
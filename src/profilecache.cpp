@@ -0,0 +1,116 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "profilecache.hpp"
+#include "connection.hpp"
+#include "requestscheduler.hpp"
+
+#include <QDebug>
+#include <QPointer>
+
+// Quotient
+#include <connection.h>
+#include <csapi/profile.h>
+
+// Leaves the rest of the Directory class to the interactive searches
+static const int c_maxParallelFetches = 3;
+
+MatrixProfileCache::MatrixProfileCache(MatrixConnection *connection)
+    : QObject(connection),
+      m_connection(connection)
+{
+}
+
+void MatrixProfileCache::update(const QString &userId, const Profile &profile)
+{
+    auto it = m_profiles.find(userId);
+    if ((it != m_profiles.end()) && (it->displayName == profile.displayName) && (it->avatarUrl == profile.avatarUrl)) {
+        return;
+    }
+    m_profiles.insert(userId, profile);
+    emit profileChanged(userId);
+}
+
+void MatrixProfileCache::invalidate(const QString &userId)
+{
+    m_profiles.remove(userId);
+}
+
+void MatrixProfileCache::request(const QStringList &userIds)
+{
+    for (const QString &userId : userIds) {
+        if (m_profiles.contains(userId) || m_pending.contains(userId)) {
+            continue;
+        }
+        m_pending.insert(userId);
+        m_queue.append(userId);
+    }
+    startFetches();
+}
+
+void MatrixProfileCache::clear()
+{
+    ++m_generation;
+    m_profiles.clear();
+    m_queue.clear();
+    m_pending.clear();
+    m_inFlight = 0;
+}
+
+void MatrixProfileCache::startFetches()
+{
+    const QPointer<MatrixProfileCache> cache = this;
+    const quint64 generation = m_generation;
+    Quotient::Connection *matrix = m_connection->matrix();
+
+    while (!m_queue.isEmpty() && (m_inFlight < c_maxParallelFetches)) {
+        const QString userId = m_queue.takeFirst();
+        ++m_inFlight;
+        m_connection->scheduler()->schedule(MatrixRequestScheduler::Priority::Directory, [cache, generation, matrix, userId]() -> Quotient::BaseJob * {
+            if (!cache || (cache->m_generation != generation)) {
+                return nullptr;
+            }
+            Quotient::GetUserProfileJob *job = matrix->callApi<Quotient::GetUserProfileJob>(userId);
+            connect(job, &Quotient::BaseJob::result, cache.data(), [cache, generation, job, userId]() {
+                if (cache->m_generation != generation) {
+                    return;
+                }
+                const bool success = job->status().good();
+                const Profile profile = success ? Profile { job->displayname(), job->avatarUrl() } : Profile();
+                cache->onFetched(userId, success, profile);
+            });
+            return job;
+        });
+    }
+}
+
+void MatrixProfileCache::onFetched(const QString &userId, bool success, const Profile &profile)
+{
+    --m_inFlight;
+    m_pending.remove(userId);
+    if (success) {
+        // A member event may have come while the request was in flight; it is more recent
+        if (!m_profiles.contains(userId)) {
+            update(userId, profile);
+        }
+    } else {
+        qWarning() << Q_FUNC_INFO << "Unable to get the profile of" << userId;
+    }
+    startFetches();
+}
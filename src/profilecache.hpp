@@ -0,0 +1,70 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_PROFILE_CACHE_HPP
+#define TANK_PROFILE_CACHE_HPP
+
+#include <QHash>
+#include <QObject>
+#include <QSet>
+#include <QStringList>
+
+class MatrixConnection;
+
+// The user profiles (display name and avatar) for ContactInfo. The members of the joined rooms
+// come from the room state; only the other users are fetched from the homeserver.
+class MatrixProfileCache : public QObject
+{
+    Q_OBJECT
+public:
+    struct Profile {
+        QString displayName;
+        QString avatarUrl;
+    };
+
+    explicit MatrixProfileCache(MatrixConnection *connection);
+
+    bool contains(const QString &userId) const { return m_profiles.contains(userId); }
+    Profile profile(const QString &userId) const { return m_profiles.value(userId); }
+
+    // Sets the profile known from a member event
+    void update(const QString &userId, const Profile &profile);
+    void invalidate(const QString &userId);
+    // Fetches the profiles which are not cached; a user already being fetched is not requested again
+    void request(const QStringList &userIds);
+    void clear();
+
+    int pendingCount() const { return m_queue.count() + m_inFlight; }
+
+signals:
+    void profileChanged(const QString &userId);
+
+protected:
+    void startFetches();
+    void onFetched(const QString &userId, bool success, const Profile &profile);
+
+    MatrixConnection *m_connection = nullptr;
+    QHash<QString, Profile> m_profiles;
+    QStringList m_queue;
+    QSet<QString> m_pending; // Queued or in flight
+    int m_inFlight = 0;
+    quint64 m_generation = 0; // Invalidates the fetches started before clear()
+};
+
+#endif // TANK_PROFILE_CACHE_HPP
@@ -72,7 +72,7 @@ Tp::BaseConnectionPtr MatrixProtocol::createConnection(const QVariantMap &parame
     qDebug() << Q_FUNC_INFO << parameters;
     Q_UNUSED(error)
 
-    Tp::BaseConnectionPtr newConnection = Tp::BaseConnection::create<MatrixConnection>(QLatin1String("tank"), name(), parameters);
+    Tp::BaseConnectionPtr newConnection = Tp::BaseConnection::create<MatrixConnection>(dbusConnection(), QLatin1String("tank"), name(), parameters);
 
     return newConnection;
 }
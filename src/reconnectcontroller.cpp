@@ -0,0 +1,102 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "reconnectcontroller.hpp"
+
+#include <QDebug>
+#include <QTimer>
+
+MatrixReconnectController::MatrixReconnectController(QObject *parent)
+    : QObject(parent),
+      m_timer(new QTimer(this)),
+      m_random(std::random_device()())
+{
+    m_timer->setSingleShot(true);
+    connect(m_timer, &QTimer::timeout, this, [this]() {
+        emit reconnectRequested(m_attempts);
+    });
+}
+
+void MatrixReconnectController::setBackoff(int initialDelay, int maxDelay)
+{
+    m_initialDelay = initialDelay;
+    m_maxDelay = maxDelay;
+}
+
+void MatrixReconnectController::setMaxAttempts(int attempts)
+{
+    m_maxAttempts = attempts;
+}
+
+void MatrixReconnectController::noteOutage()
+{
+    if (!m_outageTimer.isValid()) {
+        m_outageTimer.start();
+    }
+}
+
+void MatrixReconnectController::scheduleReconnect()
+{
+    noteOutage();
+    if (m_timer->isActive()) {
+        return;
+    }
+    if (m_attempts >= m_maxAttempts) {
+        qWarning() << Q_FUNC_INFO << "Giving up after" << m_attempts << "attempts";
+        emit gaveUp();
+        return;
+    }
+    ++m_attempts;
+    const int delay = nextDelay();
+    qDebug() << Q_FUNC_INFO << "attempt" << m_attempts << "in" << delay << "ms";
+    m_timer->start(delay);
+}
+
+void MatrixReconnectController::markRecovered()
+{
+    m_timer->stop();
+    m_attempts = 0;
+    if (!m_outageTimer.isValid()) {
+        return;
+    }
+    m_lastReconnectTime = m_outageTimer.elapsed();
+    m_maxReconnectTime = qMax(m_maxReconnectTime, m_lastReconnectTime);
+    m_totalReconnectTime += m_lastReconnectTime;
+    ++m_reconnectCount;
+    m_outageTimer.invalidate();
+    qDebug() << Q_FUNC_INFO << "Reconnected in" << m_lastReconnectTime << "ms"
+             << "(count:" << m_reconnectCount << "max:" << m_maxReconnectTime << "ms)";
+}
+
+void MatrixReconnectController::cancel()
+{
+    m_timer->stop();
+    m_attempts = 0;
+    m_outageTimer.invalidate();
+}
+
+int MatrixReconnectController::nextDelay()
+{
+    // "Equal jitter": keep at least half of the exponential delay to not hammer the server,
+    // randomize the other half to spread the clients reconnecting after a server-side outage.
+    const int exponent = qMin(m_attempts - 1, 16);
+    const qint64 delay = qMin<qint64>(m_maxDelay, static_cast<qint64>(m_initialDelay) << exponent);
+    std::uniform_int_distribution<qint64> distribution(0, delay / 2);
+    return static_cast<int>(delay / 2 + distribution(m_random));
+}
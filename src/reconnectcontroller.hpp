@@ -0,0 +1,77 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_RECONNECT_CONTROLLER_HPP
+#define TANK_RECONNECT_CONTROLLER_HPP
+
+#include <QElapsedTimer>
+#include <QObject>
+
+#include <random>
+
+class QTimer;
+
+class MatrixReconnectController : public QObject
+{
+    Q_OBJECT
+public:
+    explicit MatrixReconnectController(QObject *parent = nullptr);
+
+    void setBackoff(int initialDelay, int maxDelay);
+    void setMaxAttempts(int attempts);
+
+    bool isReconnecting() const { return m_outageTimer.isValid(); }
+    int attempts() const { return m_attempts; }
+
+    // Marks the beginning of an outage (if not marked yet). Used for the time-to-reconnect metrics.
+    void noteOutage();
+    // Schedules the next attempt with jittered exponential backoff; emits gaveUp() once the attempts are exhausted.
+    void scheduleReconnect();
+    // Called on a successful sync; closes the outage window and updates the metrics.
+    void markRecovered();
+    void cancel();
+
+    int reconnectCount() const { return m_reconnectCount; }
+    qint64 lastReconnectTime() const { return m_lastReconnectTime; }
+    qint64 maxReconnectTime() const { return m_maxReconnectTime; }
+    qint64 totalReconnectTime() const { return m_totalReconnectTime; }
+
+signals:
+    void reconnectRequested(int attempt);
+    void gaveUp();
+
+protected:
+    int nextDelay();
+
+    QTimer *m_timer = nullptr;
+    QElapsedTimer m_outageTimer;
+    std::mt19937 m_random;
+
+    int m_initialDelay = 1000;
+    int m_maxDelay = 60000;
+    int m_maxAttempts = 8;
+    int m_attempts = 0;
+
+    int m_reconnectCount = 0;
+    qint64 m_lastReconnectTime = 0;
+    qint64 m_maxReconnectTime = 0;
+    qint64 m_totalReconnectTime = 0;
+};
+
+#endif // TANK_RECONNECT_CONTROLLER_HPP
@@ -0,0 +1,179 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "requestscheduler.hpp"
+
+#include <QDebug>
+#include <QTimer>
+
+// Quotient
+#include <jobs/basejob.h>
+
+MatrixRequestScheduler::MatrixRequestScheduler(QObject *parent)
+    : QObject(parent),
+      m_dispatchTimer(new QTimer(this))
+{
+    m_classes[static_cast<int>(Priority::InteractiveSend)].limit = 4;
+    m_classes[static_cast<int>(Priority::Receipt)].limit = 2;
+    m_classes[static_cast<int>(Priority::Typing)].limit = 2;
+    m_classes[static_cast<int>(Priority::Directory)].limit = 4;
+    m_classes[static_cast<int>(Priority::Media)].limit = 2;
+
+    m_tokens = m_burst;
+    m_refillTimer.start();
+
+    m_dispatchTimer->setSingleShot(true);
+    connect(m_dispatchTimer, &QTimer::timeout, this, &MatrixRequestScheduler::dispatch);
+}
+
+void MatrixRequestScheduler::setConcurrencyLimit(Priority priority, int limit)
+{
+    m_classes[static_cast<int>(priority)].limit = qMax(1, limit);
+    dispatch();
+}
+
+void MatrixRequestScheduler::setRateLimit(int requestsPerSecond, int burst)
+{
+    m_rate = qMax(1, requestsPerSecond);
+    m_burst = qMax(1, burst);
+    m_tokens = qMin<double>(m_tokens, m_burst);
+    dispatch();
+}
+
+void MatrixRequestScheduler::schedule(Priority priority, const JobFactory &factory, const QString &coalesceKey)
+{
+    RequestClass &requestClass = m_classes[static_cast<int>(priority)];
+    if (!coalesceKey.isEmpty()) {
+        for (Request &request : requestClass.queue) {
+            if (request.coalesceKey == coalesceKey) {
+                // Only the latest request matters (e.g. the typing state); keep the queue position
+                request.factory = factory;
+                ++requestClass.coalesced;
+                return;
+            }
+        }
+    }
+
+    Request request;
+    request.factory = factory;
+    request.coalesceKey = coalesceKey;
+    request.queuedTimer.start();
+    requestClass.queue.append(request);
+
+    dispatch();
+}
+
+void MatrixRequestScheduler::clear()
+{
+    for (RequestClass &requestClass : m_classes) {
+        requestClass.queue.clear();
+        requestClass.inFlight = 0;
+    }
+    ++m_generation;
+    m_dispatchTimer->stop();
+}
+
+int MatrixRequestScheduler::queueDepth(Priority priority) const
+{
+    return m_classes[static_cast<int>(priority)].queue.count();
+}
+
+int MatrixRequestScheduler::inFlightCount(Priority priority) const
+{
+    return m_classes[static_cast<int>(priority)].inFlight;
+}
+
+QVariantMap MatrixRequestScheduler::statistics() const
+{
+    static const QStringList names = {
+        QStringLiteral("send"),
+        QStringLiteral("receipt"),
+        QStringLiteral("typing"),
+        QStringLiteral("directory"),
+        QStringLiteral("media"),
+    };
+    QVariantMap result;
+    for (int i = 0; i < PriorityCount; ++i) {
+        const RequestClass &requestClass = m_classes[i];
+        result.insert(names.at(i) + QLatin1String("-queued"), requestClass.queue.count());
+        result.insert(names.at(i) + QLatin1String("-in-flight"), requestClass.inFlight);
+        result.insert(names.at(i) + QLatin1String("-started"), requestClass.started);
+        result.insert(names.at(i) + QLatin1String("-coalesced"), requestClass.coalesced);
+        result.insert(names.at(i) + QLatin1String("-max-wait-ms"), requestClass.maxWaitTime);
+    }
+    return result;
+}
+
+void MatrixRequestScheduler::dispatch()
+{
+    for (int i = 0; i < PriorityCount; ++i) {
+        RequestClass &requestClass = m_classes[i];
+        while (!requestClass.queue.isEmpty() && (requestClass.inFlight < requestClass.limit)) {
+            if (!takeToken()) {
+                // Wake up when the next token is there
+                if (!m_dispatchTimer->isActive()) {
+                    m_dispatchTimer->start(qMax(1, 1000 / m_rate));
+                }
+                return;
+            }
+            start(i);
+        }
+        // A lower class can run only if the higher ones can not use the capacity
+    }
+}
+
+void MatrixRequestScheduler::refillTokens()
+{
+    const qint64 elapsed = m_refillTimer.restart();
+    m_tokens = qMin<double>(m_burst, m_tokens + elapsed * m_rate / 1000.0);
+}
+
+bool MatrixRequestScheduler::takeToken()
+{
+    refillTokens();
+    if (m_tokens < 1) {
+        return false;
+    }
+    m_tokens -= 1;
+    return true;
+}
+
+void MatrixRequestScheduler::start(int classIndex)
+{
+    RequestClass &requestClass = m_classes[classIndex];
+    const Request request = requestClass.queue.takeFirst();
+    requestClass.maxWaitTime = qMax(requestClass.maxWaitTime, request.queuedTimer.elapsed());
+
+    Quotient::BaseJob *job = request.factory();
+    if (!job) {
+        // Nothing was sent (e.g. the channel is gone), give the token back
+        m_tokens = qMin<double>(m_burst, m_tokens + 1);
+        return;
+    }
+    ++requestClass.inFlight;
+    ++requestClass.started;
+    const quint64 generation = m_generation;
+    connect(job, &Quotient::BaseJob::finished, this, [this, classIndex, generation]() {
+        if (generation != m_generation) {
+            return;
+        }
+        --m_classes[classIndex].inFlight;
+        dispatch();
+    });
+}
@@ -0,0 +1,101 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_REQUEST_SCHEDULER_HPP
+#define TANK_REQUEST_SCHEDULER_HPP
+
+#include <QElapsedTimer>
+#include <QList>
+#include <QObject>
+#include <QVariantMap>
+
+#include <functional>
+
+class QTimer;
+
+namespace Quotient
+{
+
+class BaseJob;
+
+} // Quotient
+
+class MatrixRequestScheduler : public QObject
+{
+    Q_OBJECT
+public:
+    // In order of precedence
+    enum class Priority {
+        InteractiveSend,
+        Receipt,
+        Typing,
+        Directory, // Room directory and user search
+        Media,
+    };
+    static constexpr int PriorityCount = 5;
+
+    // The factory starts the job (e.g. via Connection::callApi()) and returns it
+    using JobFactory = std::function<Quotient::BaseJob *()>;
+
+    explicit MatrixRequestScheduler(QObject *parent = nullptr);
+
+    void setConcurrencyLimit(Priority priority, int limit);
+    // Global token bucket shared by all classes
+    void setRateLimit(int requestsPerSecond, int burst);
+
+    // A queued (not started yet) request with the same non-empty key is replaced by the new one
+    void schedule(Priority priority, const JobFactory &factory, const QString &coalesceKey = QString());
+    // Drops the queued requests and forgets the ones in flight (e.g. aborted on a disconnect)
+    void clear();
+
+    int queueDepth(Priority priority) const;
+    int inFlightCount(Priority priority) const;
+    QVariantMap statistics() const;
+
+protected:
+    struct Request {
+        JobFactory factory;
+        QString coalesceKey;
+        QElapsedTimer queuedTimer;
+    };
+
+    struct RequestClass {
+        QList<Request> queue;
+        int inFlight = 0;
+        int limit = 1;
+        quint64 started = 0;
+        quint64 coalesced = 0;
+        qint64 maxWaitTime = 0;
+    };
+
+    void dispatch();
+    bool takeToken();
+    void refillTokens();
+    void start(int classIndex);
+
+    RequestClass m_classes[PriorityCount];
+    QTimer *m_dispatchTimer = nullptr;
+    QElapsedTimer m_refillTimer;
+    double m_tokens = 0;
+    int m_rate = 10;
+    int m_burst = 20;
+    quint64 m_generation = 0; // The jobs started before clear() do not count on finishing
+};
+
+#endif // TANK_REQUEST_SCHEDULER_HPP
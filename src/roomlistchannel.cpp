@@ -0,0 +1,162 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "roomlistchannel.hpp"
+#include "connection.hpp"
+#include "requestscheduler.hpp"
+
+#include <TelepathyQt/Constants>
+
+#include <QDebug>
+
+// Quotient
+#include <connection.h>
+#include <room.h>
+#include <csapi/list_public_rooms.h>
+
+// Rooms per directory page; that's also the size of a GotRooms batch
+static const int c_roomListPageSize = 100;
+
+MatrixRoomListChannel::MatrixRoomListChannel(MatrixConnection *connection, const QVariantMap &request)
+    : Tp::BaseChannelRoomListType(request.value(TP_QT_IFACE_CHANNEL_TYPE_ROOM_LIST + QLatin1String(".Server")).toString()),
+      m_connection(connection),
+      m_searchTerm(request.value(searchTermProperty()).toString())
+{
+    setListRoomsCallback(Tp::memFun(this, &MatrixRoomListChannel::listRoomsCB));
+    setStopListingCallback(Tp::memFun(this, &MatrixRoomListChannel::stopListingCB));
+}
+
+MatrixRoomListChannelPtr MatrixRoomListChannel::create(MatrixConnection *connection, const QVariantMap &request)
+{
+    return MatrixRoomListChannelPtr(new MatrixRoomListChannel(connection, request));
+}
+
+QString MatrixRoomListChannel::searchTermProperty()
+{
+    // Passed to the homeserver as the generic search term of the directory filter
+    return QStringLiteral("im.telepathy.tank.RoomList.SearchTerm");
+}
+
+void MatrixRoomListChannel::listRoomsCB(Tp::DBusError *error)
+{
+    Q_UNUSED(error)
+    if (getListingRooms()) {
+        return;
+    }
+    m_nextBatch.clear();
+    m_listedCount = 0;
+    setListingRooms(true);
+    requestPage();
+}
+
+void MatrixRoomListChannel::stopListingCB(Tp::DBusError *error)
+{
+    Q_UNUSED(error)
+    if (!getListingRooms()) {
+        return;
+    }
+    ++m_generation;
+    if (m_job) {
+        m_job->abandon();
+    }
+    finishListing();
+}
+
+void MatrixRoomListChannel::requestPage()
+{
+    const QPointer<MatrixRoomListChannel> channel = this;
+    const quint64 generation = m_generation;
+    Quotient::Connection *matrix = m_connection->matrix();
+    const QString server = this->server();
+    const QString since = m_nextBatch;
+    Quotient::Omittable<Quotient::QueryPublicRoomsJob::Filter> filter;
+    if (!m_searchTerm.isEmpty()) {
+        filter = Quotient::QueryPublicRoomsJob::Filter { m_searchTerm };
+    }
+
+    m_connection->scheduler()->schedule(MatrixRequestScheduler::Priority::Directory, [channel, generation, matrix, server, since, filter]() -> Quotient::BaseJob * {
+        if (!channel || (channel->m_generation != generation)) {
+            return nullptr;
+        }
+        Quotient::QueryPublicRoomsJob *job = matrix->callApi<Quotient::QueryPublicRoomsJob>(server, c_roomListPageSize, since, filter);
+        channel->m_job = job;
+        connect(job, &Quotient::BaseJob::result, channel.data(), [channel, generation, job]() {
+            if (channel->m_generation != generation) {
+                return;
+            }
+            channel->onPageReceived(job);
+        });
+        return job;
+    });
+}
+
+void MatrixRoomListChannel::onPageReceived(Quotient::BaseJob *job)
+{
+    if (!job->status().good()) {
+        qWarning() << Q_FUNC_INFO << "Unable to get the public rooms:" << job->errorString();
+        finishListing();
+        return;
+    }
+
+    const auto *roomsJob = static_cast<Quotient::QueryPublicRoomsJob *>(job);
+    Tp::RoomInfoList rooms;
+    rooms.reserve(roomsJob->chunk().count());
+    for (const Quotient::PublicRoomsChunk &chunk : roomsJob->chunk()) {
+        Tp::RoomInfo room;
+        room.channelType = TP_QT_IFACE_CHANNEL_TYPE_TEXT;
+        // Only the joined rooms get a handle; the rest is requested by the identifier
+        Quotient::Room *joinedRoom = m_connection->matrix()->room(chunk.roomId);
+        room.handle = joinedRoom ? m_connection->getRoomHandle(joinedRoom) : 0;
+        const QString identifier = chunk.canonicalAlias.isEmpty() ? chunk.roomId : chunk.canonicalAlias;
+        room.info[QStringLiteral("handle-name")] = identifier;
+        room.info[QStringLiteral("room-id")] = chunk.roomId;
+        room.info[QStringLiteral("members")] = static_cast<uint>(chunk.numJoinedMembers);
+        room.info[QStringLiteral("invite-only")] = false;
+        room.info[QStringLiteral("password")] = false;
+        if (!chunk.name.isEmpty()) {
+            room.info[QStringLiteral("name")] = chunk.name;
+        }
+        if (!chunk.topic.isEmpty()) {
+            room.info[QStringLiteral("subject")] = chunk.topic;
+        }
+        if (!server().isEmpty()) {
+            room.info[QStringLiteral("server")] = server();
+        }
+        rooms.append(room);
+    }
+    m_listedCount += rooms.count();
+    if (!rooms.isEmpty()) {
+        gotRooms(rooms);
+    }
+
+    m_nextBatch = roomsJob->nextBatch();
+    if (m_nextBatch.isEmpty() || rooms.isEmpty()) {
+        finishListing();
+        return;
+    }
+    requestPage();
+}
+
+void MatrixRoomListChannel::finishListing()
+{
+    qDebug() << Q_FUNC_INFO << "Listed" << m_listedCount << "rooms";
+    m_job.clear();
+    m_nextBatch.clear();
+    setListingRooms(false);
+}
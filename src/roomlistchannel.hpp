@@ -0,0 +1,65 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_ROOM_LIST_CHANNEL_HPP
+#define TANK_ROOM_LIST_CHANNEL_HPP
+
+#include <QPointer>
+
+#include <TelepathyQt/BaseChannel>
+
+class MatrixConnection;
+class MatrixRoomListChannel;
+
+namespace Quotient
+{
+
+class BaseJob;
+
+} // Quotient
+
+typedef Tp::SharedPtr<MatrixRoomListChannel> MatrixRoomListChannelPtr;
+
+// Lists the public rooms directory page by page; each page is emitted as a GotRooms batch and dropped
+class MatrixRoomListChannel : public Tp::BaseChannelRoomListType
+{
+    Q_OBJECT
+public:
+    static MatrixRoomListChannelPtr create(MatrixConnection *connection, const QVariantMap &request);
+
+    static QString searchTermProperty();
+
+private:
+    MatrixRoomListChannel(MatrixConnection *connection, const QVariantMap &request);
+
+    void listRoomsCB(Tp::DBusError *error);
+    void stopListingCB(Tp::DBusError *error);
+    void requestPage();
+    void onPageReceived(Quotient::BaseJob *job);
+    void finishListing();
+
+    MatrixConnection *m_connection = nullptr;
+    QString m_searchTerm;
+    QString m_nextBatch;
+    QPointer<Quotient::BaseJob> m_job;
+    quint64 m_generation = 0; // Invalidates the pages requested before a stop
+    int m_listedCount = 0;
+};
+
+#endif // TANK_ROOM_LIST_CHANNEL_HPP
@@ -0,0 +1,259 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "sendqueue.hpp"
+#include "connection.hpp"
+#include "requestscheduler.hpp"
+
+#include <QDebug>
+#include <QPointer>
+#include <QTimer>
+
+#include <algorithm>
+#include <limits>
+
+// Quotient
+#include <connection.h>
+#include <room.h>
+#include <csapi/room_send.h>
+
+static const int c_maxSendAttempts = 5;
+static const int c_defaultRetryDelay = 1000;
+
+MatrixSendQueue::MatrixSendQueue(MatrixConnection *connection, Quotient::Room *room, QObject *parent)
+    : QObject(parent),
+      m_connection(connection),
+      m_room(room),
+      m_retryTimer(new QTimer(this))
+{
+    m_retryTimer->setSingleShot(true);
+    connect(m_retryTimer, &QTimer::timeout, this, &MatrixSendQueue::flush);
+}
+
+QString MatrixSendQueue::enqueue(const QJsonObject &content, const QString &eventType)
+{
+    if (m_room->usesEncryption()) {
+        // Only the receiving side of the end-to-end encryption is there, do not leak the plain text
+        qWarning() << Q_FUNC_INFO << "Refused to send to the encrypted room" << m_room->id();
+        return QString();
+    }
+
+    Item item;
+    item.serial = m_nextSerial++;
+    item.txnId = QString::fromLatin1(m_connection->matrix()->generateTxnId());
+    item.eventType = eventType;
+    item.content = content;
+
+    // Journal the event before the token is returned to the client
+    MatrixOutbox::Entry entry;
+    entry.roomId = m_room->id();
+    entry.txnId = item.txnId;
+    entry.eventType = eventType;
+    entry.content = content;
+    if (!m_connection->outbox()->append(entry)) {
+        return QString();
+    }
+
+    m_queue.append(item);
+    emit messageQueued(item.txnId);
+
+    flush();
+    return item.txnId;
+}
+
+void MatrixSendQueue::restore(const MatrixOutbox::Entry &entry)
+{
+    // The same transaction id makes the homeserver drop the duplicate
+    // if the event has been sent right before a crash.
+    Item item;
+    item.serial = m_nextSerial++;
+    item.txnId = entry.txnId;
+    item.eventType = entry.eventType;
+    item.content = entry.content;
+    item.restored = true;
+    m_queue.append(item);
+    emit messageQueued(item.txnId);
+
+    flush();
+}
+
+void MatrixSendQueue::setMaxInFlight(int maxInFlight)
+{
+    m_maxInFlight = qMax(1, maxInFlight);
+    flush();
+}
+
+void MatrixSendQueue::flush()
+{
+    if (m_connection->status() != Tp::ConnectionStatusConnected) {
+        // Keep the events queued until the connection is back
+        return;
+    }
+    if (m_retryTimer->isActive()) {
+        // Rate limited, wait for the retry_after_ms to pass
+        return;
+    }
+    // An event sent again goes alone, the later ones wait until it is through
+    const int maxInFlight = isRetrying() ? 1 : m_maxInFlight;
+    while (!m_queue.isEmpty() && (m_inFlight.count() < maxInFlight)) {
+        startItem(m_queue.takeFirst());
+    }
+}
+
+void MatrixSendQueue::startItem(const Item &item)
+{
+    if (m_room->usesEncryption()) {
+        // Restored from the outbox, or queued before the room was encrypted
+        qWarning() << Q_FUNC_INFO << "Drop the event" << item.txnId << "for the encrypted room" << m_room->id();
+        m_connection->outbox()->markDone(item.txnId);
+        Result result;
+        result.txnId = item.txnId;
+        result.permanently = true;
+        result.reason = QStringLiteral("Sending to the encrypted rooms is not supported");
+        finishItem(item.serial, result);
+        return;
+    }
+
+    Item startedItem = item;
+    ++startedItem.attempts;
+    m_inFlight.insert(item.txnId, startedItem);
+    emit messageSending(item.txnId);
+
+    // The queue may be gone (with its channel) by the time the scheduler starts the request
+    const QPointer<MatrixSendQueue> queue = this;
+    MatrixConnection *connection = m_connection;
+    const QString roomId = m_room->id();
+    m_connection->scheduler()->schedule(MatrixRequestScheduler::Priority::InteractiveSend, [queue, connection, roomId, item]() -> Quotient::BaseJob * {
+        if (!queue) {
+            return nullptr;
+        }
+        Quotient::SendMessageJob *job = connection->matrix()->callApi<Quotient::SendMessageJob>(
+                    roomId, item.eventType, item.txnId, item.content);
+        const QString txnId = item.txnId;
+        connect(job, &Quotient::BaseJob::result, queue.data(), [queue, job, txnId]() {
+            queue->onJobFinished(job, txnId);
+        });
+        return job;
+    });
+}
+
+void MatrixSendQueue::onJobFinished(Quotient::BaseJob *job, const QString &txnId)
+{
+    const Item item = m_inFlight.take(txnId);
+    if (item.txnId.isEmpty()) {
+        return;
+    }
+
+    if (job->status().good()) {
+        Result result;
+        result.txnId = txnId;
+        result.accepted = true;
+        result.eventId = static_cast<Quotient::SendMessageJob *>(job)->eventId();
+        m_connection->outbox()->markDone(txnId);
+        finishItem(item.serial, result);
+        flush();
+        return;
+    }
+
+    const int errorCode = job->error();
+    if ((errorCode == Quotient::BaseJob::TooManyRequestsError) && (item.attempts < c_maxSendAttempts)) {
+        // M_LIMIT_EXCEEDED: put the event back in its place in the queue
+        // and hold the whole queue for the time the server asked for.
+        int retryAfter = job->jsonData().value(QLatin1String("retry_after_ms")).toInt();
+        if (retryAfter <= 0) {
+            retryAfter = c_defaultRetryDelay << (item.attempts - 1);
+        }
+        qDebug() << Q_FUNC_INFO << "Rate limited, retry" << txnId << "in" << retryAfter << "ms";
+        requeue(item);
+        pause(retryAfter);
+        return;
+    }
+
+    if (((errorCode == Quotient::BaseJob::NetworkError) || (errorCode == Quotient::BaseJob::TimeoutError))
+            && (item.attempts < c_maxSendAttempts)) {
+        // Quotient has already retried the request; keep the event queued through the outage
+        requeue(item);
+        pause(c_defaultRetryDelay << item.attempts);
+        return;
+    }
+
+    const bool permanently = (errorCode == Quotient::BaseJob::IncorrectRequestError)
+            || (errorCode == Quotient::BaseJob::ContentAccessError)
+            || (errorCode == Quotient::BaseJob::NotFoundError);
+    qWarning() << Q_FUNC_INFO << "Unable to send" << txnId << job->errorString();
+    m_connection->outbox()->markDone(txnId);
+    Result result;
+    result.txnId = txnId;
+    result.permanently = permanently;
+    result.reason = job->errorString();
+    finishItem(item.serial, result);
+    flush();
+}
+
+void MatrixSendQueue::requeue(const Item &item)
+{
+    // Several events in flight can fail together, each one goes back before the events sent after it
+    const auto position = std::lower_bound(m_queue.begin(), m_queue.end(), item.serial, [](const Item &queued, quint64 serial) {
+        return queued.serial < serial;
+    });
+    m_queue.insert(position, item);
+}
+
+bool MatrixSendQueue::isRetrying() const
+{
+    // The queue is in order of sending, a retried event is at its head. The events restored
+    // after a crash are sent again as well and keep their original order the same way.
+    if (!m_queue.isEmpty() && ((m_queue.first().attempts > 0) || m_queue.first().restored)) {
+        return true;
+    }
+    for (const Item &item : m_inFlight) {
+        if ((item.attempts > 1) || item.restored) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void MatrixSendQueue::finishItem(quint64 serial, const Result &result)
+{
+    m_results.insert(serial, result);
+
+    // A later event may go through while an earlier one waits for a retry; the client learns about
+    // it once the earlier one is through (or has failed)
+    quint64 firstPending = m_queue.isEmpty() ? std::numeric_limits<quint64>::max() : m_queue.first().serial;
+    for (const Item &item : m_inFlight) {
+        firstPending = qMin(firstPending, item.serial);
+    }
+    while (!m_results.isEmpty() && (m_results.firstKey() < firstPending)) {
+        const Result finished = m_results.take(m_results.firstKey());
+        if (finished.accepted) {
+            emit messageAccepted(finished.txnId, finished.eventId);
+        } else {
+            emit messageFailed(finished.txnId, finished.permanently, finished.reason);
+        }
+    }
+}
+
+void MatrixSendQueue::pause(int milliseconds)
+{
+    if (m_retryTimer->isActive() && (m_retryTimer->remainingTime() >= milliseconds)) {
+        return;
+    }
+    m_retryTimer->start(milliseconds);
+}
@@ -0,0 +1,104 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_SEND_QUEUE_HPP
+#define TANK_SEND_QUEUE_HPP
+
+#include <QHash>
+#include <QJsonObject>
+#include <QList>
+#include <QMap>
+#include <QObject>
+
+#include "outbox.hpp"
+
+class QTimer;
+
+class MatrixConnection;
+
+namespace Quotient
+{
+
+class BaseJob;
+class Room;
+
+} // Quotient
+
+class MatrixSendQueue : public QObject
+{
+    Q_OBJECT
+public:
+    explicit MatrixSendQueue(MatrixConnection *connection, Quotient::Room *room, QObject *parent = nullptr);
+
+    // Returns the transaction id of the queued event, or an empty string if the event is not queued:
+    // the room is encrypted or the event could not be written to the outbox
+    QString enqueue(const QJsonObject &content, const QString &eventType = QStringLiteral("m.room.message"));
+    // Queues an event restored from the outbox (keeping its transaction id)
+    void restore(const MatrixOutbox::Entry &entry);
+    // Starts the queued events (e.g. once the connection is up again)
+    void flush();
+
+    int maxInFlight() const { return m_maxInFlight; }
+    void setMaxInFlight(int maxInFlight);
+
+    int queuedCount() const { return m_queue.count(); }
+    int inFlightCount() const { return m_inFlight.count(); }
+
+signals:
+    void messageQueued(const QString &txnId);
+    void messageSending(const QString &txnId);
+    void messageAccepted(const QString &txnId, const QString &eventId);
+    void messageFailed(const QString &txnId, bool permanently, const QString &reason);
+
+protected:
+    struct Item {
+        quint64 serial = 0; // Order of sending
+        QString txnId;
+        QString eventType;
+        QJsonObject content;
+        int attempts = 0;
+        bool restored = false; // Loaded from the outbox, might have reached the homeserver already
+    };
+    struct Result {
+        QString txnId;
+        bool accepted = false;
+        QString eventId;
+        bool permanently = false;
+        QString reason;
+    };
+
+    void startItem(const Item &item);
+    void onJobFinished(Quotient::BaseJob *job, const QString &txnId);
+    void requeue(const Item &item);
+    bool isRetrying() const;
+    void finishItem(quint64 serial, const Result &result);
+    void pause(int milliseconds);
+
+    MatrixConnection *m_connection = nullptr;
+    Quotient::Room *m_room = nullptr;
+    QTimer *m_retryTimer = nullptr;
+
+    QList<Item> m_queue; // Not started yet, in order of sending
+    QHash<QString, Item> m_inFlight; // Transaction id to the item
+    QMap<quint64, Result> m_results; // Finished before an earlier item, reported in order of sending
+    quint64 m_nextSerial = 0;
+    int m_maxInFlight = 3;
+};
+
+#endif // TANK_SEND_QUEUE_HPP
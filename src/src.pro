@@ -10,15 +10,67 @@ PKGCONFIG += openssl zlib
 PKGCONFIG += TelepathyQt5
 PKGCONFIG += TelepathyQt5Service
 
+# qmake CONFIG+=e2ee to decrypt the end-to-end encrypted rooms
+e2ee {
+    PKGCONFIG += olm
+    DEFINES += TANK_E2EE
+}
+
 SOURCES = main.cpp \
     connection.cpp \
+    contactsearchchannel.cpp \
+    cryptostore.cpp \
+    decryptor.cpp \
+    deliverytracker.cpp \
+    e2ee.cpp \
+    filetransferchannel.cpp \
+    handleregistry.cpp \
+    idtable.cpp \
+    mediacache.cpp \
+    memorybudget.cpp \
+    olm.cpp \
     protocol.cpp \
-    messageschannel.cpp
+    messageschannel.cpp \
+    outbox.cpp \
+    pendinglog.cpp \
+    profilecache.cpp \
+    reconnectcontroller.cpp \
+    requestscheduler.cpp \
+    roomlistchannel.cpp \
+    sendqueue.cpp \
+    statistics.cpp \
+    statisticsinterface.cpp \
+    tracer.cpp \
+    userdirectory.cpp \
+    watchdog.cpp
 
 HEADERS = \
     connection.hpp \
+    contactsearchchannel.hpp \
+    cryptostore.hpp \
+    decryptor.hpp \
+    deliverytracker.hpp \
+    e2ee.hpp \
+    filetransferchannel.hpp \
+    handleregistry.hpp \
+    idtable.hpp \
+    mediacache.hpp \
+    memorybudget.hpp \
+    olm.hpp \
     protocol.hpp \
-    messageschannel.hpp
+    messageschannel.hpp \
+    outbox.hpp \
+    pendinglog.hpp \
+    profilecache.hpp \
+    reconnectcontroller.hpp \
+    requestscheduler.hpp \
+    roomlistchannel.hpp \
+    sendqueue.hpp \
+    statistics.hpp \
+    statisticsinterface.hpp \
+    tracer.hpp \
+    userdirectory.hpp \
+    watchdog.hpp
 
 OTHER_FILES += CMakeLists.txt
 OTHER_FILES += rpm/telepathy-tank.spec
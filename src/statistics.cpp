@@ -0,0 +1,59 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "statistics.hpp"
+
+void MatrixStatistics::addSync(qint64 payloadBytes)
+{
+    ++m_syncCount;
+    m_syncBytes += payloadBytes;
+}
+
+void MatrixStatistics::addEvent(const QString &type)
+{
+    ++m_eventCounts[type];
+}
+
+void MatrixStatistics::addAvatarLookup(bool hit)
+{
+    if (hit) {
+        ++m_avatarHits;
+    } else {
+        ++m_avatarMisses;
+    }
+}
+
+QVariantMap MatrixStatistics::toVariantMap() const
+{
+    QVariantMap result;
+    result.insert(QStringLiteral("sync-count"), m_syncCount);
+    result.insert(QStringLiteral("sync-bytes"), m_syncBytes);
+
+    QVariantMap events;
+    for (auto it = m_eventCounts.cbegin(); it != m_eventCounts.cend(); ++it) {
+        events.insert(it.key(), it.value());
+    }
+    result.insert(QStringLiteral("events"), events);
+
+    const quint64 avatarLookups = m_avatarHits + m_avatarMisses;
+    result.insert(QStringLiteral("avatar-cache-hits"), m_avatarHits);
+    result.insert(QStringLiteral("avatar-cache-misses"), m_avatarMisses);
+    result.insert(QStringLiteral("avatar-cache-hit-rate"), avatarLookups ? double(m_avatarHits) / avatarLookups : 0.0);
+    return result;
+}
@@ -0,0 +1,46 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_STATISTICS_HPP
+#define TANK_STATISTICS_HPP
+
+#include <QHash>
+#include <QVariantMap>
+
+// Runtime counters of a connection; cheap to update from the hot paths
+class MatrixStatistics
+{
+public:
+    void addSync(qint64 payloadBytes);
+    void addEvent(const QString &type);
+    void addAvatarLookup(bool hit);
+
+    quint64 syncCount() const { return m_syncCount; }
+
+    QVariantMap toVariantMap() const;
+
+protected:
+    quint64 m_syncCount = 0;
+    qint64 m_syncBytes = 0;
+    QHash<QString, quint64> m_eventCounts;
+    quint64 m_avatarHits = 0;
+    quint64 m_avatarMisses = 0;
+};
+
+#endif // TANK_STATISTICS_HPP
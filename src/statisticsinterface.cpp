@@ -0,0 +1,78 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "statisticsinterface.hpp"
+
+#include <TelepathyQt/Constants>
+#include <TelepathyQt/DBusObject>
+
+#include <QDBusMessage>
+
+MatrixStatisticsInterface::MatrixStatisticsInterface()
+    : Tp::AbstractConnectionInterface(QStringLiteral(TANK_IFACE_CONNECTION_INTERFACE_STATISTICS))
+{
+}
+
+MatrixStatisticsInterfacePtr MatrixStatisticsInterface::create()
+{
+    return MatrixStatisticsInterfacePtr(new MatrixStatisticsInterface());
+}
+
+QVariantMap MatrixStatisticsInterface::immutableProperties() const
+{
+    return QVariantMap();
+}
+
+void MatrixStatisticsInterface::setGetStatisticsCallback(const GetStatisticsCallback &cb)
+{
+    m_getStatisticsCB = cb;
+}
+
+QVariantMap MatrixStatisticsInterface::getStatistics(Tp::DBusError *error)
+{
+    if (!m_getStatisticsCB.isValid()) {
+        error->set(TP_QT_ERROR_NOT_IMPLEMENTED, QStringLiteral("Not implemented"));
+        return QVariantMap();
+    }
+    return m_getStatisticsCB(error);
+}
+
+void MatrixStatisticsInterface::createAdaptor()
+{
+    (void) new MatrixStatisticsAdaptor(dbusObject()->dbusConnection(), this, dbusObject());
+}
+
+MatrixStatisticsAdaptor::MatrixStatisticsAdaptor(const QDBusConnection &dbusConnection, MatrixStatisticsInterface *iface, QObject *parent)
+    : QDBusAbstractAdaptor(parent),
+      m_dbusConnection(dbusConnection),
+      m_interface(iface)
+{
+}
+
+QVariantMap MatrixStatisticsAdaptor::GetStatistics(const QDBusMessage &message)
+{
+    Tp::DBusError error;
+    const QVariantMap statistics = m_interface->getStatistics(&error);
+    if (error.isValid()) {
+        message.setDelayedReply(true);
+        m_dbusConnection.send(message.createErrorReply(error.name(), error.message()));
+        return QVariantMap();
+    }
+    return statistics;
+}
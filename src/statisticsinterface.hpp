@@ -0,0 +1,70 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_STATISTICS_INTERFACE_HPP
+#define TANK_STATISTICS_INTERFACE_HPP
+
+#include <QDBusAbstractAdaptor>
+
+#include <TelepathyQt/BaseConnection>
+#include <TelepathyQt/Callbacks>
+
+class MatrixStatisticsInterface;
+
+typedef Tp::SharedPtr<MatrixStatisticsInterface> MatrixStatisticsInterfacePtr;
+
+#define TANK_IFACE_CONNECTION_INTERFACE_STATISTICS "im.telepathy.tank.Connection.Interface.Statistics"
+
+// Connection interface with the runtime statistics for the monitoring
+class MatrixStatisticsInterface : public Tp::AbstractConnectionInterface
+{
+    Q_OBJECT
+public:
+    static MatrixStatisticsInterfacePtr create();
+
+    QVariantMap immutableProperties() const override;
+
+    typedef Tp::Callback1<QVariantMap, Tp::DBusError *> GetStatisticsCallback;
+    void setGetStatisticsCallback(const GetStatisticsCallback &cb);
+    QVariantMap getStatistics(Tp::DBusError *error);
+
+private:
+    MatrixStatisticsInterface();
+
+    void createAdaptor() override;
+
+    GetStatisticsCallback m_getStatisticsCB;
+};
+
+class MatrixStatisticsAdaptor : public QDBusAbstractAdaptor
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", TANK_IFACE_CONNECTION_INTERFACE_STATISTICS)
+public:
+    MatrixStatisticsAdaptor(const QDBusConnection &dbusConnection, MatrixStatisticsInterface *iface, QObject *parent);
+
+public slots:
+    QVariantMap GetStatistics(const QDBusMessage &message);
+
+private:
+    QDBusConnection m_dbusConnection;
+    MatrixStatisticsInterface *m_interface = nullptr;
+};
+
+#endif // TANK_STATISTICS_INTERFACE_HPP
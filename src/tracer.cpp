@@ -0,0 +1,152 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "tracer.hpp"
+
+#include <QCoreApplication>
+#include <QDebug>
+#include <QFile>
+
+#include <cmath>
+
+void MatrixLatencyHistogram::record(qint64 microseconds)
+{
+    microseconds = qMax<qint64>(0, microseconds);
+    ++m_buckets[bucketIndex(microseconds)];
+    ++m_count;
+    m_max = qMax(m_max, microseconds);
+}
+
+qint64 MatrixLatencyHistogram::percentile(double percent) const
+{
+    if (!m_count) {
+        return 0;
+    }
+    const quint64 rank = qMax<quint64>(1, static_cast<quint64>(std::ceil(m_count * percent / 100.0)));
+    quint64 seen = 0;
+    for (int i = 0; i < BucketCount; ++i) {
+        seen += m_buckets[i];
+        if (seen >= rank) {
+            return qMin(bucketUpperBound(i), m_max);
+        }
+    }
+    return m_max;
+}
+
+int MatrixLatencyHistogram::bucketIndex(qint64 microseconds)
+{
+    if (microseconds <= 1) {
+        return 0;
+    }
+    const int index = static_cast<int>(std::log2(static_cast<double>(microseconds)) * 4) + 1;
+    return qMin(index, BucketCount - 1);
+}
+
+qint64 MatrixLatencyHistogram::bucketUpperBound(int index)
+{
+    return static_cast<qint64>(std::ceil(std::exp2(index / 4.0)));
+}
+
+MatrixTracer::MatrixTracer()
+{
+    m_clock.start();
+
+    const QString traceFileName = qEnvironmentVariable("TANK_TRACE_FILE");
+    if (traceFileName.isEmpty()) {
+        return;
+    }
+    m_traceFile = new QFile(traceFileName);
+    if (!m_traceFile->open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << Q_FUNC_INFO << "Unable to open the trace file" << traceFileName;
+        delete m_traceFile;
+        m_traceFile = nullptr;
+        return;
+    }
+    // The trace viewers accept an unterminated array, so the file stays valid if the process is killed
+    m_traceFile->write("[\n");
+}
+
+MatrixTracer::~MatrixTracer()
+{
+    if (m_traceFile) {
+        m_traceFile->write("{}]\n");
+        m_traceFile->close();
+        delete m_traceFile;
+    }
+}
+
+void MatrixTracer::record(Stage stage, qint64 startTime, qint64 endTime)
+{
+    if (endTime < 0) {
+        endTime = now();
+    }
+    const qint64 duration = endTime - startTime;
+    m_histograms[static_cast<int>(stage)].record(duration);
+    if (m_traceFile) {
+        writeTraceEvent(stage, startTime, duration);
+    }
+}
+
+QVariantMap MatrixTracer::statistics() const
+{
+    QVariantMap result;
+    for (int i = 0; i < StageCount; ++i) {
+        const MatrixLatencyHistogram &histogram = m_histograms[i];
+        const QString prefix = QLatin1String("latency-") + stageName(static_cast<Stage>(i));
+        result.insert(prefix + QLatin1String("-count"), histogram.count());
+        result.insert(prefix + QLatin1String("-p50-us"), histogram.percentile(50));
+        result.insert(prefix + QLatin1String("-p99-us"), histogram.percentile(99));
+        result.insert(prefix + QLatin1String("-max-us"), histogram.max());
+    }
+    return result;
+}
+
+QString MatrixTracer::stageName(Stage stage)
+{
+    switch (stage) {
+    case Stage::SyncRequest:
+        return QStringLiteral("sync-request");
+    case Stage::ServerToSync:
+        return QStringLiteral("server-to-sync");
+    case Stage::SyncToEvents:
+        return QStringLiteral("sync-to-events");
+    case Stage::EventProcessing:
+        return QStringLiteral("event-processing");
+    case Stage::SyncToDBus:
+        return QStringLiteral("sync-to-dbus");
+    case Stage::SendToAccepted:
+        return QStringLiteral("send-to-accepted");
+    case Stage::SendToEcho:
+        return QStringLiteral("send-to-echo");
+    }
+    return QString();
+}
+
+void MatrixTracer::writeTraceEvent(Stage stage, qint64 startTime, qint64 duration)
+{
+    static const QByteArray pid = QByteArray::number(QCoreApplication::applicationPid());
+    QByteArray event = "{\"name\":\"" + stageName(stage).toLatin1() + "\",\"cat\":\"tank\",\"ph\":\"X\",\"ts\":"
+            + QByteArray::number(startTime) + ",\"dur\":" + QByteArray::number(duration)
+            + ",\"pid\":" + pid + ",\"tid\":" + QByteArray::number(static_cast<int>(stage) + 1) + "},\n";
+    m_traceFile->write(event);
+    if (++m_unflushedEvents >= 100) {
+        m_traceFile->flush();
+        m_unflushedEvents = 0;
+    }
+}
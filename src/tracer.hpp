@@ -0,0 +1,89 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_TRACER_HPP
+#define TANK_TRACER_HPP
+
+#include <QElapsedTimer>
+#include <QVariantMap>
+
+class QFile;
+
+// Latency histogram with quarter-octave buckets (about 19% resolution) from 1 us to 2^27 us
+class MatrixLatencyHistogram
+{
+public:
+    void record(qint64 microseconds);
+    // Returns the upper bound of the bucket with the given percentile (0..100)
+    qint64 percentile(double percent) const;
+    quint64 count() const { return m_count; }
+    qint64 max() const { return m_max; }
+
+protected:
+    static constexpr int BucketCount = 27 * 4 + 1;
+    static int bucketIndex(qint64 microseconds);
+    static qint64 bucketUpperBound(int index);
+
+    quint64 m_buckets[BucketCount] = {};
+    quint64 m_count = 0;
+    qint64 m_max = 0;
+};
+
+// Message latency tracing. Every span goes into the histogram of its stage and, if the TANK_TRACE_FILE
+// environment variable is set, into a trace file in the Chrome trace event format (chrome://tracing, Perfetto).
+class MatrixTracer
+{
+public:
+    enum class Stage {
+        SyncRequest,     // The sync long-poll request
+        ServerToSync,    // The event origin_server_ts to the sync response, live events only (subject to the clock skew)
+        SyncToEvents,    // The sync response to the room events handling (Quotient parsing)
+        EventProcessing, // processMessageEvent()
+        SyncToDBus,      // The sync response to the message signalled on the bus
+        SendToAccepted,  // sendMessage() to the homeserver response
+        SendToEcho,      // sendMessage() to the remote echo in a sync
+    };
+    static constexpr int StageCount = 7;
+
+    MatrixTracer();
+    ~MatrixTracer();
+    Q_DISABLE_COPY(MatrixTracer)
+
+    // Monotonic time in microseconds
+    qint64 now() const { return m_clock.nsecsElapsed() / 1000; }
+    void record(Stage stage, qint64 startTime, qint64 endTime = -1);
+
+    // The receive time of the sync being processed or -1
+    qint64 syncReceivedTime() const { return m_syncReceivedTime; }
+    void setSyncReceivedTime(qint64 time) { m_syncReceivedTime = time; }
+
+    QVariantMap statistics() const;
+
+protected:
+    static QString stageName(Stage stage);
+    void writeTraceEvent(Stage stage, qint64 startTime, qint64 duration);
+
+    QElapsedTimer m_clock;
+    MatrixLatencyHistogram m_histograms[StageCount];
+    qint64 m_syncReceivedTime = -1;
+    QFile *m_traceFile = nullptr;
+    int m_unflushedEvents = 0;
+};
+
+#endif // TANK_TRACER_HPP
@@ -0,0 +1,176 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "userdirectory.hpp"
+#include "connection.hpp"
+#include "requestscheduler.hpp"
+
+#include <QDebug>
+
+// Quotient
+#include <connection.h>
+#include <csapi/users.h>
+
+// How long the results of a query are reused
+static const int c_cacheLifetime = 30000;
+static const int c_maxCachedQueries = 32;
+
+MatrixUserDirectory::MatrixUserDirectory(MatrixConnection *connection)
+    : QObject(connection),
+      m_connection(connection)
+{
+}
+
+void MatrixUserDirectory::search(const QString &term, int limit, QObject *context, const Callback &callback)
+{
+    const QString key = normalizedTerm(term);
+    Reply cached;
+    if (lookup(key, limit, &cached)) {
+        callback(cached);
+        return;
+    }
+
+    if (!m_waiters.isEmpty() && (m_pendingTerm == key) && (m_pendingLimit >= limit)) {
+        m_waiters.append({ context, callback });
+        return;
+    }
+
+    // The user has typed further: the previous query is stale
+    abandonPending();
+
+    m_pendingTerm = key;
+    m_pendingLimit = limit;
+    m_waiters.append({ context, callback });
+
+    const QPointer<MatrixUserDirectory> directory = this;
+    const quint64 generation = ++m_generation;
+    Quotient::Connection *matrix = m_connection->matrix();
+    // A query still in the scheduler queue is replaced by the new one
+    m_connection->scheduler()->schedule(MatrixRequestScheduler::Priority::Directory, [directory, generation, matrix, key, limit]() -> Quotient::BaseJob * {
+        if (!directory || (directory->m_generation != generation)) {
+            return nullptr;
+        }
+        Quotient::SearchUserDirectoryJob *job = matrix->callApi<Quotient::SearchUserDirectoryJob>(key, limit);
+        directory->m_job = job;
+        connect(job, &Quotient::BaseJob::result, directory.data(), [directory, generation, job, key, limit]() {
+            if (directory->m_generation != generation) {
+                return;
+            }
+            Reply reply;
+            if (!job->status().good()) {
+                reply.error = job->errorString();
+                directory->finish(reply);
+                return;
+            }
+            for (const auto &result : job->results()) {
+                reply.users.append({ result.userId, result.displayName, result.avatarUrl });
+            }
+            reply.limited = job->limited();
+            directory->insert(key, limit, reply);
+            directory->finish(reply);
+        });
+        return job;
+    }, QStringLiteral("user-directory"));
+}
+
+void MatrixUserDirectory::cancel(QObject *context)
+{
+    for (int i = m_waiters.count() - 1; i >= 0; --i) {
+        if (!m_waiters.at(i).context || (m_waiters.at(i).context == context)) {
+            m_waiters.removeAt(i);
+        }
+    }
+    if (m_waiters.isEmpty()) {
+        abandonPending();
+    }
+}
+
+void MatrixUserDirectory::clear()
+{
+    abandonPending();
+    m_cache.clear();
+}
+
+QString MatrixUserDirectory::normalizedTerm(const QString &term)
+{
+    return term.simplified().toCaseFolded();
+}
+
+bool MatrixUserDirectory::lookup(const QString &term, int limit, Reply *reply)
+{
+    auto it = m_cache.find(term);
+    if (it == m_cache.end()) {
+        return false;
+    }
+    if (it->age.hasExpired(c_cacheLifetime)) {
+        m_cache.erase(it);
+        return false;
+    }
+    // A complete or a bigger result is good for a smaller limit as well
+    if ((it->limit < limit) && it->reply.limited) {
+        return false;
+    }
+    *reply = it->reply;
+    if (reply->users.count() > limit) {
+        reply->users = reply->users.mid(0, limit);
+        reply->limited = true;
+    }
+    return true;
+}
+
+void MatrixUserDirectory::insert(const QString &term, int limit, const Reply &reply)
+{
+    if ((m_cache.count() >= c_maxCachedQueries) && !m_cache.contains(term)) {
+        auto oldest = m_cache.begin();
+        for (auto it = m_cache.begin(); it != m_cache.end(); ++it) {
+            if (it->age.elapsed() > oldest->age.elapsed()) {
+                oldest = it;
+            }
+        }
+        m_cache.erase(oldest);
+    }
+    CacheEntry &entry = m_cache[term];
+    entry.limit = limit;
+    entry.reply = reply;
+    entry.age.start();
+}
+
+void MatrixUserDirectory::finish(const Reply &reply)
+{
+    const QList<Waiter> waiters = m_waiters;
+    m_waiters.clear();
+    m_pendingTerm.clear();
+    m_job.clear();
+    for (const Waiter &waiter : waiters) {
+        if (waiter.context) {
+            waiter.callback(reply);
+        }
+    }
+}
+
+void MatrixUserDirectory::abandonPending()
+{
+    ++m_generation;
+    if (m_job) {
+        m_job->abandon();
+    }
+    Reply reply;
+    reply.cancelled = true;
+    finish(reply);
+}
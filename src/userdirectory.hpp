@@ -0,0 +1,97 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_USER_DIRECTORY_HPP
+#define TANK_USER_DIRECTORY_HPP
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QObject>
+#include <QPointer>
+
+#include <functional>
+
+class MatrixConnection;
+
+namespace Quotient
+{
+
+class BaseJob;
+
+} // Quotient
+
+// Searches the homeserver user directory. The identical queries made in a short time are served
+// from a cache, and a new query supersedes the one still waiting for the reply.
+class MatrixUserDirectory : public QObject
+{
+    Q_OBJECT
+public:
+    struct User {
+        QString userId;
+        QString displayName;
+        QString avatarUrl;
+    };
+
+    struct Reply {
+        bool cancelled = false;
+        QString error; // Empty on success
+        QList<User> users;
+        bool limited = false; // There are more matching users
+    };
+
+    using Callback = std::function<void(const Reply &reply)>;
+
+    explicit MatrixUserDirectory(MatrixConnection *connection);
+
+    void search(const QString &term, int limit, QObject *context, const Callback &callback);
+    // Drops the callbacks of the context; the request is abandoned if nobody else waits for it
+    void cancel(QObject *context);
+    void clear();
+
+protected:
+    struct CacheEntry {
+        int limit = 0;
+        Reply reply;
+        QElapsedTimer age;
+    };
+
+    struct Waiter {
+        QPointer<QObject> context;
+        Callback callback;
+    };
+
+    static QString normalizedTerm(const QString &term);
+    bool lookup(const QString &term, int limit, Reply *reply);
+    void insert(const QString &term, int limit, const Reply &reply);
+    void finish(const Reply &reply);
+    void abandonPending();
+
+    MatrixConnection *m_connection = nullptr;
+    QHash<QString, CacheEntry> m_cache;
+
+    // The query waiting for the reply
+    QString m_pendingTerm;
+    int m_pendingLimit = 0;
+    QList<Waiter> m_waiters;
+    QPointer<Quotient::BaseJob> m_job;
+    quint64 m_generation = 0;
+};
+
+#endif // TANK_USER_DIRECTORY_HPP
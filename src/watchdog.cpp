@@ -0,0 +1,167 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "watchdog.hpp"
+
+#include <QCoreApplication>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QThread>
+#include <QTimer>
+
+static MatrixWatchdog *s_instance = nullptr;
+static std::atomic<const char *> s_currentLabel { nullptr };
+static QElapsedTimer s_clock;
+
+static const int c_minimumThreshold = 20; // ms
+
+static qint64 now()
+{
+    return s_clock.elapsed();
+}
+
+MatrixWatchdog::Scope::Scope(const char *label)
+    : m_previous(s_currentLabel.exchange(label, std::memory_order_relaxed))
+{
+}
+
+MatrixWatchdog::Scope::~Scope()
+{
+    s_currentLabel.store(m_previous, std::memory_order_relaxed);
+}
+
+MatrixWatchdog::MatrixWatchdog(int threshold)
+    : QObject(QCoreApplication::instance()),
+      m_threshold(threshold)
+{
+    s_clock.start();
+    m_lastBeat = now();
+
+    // The timer fires late exactly when the loop is stalled
+    m_heartbeatTimer = new QTimer(this);
+    m_heartbeatTimer->setInterval(m_threshold / 4);
+    connect(m_heartbeatTimer, &QTimer::timeout, this, &MatrixWatchdog::beat);
+    m_heartbeatTimer->start();
+
+    m_monitorThread = QThread::create([this]() { monitor(); });
+    m_monitorThread->setObjectName(QStringLiteral("tank-watchdog"));
+    m_monitorThread->start(QThread::HighPriority);
+}
+
+MatrixWatchdog::~MatrixWatchdog()
+{
+    m_monitorThread->requestInterruption();
+    m_monitorThread->wait();
+    delete m_monitorThread;
+    if (s_instance == this) {
+        s_instance = nullptr;
+    }
+}
+
+void MatrixWatchdog::startFromEnvironment()
+{
+    if (s_instance) {
+        return;
+    }
+    const int threshold = qEnvironmentVariableIntValue("TANK_WATCHDOG_MS");
+    if (threshold <= 0) {
+        return;
+    }
+    s_instance = new MatrixWatchdog(qMax(threshold, c_minimumThreshold));
+    qDebug() << Q_FUNC_INFO << "Reporting the event loop stalls over" << s_instance->threshold() << "ms";
+}
+
+MatrixWatchdog *MatrixWatchdog::instance()
+{
+    return s_instance;
+}
+
+QVariantMap MatrixWatchdog::statistics() const
+{
+    QMutexLocker locker(&m_statsMutex);
+    QVariantMap result;
+    result.insert(QStringLiteral("stall-threshold-ms"), m_threshold);
+    result.insert(QStringLiteral("stalls"), m_total.count);
+    result.insert(QStringLiteral("stall-total-ms"), m_total.totalTime);
+    result.insert(QStringLiteral("stall-max-ms"), m_total.maxTime);
+    for (auto it = m_stalls.cbegin(); it != m_stalls.cend(); ++it) {
+        const QString prefix = QStringLiteral("stall:") + it.key();
+        result.insert(prefix + QStringLiteral("-count"), it.value().count);
+        result.insert(prefix + QStringLiteral("-total-ms"), it.value().totalTime);
+        result.insert(prefix + QStringLiteral("-max-ms"), it.value().maxTime);
+    }
+    return result;
+}
+
+QString MatrixWatchdog::labelName(const char *label)
+{
+    if (!label) {
+        return QStringLiteral("unknown");
+    }
+    // "void MatrixConnection::onSyncDone()" -> "MatrixConnection::onSyncDone"
+    QString name = QString::fromLatin1(label);
+    name.truncate(name.indexOf(QLatin1Char('(')));
+    return name.mid(name.lastIndexOf(QLatin1Char(' ')) + 1);
+}
+
+void MatrixWatchdog::beat()
+{
+    m_lastBeat.store(now());
+}
+
+void MatrixWatchdog::monitor()
+{
+    const int pollInterval = m_threshold / 4;
+    qint64 stalledBeat = -1; // The last beat before the stall being reported
+    QString stalledLabel;
+
+    while (!QThread::currentThread()->isInterruptionRequested()) {
+        QThread::msleep(pollInterval);
+        const qint64 lastBeat = m_lastBeat.load();
+        const qint64 current = now();
+
+        if (stalledBeat >= 0) {
+            if (lastBeat == stalledBeat) {
+                continue;
+            }
+            // The loop is back; the gap is the stall minus the regular beat interval
+            const qint64 duration = qMax<qint64>(0, lastBeat - stalledBeat - pollInterval);
+            qWarning() << "Event loop stall of" << duration << "ms in" << stalledLabel;
+            recordStall(stalledLabel, duration);
+            stalledBeat = -1;
+            continue;
+        }
+
+        if (current - lastBeat > m_threshold) {
+            stalledBeat = lastBeat;
+            stalledLabel = labelName(s_currentLabel.load(std::memory_order_relaxed));
+            qWarning() << "Event loop stalled for" << current - lastBeat << "ms, running" << stalledLabel;
+        }
+    }
+}
+
+void MatrixWatchdog::recordStall(const QString &label, qint64 duration)
+{
+    QMutexLocker locker(&m_statsMutex);
+    for (StallStats *stats : { &m_stalls[label], &m_total }) {
+        ++stats->count;
+        stats->totalTime += duration;
+        stats->maxTime = qMax(stats->maxTime, duration);
+    }
+}
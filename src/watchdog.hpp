@@ -0,0 +1,87 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_WATCHDOG_HPP
+#define TANK_WATCHDOG_HPP
+
+#include <QHash>
+#include <QMutex>
+#include <QObject>
+#include <QVariantMap>
+
+#include <atomic>
+
+class QThread;
+class QTimer;
+
+// Event loop stall watchdog. The loop of the main thread beats a heartbeat, and a monitor thread reports
+// (while it is still happening) any gap longer than the threshold together with the handler that runs,
+// as marked with TANK_WATCHDOG_SCOPE(). Enabled with the TANK_WATCHDOG_MS environment variable.
+class MatrixWatchdog : public QObject
+{
+    Q_OBJECT
+public:
+    // Marks the running handler; nests, the innermost one is reported
+    class Scope
+    {
+    public:
+        explicit Scope(const char *label);
+        ~Scope();
+        Q_DISABLE_COPY(Scope)
+
+    protected:
+        const char *m_previous;
+    };
+
+    ~MatrixWatchdog() override;
+
+    // Starts the process-wide watchdog if it is configured; call from the thread of the main loop
+    static void startFromEnvironment();
+    // Returns the watchdog or nullptr if it is not enabled
+    static MatrixWatchdog *instance();
+
+    int threshold() const { return m_threshold; }
+    QVariantMap statistics() const;
+
+protected:
+    struct StallStats {
+        quint64 count = 0;
+        qint64 totalTime = 0; // ms
+        qint64 maxTime = 0; // ms
+    };
+
+    explicit MatrixWatchdog(int threshold);
+    static QString labelName(const char *label);
+    void beat();
+    void monitor();
+    void recordStall(const QString &label, qint64 duration);
+
+    const int m_threshold; // ms
+    QTimer *m_heartbeatTimer = nullptr;
+    QThread *m_monitorThread = nullptr;
+    std::atomic<qint64> m_lastBeat { 0 };
+
+    mutable QMutex m_statsMutex;
+    QHash<QString, StallStats> m_stalls;
+    StallStats m_total;
+};
+
+#define TANK_WATCHDOG_SCOPE() MatrixWatchdog::Scope watchdogScope(Q_FUNC_INFO)
+
+#endif // TANK_WATCHDOG_HPP
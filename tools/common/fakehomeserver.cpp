@@ -0,0 +1,518 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "fakehomeserver.hpp"
+#include "probe.hpp"
+
+#include <QDateTime>
+#include <QDebug>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QRegularExpression>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTimer>
+
+static const int c_tickInterval = 20; // ms
+static const int c_maxEventsPerSync = 500;
+static const QString c_serverName = QStringLiteral("localhost");
+
+// A 1x1 PNG for the media downloads and thumbnails
+static const char c_pixel[] = "iVBORw0KGgoAAAANSUhEUgAAAAEAAAABCAYAAAAfFcSJAAAADUlEQVR42mNkYPhfDwAChwGA60e6kgAAAABJRU5ErkJggg==";
+
+FakeHomeserver::FakeHomeserver(const Config &config, QObject *parent)
+    : QObject(parent),
+      m_config(config)
+{
+}
+
+FakeHomeserver::~FakeHomeserver()
+{
+    stop();
+}
+
+QString FakeHomeserver::userId()
+{
+    return QStringLiteral("@loadtest:") + c_serverName;
+}
+
+QString FakeHomeserver::roomId(int index)
+{
+    return QStringLiteral("!room%1:").arg(index) + c_serverName;
+}
+
+QString FakeHomeserver::memberId(int index)
+{
+    return QStringLiteral("@user%1:").arg(index) + c_serverName;
+}
+
+QUrl FakeHomeserver::url() const
+{
+    return QUrl(QStringLiteral("http://127.0.0.1:%1").arg(m_port));
+}
+
+bool FakeHomeserver::listen()
+{
+    if (!m_config.replayFile.isEmpty() && !loadReplay()) {
+        return false;
+    }
+    m_server = new QTcpServer(this);
+    connect(m_server, &QTcpServer::newConnection, this, &FakeHomeserver::onNewConnection);
+    if (!m_server->listen(QHostAddress::LocalHost)) {
+        qWarning() << Q_FUNC_INFO << "Unable to listen:" << m_server->errorString();
+        return false;
+    }
+    m_port = m_server->serverPort();
+
+    // The timer also expires the held syncs, so it runs before the load starts
+    m_tickTimer = new QTimer(this);
+    m_tickTimer->setInterval(c_tickInterval);
+    connect(m_tickTimer, &QTimer::timeout, this, &FakeHomeserver::onTick);
+    m_tickTimer->start();
+    return true;
+}
+
+void FakeHomeserver::start()
+{
+    m_running = true;
+    m_lastTick = monotonicMicroseconds();
+    m_messageBudget = 0;
+}
+
+void FakeHomeserver::stop()
+{
+    m_running = false;
+}
+
+QVariantMap FakeHomeserver::statistics() const
+{
+    QVariantMap result;
+    result.insert(QStringLiteral("syncs"), m_syncCount);
+    result.insert(QStringLiteral("dropped-syncs"), m_droppedSyncs);
+    result.insert(QStringLiteral("generated-messages"), m_generatedMessages);
+    result.insert(QStringLiteral("replayed-syncs"), m_replay.isEmpty() ? 0 : qMax(0, m_replayPosition - 1));
+    for (auto it = m_requestCounts.cbegin(); it != m_requestCounts.cend(); ++it) {
+        result.insert(QStringLiteral("requests-") + it.key(), it.value());
+    }
+    result.insert(QStringLiteral("send-count"), m_sendLatency.count());
+    result.insert(QStringLiteral("send-p50-us"), m_sendLatency.percentile(50));
+    result.insert(QStringLiteral("send-p99-us"), m_sendLatency.percentile(99));
+    result.insert(QStringLiteral("send-max-us"), m_sendLatency.max());
+    return result;
+}
+
+void FakeHomeserver::onNewConnection()
+{
+    while (QTcpSocket *socket = m_server->nextPendingConnection()) {
+        connect(socket, &QTcpSocket::readyRead, this, [this, socket]() {
+            onReadyRead(socket);
+        });
+        connect(socket, &QTcpSocket::disconnected, this, [this, socket]() {
+            m_buffers.remove(socket);
+            socket->deleteLater();
+        });
+    }
+}
+
+void FakeHomeserver::onReadyRead(QTcpSocket *socket)
+{
+    QByteArray &buffer = m_buffers[socket];
+    buffer.append(socket->readAll());
+
+    while (true) {
+        const int headerEnd = buffer.indexOf("\r\n\r\n");
+        if (headerEnd < 0) {
+            return;
+        }
+        const QList<QByteArray> lines = buffer.left(headerEnd).split('\n');
+        const QList<QByteArray> requestLine = lines.first().trimmed().split(' ');
+        if (requestLine.count() < 2) {
+            socket->abort();
+            return;
+        }
+        int contentLength = 0;
+        for (int i = 1; i < lines.count(); ++i) {
+            const int colon = lines.at(i).indexOf(':');
+            if ((colon > 0) && (lines.at(i).left(colon).trimmed().toLower() == "content-length")) {
+                contentLength = lines.at(i).mid(colon + 1).trimmed().toInt();
+            }
+        }
+        if (buffer.size() < headerEnd + 4 + contentLength) {
+            return;
+        }
+
+        HttpRequest request;
+        request.method = requestLine.at(0);
+        const QUrl target(QString::fromLatin1(requestLine.at(1)));
+        request.path = target.path(QUrl::FullyDecoded);
+        request.query = QUrlQuery(target);
+        request.body = buffer.mid(headerEnd + 4, contentLength);
+        buffer.remove(0, headerEnd + 4 + contentLength);
+
+        handleRequest(socket, request);
+        if (socket->state() != QAbstractSocket::ConnectedState) {
+            return;
+        }
+    }
+}
+
+void FakeHomeserver::onTick()
+{
+    const qint64 now = monotonicMicroseconds();
+    if (m_running) {
+        if (!m_replay.isEmpty()) {
+            m_messageBudget += m_config.replayedSyncsPerSecond * (now - m_lastTick) / 1000000.0;
+            while ((m_messageBudget >= 1) && (m_replayPosition < m_replay.count())) {
+                m_messageBudget -= 1;
+                m_log.append(LogEntry { QString(), m_replay.at(m_replayPosition++) });
+            }
+        } else if (m_config.rooms > 0) {
+            m_messageBudget += m_config.messagesPerSecond * (now - m_lastTick) / 1000000.0;
+            while (m_messageBudget >= 1) {
+                m_messageBudget -= 1;
+                const int room = m_generatedMessages % m_config.rooms;
+                const int member = (m_generatedMessages / m_config.rooms) % qMax(1, m_config.membersPerRoom);
+                const QString sender = memberId(room * m_config.membersPerRoom + member);
+                appendEvent(roomId(room), messageEvent(sender, makeProbe(m_generatedMessages)));
+                ++m_generatedMessages;
+            }
+        }
+    }
+    m_lastTick = now;
+    answerPendingSyncs();
+}
+
+void FakeHomeserver::handleRequest(QTcpSocket *socket, const HttpRequest &request)
+{
+    static const QRegularExpression clientApi(QStringLiteral("^/_matrix/client/(?:r0|v3)(/.*)$"));
+    static const QRegularExpression sendPath(QStringLiteral("^/rooms/([^/]+)/send/([^/]+)/([^/]+)$"));
+    static const QRegularExpression typingPath(QStringLiteral("^/rooms/([^/]+)/typing/"));
+    static const QRegularExpression receiptPath(QStringLiteral("^/rooms/([^/]+)/(receipt|read_markers)"));
+    static const QRegularExpression profilePath(QStringLiteral("^/profile/([^/]+)"));
+    static const QRegularExpression mediaApi(QStringLiteral("^/_matrix/media/(?:r0|v3)/(download|thumbnail|upload)"));
+
+    if (request.path == QLatin1String("/_matrix/client/versions")) {
+        count(QStringLiteral("versions"));
+        replyJson(socket, QJsonObject {
+                      { QStringLiteral("versions"), QJsonArray { QStringLiteral("r0.5.0"), QStringLiteral("r0.6.0") } },
+                  });
+        return;
+    }
+
+    const QRegularExpressionMatch media = mediaApi.match(request.path);
+    if (media.hasMatch()) {
+        const QString kind = media.captured(1);
+        count(QStringLiteral("media-") + kind);
+        if (kind == QLatin1String("upload")) {
+            replyJson(socket, QJsonObject {
+                          { QStringLiteral("content_uri"), QStringLiteral("mxc://%1/upload%2").arg(c_serverName).arg(++m_nextEventId) },
+                      });
+        } else {
+            reply(socket, 200, QByteArray::fromBase64(c_pixel), QByteArrayLiteral("image/png"));
+        }
+        return;
+    }
+
+    const QRegularExpressionMatch client = clientApi.match(request.path);
+    if (!client.hasMatch()) {
+        count(QStringLiteral("unknown"));
+        reply(socket, 404, QByteArrayLiteral("{\"errcode\":\"M_UNRECOGNIZED\"}"));
+        return;
+    }
+    const QString path = client.captured(1);
+
+    if (path == QLatin1String("/sync")) {
+        handleSync(socket, request);
+        return;
+    }
+    if (path == QLatin1String("/login")) {
+        count(QStringLiteral("login"));
+        if (request.method == "GET") {
+            replyJson(socket, QJsonObject {
+                          { QStringLiteral("flows"), QJsonArray { QJsonObject { { QStringLiteral("type"), QStringLiteral("m.login.password") } } } },
+                      });
+        } else {
+            replyJson(socket, QJsonObject {
+                          { QStringLiteral("user_id"), userId() },
+                          { QStringLiteral("access_token"), QStringLiteral("loadtest-token") },
+                          { QStringLiteral("device_id"), QStringLiteral("LOADTEST") },
+                          { QStringLiteral("home_server"), c_serverName },
+                      });
+        }
+        return;
+    }
+
+    QRegularExpressionMatch match = sendPath.match(path);
+    if (match.hasMatch() && (request.method == "PUT")) {
+        handleSend(socket, match.captured(1), match.captured(2), match.captured(3), request.body);
+        return;
+    }
+    if (typingPath.match(path).hasMatch()) {
+        count(QStringLiteral("typing"));
+    } else if ((match = receiptPath.match(path)).hasMatch()) {
+        count(QStringLiteral("receipt"));
+    } else if (path.startsWith(QLatin1String("/presence/"))) {
+        count(QStringLiteral("presence"));
+    } else if ((match = profilePath.match(path)).hasMatch()) {
+        count(QStringLiteral("profile"));
+        replyJson(socket, QJsonObject {
+                      { QStringLiteral("displayname"), match.captured(1).mid(1).section(QLatin1Char(':'), 0, 0) },
+                  });
+        return;
+    } else {
+        count(QStringLiteral("other"));
+    }
+    replyJson(socket, QJsonObject());
+}
+
+void FakeHomeserver::handleSync(QTcpSocket *socket, const HttpRequest &request)
+{
+    ++m_syncCount;
+    count(QStringLiteral("sync"));
+    if ((m_config.dropEvery > 0) && ((m_syncCount % m_config.dropEvery) == 0)) {
+        ++m_droppedSyncs;
+        socket->abort();
+        return;
+    }
+
+    const QString since = request.query.queryItemValue(QStringLiteral("since"));
+    if (since.isEmpty()) {
+        replyJson(socket, initialSync());
+        return;
+    }
+
+    const quint64 position = since.mid(1).toULongLong();
+    // Everything before the token is known to the client now
+    const int known = qMin<quint64>(position - qMin(position, m_logOffset), m_log.count());
+    m_log.remove(0, known);
+    m_logOffset += known;
+
+    if (answerSync(socket, position, false)) {
+        return;
+    }
+    const int timeout = request.query.queryItemValue(QStringLiteral("timeout")).toInt();
+    PendingSync pending;
+    pending.socket = socket;
+    pending.since = position;
+    pending.deadline = monotonicMicroseconds() + qint64(timeout) * 1000;
+    m_pendingSyncs.append(pending);
+}
+
+void FakeHomeserver::handleSend(QTcpSocket *socket, const QString &roomId, const QString &type,
+                                const QString &txnId, const QByteArray &body)
+{
+    count(QStringLiteral("send"));
+    m_sentTransactions.append(txnId);
+    const QJsonObject content = QJsonDocument::fromJson(body).object();
+    const qint64 probe = probeTime(content.value(QLatin1String("body")).toString());
+    if (probe >= 0) {
+        m_sendLatency.record(monotonicMicroseconds() - probe);
+    }
+
+    const QString eventId = QStringLiteral("$event%1:").arg(++m_nextEventId) + c_serverName;
+    QJsonObject event {
+        { QStringLiteral("type"), type },
+        { QStringLiteral("event_id"), eventId },
+        { QStringLiteral("sender"), userId() },
+        { QStringLiteral("origin_server_ts"), QDateTime::currentMSecsSinceEpoch() },
+        { QStringLiteral("content"), content },
+        { QStringLiteral("unsigned"), QJsonObject { { QStringLiteral("transaction_id"), txnId } } },
+    };
+    appendEvent(roomId, event);
+    replyJson(socket, QJsonObject { { QStringLiteral("event_id"), eventId } });
+}
+
+void FakeHomeserver::answerPendingSyncs()
+{
+    const qint64 now = monotonicMicroseconds();
+    for (int i = m_pendingSyncs.count() - 1; i >= 0; --i) {
+        const PendingSync &pending = m_pendingSyncs.at(i);
+        if (!pending.socket || (pending.socket->state() != QAbstractSocket::ConnectedState)) {
+            m_pendingSyncs.remove(i);
+            continue;
+        }
+        const bool expired = pending.deadline <= now;
+        if (answerSync(pending.socket, pending.since, expired)) {
+            m_pendingSyncs.remove(i);
+        }
+    }
+}
+
+bool FakeHomeserver::answerSync(QTcpSocket *socket, quint64 since, bool evenIfEmpty)
+{
+    const int start = qMax<qint64>(0, qint64(since) - qint64(m_logOffset));
+    if ((start >= m_log.count()) && !evenIfEmpty) {
+        return false;
+    }
+
+    if ((start < m_log.count()) && m_log.at(start).roomId.isEmpty()) {
+        QJsonObject recorded = m_log.at(start).data;
+        recorded.insert(QStringLiteral("next_batch"), QStringLiteral("s%1").arg(m_logOffset + start + 1));
+        replyJson(socket, recorded);
+        return true;
+    }
+
+    QHash<QString, QJsonArray> timelines;
+    int end = start;
+    while ((end < m_log.count()) && (end - start < c_maxEventsPerSync) && !m_log.at(end).roomId.isEmpty()) {
+        timelines[m_log.at(end).roomId].append(m_log.at(end).data);
+        ++end;
+    }
+    QJsonObject join;
+    for (auto it = timelines.cbegin(); it != timelines.cend(); ++it) {
+        join.insert(it.key(), QJsonObject {
+                        { QStringLiteral("timeline"), QJsonObject {
+                              { QStringLiteral("events"), it.value() },
+                              { QStringLiteral("limited"), false },
+                          } },
+                    });
+    }
+    replyJson(socket, QJsonObject {
+                  { QStringLiteral("next_batch"), QStringLiteral("s%1").arg(m_logOffset + end) },
+                  { QStringLiteral("rooms"), QJsonObject { { QStringLiteral("join"), join } } },
+              });
+    return true;
+}
+
+QJsonObject FakeHomeserver::initialSync() const
+{
+    const QString nextBatch = QStringLiteral("s%1").arg(m_logOffset + m_log.count());
+    if (!m_replay.isEmpty()) {
+        QJsonObject recorded = m_replay.first();
+        recorded.insert(QStringLiteral("next_batch"), nextBatch);
+        return recorded;
+    }
+
+    QJsonObject join;
+    for (int i = 0; i < m_config.rooms; ++i) {
+        join.insert(roomId(i), roomState(i));
+    }
+    return QJsonObject {
+        { QStringLiteral("next_batch"), nextBatch },
+        { QStringLiteral("rooms"), QJsonObject { { QStringLiteral("join"), join } } },
+    };
+}
+
+QJsonObject FakeHomeserver::roomState(int index) const
+{
+    const qint64 timestamp = QDateTime::currentMSecsSinceEpoch();
+    auto stateEvent = [timestamp](const QString &type, const QString &sender, const QString &stateKey,
+            const QJsonObject &content, const QString &eventId) {
+        return QJsonObject {
+            { QStringLiteral("type"), type },
+            { QStringLiteral("event_id"), eventId },
+            { QStringLiteral("sender"), sender },
+            { QStringLiteral("state_key"), stateKey },
+            { QStringLiteral("origin_server_ts"), timestamp },
+            { QStringLiteral("content"), content },
+        };
+    };
+    auto joined = [](const QString &displayName) {
+        return QJsonObject {
+            { QStringLiteral("membership"), QStringLiteral("join") },
+            { QStringLiteral("displayname"), displayName },
+        };
+    };
+
+    const QString prefix = QStringLiteral("$state%1-").arg(index);
+    QJsonArray state;
+    state.append(stateEvent(QStringLiteral("m.room.create"), userId(), QString(),
+                            QJsonObject { { QStringLiteral("creator"), userId() } }, prefix + QStringLiteral("create")));
+    state.append(stateEvent(QStringLiteral("m.room.name"), userId(), QString(),
+                            QJsonObject { { QStringLiteral("name"), QStringLiteral("Room %1").arg(index) } }, prefix + QStringLiteral("name")));
+    state.append(stateEvent(QStringLiteral("m.room.member"), userId(), userId(),
+                            joined(QStringLiteral("Load Test")), prefix + QStringLiteral("self")));
+    for (int i = 0; i < m_config.membersPerRoom; ++i) {
+        const QString member = memberId(index * m_config.membersPerRoom + i);
+        state.append(stateEvent(QStringLiteral("m.room.member"), member, member,
+                                joined(member.mid(1).section(QLatin1Char(':'), 0, 0)), prefix + QString::number(i)));
+    }
+    return QJsonObject {
+        { QStringLiteral("state"), QJsonObject { { QStringLiteral("events"), state } } },
+        { QStringLiteral("timeline"), QJsonObject {
+              { QStringLiteral("events"), QJsonArray() },
+              { QStringLiteral("limited"), false },
+          } },
+    };
+}
+
+QJsonObject FakeHomeserver::messageEvent(const QString &sender, const QString &body)
+{
+    return QJsonObject {
+        { QStringLiteral("type"), QStringLiteral("m.room.message") },
+        { QStringLiteral("event_id"), QStringLiteral("$event%1:").arg(++m_nextEventId) + c_serverName },
+        { QStringLiteral("sender"), sender },
+        { QStringLiteral("origin_server_ts"), QDateTime::currentMSecsSinceEpoch() },
+        { QStringLiteral("content"), QJsonObject {
+              { QStringLiteral("msgtype"), QStringLiteral("m.text") },
+              { QStringLiteral("body"), body },
+          } },
+    };
+}
+
+void FakeHomeserver::appendEvent(const QString &roomId, const QJsonObject &event)
+{
+    m_log.append(LogEntry { roomId, event });
+}
+
+bool FakeHomeserver::loadReplay()
+{
+    QFile file(m_config.replayFile);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qWarning() << Q_FUNC_INFO << "Unable to open" << m_config.replayFile;
+        return false;
+    }
+    while (!file.atEnd()) {
+        const QByteArray line = file.readLine().trimmed();
+        if (line.isEmpty()) {
+            continue;
+        }
+        QJsonParseError error;
+        const QJsonDocument document = QJsonDocument::fromJson(line, &error);
+        if (!document.isObject()) {
+            qWarning() << Q_FUNC_INFO << "Invalid sync response at" << m_replay.count() + 1 << error.errorString();
+            return false;
+        }
+        m_replay.append(document.object());
+    }
+    // The first response is the initial sync
+    m_replayPosition = 1;
+    return !m_replay.isEmpty();
+}
+
+void FakeHomeserver::reply(QTcpSocket *socket, int status, const QByteArray &body, const QByteArray &contentType)
+{
+    QByteArray response = "HTTP/1.1 " + QByteArray::number(status)
+            + (status == 200 ? " OK" : " Error") + "\r\nContent-Type: " + contentType
+            + "\r\nContent-Length: " + QByteArray::number(body.size())
+            + "\r\nConnection: keep-alive\r\n\r\n";
+    response.append(body);
+    socket->write(response);
+}
+
+void FakeHomeserver::replyJson(QTcpSocket *socket, const QJsonObject &object, int status)
+{
+    reply(socket, status, QJsonDocument(object).toJson(QJsonDocument::Compact));
+}
+
+void FakeHomeserver::count(const QString &endpoint)
+{
+    ++m_requestCounts[endpoint];
+}
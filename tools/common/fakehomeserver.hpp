@@ -0,0 +1,140 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_TOOLS_FAKEHOMESERVER_HPP
+#define TANK_TOOLS_FAKEHOMESERVER_HPP
+
+#include <QHash>
+#include <QJsonObject>
+#include <QObject>
+#include <QPointer>
+#include <QStringList>
+#include <QUrl>
+#include <QUrlQuery>
+#include <QVector>
+
+#include "tracer.hpp"
+
+class QTcpServer;
+class QTcpSocket;
+class QTimer;
+
+// A local stand-in for a Matrix homeserver: just enough of the client-server API (login, sync, send,
+// typing, receipts, profiles, media) for a connection to run against it. The sync stream is either
+// synthetic (rooms with members and a configured message rate) or replayed from a recording.
+// Everything runs in the thread the object lives in, so it can be kept off the measured thread.
+class FakeHomeserver : public QObject
+{
+    Q_OBJECT
+public:
+    struct Config {
+        int rooms = 10;
+        int membersPerRoom = 20;
+        int messagesPerSecond = 100;
+        // A file with one recorded /sync response per line; the first one is served as the initial sync
+        QString replayFile;
+        int replayedSyncsPerSecond = 10;
+        // Abort the connection instead of answering every N-th sync (0 to never)
+        int dropEvery = 0;
+    };
+
+    explicit FakeHomeserver(const Config &config, QObject *parent = nullptr);
+    ~FakeHomeserver() override;
+
+    static QString userId();
+    static QString roomId(int index);
+    static QString memberId(int index);
+
+    QUrl url() const;
+
+public slots:
+    bool listen();
+    void start();
+    void stop();
+    QVariantMap statistics() const;
+    // The transaction ids of the accepted sends, in order of arrival
+    QStringList sentTransactions() const { return m_sentTransactions; }
+
+protected:
+    struct HttpRequest {
+        QByteArray method;
+        QString path;
+        QUrlQuery query;
+        QByteArray body;
+    };
+
+    struct LogEntry {
+        QString roomId; // Empty for a recorded response
+        QJsonObject data; // The timeline event or the recorded response
+    };
+
+    struct PendingSync {
+        QPointer<QTcpSocket> socket;
+        quint64 since = 0;
+        qint64 deadline = 0; // monotonicMicroseconds()
+    };
+
+    void onNewConnection();
+    void onReadyRead(QTcpSocket *socket);
+    void onTick();
+
+    void handleRequest(QTcpSocket *socket, const HttpRequest &request);
+    void handleSync(QTcpSocket *socket, const HttpRequest &request);
+    void handleSend(QTcpSocket *socket, const QString &roomId, const QString &type, const QString &txnId,
+                    const QByteArray &body);
+    void answerPendingSyncs();
+    bool answerSync(QTcpSocket *socket, quint64 since, bool evenIfEmpty);
+
+    QJsonObject initialSync() const;
+    QJsonObject roomState(int index) const;
+    QJsonObject messageEvent(const QString &sender, const QString &body);
+    void appendEvent(const QString &roomId, const QJsonObject &event);
+    bool loadReplay();
+
+    static void reply(QTcpSocket *socket, int status, const QByteArray &body,
+                      const QByteArray &contentType = QByteArrayLiteral("application/json"));
+    static void replyJson(QTcpSocket *socket, const QJsonObject &object, int status = 200);
+    void count(const QString &endpoint);
+
+    Config m_config;
+    QTcpServer *m_server = nullptr;
+    quint16 m_port = 0;
+    QTimer *m_tickTimer = nullptr;
+    QHash<QTcpSocket *, QByteArray> m_buffers;
+    QVector<PendingSync> m_pendingSyncs;
+
+    QVector<LogEntry> m_log;
+    quint64 m_logOffset = 0; // The position of m_log.first() in the stream
+    QVector<QJsonObject> m_replay;
+    int m_replayPosition = 0;
+
+    bool m_running = false;
+    qint64 m_lastTick = 0;
+    double m_messageBudget = 0;
+    quint64 m_nextEventId = 0;
+    quint64 m_generatedMessages = 0;
+
+    quint64 m_syncCount = 0;
+    quint64 m_droppedSyncs = 0;
+    QHash<QString, quint64> m_requestCounts;
+    QStringList m_sentTransactions;
+    MatrixLatencyHistogram m_sendLatency; // Probe creation to the send request
+};
+
+#endif // TANK_TOOLS_FAKEHOMESERVER_HPP
@@ -0,0 +1,66 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "privatebus.hpp"
+
+#include <QDebug>
+
+static const int c_startTimeout = 5000; // ms
+
+PrivateBus::~PrivateBus()
+{
+    stop();
+}
+
+bool PrivateBus::start(QString *errorMessage)
+{
+    m_daemon.setProcessChannelMode(QProcess::SeparateChannels);
+    m_daemon.start(QStringLiteral("dbus-daemon"), {
+                       QStringLiteral("--session"),
+                       QStringLiteral("--nofork"),
+                       QStringLiteral("--print-address"),
+                   });
+    if (!m_daemon.waitForStarted(c_startTimeout)) {
+        *errorMessage = QStringLiteral("Unable to start dbus-daemon: ") + m_daemon.errorString();
+        return false;
+    }
+    while (!m_daemon.canReadLine()) {
+        if (!m_daemon.waitForReadyRead(c_startTimeout)) {
+            *errorMessage = QStringLiteral("dbus-daemon did not report its address");
+            stop();
+            return false;
+        }
+    }
+    m_address = QString::fromLocal8Bit(m_daemon.readLine().trimmed());
+    qputenv("DBUS_SESSION_BUS_ADDRESS", m_address.toLocal8Bit());
+    qDebug() << Q_FUNC_INFO << "Started at" << m_address;
+    return true;
+}
+
+void PrivateBus::stop()
+{
+    if (m_daemon.state() == QProcess::NotRunning) {
+        return;
+    }
+    m_daemon.terminate();
+    if (!m_daemon.waitForFinished(c_startTimeout)) {
+        m_daemon.kill();
+        m_daemon.waitForFinished();
+    }
+}
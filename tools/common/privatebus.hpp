@@ -0,0 +1,45 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_TOOLS_PRIVATEBUS_HPP
+#define TANK_TOOLS_PRIVATEBUS_HPP
+
+#include <QProcess>
+
+// A dbus-daemon owned by the tool, so the measurements do not depend on (and do not disturb) the user session
+class PrivateBus
+{
+public:
+    PrivateBus() = default;
+    ~PrivateBus();
+    Q_DISABLE_COPY(PrivateBus)
+
+    // Starts the daemon and makes it the session bus of the process.
+    // Must be called before anything touches QDBusConnection::sessionBus().
+    bool start(QString *errorMessage);
+    void stop();
+
+    QString address() const { return m_address; }
+
+protected:
+    QProcess m_daemon;
+    QString m_address;
+};
+
+#endif // TANK_TOOLS_PRIVATEBUS_HPP
@@ -0,0 +1,56 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_TOOLS_PROBE_HPP
+#define TANK_TOOLS_PROBE_HPP
+
+#include <QString>
+#include <QStringList>
+
+#include <chrono>
+
+// Monotonic time in microseconds, consistent between the threads of a tool
+inline qint64 monotonicMicroseconds()
+{
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// A probe is a message body carrying its creation time, to measure the latency wherever it is seen
+inline QString makeProbe(quint64 sequence)
+{
+    return QStringLiteral("probe %1 %2").arg(sequence).arg(monotonicMicroseconds());
+}
+
+// Returns the creation time of the probe or -1 if the body is not a probe
+inline qint64 probeTime(const QString &body)
+{
+    if (!body.startsWith(QLatin1String("probe "))) {
+        return -1;
+    }
+    const QStringList parts = body.split(QLatin1Char(' '));
+    if (parts.count() != 3) {
+        return -1;
+    }
+    bool ok = false;
+    const qint64 time = parts.at(2).toLongLong(&ok);
+    return ok ? time : -1;
+}
+
+#endif // TANK_TOOLS_PROBE_HPP
@@ -0,0 +1,329 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "benchclient.hpp"
+#include "fakehomeserver.hpp"
+#include "probe.hpp"
+#include "statisticsinterface.hpp"
+
+#include <TelepathyQt/Constants>
+#include <TelepathyQt/Types>
+
+#include <QDBusObjectPath>
+#include <QDBusPendingCallWatcher>
+#include <QDBusReply>
+#include <QDebug>
+#include <QEventLoop>
+#include <QTimer>
+
+#include <algorithm>
+
+static const int c_callTimeout = 10 * 60 * 1000; // ms, generous for the largest rosters
+static const int c_connectTimeout = 10 * 60 * 1000; // ms, includes the initial sync
+static const int c_handleBatchSize = 1000;
+static const int c_attributesBatchSize = 100;
+static const int c_drainTime = 1000; // ms
+
+BenchClient::BenchClient(const QString &busAddress, const QVariantMap &accountParameters, const Config &config,
+                         QObject *server, QObject *parent)
+    : QObject(parent),
+      m_busAddress(busAddress),
+      m_accountParameters(accountParameters),
+      m_config(config),
+      m_server(server),
+      m_bus(QString())
+{
+}
+
+void BenchClient::run()
+{
+    m_bus = QDBusConnection::connectToBus(m_busAddress, QStringLiteral("tank-benchclient"));
+    if (!m_bus.isConnected()) {
+        emit failed(QStringLiteral("Unable to connect to the bus: ") + m_bus.lastError().message());
+        return;
+    }
+
+    QVariantMap result;
+    result.insert(QStringLiteral("roster"), m_config.rosterSize);
+    QString errorMessage;
+    if (!connectAccount(&result, &errorMessage)) {
+        emit failed(errorMessage);
+        return;
+    }
+    measureContacts(&result);
+    measureReceive(&result);
+    measureSend(&result);
+
+    const QDBusMessage statistics = call(m_connectionPath, QLatin1String(TANK_IFACE_CONNECTION_INTERFACE_STATISTICS),
+                                         QStringLiteral("GetStatistics"), {});
+    if (statistics.type() == QDBusMessage::ReplyMessage) {
+        result.insert(QStringLiteral("connection"), qdbus_cast<QVariantMap>(statistics.arguments().value(0)));
+    }
+    call(m_connectionPath, TP_QT_IFACE_CONNECTION, QStringLiteral("Disconnect"), {});
+    emit finished(result);
+}
+
+bool BenchClient::connectAccount(QVariantMap *result, QString *errorMessage)
+{
+    m_bus.connect(QString(), QString(), TP_QT_IFACE_CHANNEL_INTERFACE_MESSAGES, QStringLiteral("MessageReceived"),
+                  this, SLOT(onMessageReceived(QDBusMessage)));
+
+    const qint64 startTime = monotonicMicroseconds();
+    QDBusMessage request = QDBusMessage::createMethodCall(TP_QT_CONNECTION_MANAGER_BUS_NAME_BASE + QStringLiteral("tank"),
+                                                          TP_QT_CONNECTION_MANAGER_OBJECT_PATH_BASE + QStringLiteral("tank"),
+                                                          TP_QT_IFACE_CONNECTION_MANAGER,
+                                                          QStringLiteral("RequestConnection"));
+    request.setArguments({ QStringLiteral("matrix"), m_accountParameters });
+    const QDBusMessage reply = m_bus.call(request, QDBus::Block, c_callTimeout);
+    if (reply.type() != QDBusMessage::ReplyMessage) {
+        *errorMessage = QStringLiteral("RequestConnection failed: ") + reply.errorMessage();
+        return false;
+    }
+    m_connectionService = reply.arguments().value(0).toString();
+    m_connectionPath = qdbus_cast<QDBusObjectPath>(reply.arguments().value(1)).path();
+    m_bus.connect(m_connectionService, m_connectionPath, TP_QT_IFACE_CONNECTION, QStringLiteral("StatusChanged"),
+                  this, SLOT(onStatusChanged(uint,uint)));
+    call(m_connectionPath, TP_QT_IFACE_CONNECTION, QStringLiteral("Connect"), {});
+
+    // The status arrives through onStatusChanged() while waiting
+    const qint64 deadline = startTime + qint64(c_connectTimeout) * 1000;
+    while ((m_status != Tp::ConnectionStatusConnected) && (monotonicMicroseconds() < deadline)) {
+        wait(10);
+    }
+    if (m_status != Tp::ConnectionStatusConnected) {
+        *errorMessage = QStringLiteral("The connection did not connect");
+        return false;
+    }
+    result->insert(QStringLiteral("connect-ms"), (monotonicMicroseconds() - startTime) / 1000);
+    return true;
+}
+
+QDBusMessage BenchClient::call(const QString &path, const QString &interface, const QString &method,
+                               const QVariantList &arguments)
+{
+    QDBusMessage request = QDBusMessage::createMethodCall(m_connectionService, path, interface, method);
+    request.setArguments(arguments);
+    const QDBusMessage reply = m_bus.call(request, QDBus::Block, c_callTimeout);
+    if (reply.type() != QDBusMessage::ReplyMessage) {
+        qWarning() << Q_FUNC_INFO << method << "failed:" << reply.errorMessage();
+    }
+    return reply;
+}
+
+qint64 BenchClient::medianCallTime(const QString &interface, const QString &method, const QVariantList &arguments)
+{
+    QVector<qint64> times;
+    for (int i = 0; i < m_config.repeats; ++i) {
+        const qint64 startTime = monotonicMicroseconds();
+        if (call(m_connectionPath, interface, method, arguments).type() != QDBusMessage::ReplyMessage) {
+            return -1;
+        }
+        times.append(monotonicMicroseconds() - startTime);
+    }
+    std::sort(times.begin(), times.end());
+    return times.at(times.count() / 2);
+}
+
+void BenchClient::measureContacts(QVariantMap *result)
+{
+    Tp::UIntList handles;
+    qint64 startTime = monotonicMicroseconds();
+    for (int first = 0; first < m_config.rosterSize; first += c_handleBatchSize) {
+        QStringList ids;
+        for (int i = first; i < qMin(first + c_handleBatchSize, m_config.rosterSize); ++i) {
+            ids.append(FakeHomeserver::memberId(i));
+        }
+        const QDBusMessage reply = call(m_connectionPath, TP_QT_IFACE_CONNECTION, QStringLiteral("RequestHandles"),
+                                        { uint(Tp::HandleTypeContact), ids });
+        handles += qdbus_cast<Tp::UIntList>(reply.arguments().value(0));
+    }
+    result->insert(QStringLiteral("request-handles-ms"), (monotonicMicroseconds() - startTime) / 1000);
+    result->insert(QStringLiteral("handles"), handles.count());
+    if (handles.isEmpty()) {
+        return;
+    }
+
+    const QStringList interfaces {
+        TP_QT_IFACE_CONNECTION_INTERFACE_ALIASING,
+        TP_QT_IFACE_CONNECTION_INTERFACE_AVATARS,
+        TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_INFO,
+        TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_LIST,
+        TP_QT_IFACE_CONNECTION_INTERFACE_SIMPLE_PRESENCE,
+    };
+    const qint64 allAttributes = medianCallTime(TP_QT_IFACE_CONNECTION_INTERFACE_CONTACTS,
+                                                QStringLiteral("GetContactAttributes"),
+                                                { QVariant::fromValue(handles), interfaces, false });
+    result->insert(QStringLiteral("contact-attributes-all-us"), allAttributes);
+    if (allAttributes > 0) {
+        result->insert(QStringLiteral("contact-attributes-per-s"), handles.count() * 1000000.0 / allAttributes);
+    }
+
+    // The way the clients usually fetch a roster
+    MatrixLatencyHistogram batches;
+    for (int first = 0; first < handles.count(); first += c_attributesBatchSize) {
+        const QVariantList arguments { QVariant::fromValue(handles.mid(first, c_attributesBatchSize)), interfaces, false };
+        startTime = monotonicMicroseconds();
+        call(m_connectionPath, TP_QT_IFACE_CONNECTION_INTERFACE_CONTACTS, QStringLiteral("GetContactAttributes"), arguments);
+        batches.record(monotonicMicroseconds() - startTime);
+    }
+    insertLatency(result, QStringLiteral("contact-attributes-batch-%1").arg(c_attributesBatchSize), batches);
+
+    const qint64 aliases = medianCallTime(TP_QT_IFACE_CONNECTION_INTERFACE_ALIASING, QStringLiteral("GetAliases"),
+                                          { QVariant::fromValue(handles) });
+    result->insert(QStringLiteral("aliases-all-us"), aliases);
+    if (aliases > 0) {
+        result->insert(QStringLiteral("aliases-per-s"), handles.count() * 1000000.0 / aliases);
+    }
+}
+
+void BenchClient::measureReceive(QVariantMap *result)
+{
+    QTimer ackTimer;
+    ackTimer.setInterval(50);
+    connect(&ackTimer, &QTimer::timeout, this, &BenchClient::flushAcknowledgements);
+    ackTimer.start();
+
+    m_receiving = true;
+    QMetaObject::invokeMethod(m_server, "start");
+    wait(m_config.duration * 1000);
+    m_receiving = false;
+    QMetaObject::invokeMethod(m_server, "stop");
+    const quint64 received = m_receivedMessages;
+
+    // Leave the connection idle before the next phase
+    wait(c_drainTime);
+    flushAcknowledgements();
+
+    result->insert(QStringLiteral("received-messages"), received);
+    result->insert(QStringLiteral("received-per-s"), double(received) / m_config.duration);
+    insertLatency(result, QStringLiteral("receive-latency"), m_receiveLatency);
+}
+
+void BenchClient::measureSend(QVariantMap *result)
+{
+    if (m_channels.isEmpty()) {
+        qWarning() << Q_FUNC_INFO << "No channels to send to";
+        return;
+    }
+    m_sending = true;
+    for (int i = 0; i < m_config.sendWindow; ++i) {
+        sendNext();
+    }
+    wait(m_config.duration * 1000);
+    m_sending = false;
+    const quint64 sent = m_sendLatency.count();
+    wait(c_drainTime);
+    flushAcknowledgements();
+
+    result->insert(QStringLiteral("sent-messages"), sent);
+    result->insert(QStringLiteral("sent-per-s"), double(sent) / m_config.duration);
+    result->insert(QStringLiteral("send-errors"), m_sendErrors);
+    insertLatency(result, QStringLiteral("send-call-latency"), m_sendLatency);
+}
+
+void BenchClient::sendNext()
+{
+    Tp::MessagePart header;
+    header.insert(QStringLiteral("message-type"), QDBusVariant(uint(Tp::ChannelTextMessageTypeNormal)));
+    Tp::MessagePart body;
+    body.insert(QStringLiteral("content-type"), QDBusVariant(QStringLiteral("text/plain")));
+    body.insert(QStringLiteral("content"), QDBusVariant(makeProbe(m_sendSequence)));
+
+    const QString &channel = m_channels.at(m_sendSequence % m_channels.count());
+    ++m_sendSequence;
+    QDBusMessage request = QDBusMessage::createMethodCall(m_connectionService, channel,
+                                                          TP_QT_IFACE_CHANNEL_INTERFACE_MESSAGES,
+                                                          QStringLiteral("SendMessage"));
+    request.setArguments({ QVariant::fromValue(Tp::MessagePartList { header, body }), 0u });
+
+    const qint64 callTime = monotonicMicroseconds();
+    QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(m_bus.asyncCall(request), this);
+    connect(watcher, &QDBusPendingCallWatcher::finished, this, [this, watcher, callTime]() {
+        watcher->deleteLater();
+        if (!m_sending) {
+            return;
+        }
+        if (watcher->isError()) {
+            ++m_sendErrors;
+        } else {
+            m_sendLatency.record(monotonicMicroseconds() - callTime);
+        }
+        sendNext();
+    });
+}
+
+void BenchClient::onStatusChanged(uint status, uint reason)
+{
+    Q_UNUSED(reason)
+    m_status = status;
+}
+
+void BenchClient::onMessageReceived(const QDBusMessage &message)
+{
+    const Tp::MessagePartList parts = qdbus_cast<Tp::MessagePartList>(message.arguments().value(0));
+    if (parts.isEmpty()) {
+        return;
+    }
+    const Tp::MessagePart &header = parts.first();
+    m_pendingAcks[message.path()].append(header.value(QStringLiteral("pending-message-id")).variant().toUInt());
+    if (header.value(QStringLiteral("message-type")).variant().toUInt() == Tp::ChannelTextMessageTypeDeliveryReport) {
+        return;
+    }
+    if (!m_channels.contains(message.path())) {
+        m_channels.append(message.path());
+    }
+    if (!m_receiving) {
+        return;
+    }
+    ++m_receivedMessages;
+    for (int i = 1; i < parts.count(); ++i) {
+        const qint64 created = probeTime(parts.at(i).value(QStringLiteral("content")).variant().toString());
+        if (created >= 0) {
+            m_receiveLatency.record(monotonicMicroseconds() - created);
+            break;
+        }
+    }
+}
+
+void BenchClient::flushAcknowledgements()
+{
+    for (auto it = m_pendingAcks.cbegin(); it != m_pendingAcks.cend(); ++it) {
+        QDBusMessage request = QDBusMessage::createMethodCall(m_connectionService, it.key(),
+                                                              TP_QT_IFACE_CHANNEL_TYPE_TEXT,
+                                                              QStringLiteral("AcknowledgePendingMessages"));
+        request.setArguments({ QVariant::fromValue(it.value()) });
+        m_bus.asyncCall(request);
+    }
+    m_pendingAcks.clear();
+}
+
+void BenchClient::wait(int msecs)
+{
+    QEventLoop loop;
+    QTimer::singleShot(msecs, &loop, &QEventLoop::quit);
+    loop.exec();
+}
+
+void BenchClient::insertLatency(QVariantMap *map, const QString &prefix, const MatrixLatencyHistogram &histogram)
+{
+    map->insert(prefix + QStringLiteral("-count"), histogram.count());
+    map->insert(prefix + QStringLiteral("-p50-us"), histogram.percentile(50));
+    map->insert(prefix + QStringLiteral("-p99-us"), histogram.percentile(99));
+    map->insert(prefix + QStringLiteral("-max-us"), histogram.max());
+}
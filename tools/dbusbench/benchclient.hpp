@@ -0,0 +1,96 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_TOOLS_BENCHCLIENT_HPP
+#define TANK_TOOLS_BENCHCLIENT_HPP
+
+#include <QDBusConnection>
+#include <QDBusMessage>
+#include <QHash>
+#include <QObject>
+#include <QPointer>
+#include <QStringList>
+
+#include "tracer.hpp"
+
+// Measures the bus side of a connection in phases: contact attributes over the whole roster, then
+// the receive throughput, then the send throughput. The phases run one after another in run(),
+// with the synchronous calls blocking only the thread of the client.
+class BenchClient : public QObject
+{
+    Q_OBJECT
+public:
+    struct Config {
+        int rosterSize = 100;
+        int duration = 10; // Seconds of each throughput phase
+        int sendWindow = 16; // Outstanding SendMessage calls
+        int repeats = 5;
+    };
+
+    BenchClient(const QString &busAddress, const QVariantMap &accountParameters, const Config &config,
+                QObject *server, QObject *parent = nullptr);
+
+public slots:
+    void run();
+
+signals:
+    void finished(const QVariantMap &result);
+    void failed(const QString &message);
+
+protected slots:
+    void onStatusChanged(uint status, uint reason);
+    void onMessageReceived(const QDBusMessage &message);
+
+protected:
+    bool connectAccount(QVariantMap *result, QString *errorMessage);
+    QDBusMessage call(const QString &path, const QString &interface, const QString &method,
+                      const QVariantList &arguments);
+    // Calls the method config.repeats times and returns the median duration in microseconds or -1
+    qint64 medianCallTime(const QString &interface, const QString &method, const QVariantList &arguments);
+    void measureContacts(QVariantMap *result);
+    void measureReceive(QVariantMap *result);
+    void measureSend(QVariantMap *result);
+    void sendNext();
+    void flushAcknowledgements();
+    void wait(int msecs);
+
+    static void insertLatency(QVariantMap *map, const QString &prefix, const MatrixLatencyHistogram &histogram);
+
+    QString m_busAddress;
+    QVariantMap m_accountParameters;
+    Config m_config;
+    QPointer<QObject> m_server;
+    QDBusConnection m_bus;
+    QString m_connectionService;
+    QString m_connectionPath;
+    uint m_status = 2; // Disconnected
+
+    QHash<QString, QList<uint>> m_pendingAcks;
+    QStringList m_channels;
+    bool m_receiving = false;
+    quint64 m_receivedMessages = 0;
+    MatrixLatencyHistogram m_receiveLatency;
+
+    bool m_sending = false;
+    quint64 m_sendSequence = 0;
+    quint64 m_sendErrors = 0;
+    MatrixLatencyHistogram m_sendLatency;
+};
+
+#endif // TANK_TOOLS_BENCHCLIENT_HPP
@@ -0,0 +1,208 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QLoggingCategory>
+#include <QProcess>
+#include <QTemporaryDir>
+#include <QThread>
+
+#include <TelepathyQt/BaseConnectionManager>
+#include <TelepathyQt/Debug>
+#include <TelepathyQt/Types>
+
+#include "benchclient.hpp"
+#include "fakehomeserver.hpp"
+#include "privatebus.hpp"
+#include "protocol.hpp"
+
+#include <cstdio>
+
+static const int c_rooms = 10;
+
+// Measures one roster size in this process and prints the result as a JSON object
+static int runSingle(QCoreApplication *app, const BenchClient::Config &clientConfig, int rate)
+{
+    PrivateBus bus;
+    QString errorMessage;
+    if (!bus.start(&errorMessage)) {
+        fprintf(stderr, "%s\n", qPrintable(errorMessage));
+        return 1;
+    }
+
+    Tp::registerTypes();
+    Tp::enableDebug(false);
+    Tp::enableWarnings(true);
+
+    Tp::BaseProtocolPtr protocol = Tp::BaseProtocol::create<MatrixProtocol>(QLatin1String("matrix"));
+    Tp::BaseConnectionManagerPtr cm = Tp::BaseConnectionManager::create(QLatin1String("tank"));
+    if (!cm->addProtocol(protocol) || !cm->registerObject()) {
+        fprintf(stderr, "Unable to register the connection manager\n");
+        return 1;
+    }
+
+    FakeHomeserver::Config serverConfig;
+    serverConfig.rooms = c_rooms;
+    serverConfig.membersPerRoom = qMax(1, clientConfig.rosterSize / c_rooms);
+    serverConfig.messagesPerSecond = rate;
+
+    QThread serverThread;
+    FakeHomeserver *server = new FakeHomeserver(serverConfig);
+    server->moveToThread(&serverThread);
+    QObject::connect(&serverThread, &QThread::finished, server, &QObject::deleteLater);
+    serverThread.start();
+    bool listening = false;
+    QMetaObject::invokeMethod(server, "listen", Qt::BlockingQueuedConnection, Q_RETURN_ARG(bool, listening));
+    if (!listening) {
+        fprintf(stderr, "Unable to start the homeserver\n");
+        serverThread.quit();
+        serverThread.wait();
+        return 1;
+    }
+
+    const QVariantMap account {
+        { QStringLiteral("user"), FakeHomeserver::userId() },
+        { QStringLiteral("password"), QStringLiteral("bench") },
+        { QStringLiteral("server"), server->url().toString() },
+    };
+    BenchClient::Config config = clientConfig;
+    config.rosterSize = serverConfig.rooms * serverConfig.membersPerRoom;
+    QThread clientThread;
+    BenchClient *client = new BenchClient(bus.address(), account, config, server);
+    client->moveToThread(&clientThread);
+    QObject::connect(&clientThread, &QThread::finished, client, &QObject::deleteLater);
+    clientThread.start();
+
+    int exitCode = 0;
+    QObject::connect(client, &BenchClient::failed, app, [app, &exitCode](const QString &message) {
+        fprintf(stderr, "%s\n", qPrintable(message));
+        exitCode = 1;
+        app->quit();
+    });
+    QObject::connect(client, &BenchClient::finished, app, [app, server](const QVariantMap &clientResult) {
+        QVariantMap result = clientResult;
+        QVariantMap serverStatistics;
+        QMetaObject::invokeMethod(server, "statistics", Qt::BlockingQueuedConnection,
+                                  Q_RETURN_ARG(QVariantMap, serverStatistics));
+        result.insert(QStringLiteral("server"), serverStatistics);
+        const QByteArray json = QJsonDocument(QJsonObject::fromVariantMap(result)).toJson(QJsonDocument::Compact);
+        fwrite(json.constData(), 1, json.size(), stdout);
+        fflush(stdout);
+        app->quit();
+    });
+    QMetaObject::invokeMethod(client, "run");
+
+    app->exec();
+
+    clientThread.quit();
+    serverThread.quit();
+    clientThread.wait();
+    serverThread.wait();
+    return exitCode;
+}
+
+int main(int argc, char *argv[])
+{
+    // Keep the sessions and caches of the run away from the user ones
+    QTemporaryDir sandbox;
+    if (!sandbox.isValid()) {
+        fprintf(stderr, "Unable to create a temporary directory\n");
+        return 1;
+    }
+    qputenv("XDG_CACHE_HOME", QFile::encodeName(sandbox.path() + QStringLiteral("/cache")));
+    qputenv("XDG_CONFIG_HOME", QFile::encodeName(sandbox.path() + QStringLiteral("/config")));
+    qputenv("XDG_DATA_HOME", QFile::encodeName(sandbox.path() + QStringLiteral("/data")));
+
+    QCoreApplication app(argc, argv);
+    app.setOrganizationName(QStringLiteral("TelepathyIM"));
+    app.setApplicationName(QLatin1String("tank-dbusbench"));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("D-Bus throughput benchmark of the Matrix connection manager"));
+    parser.addHelpOption();
+    const QCommandLineOption sizesOption(QStringLiteral("roster-sizes"), QStringLiteral("Comma-separated roster sizes, each measured in a fresh process."),
+                                         QStringLiteral("sizes"), QStringLiteral("100,1000,10000,50000"));
+    const QCommandLineOption rosterOption(QStringLiteral("roster"), QStringLiteral("Measure a single roster size in this process."), QStringLiteral("size"));
+    const QCommandLineOption durationOption(QStringLiteral("duration"), QStringLiteral("Duration of each throughput phase in seconds."), QStringLiteral("seconds"), QStringLiteral("10"));
+    const QCommandLineOption rateOption(QStringLiteral("rate"), QStringLiteral("Incoming messages per second offered by the homeserver."), QStringLiteral("rate"), QStringLiteral("5000"));
+    const QCommandLineOption windowOption(QStringLiteral("send-window"), QStringLiteral("Outstanding SendMessage calls."), QStringLiteral("calls"), QStringLiteral("16"));
+    const QCommandLineOption outputOption(QStringLiteral("output"), QStringLiteral("Write the results to the file instead of stdout."), QStringLiteral("file"));
+    parser.addOptions({ sizesOption, rosterOption, durationOption, rateOption, windowOption, outputOption });
+    parser.process(app);
+
+    // The debug output of the hot paths would dominate the measurements
+    QLoggingCategory::setFilterRules(QStringLiteral("*.debug=false"));
+
+    BenchClient::Config config;
+    config.duration = parser.value(durationOption).toInt();
+    config.sendWindow = parser.value(windowOption).toInt();
+    const int rate = parser.value(rateOption).toInt();
+
+    if (parser.isSet(rosterOption)) {
+        config.rosterSize = parser.value(rosterOption).toInt();
+        return runSingle(&app, config, rate);
+    }
+
+    QJsonArray results;
+    for (const QString &size : parser.value(sizesOption).split(QLatin1Char(','), QString::SkipEmptyParts)) {
+        fprintf(stderr, "Measuring the roster of %s contacts\n", qPrintable(size));
+        QProcess run;
+        run.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+        run.start(QCoreApplication::applicationFilePath(), {
+                      QStringLiteral("--roster"), size,
+                      QStringLiteral("--duration"), QString::number(config.duration),
+                      QStringLiteral("--rate"), QString::number(rate),
+                      QStringLiteral("--send-window"), QString::number(config.sendWindow),
+                  });
+        run.waitForFinished(-1);
+        const QJsonDocument document = QJsonDocument::fromJson(run.readAllStandardOutput());
+        if ((run.exitStatus() != QProcess::NormalExit) || run.exitCode() || !document.isObject()) {
+            results.append(QJsonObject {
+                               { QStringLiteral("roster"), size.toInt() },
+                               { QStringLiteral("error"), QStringLiteral("The run failed with code %1").arg(run.exitCode()) },
+                           });
+            continue;
+        }
+        results.append(document.object());
+    }
+
+    const QJsonObject report {
+        { QStringLiteral("benchmark"), QStringLiteral("dbus") },
+        { QStringLiteral("date"), QDateTime::currentDateTimeUtc().toString(Qt::ISODate) },
+        { QStringLiteral("duration-s"), config.duration },
+        { QStringLiteral("rate"), rate },
+        { QStringLiteral("send-window"), config.sendWindow },
+        { QStringLiteral("results"), results },
+    };
+    const QByteArray json = QJsonDocument(report).toJson(QJsonDocument::Indented);
+    QFile output;
+    if (parser.isSet(outputOption)) {
+        output.setFileName(parser.value(outputOption));
+        output.open(QIODevice::WriteOnly);
+    } else {
+        output.open(stdout, QIODevice::WriteOnly);
+    }
+    return output.write(json) == json.size() ? 0 : 1;
+}
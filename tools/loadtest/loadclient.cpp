@@ -0,0 +1,229 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "loadclient.hpp"
+#include "probe.hpp"
+#include "statisticsinterface.hpp"
+
+#include <TelepathyQt/Constants>
+#include <TelepathyQt/Types>
+
+#include <QDBusObjectPath>
+#include <QDBusPendingCallWatcher>
+#include <QDBusPendingReply>
+#include <QDebug>
+#include <QTimer>
+
+static const int c_ackInterval = 50; // ms
+static const int c_sendTickInterval = 10; // ms
+
+LoadClient::LoadClient(const QString &busAddress, const QVariantMap &accountParameters, QObject *parent)
+    : QObject(parent),
+      m_busAddress(busAddress),
+      m_accountParameters(accountParameters),
+      m_bus(QString())
+{
+}
+
+void LoadClient::connectAccount()
+{
+    // A connection of its own, so the client traffic goes through the daemon like from a separate process
+    m_bus = QDBusConnection::connectToBus(m_busAddress, QStringLiteral("tank-loadclient"));
+    if (!m_bus.isConnected()) {
+        emit failed(QStringLiteral("Unable to connect to the bus: ") + m_bus.lastError().message());
+        return;
+    }
+
+    m_ackTimer = new QTimer(this);
+    m_ackTimer->setInterval(c_ackInterval);
+    connect(m_ackTimer, &QTimer::timeout, this, &LoadClient::flushAcknowledgements);
+    m_sendTimer = new QTimer(this);
+    m_sendTimer->setInterval(c_sendTickInterval);
+    connect(m_sendTimer, &QTimer::timeout, this, &LoadClient::onSendTick);
+
+    // Any channel of the connection
+    m_bus.connect(QString(), QString(), TP_QT_IFACE_CHANNEL_INTERFACE_MESSAGES, QStringLiteral("MessageReceived"),
+                  this, SLOT(onMessageReceived(QDBusMessage)));
+
+    QDBusMessage request = QDBusMessage::createMethodCall(TP_QT_CONNECTION_MANAGER_BUS_NAME_BASE + QStringLiteral("tank"),
+                                                          TP_QT_CONNECTION_MANAGER_OBJECT_PATH_BASE + QStringLiteral("tank"),
+                                                          TP_QT_IFACE_CONNECTION_MANAGER,
+                                                          QStringLiteral("RequestConnection"));
+    request.setArguments({ QStringLiteral("matrix"), m_accountParameters });
+    QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(m_bus.asyncCall(request), this);
+    connect(watcher, &QDBusPendingCallWatcher::finished, this, [this, watcher]() {
+        watcher->deleteLater();
+        QDBusPendingReply<QString, QDBusObjectPath> reply = *watcher;
+        if (reply.isError()) {
+            emit failed(QStringLiteral("RequestConnection failed: ") + reply.error().message());
+            return;
+        }
+        m_connectionService = reply.argumentAt<0>();
+        m_connectionPath = reply.argumentAt<1>().path();
+        m_bus.connect(m_connectionService, m_connectionPath, TP_QT_IFACE_CONNECTION, QStringLiteral("StatusChanged"),
+                      this, SLOT(onStatusChanged(uint,uint)));
+        m_bus.asyncCall(QDBusMessage::createMethodCall(m_connectionService, m_connectionPath,
+                                                       TP_QT_IFACE_CONNECTION, QStringLiteral("Connect")));
+    });
+}
+
+void LoadClient::startSending(int messagesPerSecond)
+{
+    m_startTime = monotonicMicroseconds();
+    m_lastSendTick = m_startTime;
+    m_sendRate = messagesPerSecond;
+    m_ackTimer->start();
+    if (m_sendRate > 0) {
+        m_sendTimer->start();
+    }
+}
+
+void LoadClient::finish()
+{
+    m_sendTimer->stop();
+    m_ackTimer->stop();
+    flushAcknowledgements();
+
+    const QDBusMessage request = QDBusMessage::createMethodCall(m_connectionService, m_connectionPath,
+                                                                QLatin1String(TANK_IFACE_CONNECTION_INTERFACE_STATISTICS),
+                                                                QStringLiteral("GetStatistics"));
+    QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(m_bus.asyncCall(request), this);
+    connect(watcher, &QDBusPendingCallWatcher::finished, this, [this, watcher]() {
+        watcher->deleteLater();
+        QDBusPendingReply<QVariantMap> reply = *watcher;
+        if (reply.isError()) {
+            qWarning() << "GetStatistics failed:" << reply.error().message();
+        }
+        const QVariantMap result = report(reply.isError() ? QVariantMap() : reply.value());
+        m_bus.asyncCall(QDBusMessage::createMethodCall(m_connectionService, m_connectionPath,
+                                                       TP_QT_IFACE_CONNECTION, QStringLiteral("Disconnect")));
+        emit finished(result);
+    });
+}
+
+void LoadClient::onStatusChanged(uint status, uint reason)
+{
+    if (status == Tp::ConnectionStatusConnected) {
+        emit connected();
+    } else if ((status == Tp::ConnectionStatusDisconnected) && (m_startTime == 0)) {
+        emit failed(QStringLiteral("The connection failed to connect (reason %1)").arg(reason));
+    }
+}
+
+void LoadClient::onMessageReceived(const QDBusMessage &message)
+{
+    const Tp::MessagePartList parts = qdbus_cast<Tp::MessagePartList>(message.arguments().value(0));
+    if (parts.isEmpty()) {
+        return;
+    }
+    const Tp::MessagePart &header = parts.first();
+    m_pendingAcks[message.path()].append(header.value(QStringLiteral("pending-message-id")).variant().toUInt());
+
+    if (header.value(QStringLiteral("message-type")).variant().toUInt() == Tp::ChannelTextMessageTypeDeliveryReport) {
+        ++m_deliveryReports;
+        return;
+    }
+    if (!m_channels.contains(message.path())) {
+        m_channels.append(message.path());
+    }
+    ++m_receivedMessages;
+    for (int i = 1; i < parts.count(); ++i) {
+        const qint64 created = probeTime(parts.at(i).value(QStringLiteral("content")).variant().toString());
+        if (created >= 0) {
+            m_receiveLatency.record(monotonicMicroseconds() - created);
+            break;
+        }
+    }
+}
+
+void LoadClient::onSendTick()
+{
+    const qint64 now = monotonicMicroseconds();
+    m_sendBudget += m_sendRate * (now - m_lastSendTick) / 1000000.0;
+    m_lastSendTick = now;
+    if (m_channels.isEmpty()) {
+        // Nothing to send to until the first message arrives
+        m_sendBudget = 0;
+        return;
+    }
+
+    while (m_sendBudget >= 1) {
+        m_sendBudget -= 1;
+        Tp::MessagePart header;
+        header.insert(QStringLiteral("message-type"), QDBusVariant(uint(Tp::ChannelTextMessageTypeNormal)));
+        Tp::MessagePart body;
+        body.insert(QStringLiteral("content-type"), QDBusVariant(QStringLiteral("text/plain")));
+        body.insert(QStringLiteral("content"), QDBusVariant(makeProbe(m_sendSequence)));
+
+        const QString &channel = m_channels.at(m_sendSequence % m_channels.count());
+        ++m_sendSequence;
+        QDBusMessage request = QDBusMessage::createMethodCall(m_connectionService, channel,
+                                                              TP_QT_IFACE_CHANNEL_INTERFACE_MESSAGES,
+                                                              QStringLiteral("SendMessage"));
+        request.setArguments({ QVariant::fromValue(Tp::MessagePartList { header, body }), 0u });
+
+        const qint64 callTime = monotonicMicroseconds();
+        QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(m_bus.asyncCall(request), this);
+        connect(watcher, &QDBusPendingCallWatcher::finished, this, [this, watcher, callTime]() {
+            watcher->deleteLater();
+            if (watcher->isError()) {
+                ++m_sendErrors;
+                return;
+            }
+            m_sendLatency.record(monotonicMicroseconds() - callTime);
+        });
+    }
+}
+
+void LoadClient::flushAcknowledgements()
+{
+    for (auto it = m_pendingAcks.cbegin(); it != m_pendingAcks.cend(); ++it) {
+        QDBusMessage request = QDBusMessage::createMethodCall(m_connectionService, it.key(),
+                                                              TP_QT_IFACE_CHANNEL_TYPE_TEXT,
+                                                              QStringLiteral("AcknowledgePendingMessages"));
+        request.setArguments({ QVariant::fromValue(it.value()) });
+        m_bus.asyncCall(request);
+    }
+    m_pendingAcks.clear();
+}
+
+QVariantMap LoadClient::report(const QVariantMap &connectionStatistics) const
+{
+    const double seconds = qMax<qint64>(1, monotonicMicroseconds() - m_startTime) / 1000000.0;
+    QVariantMap result;
+    result.insert(QStringLiteral("duration-s"), seconds);
+    result.insert(QStringLiteral("channels"), m_channels.count());
+    result.insert(QStringLiteral("received-messages"), m_receivedMessages);
+    result.insert(QStringLiteral("received-per-s"), m_receivedMessages / seconds);
+    insertLatency(&result, QStringLiteral("receive-latency"), m_receiveLatency);
+    result.insert(QStringLiteral("delivery-reports"), m_deliveryReports);
+    result.insert(QStringLiteral("sent-messages"), m_sendLatency.count());
+    result.insert(QStringLiteral("sent-per-s"), m_sendLatency.count() / seconds);
+    result.insert(QStringLiteral("send-errors"), m_sendErrors);
+    insertLatency(&result, QStringLiteral("send-call-latency"), m_sendLatency);
+    result.insert(QStringLiteral("connection"), connectionStatistics);
+    return result;
+}
+
+void LoadClient::insertLatency(QVariantMap *map, const QString &prefix, const MatrixLatencyHistogram &histogram)
+{
+    map->insert(prefix + QStringLiteral("-p50-us"), histogram.percentile(50));
+    map->insert(prefix + QStringLiteral("-p99-us"), histogram.percentile(99));
+    map->insert(prefix + QStringLiteral("-max-us"), histogram.max());
+}
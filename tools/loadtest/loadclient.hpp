@@ -0,0 +1,86 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_TOOLS_LOADCLIENT_HPP
+#define TANK_TOOLS_LOADCLIENT_HPP
+
+#include <QDBusConnection>
+#include <QDBusMessage>
+#include <QHash>
+#include <QObject>
+#include <QStringList>
+
+#include "tracer.hpp"
+
+class QTimer;
+
+// A synthetic Telepathy client: it brings a connection up over D-Bus, acknowledges every received
+// message, sends probes to the channels it has seen and measures what comes back.
+class LoadClient : public QObject
+{
+    Q_OBJECT
+public:
+    LoadClient(const QString &busAddress, const QVariantMap &accountParameters, QObject *parent = nullptr);
+
+public slots:
+    void connectAccount();
+    void startSending(int messagesPerSecond);
+    // Collects the connection statistics, disconnects and emits finished()
+    void finish();
+
+signals:
+    void connected();
+    void failed(const QString &message);
+    void finished(const QVariantMap &report);
+
+protected slots:
+    void onStatusChanged(uint status, uint reason);
+    void onMessageReceived(const QDBusMessage &message);
+
+protected:
+    void onSendTick();
+    void flushAcknowledgements();
+    QVariantMap report(const QVariantMap &connectionStatistics) const;
+    static void insertLatency(QVariantMap *map, const QString &prefix, const MatrixLatencyHistogram &histogram);
+
+    QString m_busAddress;
+    QVariantMap m_accountParameters;
+    QDBusConnection m_bus;
+    QString m_connectionService;
+    QString m_connectionPath;
+
+    QTimer *m_ackTimer = nullptr;
+    QTimer *m_sendTimer = nullptr;
+    QHash<QString, QList<uint>> m_pendingAcks; // Channel path to the pending message ids
+    QStringList m_channels;
+
+    qint64 m_startTime = 0;
+    int m_sendRate = 0;
+    double m_sendBudget = 0;
+    qint64 m_lastSendTick = 0;
+    quint64 m_sendSequence = 0;
+    quint64 m_sendErrors = 0;
+    quint64 m_receivedMessages = 0;
+    quint64 m_deliveryReports = 0;
+
+    MatrixLatencyHistogram m_receiveLatency; // Probe creation on the server to MessageReceived
+    MatrixLatencyHistogram m_sendLatency; // SendMessage call to its reply
+};
+
+#endif // TANK_TOOLS_LOADCLIENT_HPP
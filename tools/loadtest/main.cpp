@@ -0,0 +1,189 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QLoggingCategory>
+#include <QTemporaryDir>
+#include <QThread>
+#include <QTimer>
+
+#include <TelepathyQt/BaseConnectionManager>
+#include <TelepathyQt/Debug>
+#include <TelepathyQt/Types>
+
+#include "fakehomeserver.hpp"
+#include "loadclient.hpp"
+#include "privatebus.hpp"
+#include "protocol.hpp"
+#include "watchdog.hpp"
+
+#include <cstdio>
+
+// Runs the connection manager in this process, against a local stand-in homeserver on one thread and
+// a synthetic client on another, all over a private bus. The report is written as JSON.
+int main(int argc, char *argv[])
+{
+    // Keep the sessions and caches of the run away from the user ones
+    QTemporaryDir sandbox;
+    if (!sandbox.isValid()) {
+        fprintf(stderr, "Unable to create a temporary directory\n");
+        return 1;
+    }
+    qputenv("XDG_CACHE_HOME", QFile::encodeName(sandbox.path() + QStringLiteral("/cache")));
+    qputenv("XDG_CONFIG_HOME", QFile::encodeName(sandbox.path() + QStringLiteral("/config")));
+    qputenv("XDG_DATA_HOME", QFile::encodeName(sandbox.path() + QStringLiteral("/data")));
+
+    QCoreApplication app(argc, argv);
+    app.setOrganizationName(QStringLiteral("TelepathyIM"));
+    app.setApplicationName(QLatin1String("tank-loadtest"));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Load test of the Matrix connection manager against a local stand-in homeserver"));
+    parser.addHelpOption();
+    const QCommandLineOption roomsOption(QStringLiteral("rooms"), QStringLiteral("Number of rooms."), QStringLiteral("count"), QStringLiteral("10"));
+    const QCommandLineOption membersOption(QStringLiteral("members"), QStringLiteral("Members per room."), QStringLiteral("count"), QStringLiteral("20"));
+    const QCommandLineOption rateOption(QStringLiteral("rate"), QStringLiteral("Incoming messages per second."), QStringLiteral("rate"), QStringLiteral("100"));
+    const QCommandLineOption sendRateOption(QStringLiteral("send-rate"), QStringLiteral("Outgoing messages per second."), QStringLiteral("rate"), QStringLiteral("10"));
+    const QCommandLineOption durationOption(QStringLiteral("duration"), QStringLiteral("Duration of the load in seconds."), QStringLiteral("seconds"), QStringLiteral("30"));
+    const QCommandLineOption replayOption(QStringLiteral("replay"), QStringLiteral("Replay the sync responses (one JSON per line) instead of the synthetic stream."), QStringLiteral("file"));
+    const QCommandLineOption replayRateOption(QStringLiteral("replay-rate"), QStringLiteral("Replayed sync responses per second."), QStringLiteral("rate"), QStringLiteral("10"));
+    const QCommandLineOption dropOption(QStringLiteral("drop-every"), QStringLiteral("Drop the connection instead of answering every N-th sync."), QStringLiteral("N"), QStringLiteral("0"));
+    const QCommandLineOption outputOption(QStringLiteral("output"), QStringLiteral("Write the report to the file instead of stdout."), QStringLiteral("file"));
+    const QCommandLineOption verboseOption(QStringLiteral("verbose"), QStringLiteral("Keep the debug output of the connection manager."));
+    parser.addOptions({ roomsOption, membersOption, rateOption, sendRateOption, durationOption, replayOption,
+                        replayRateOption, dropOption, outputOption, verboseOption });
+    parser.process(app);
+
+    FakeHomeserver::Config config;
+    config.rooms = parser.value(roomsOption).toInt();
+    config.membersPerRoom = parser.value(membersOption).toInt();
+    config.messagesPerSecond = parser.value(rateOption).toInt();
+    config.replayFile = parser.value(replayOption);
+    config.replayedSyncsPerSecond = parser.value(replayRateOption).toInt();
+    config.dropEvery = parser.value(dropOption).toInt();
+    const int sendRate = parser.value(sendRateOption).toInt();
+    const int duration = parser.value(durationOption).toInt();
+
+    if (!parser.isSet(verboseOption)) {
+        // The debug output of the hot paths would dominate the measurements
+        QLoggingCategory::setFilterRules(QStringLiteral("*.debug=false"));
+    }
+
+    PrivateBus bus;
+    QString errorMessage;
+    if (!bus.start(&errorMessage)) {
+        fprintf(stderr, "%s\n", qPrintable(errorMessage));
+        return 1;
+    }
+
+    Tp::registerTypes();
+    Tp::enableDebug(parser.isSet(verboseOption));
+    Tp::enableWarnings(true);
+    MatrixWatchdog::startFromEnvironment();
+
+    Tp::BaseProtocolPtr protocol = Tp::BaseProtocol::create<MatrixProtocol>(QLatin1String("matrix"));
+    Tp::BaseConnectionManagerPtr cm = Tp::BaseConnectionManager::create(QLatin1String("tank"));
+    if (!cm->addProtocol(protocol) || !cm->registerObject()) {
+        fprintf(stderr, "Unable to register the connection manager\n");
+        return 1;
+    }
+
+    QThread serverThread;
+    FakeHomeserver *server = new FakeHomeserver(config);
+    server->moveToThread(&serverThread);
+    QObject::connect(&serverThread, &QThread::finished, server, &QObject::deleteLater);
+    serverThread.start();
+    bool listening = false;
+    QMetaObject::invokeMethod(server, "listen", Qt::BlockingQueuedConnection, Q_RETURN_ARG(bool, listening));
+    if (!listening) {
+        fprintf(stderr, "Unable to start the homeserver\n");
+        serverThread.quit();
+        serverThread.wait();
+        return 1;
+    }
+
+    const QVariantMap account {
+        { QStringLiteral("user"), FakeHomeserver::userId() },
+        { QStringLiteral("password"), QStringLiteral("loadtest") },
+        { QStringLiteral("server"), server->url().toString() },
+    };
+    QThread clientThread;
+    LoadClient *client = new LoadClient(bus.address(), account);
+    client->moveToThread(&clientThread);
+    QObject::connect(&clientThread, &QThread::finished, client, &QObject::deleteLater);
+    clientThread.start();
+
+    int exitCode = 0;
+    QObject::connect(client, &LoadClient::failed, &app, [&app, &exitCode](const QString &message) {
+        fprintf(stderr, "%s\n", qPrintable(message));
+        exitCode = 1;
+        app.quit();
+    });
+    QObject::connect(client, &LoadClient::connected, &app, [&]() {
+        QMetaObject::invokeMethod(server, "start");
+        QMetaObject::invokeMethod(client, "startSending", Q_ARG(int, sendRate));
+        QTimer::singleShot(duration * 1000, &app, [&]() {
+            QMetaObject::invokeMethod(server, "stop");
+            QMetaObject::invokeMethod(client, "finish");
+        });
+    });
+    QObject::connect(client, &LoadClient::finished, &app, [&](const QVariantMap &clientReport) {
+        QVariantMap serverStatistics;
+        QMetaObject::invokeMethod(server, "statistics", Qt::BlockingQueuedConnection,
+                                  Q_RETURN_ARG(QVariantMap, serverStatistics));
+        QVariantMap report = clientReport;
+        report.insert(QStringLiteral("server"), serverStatistics);
+        report.insert(QStringLiteral("config"), QVariantMap {
+                          { QStringLiteral("rooms"), config.rooms },
+                          { QStringLiteral("members"), config.membersPerRoom },
+                          { QStringLiteral("rate"), config.messagesPerSecond },
+                          { QStringLiteral("send-rate"), sendRate },
+                          { QStringLiteral("replay"), config.replayFile },
+                          { QStringLiteral("replay-rate"), config.replayedSyncsPerSecond },
+                          { QStringLiteral("drop-every"), config.dropEvery },
+                      });
+        const QByteArray json = QJsonDocument(QJsonObject::fromVariantMap(report)).toJson(QJsonDocument::Indented);
+
+        QFile output;
+        if (parser.isSet(outputOption)) {
+            output.setFileName(parser.value(outputOption));
+            output.open(QIODevice::WriteOnly);
+        } else {
+            output.open(stdout, QIODevice::WriteOnly);
+        }
+        if (output.write(json) != json.size()) {
+            exitCode = 1;
+        }
+        output.close();
+        app.quit();
+    });
+    QMetaObject::invokeMethod(client, "connectAccount");
+
+    app.exec();
+
+    clientThread.quit();
+    serverThread.quit();
+    clientThread.wait();
+    serverThread.wait();
+    return exitCode;
+}
@@ -0,0 +1,154 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "testconnection.hpp"
+#include "protocol.hpp"
+#include "statisticsinterface.hpp"
+
+#include <TelepathyQt/Constants>
+#include <TelepathyQt/Types>
+
+#include <QDBusMessage>
+#include <QDBusObjectPath>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QLoggingCategory>
+#include <QStandardPaths>
+#include <QTest>
+
+TestConnection::TestConnection(QObject *parent)
+    : QObject(parent),
+      m_client(QString())
+{
+}
+
+TestConnection::~TestConnection()
+{
+    if (m_client.isConnected()) {
+        QDBusConnection::disconnectFromBus(m_client.name());
+    }
+}
+
+bool TestConnection::setUp(QString *errorMessage)
+{
+    if (!m_sandbox.isValid()) {
+        *errorMessage = QStringLiteral("Unable to create a temporary directory");
+        return false;
+    }
+    // Keep the sessions and caches of the test away from the user ones
+    qputenv("XDG_CACHE_HOME", QFile::encodeName(m_sandbox.path() + QStringLiteral("/cache")));
+    qputenv("XDG_CONFIG_HOME", QFile::encodeName(m_sandbox.path() + QStringLiteral("/config")));
+    qputenv("XDG_DATA_HOME", QFile::encodeName(m_sandbox.path() + QStringLiteral("/data")));
+    // The debug output of the connection manager would bury the test output
+    QLoggingCategory::setFilterRules(QStringLiteral("*.debug=false"));
+
+    if (!m_bus.start(errorMessage)) {
+        return false;
+    }
+
+    Tp::registerTypes();
+    Tp::BaseProtocolPtr protocol = Tp::BaseProtocol::create<MatrixProtocol>(QLatin1String("matrix"));
+    m_connectionManager = Tp::BaseConnectionManager::create(QLatin1String("tank"));
+    if (!m_connectionManager->addProtocol(protocol) || !m_connectionManager->registerObject()) {
+        *errorMessage = QStringLiteral("Unable to register the connection manager");
+        return false;
+    }
+
+    // A connection of its own, so the client calls go through the daemon like from a separate process
+    m_client = QDBusConnection::connectToBus(m_bus.address(), QStringLiteral("tank-testclient"));
+    if (!m_client.isConnected()) {
+        *errorMessage = QStringLiteral("Unable to connect to the bus: ") + m_client.lastError().message();
+        return false;
+    }
+    return true;
+}
+
+QString TestConnection::cachePath() const
+{
+    return QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+}
+
+bool TestConnection::request(const QVariantMap &parameters, QString *errorMessage)
+{
+    QDBusMessage request = QDBusMessage::createMethodCall(TP_QT_CONNECTION_MANAGER_BUS_NAME_BASE + QStringLiteral("tank"),
+                                                          TP_QT_CONNECTION_MANAGER_OBJECT_PATH_BASE + QStringLiteral("tank"),
+                                                          TP_QT_IFACE_CONNECTION_MANAGER,
+                                                          QStringLiteral("RequestConnection"));
+    request.setArguments({ QStringLiteral("matrix"), parameters });
+    const QDBusMessage reply = m_client.call(request, QDBus::BlockWithGui);
+    if (reply.type() != QDBusMessage::ReplyMessage) {
+        *errorMessage = QStringLiteral("RequestConnection failed: ") + reply.errorMessage();
+        return false;
+    }
+    m_connectionService = reply.arguments().value(0).toString();
+    m_connectionPath = qdbus_cast<QDBusObjectPath>(reply.arguments().value(1)).path();
+    m_statuses.clear();
+    m_client.connect(m_connectionService, m_connectionPath, TP_QT_IFACE_CONNECTION, QStringLiteral("StatusChanged"),
+                     this, SLOT(onStatusChanged(uint,uint)));
+    return true;
+}
+
+bool TestConnection::connectAccount()
+{
+    const QDBusMessage reply = m_client.call(QDBusMessage::createMethodCall(m_connectionService, m_connectionPath,
+                                                                            TP_QT_IFACE_CONNECTION, QStringLiteral("Connect")),
+                                             QDBus::BlockWithGui);
+    return reply.type() == QDBusMessage::ReplyMessage;
+}
+
+bool TestConnection::disconnectAccount()
+{
+    const QDBusMessage reply = m_client.call(QDBusMessage::createMethodCall(m_connectionService, m_connectionPath,
+                                                                            TP_QT_IFACE_CONNECTION, QStringLiteral("Disconnect")),
+                                             QDBus::BlockWithGui);
+    return reply.type() == QDBusMessage::ReplyMessage;
+}
+
+bool TestConnection::waitForStatus(uint status, int timeout)
+{
+    QElapsedTimer timer;
+    timer.start();
+    while (m_statuses.isEmpty() || (m_statuses.last() != status)) {
+        if (timer.hasExpired(timeout)) {
+            return false;
+        }
+        QTest::qWait(10);
+    }
+    return true;
+}
+
+QVariantMap TestConnection::statistics() const
+{
+    const QDBusMessage reply = m_client.call(QDBusMessage::createMethodCall(m_connectionService, m_connectionPath,
+                                                                            QLatin1String(TANK_IFACE_CONNECTION_INTERFACE_STATISTICS),
+                                                                            QStringLiteral("GetStatistics")),
+                                             QDBus::BlockWithGui);
+    if (reply.type() != QDBusMessage::ReplyMessage) {
+        qWarning() << Q_FUNC_INFO << "GetStatistics failed:" << reply.errorMessage();
+        return QVariantMap();
+    }
+    return qdbus_cast<QVariantMap>(reply.arguments().value(0));
+}
+
+void TestConnection::onStatusChanged(uint status, uint reason)
+{
+    Q_UNUSED(reason)
+    m_statuses.append(status);
+}
@@ -0,0 +1,69 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TANK_TOOLS_TESTCONNECTION_HPP
+#define TANK_TOOLS_TESTCONNECTION_HPP
+
+#include <QDBusConnection>
+#include <QObject>
+#include <QTemporaryDir>
+#include <QVariantMap>
+
+#include <TelepathyQt/BaseConnectionManager>
+
+#include "privatebus.hpp"
+
+// Runs the connection manager in the test process on a private bus and drives one of its connections
+// the way a Telepathy client does. Everything runs in the main thread: the D-Bus calls wait for the
+// replies in a local event loop, so the connection manager keeps working meanwhile.
+class TestConnection : public QObject
+{
+    Q_OBJECT
+public:
+    explicit TestConnection(QObject *parent = nullptr);
+    ~TestConnection() override;
+
+    // Creates the sandbox for the caches and the bus and registers the connection manager.
+    // Must be called before anything touches QDBusConnection::sessionBus().
+    bool setUp(QString *errorMessage);
+    // The cache directory of the connection manager (inside the sandbox)
+    QString cachePath() const;
+
+    bool request(const QVariantMap &parameters, QString *errorMessage);
+    bool connectAccount();
+    bool disconnectAccount();
+    bool waitForStatus(uint status, int timeout);
+
+    QList<uint> statuses() const { return m_statuses; }
+    QVariantMap statistics() const;
+
+protected slots:
+    void onStatusChanged(uint status, uint reason);
+
+protected:
+    QTemporaryDir m_sandbox;
+    PrivateBus m_bus;
+    Tp::BaseConnectionManagerPtr m_connectionManager;
+    QDBusConnection m_client;
+    QString m_connectionService;
+    QString m_connectionPath;
+    QList<uint> m_statuses; // In order of the StatusChanged signals
+};
+
+#endif // TANK_TOOLS_TESTCONNECTION_HPP
@@ -0,0 +1,125 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "handleregistry.hpp"
+
+#include <QTest>
+
+class TestHandleRegistry : public QObject
+{
+    Q_OBJECT
+private slots:
+    void roundTrip();
+    void compact();
+    void compactKeepsReferenced();
+    void noReuseAfterCompact();
+    void sharedTable();
+};
+
+void TestHandleRegistry::roundTrip()
+{
+    MatrixIdTable ids;
+    MatrixHandleRegistry registry(&ids);
+    const uint alice = registry.ensureHandle(QStringLiteral("@alice:example.org"));
+    const uint bob = registry.ensureHandle(QStringLiteral("@bob:example.org:8448"));
+    QVERIFY(alice);
+    QVERIFY(bob);
+    QVERIFY(alice != bob);
+    QCOMPARE(registry.ensureHandle(QStringLiteral("@alice:example.org")), alice);
+    QCOMPARE(registry.handle(QStringLiteral("@bob:example.org:8448")), bob);
+    QCOMPARE(registry.identifier(bob), QStringLiteral("@bob:example.org:8448"));
+    QCOMPARE(registry.handle(QStringLiteral("@bob:example.org")), 0u);
+    QCOMPARE(registry.identifier(bob + 1), QString());
+    QCOMPARE(registry.count(), 2);
+    QCOMPARE(ids.count(), 2);
+}
+
+void TestHandleRegistry::compact()
+{
+    MatrixIdTable ids;
+    MatrixHandleRegistry registry(&ids);
+    const uint alice = registry.ensureHandle(QStringLiteral("@alice:example.org"));
+
+    // A new handle survives one compaction period
+    QVERIFY(registry.compact().isEmpty());
+    QCOMPARE(registry.compact(), QList<uint>() << alice);
+    QVERIFY(!registry.isValid(alice));
+    QCOMPARE(registry.identifier(alice), QString());
+    QCOMPARE(registry.handle(QStringLiteral("@alice:example.org")), 0u);
+    QCOMPARE(ids.count(), 0);
+
+    // So does a touched one
+    const uint bob = registry.ensureHandle(QStringLiteral("@bob:example.org"));
+    registry.compact();
+    registry.touch(bob);
+    QVERIFY(registry.compact().isEmpty());
+    QCOMPARE(registry.compact(), QList<uint>() << bob);
+}
+
+void TestHandleRegistry::compactKeepsReferenced()
+{
+    MatrixIdTable ids;
+    MatrixHandleRegistry registry(&ids);
+    const uint alice = registry.ensureHandle(QStringLiteral("@alice:example.org"));
+    registry.ref(alice);
+    registry.compact();
+    QVERIFY(registry.compact().isEmpty());
+    QCOMPARE(registry.refCount(alice), 1);
+
+    registry.unref(alice);
+    QVERIFY(registry.compact().isEmpty());
+    QCOMPARE(registry.compact(), QList<uint>() << alice);
+}
+
+void TestHandleRegistry::noReuseAfterCompact()
+{
+    MatrixIdTable ids;
+    MatrixHandleRegistry registry(&ids);
+    const uint alice = registry.ensureHandle(QStringLiteral("@alice:example.org"));
+    registry.compact();
+    registry.compact();
+
+    // The id table entry is reused, the handle number is not
+    const uint aliceAgain = registry.ensureHandle(QStringLiteral("@alice:example.org"));
+    QVERIFY(aliceAgain != alice);
+    QCOMPARE(registry.lastHandle(), aliceAgain);
+    QCOMPARE(registry.identifier(aliceAgain), QStringLiteral("@alice:example.org"));
+    QCOMPARE(registry.identifier(alice), QString());
+}
+
+void TestHandleRegistry::sharedTable()
+{
+    MatrixIdTable ids;
+    MatrixHandleRegistry contacts(&ids);
+    {
+        MatrixHandleRegistry rooms(&ids);
+        const uint room = rooms.ensureHandle(QStringLiteral("!room:example.org:8448"));
+        const uint contact = contacts.ensureHandle(QStringLiteral("!room:example.org:8448"));
+        QVERIFY(room && contact);
+        QCOMPARE(ids.count(), 1);
+        QCOMPARE(rooms.id(room), contacts.id(contact));
+    }
+    // The destroyed registry released its reference only
+    QCOMPARE(ids.count(), 1);
+    QCOMPARE(contacts.handle(QStringLiteral("!room:example.org:8448")), 1u);
+}
+
+QTEST_APPLESS_MAIN(TestHandleRegistry)
+
+#include "tst_handleregistry.moc"
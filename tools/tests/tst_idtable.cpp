@@ -0,0 +1,176 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "idtable.hpp"
+
+#include <QTest>
+
+// Exposes the buffer compaction and the bookkeeping to check it
+class CompactableIdTable : public MatrixIdTable
+{
+public:
+    using MatrixIdTable::compactBuffer;
+    int bufferSize() const { return m_localparts.size(); }
+    int wastedBytes() const { return m_wastedBytes; }
+};
+
+class TestIdTable : public QObject
+{
+    Q_OBJECT
+private slots:
+    void roundTrip_data();
+    void roundTrip();
+    void refCount();
+    void reuseAfterRelease();
+    void sharedServers();
+    void compactBuffer();
+    void automaticCompaction();
+};
+
+void TestIdTable::roundTrip_data()
+{
+    QTest::addColumn<QString>("identifier");
+
+    QTest::newRow("user") << QStringLiteral("@alice:example.org");
+    QTest::newRow("room") << QStringLiteral("!OGEhHVWSdvArJzumhm:matrix.org");
+    QTest::newRow("alias") << QStringLiteral("#tank:example.org");
+    QTest::newRow("port") << QStringLiteral("@bob:example.org:8448");
+    QTest::newRow("ipv6 with port") << QStringLiteral("@carol:[::1]:8448");
+    QTest::newRow("no server") << QStringLiteral("@dave");
+    QTest::newRow("no sigil") << QStringLiteral("eve:example.org");
+    QTest::newRow("non-ascii") << QStringLiteral("@émile:example.org");
+}
+
+void TestIdTable::roundTrip()
+{
+    QFETCH(QString, identifier);
+
+    MatrixIdTable table;
+    const MatrixIdTable::Id id = table.intern(identifier);
+    QVERIFY(id.isValid());
+    QCOMPARE(table.toString(id), identifier);
+    QCOMPARE(table.find(identifier), id);
+    QCOMPARE(table.count(), 1);
+
+    table.release(id);
+    QVERIFY(!table.find(identifier).isValid());
+    QCOMPARE(table.count(), 0);
+    QCOMPARE(table.plainStringMemoryUsage(), qint64(0));
+}
+
+void TestIdTable::refCount()
+{
+    MatrixIdTable table;
+    const QString identifier = QStringLiteral("@alice:example.org");
+    const MatrixIdTable::Id id = table.intern(identifier);
+    QCOMPARE(table.intern(identifier), id);
+    QCOMPARE(table.count(), 1);
+
+    table.release(id);
+    QCOMPARE(table.find(identifier), id);
+    table.release(id);
+    QVERIFY(!table.find(identifier).isValid());
+}
+
+void TestIdTable::reuseAfterRelease()
+{
+    MatrixIdTable table;
+    const MatrixIdTable::Id alice = table.intern(QStringLiteral("@alice:example.org"));
+    const MatrixIdTable::Id bob = table.intern(QStringLiteral("@bob:example.org:8448"));
+    table.release(alice);
+
+    // The freed entry is given to the next id, which must not be found by the old identifier
+    const MatrixIdTable::Id carol = table.intern(QStringLiteral("@carol:example.org"));
+    QCOMPARE(carol, alice);
+    QCOMPARE(table.toString(carol), QStringLiteral("@carol:example.org"));
+    QVERIFY(!table.find(QStringLiteral("@alice:example.org")).isValid());
+    QCOMPARE(table.find(QStringLiteral("@bob:example.org:8448")), bob);
+    QCOMPARE(table.toString(bob), QStringLiteral("@bob:example.org:8448"));
+
+    // The same localpart on the other server is another id
+    QVERIFY(!table.find(QStringLiteral("@bob:example.org")).isValid());
+    const MatrixIdTable::Id otherBob = table.intern(QStringLiteral("@bob:example.org"));
+    QVERIFY(otherBob != bob);
+    QCOMPARE(table.toString(otherBob), QStringLiteral("@bob:example.org"));
+}
+
+void TestIdTable::sharedServers()
+{
+    MatrixIdTable table;
+    table.intern(QStringLiteral("@alice:example.org"));
+    table.intern(QStringLiteral("!room:example.org"));
+    table.intern(QStringLiteral("@bob:example.org:8448"));
+    QCOMPARE(table.count(), 3);
+    // The port is a part of the server name
+    QCOMPARE(table.serverCount(), 2);
+}
+
+void TestIdTable::compactBuffer()
+{
+    CompactableIdTable table;
+    QVector<MatrixIdTable::Id> ids;
+    for (int i = 0; i < 10; ++i) {
+        ids.append(table.intern(QStringLiteral("@user%1:example.org:8448").arg(i)));
+    }
+    const int fullSize = table.bufferSize();
+    for (int i = 0; i < 10; i += 2) {
+        table.release(ids.at(i));
+    }
+    QVERIFY(table.wastedBytes() > 0);
+
+    table.compactBuffer();
+    QCOMPARE(table.wastedBytes(), 0);
+    QVERIFY(table.bufferSize() < fullSize);
+    for (int i = 1; i < 10; i += 2) {
+        const QString identifier = QStringLiteral("@user%1:example.org:8448").arg(i);
+        QCOMPARE(table.toString(ids.at(i)), identifier);
+        QCOMPARE(table.find(identifier), ids.at(i));
+    }
+    for (int i = 0; i < 10; i += 2) {
+        QVERIFY(!table.find(QStringLiteral("@user%1:example.org:8448").arg(i)).isValid());
+    }
+
+    // The ids added after the compaction go to the end of the compacted buffer
+    const MatrixIdTable::Id id = table.intern(QStringLiteral("@newcomer:example.org"));
+    QCOMPARE(table.toString(id), QStringLiteral("@newcomer:example.org"));
+    QCOMPARE(table.toString(ids.at(9)), QStringLiteral("@user9:example.org:8448"));
+}
+
+void TestIdTable::automaticCompaction()
+{
+    CompactableIdTable table;
+    QVector<MatrixIdTable::Id> ids;
+    for (int i = 0; i < 1000; ++i) {
+        ids.append(table.intern(QStringLiteral("@someone-with-a-long-name-%1:example.org").arg(i)));
+    }
+    const int fullSize = table.bufferSize();
+    const MatrixIdTable::Id kept = ids.takeLast();
+    for (const MatrixIdTable::Id &id : ids) {
+        table.release(id);
+    }
+    // Compacted on the way, each time more than the half of the buffer (and over 4 KiB) is released
+    QVERIFY(table.wastedBytes() <= 4096);
+    QVERIFY(table.bufferSize() < fullSize / 4);
+    QCOMPARE(table.count(), 1);
+    QCOMPARE(table.toString(kept), QStringLiteral("@someone-with-a-long-name-999:example.org"));
+}
+
+QTEST_APPLESS_MAIN(TestIdTable)
+
+#include "tst_idtable.moc"
@@ -0,0 +1,150 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "fakehomeserver.hpp"
+#include "outbox.hpp"
+#include "testconnection.hpp"
+
+#include <TelepathyQt/Constants>
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTest>
+
+static const int c_timeout = 30000; // ms
+
+class TestOutbox : public QObject
+{
+    Q_OBJECT
+private slots:
+    void initTestCase();
+    void resendAfterCrash();
+
+private:
+    static QByteArray queuedRecord(const QString &txnId, const QString &body);
+    static QByteArray doneRecord(const QString &txnId);
+    // The transaction ids of the journal records of the given operation, in order
+    static QStringList journalled(const QString &fileName, const QString &op);
+
+    TestConnection m_connection;
+};
+
+void TestOutbox::initTestCase()
+{
+    QString errorMessage;
+    QVERIFY2(m_connection.setUp(&errorMessage), qPrintable(errorMessage));
+}
+
+QByteArray TestOutbox::queuedRecord(const QString &txnId, const QString &body)
+{
+    const QJsonObject record {
+        { QStringLiteral("op"), QStringLiteral("queued") },
+        { QStringLiteral("room"), FakeHomeserver::roomId(0) },
+        { QStringLiteral("txn"), txnId },
+        { QStringLiteral("type"), QStringLiteral("m.room.message") },
+        { QStringLiteral("content"), QJsonObject {
+              { QStringLiteral("msgtype"), QStringLiteral("m.text") },
+              { QStringLiteral("body"), body },
+          } },
+    };
+    return QJsonDocument(record).toJson(QJsonDocument::Compact) + '\n';
+}
+
+QByteArray TestOutbox::doneRecord(const QString &txnId)
+{
+    const QJsonObject record {
+        { QStringLiteral("op"), QStringLiteral("done") },
+        { QStringLiteral("txn"), txnId },
+    };
+    return QJsonDocument(record).toJson(QJsonDocument::Compact) + '\n';
+}
+
+QStringList TestOutbox::journalled(const QString &fileName, const QString &op)
+{
+    QStringList result;
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return result;
+    }
+    while (!file.atEnd()) {
+        const QJsonObject record = QJsonDocument::fromJson(file.readLine().trimmed()).object();
+        if (record.value(QLatin1String("op")).toString() == op) {
+            result.append(record.value(QLatin1String("txn")).toString());
+        }
+    }
+    return result;
+}
+
+void TestOutbox::resendAfterCrash()
+{
+    // The journal as left by a crash: the queued events without the done records (but one),
+    // and the last record cut in the middle of the write
+    const QString fileName = m_connection.cachePath() + QStringLiteral("/outbox/") + FakeHomeserver::userId();
+    QVERIFY(QDir().mkpath(QFileInfo(fileName).absolutePath()));
+    QFile journal(fileName);
+    QVERIFY(journal.open(QIODevice::WriteOnly));
+    journal.write(queuedRecord(QStringLiteral("crash-1"), QStringLiteral("first")));
+    journal.write(queuedRecord(QStringLiteral("crash-2"), QStringLiteral("accepted before the crash")));
+    journal.write(queuedRecord(QStringLiteral("crash-3"), QStringLiteral("second")));
+    journal.write(doneRecord(QStringLiteral("crash-2")));
+    journal.write(queuedRecord(QStringLiteral("crash-4"), QStringLiteral("third")));
+    journal.write(queuedRecord(QStringLiteral("crash-5"), QStringLiteral("lost")).left(40));
+    journal.close();
+    const QStringList expected { QStringLiteral("crash-1"), QStringLiteral("crash-3"), QStringLiteral("crash-4") };
+
+    FakeHomeserver::Config config;
+    config.rooms = 1;
+    config.membersPerRoom = 2;
+    config.messagesPerSecond = 0;
+    FakeHomeserver server(config);
+    QVERIFY(server.listen());
+
+    QString errorMessage;
+    QVERIFY2(m_connection.request({
+                                      { QStringLiteral("user"), FakeHomeserver::userId() },
+                                      { QStringLiteral("password"), QStringLiteral("test") },
+                                      { QStringLiteral("server"), server.url().toString() },
+                                  }, &errorMessage), qPrintable(errorMessage));
+    QVERIFY(m_connection.connectAccount());
+    QVERIFY(m_connection.waitForStatus(Tp::ConnectionStatusConnected, c_timeout));
+
+    // Resent once the room is known, one by one in the original order and with the original transaction ids
+    QTRY_VERIFY_WITH_TIMEOUT(server.sentTransactions().count() >= expected.count(), c_timeout);
+    QCOMPARE(server.sentTransactions(), expected);
+
+    // The journal was compacted on the start to the events to resend, which are marked as done once accepted
+    QCOMPARE(journalled(fileName, QStringLiteral("queued")), expected);
+    QTRY_COMPARE_WITH_TIMEOUT(journalled(fileName, QStringLiteral("done")), expected, c_timeout);
+
+    QVERIFY(m_connection.disconnectAccount());
+    QVERIFY(m_connection.waitForStatus(Tp::ConnectionStatusDisconnected, c_timeout));
+
+    // Nothing is left to send after the next start, and the journal is compacted
+    MatrixOutbox outbox(fileName);
+    QVERIFY(outbox.load().isEmpty());
+    QCOMPARE(outbox.pendingCount(), 0);
+    QCOMPARE(QFileInfo(fileName).size(), 0);
+}
+
+QTEST_GUILESS_MAIN(TestOutbox)
+
+#include "tst_outbox.moc"
@@ -0,0 +1,116 @@
+/*
+    This file is part of the telepathy-tank connection manager.
+    Copyright (C) 2018 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "fakehomeserver.hpp"
+#include "testconnection.hpp"
+
+#include <TelepathyQt/Constants>
+
+#include <QElapsedTimer>
+#include <QTest>
+
+static const int c_droppedSyncs = 3;
+// Quotient retries a dropped sync after a few seconds
+static const int c_recoveryTimeout = 90000; // ms
+static const int c_sampleInterval = 20; // ms
+
+class TestReconnect : public QObject
+{
+    Q_OBJECT
+private slots:
+    void initTestCase();
+    void droppedSyncs();
+
+private:
+    TestConnection m_connection;
+};
+
+void TestReconnect::initTestCase()
+{
+    QString errorMessage;
+    QVERIFY2(m_connection.setUp(&errorMessage), qPrintable(errorMessage));
+}
+
+void TestReconnect::droppedSyncs()
+{
+    FakeHomeserver::Config config;
+    config.rooms = 2;
+    config.membersPerRoom = 2;
+    config.messagesPerSecond = 20; // Keeps the syncs coming
+    config.dropEvery = 4;
+    FakeHomeserver server(config);
+    QVERIFY(server.listen());
+    server.start();
+
+    QString errorMessage;
+    QVERIFY2(m_connection.request({
+                                      { QStringLiteral("user"), FakeHomeserver::userId() },
+                                      { QStringLiteral("password"), QStringLiteral("test") },
+                                      { QStringLiteral("server"), server.url().toString() },
+                                  }, &errorMessage), qPrintable(errorMessage));
+    QVERIFY(m_connection.connectAccount());
+    QVERIFY(m_connection.waitForStatus(Tp::ConnectionStatusConnected, 10000));
+
+    // Sample the statistics to see every outage begin and end
+    int outages = 0;
+    int recoveries = 0;
+    bool recovering = false;
+    QElapsedTimer timer;
+    timer.start();
+    while ((recoveries < c_droppedSyncs) && !timer.hasExpired(c_recoveryTimeout)) {
+        const QVariantMap statistics = m_connection.statistics();
+        QVERIFY(statistics.contains(QStringLiteral("reconnect-in-progress")));
+        const bool inProgress = statistics.value(QStringLiteral("reconnect-in-progress")).toBool();
+        if (inProgress && !recovering) {
+            ++outages;
+        } else if (!inProgress && recovering) {
+            ++recoveries;
+            // An outage may begin and end between two samples, so the connection can count more
+            QVERIFY(statistics.value(QStringLiteral("reconnect-count")).toInt() >= recoveries);
+        }
+        recovering = inProgress;
+        QTest::qWait(c_sampleInterval);
+    }
+    QVERIFY2(recoveries == c_droppedSyncs, qPrintable(QStringLiteral("Recovered %1 times").arg(recoveries)));
+    QVERIFY(outages >= recoveries);
+    QVERIFY(server.statistics().value(QStringLiteral("dropped-syncs")).toInt() >= c_droppedSyncs);
+
+    const QVariantMap statistics = m_connection.statistics();
+    QVERIFY(statistics.value(QStringLiteral("reconnect-count")).toInt() >= c_droppedSyncs);
+    const qint64 lastTime = statistics.value(QStringLiteral("reconnect-last-ms")).toLongLong();
+    const qint64 maxTime = statistics.value(QStringLiteral("reconnect-max-ms")).toLongLong();
+    const qint64 totalTime = statistics.value(QStringLiteral("reconnect-total-ms")).toLongLong();
+    QVERIFY(lastTime <= maxTime);
+    QVERIFY(maxTime <= totalTime);
+    QVERIFY(totalTime > 0);
+
+    // The session stayed valid, so the client saw the connection Connected all the time
+    const QList<uint> statuses = m_connection.statuses();
+    QCOMPARE(statuses.count(uint(Tp::ConnectionStatusConnected)), 1);
+    QVERIFY(!statuses.contains(uint(Tp::ConnectionStatusDisconnected)));
+    QCOMPARE(statuses.last(), uint(Tp::ConnectionStatusConnected));
+
+    server.stop();
+    QVERIFY(m_connection.disconnectAccount());
+    QVERIFY(m_connection.waitForStatus(Tp::ConnectionStatusDisconnected, 10000));
+}
+
+QTEST_GUILESS_MAIN(TestReconnect)
+
+#include "tst_reconnect.moc"